@@ -1,6 +1,6 @@
 from . import ops
 from .ops import *
-from .autograd import Tensor, cpu, all_devices
+from .autograd import Tensor, cpu, all_devices, no_grad
 
 from . import init
 from .init import ones, zeros, zeros_like, ones_like
@@ -8,4 +8,7 @@ from .init import ones, zeros, zeros_like, ones_like
 from . import data
 from . import nn
 from . import optim
+from . import lazy
+from . import memory
+from . import cuda_graphs
 from .backend_selection import *
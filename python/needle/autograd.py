@@ -3,12 +3,15 @@ import needle
 from .backend_numpy import Device, cpu, all_devices
 from typing import List, Optional, NamedTuple, Tuple, Union
 from collections import namedtuple
+import contextlib
 import numpy
 
 from needle import init
 
 # needle version
 LAZY_MODE = False
+# whether ops record the graph for backward(), see no_grad()
+GRAD_ENABLED = True
 TENSOR_COUNTER = 0
 
 # NOTE: we will import numpy as the array_api
@@ -20,9 +23,29 @@ NDArray = numpy.ndarray
 from .backend_selection import array_api, NDArray
 
 
+@contextlib.contextmanager
+def no_grad(disabled=True):
+    """Build no graph within a with block: results of ops do not require
+    grad and keep no references to their inputs, which are freed as soon as
+    nothing else uses them (for inference, and for updates of parameters
+    outside the graph)."""
+    global GRAD_ENABLED
+    previous = GRAD_ENABLED
+    GRAD_ENABLED = not disabled
+    try:
+        yield
+    finally:
+        GRAD_ENABLED = previous
+
+
 class Op:
     """Operator definition."""
 
+    # whether compute() maps its equal-shaped inputs item by item, using only
+    # operators that FusedValue has too, so that lazy mode can fuse it with
+    # its neighbours into one ewise_fused() call (see lazy.py)
+    elementwise = False
+
     def __call__(self, *args):
         raise NotImplementedError()
 
@@ -104,12 +127,18 @@ class Value:
         # avoid recomputation
         if self.cached_data is not None:
             return self.cached_data
-        # note: data implicitly calls realized cached data
-        self.cached_data = self.op.compute(
-            *[x.realize_cached_data() for x in self.inputs]
-        )
+        if all(x.cached_data is not None for x in self.inputs):
+            self.cached_data = self.op.compute(*[x.cached_data for x in self.inputs])
+        else:
+            # part of a graph built in lazy mode: plan and run all of it
+            needle.lazy.realize(self)
         return self.cached_data
 
+    def realize(self):
+        """Compute the value now, if it is not yet (in lazy mode), and return it."""
+        self.realize_cached_data()
+        return self
+
     def is_leaf(self):
         return self.op is None
 
@@ -129,7 +158,7 @@ class Value:
         global TENSOR_COUNTER
         TENSOR_COUNTER += 1
         if requires_grad is None:
-            requires_grad = any(x.requires_grad for x in inputs)
+            requires_grad = GRAD_ENABLED and any(x.requires_grad for x in inputs)
         self.op = op
         self.inputs = inputs
         self.num_outputs = num_outputs
@@ -149,12 +178,13 @@ class Value:
 
     @classmethod
     def make_from_op(cls, op: Op, inputs: List["Value"]):
+        if not LAZY_MODE and not (GRAD_ENABLED and any(x.requires_grad for x in inputs)):
+            # nothing to differentiate: the result alone, with no graph node
+            return cls.make_const(op.compute(*[x.realize_cached_data() for x in inputs]))
         value = cls.__new__(cls)
         value._init(op, inputs)
 
         if not LAZY_MODE:
-            if not value.requires_grad:
-                return value.detach()
             value.realize_cached_data()
         return value
 
@@ -235,11 +265,12 @@ class Tensor(Value):
 
     @staticmethod
     def make_from_op(op: Op, inputs: List["Value"]):
+        if not LAZY_MODE and not (GRAD_ENABLED and any(x.requires_grad for x in inputs)):
+            # nothing to differentiate: the result alone, with no graph node
+            return Tensor.make_const(op.compute(*[x.realize_cached_data() for x in inputs]))
         tensor = Tensor.__new__(Tensor)
         tensor._init(op, inputs)
         if not LAZY_MODE:
-            if not tensor.requires_grad:
-                return tensor.detach()
             tensor.realize_cached_data()
         return tensor
 
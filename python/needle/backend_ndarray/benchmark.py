@@ -0,0 +1,138 @@
+"""Per-call overhead of the NDArray layer, the part of an operation that the
+native benchmarks (build/ndarray_benchmark_cpu, _cuda) do not see.
+
+Each operation is timed twice on the same arrays: as the NDArray expression
+("ndarray": output allocation, shape checks, dispatch) and as the bare call
+of the backend module function it ends up in ("module": the pybind11 call
+and the kernel).  overhead_us is the difference of the medians.  On small
+arrays, where the kernel is nearly free, that is what a model pays per op.
+
+    python -m needle.backend_ndarray.benchmark --device cpu --out before.csv
+    python -m needle.backend_ndarray.benchmark --baseline before.csv
+
+The CSV has one line per (backend, layer, op, case), and --baseline compares
+the medians against an earlier run like the native benchmarks do.
+"""
+import argparse
+import csv
+import sys
+import time
+
+import numpy as np
+
+from . import ndarray as nd
+
+
+def _time_calls(func, sync, min_time, min_repeats):
+    for _ in range(3):
+        func()
+    sync()
+    times = []
+    total = 0.0
+    while (total < min_time or len(times) < min_repeats) and len(times) < 100000:
+        start = time.perf_counter()
+        func()
+        sync()
+        times.append(time.perf_counter() - start)
+        total += times[-1]
+    times.sort()
+    n = len(times)
+    return n, times[n // 2] * 1e6, times[min(n - 1, int(np.ceil(0.99 * n)) - 1)] * 1e6
+
+
+def _cases(device, sizes):
+    """(op, case, ndarray_call, module_call) tuples; module_call is None for
+    operations that are pure NDArray bookkeeping (views)."""
+    for n in sizes:
+        A = nd.array(np.random.randn(n, n).astype("float32"), device=device)
+        B = nd.array(np.random.randn(n, n).astype("float32"), device=device)
+        out = nd.NDArray.make((n, n), device=device)
+        row = nd.NDArray.make((n, 1), device=device)
+        case = "%dx%d" % (n, n)
+        a, b, o = A._handle, B._handle, out._handle
+        yield "ewise_add", case, lambda: A + B, lambda: device.ewise_add(a, b, o)
+        yield "scalar_mul", case, lambda: A * 2.0, lambda: device.scalar_mul(a, 2.0, o)
+        yield "exp", case, lambda: A.exp(), lambda: device.ewise_exp(a, o)
+        yield "matmul", case, lambda: A @ B, lambda: device.matmul(a, b, o, n, n, n)
+        yield "sum", case + ":axis1", lambda: A.sum(axis=1), lambda: device.reduce_sum(
+            a, row._handle, n
+        )
+        T = A.permute((1, 0))
+        yield "compact", case + ":transpose", lambda: T.compact(), lambda: device.compact(
+            a, o, (n, n), (1, n), 0
+        )
+        yield "getitem", case, lambda: A[1:, :-1], None
+        yield "reshape", case, lambda: A.reshape((n * n,)), None
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--device", default="cpu", help="comma separated: cpu,cuda,cpu_numpy")
+    parser.add_argument("--sizes", default="1,64,512", help="side of the square operands")
+    parser.add_argument("--filter", default="", help="only ops whose name contains this")
+    parser.add_argument("--min-time", type=float, default=0.2)
+    parser.add_argument("--min-repeats", type=int, default=10)
+    parser.add_argument("--out", help="write the CSV here instead of stdout")
+    parser.add_argument("--baseline", help="CSV of an earlier run to compare against")
+    parser.add_argument("--max-regression", type=float, default=0.1)
+    args = parser.parse_args(argv)
+
+    baseline = {}
+    if args.baseline:
+        with open(args.baseline) as f:
+            for r in csv.DictReader(f):
+                baseline[(r["backend"], r["layer"], r["op"], r["case"])] = float(r["p50_us"])
+
+    rows, regressions = [], []
+    sizes = [int(s) for s in args.sizes.split(",")]
+    for name in args.device.split(","):
+        device = getattr(nd, name)()
+        if not device.enabled():
+            print("skipping %s: not built" % name, file=sys.stderr)
+            continue
+        sync = device.synchronize if name == "cuda" else lambda: None
+        for op, case, ndarray_call, module_call in _cases(device, sizes):
+            if args.filter not in op:
+                continue
+            module_p50 = None
+            for layer, call in (("module", module_call), ("ndarray", ndarray_call)):
+                if call is None:
+                    continue
+                calls, p50, p99 = _time_calls(call, sync, args.min_time, args.min_repeats)
+                row = {"backend": name, "layer": layer, "op": op, "case": case, "calls": calls,
+                       "p50_us": "%.3f" % p50, "p99_us": "%.3f" % p99, "overhead_us": "",
+                       "baseline_p50_us": "", "change": ""}
+                if layer == "module":
+                    module_p50 = p50
+                elif module_p50 is not None:
+                    row["overhead_us"] = "%.3f" % (p50 - module_p50)
+                base = baseline.get((name, layer, op, case))
+                if base is not None:
+                    change = p50 / base - 1
+                    row["baseline_p50_us"] = "%.3f" % base
+                    row["change"] = "%+.3f" % change
+                    if change > args.max_regression:
+                        regressions.append("%s,%s,%s,%s: %d%% slower"
+                                           % (name, layer, op, case, round(100 * change)))
+                rows.append(row)
+                print("%s,%s,%s,%s: %.3f us" % (name, layer, op, case, p50), file=sys.stderr)
+
+    fields = ["backend", "layer", "op", "case", "calls", "p50_us", "p99_us", "overhead_us",
+              "baseline_p50_us", "change"]
+    out = open(args.out, "w", newline="") if args.out else sys.stdout
+    writer = csv.DictWriter(out, fields, lineterminator="\n")
+    writer.writeheader()
+    writer.writerows(rows)
+    if args.out:
+        out.close()
+    if args.baseline:
+        print("%d slower than %s by more than %d%%"
+              % (len(regressions), args.baseline, round(100 * args.max_regression)),
+              file=sys.stderr)
+        for r in regressions:
+            print("  " + r, file=sys.stderr)
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,4 +1,5 @@
 import builtins
+import contextlib
 import operator
 import math
 from functools import reduce
@@ -15,59 +16,111 @@ def prod(x):
 class BackendDevice:
     """A backend device, wrapps the implementation module."""
 
-    def __init__(self, name, mod):
+    def __init__(self, name, mod, index=None):
         self.name = name
         # mod holds the module implementation that implements all functions
         self.mod = mod
+        # which of several (cuda) devices, None for the current one
+        self.index = index
 
     def __eq__(self, other):
         return self.name == other.name
 
+    def __hash__(self):
+        return hash(self.name)
+
     def __repr__(self):
         return self.name + "()"
 
     # 通过定义__getattr__方法，device.name(例如device.compact())全部转化为self.mod.name, 实现同一函数名针对不同backend的dispatch
     def __getattr__(self, name):
         # equal to self.mod.name
-        return getattr(self.mod, name)
+        attr = getattr(self.mod, name)
+        if self.index and callable(attr):
+            # on another device than the current one, which the call makes current: arrays and
+            # streams are created there (the kernels follow their arrays by themselves)
+            on_device = self.mod.on_device
+            return lambda *args, **kwargs: on_device(self.index, attr, *args, **kwargs)
+        return attr
 
     def enabled(self):
         return self.mod is not None
 
+    @contextlib.contextmanager
+    def stream(self, stream):
+        """Issue the work of this (cuda) device on stream within a with block."""
+        previous = self.current_stream()
+        self.set_stream(stream)
+        try:
+            yield stream
+        finally:
+            self.set_stream(previous)
+
+    @contextlib.contextmanager
+    def capture(self, graph, stream=None):
+        """Capture the work issued on this (cuda) device within a with block
+        into graph (a device.Graph()), for graph.replay() to run again in one
+        launch.  The work is recorded rather than run; it is captured on
+        stream, a new one by default, as the default stream cannot be."""
+        stream = stream if stream is not None else self.Stream()
+        previous = self.current_stream()
+        stream.wait_stream(previous)
+        with self.stream(stream):
+            graph.capture_begin()
+            try:
+                yield graph
+            finally:
+                graph.capture_end()
+        previous.wait_stream(stream)
+
+    @contextlib.contextmanager
+    def profile(self, trace_path=None):
+        """Profile the kernels and allocations of this (cpu or cuda) device within
+        a with block, starting from zero; read the results with
+        device.profiler_stats(), and get them as a Chrome trace in trace_path."""
+        self.mod.profiler_reset()
+        self.mod.profiler_enable(True)
+        try:
+            yield self
+        finally:
+            self.mod.profiler_enable(False)
+            if trace_path is not None:
+                self.mod.profiler_export_trace(trace_path)
+
     def randn(self, *shape, dtype="float32"):
         # note: numpy doesn't support types within standard random routines, and
         # .astype("float32") does work if we're generating a singleton
-        return NDArray(np.random.randn(*shape).astype(dtype), device=self)
+        return NDArray(np.random.randn(*shape).astype("float32"), device=self, dtype=dtype)
 
     def rand(self, *shape, dtype="float32"):
         # note: numpy doesn't support types within standard random routines, and
         # .astype("float32") does work if we're generating a singleton
-        return NDArray(np.random.rand(*shape).astype(dtype), device=self)
+        return NDArray(np.random.rand(*shape).astype("float32"), device=self, dtype=dtype)
 
     def one_hot(self, n, i, dtype="float32"):
-        return NDArray(np.eye(n, dtype=dtype)[i], device=self)
+        return NDArray(np.eye(n, dtype="float32")[i], device=self, dtype=dtype)
 
     def empty(self, shape, dtype="float32"):
         dtype = "float32" if dtype is None else dtype
-        assert dtype == "float32"
-        return NDArray.make(shape, device=self)
+        return NDArray.make(shape, device=self, dtype=dtype)
 
     def full(self, shape, fill_value, dtype="float32"):
         dtype = "float32" if dtype is None else dtype
-        assert dtype == "float32"
         arr = self.empty(shape, dtype)
         arr.fill(fill_value)
         return arr
 
 
-def cuda():
-    """Return cuda device"""
+def cuda(index=None):
+    """Return cuda device, the current one or that of the given index; cuda(0)
+    is cuda(), the current device being 0 unless changed outside of needle"""
+    name = "cuda" if not index else "cuda:%d" % index
     try:
         from . import ndarray_backend_cuda
 
-        return BackendDevice("cuda", ndarray_backend_cuda)
+        return BackendDevice(name, ndarray_backend_cuda, index)
     except ImportError:
-        return BackendDevice("cuda", None)
+        return BackendDevice(name, None, index)
 
 
 def cpu_numpy():
@@ -89,6 +142,20 @@ def all_devices():
     return [cpu(), cuda(), cpu_numpy()]
 
 
+# what NDArray.make() gets new memory from, as allocator(device, size, dtype),
+# when it is not device.Array (see set_allocator())
+_allocator = None
+
+
+def set_allocator(allocator):
+    """Have new arrays allocated by allocator(device, size, dtype) instead of
+    device.Array(size, dtype), or by device.Array again with None.  Returns
+    the previous allocator (needle.memory plans training steps this way)."""
+    global _allocator
+    previous, _allocator = _allocator, allocator
+    return previous
+
+
 class NDArray:
     """A generic ND array class that may contain multipe different backends
     i.e., a Numpy backend, a native CPU backend, or a GPU backend.
@@ -97,26 +164,36 @@ class NDArray:
     to actually get the desired functionality for the programming examples
     in the homework, and no more.
 
-    For now, for simplicity the class only supports float32 types, though
-    this can be extended if desired.
+    Items are float32, or on the cpu and cuda backends float16 or bfloat16
+    (see DTYPES).  The 16-bit types are storage formats: the backends compute
+    and accumulate in float32 and round the results back.  int8 arrays hold
+    quantized values for matmul_int8() (see quantize()); only copies,
+    indexing and astype() take them.
     """
 
-    def __init__(self, other, device=None):
-        """Create by copying another NDArray, or from numpy"""
+    def __init__(self, other, device=None, dtype=None):
+        """Create by copying another NDArray, or from numpy; dtype defaults to
+        that of other, or float32 for anything else"""
         if isinstance(other, NDArray):
             # create a copy of existing NDArray
             if device is None:
                 device = other.device
-            self._init(other.to(device) + 0.0)  # this creates a copy
+            copy = other.to(device).astype(dtype or other.dtype)
+            if copy is other:
+                # copy through compact(), which takes every dtype; int8 has no arithmetic
+                copy = NDArray.make(other.shape, device=device, dtype=other.dtype)
+                device.compact(other._handle, copy._handle, other.shape, other.strides,
+                               other._offset)
+            self._init(copy)
         elif isinstance(other, np.ndarray):
-            # create copy from numpy array
+            # create copy from numpy array, rounded to dtype by the backend
             device = device if device is not None else default_device()
-            array = self.make(other.shape, device=device)
-            array.device.from_numpy(np.ascontiguousarray(other), array._handle)
+            array = self.make(other.shape, device=device, dtype=dtype or "float32")
+            array.device.from_numpy(np.ascontiguousarray(other, dtype=np.float32), array._handle)
             self._init(array)
         else:
             # see if we can create a numpy array from input
-            array = NDArray(np.array(other), device=device)
+            array = NDArray(np.array(other), device=device, dtype=dtype)
             self._init(array)
 
     def _init(self, other):
@@ -144,10 +221,10 @@ class NDArray:
     # 对于很多操作，例如广播，切片，转置等，通过只修改strdes和offset，不改变底层handle，就可以实现zero copy
     # 在底层存储不变的情况下修改上层的视图(view)
     @staticmethod
-    def make(shape, strides=None, device=None, handle=None, offset=0):
+    def make(shape, strides=None, device=None, handle=None, offset=0, dtype="float32"):
         """Create a new NDArray with the given properties.  This will allocation the
         memory if handle=None, otherwise it will use the handle of an existing
-        array."""
+        array (and dtype is that of the handle)."""
         array = NDArray.__new__(NDArray)
         array._shape = tuple(shape)
         array._strides = NDArray.compact_strides(shape) if strides is None else strides
@@ -156,7 +233,10 @@ class NDArray:
         if handle is None:
             # device.Array对应cuda实现中的struct CudaArray或者cpu实现中的struct AlignedArray
             # 又或者是numpy实现里的class Array
-            array._handle = array.device.Array(prod(shape))
+            if _allocator is not None:
+                array._handle = _allocator(array.device, prod(shape), dtype)
+            else:
+                array._handle = array.device.Array(prod(shape), dtype)
         else:
             array._handle = handle
         return array
@@ -176,8 +256,7 @@ class NDArray:
 
     @property
     def dtype(self):
-        # only support float32 for now
-        return "float32"
+        return self._handle.dtype
 
     @property
     def ndim(self):
@@ -201,17 +280,50 @@ class NDArray:
         self._device.fill(self._handle, value)
 
     def to(self, device):
-        """Convert between devices, using to/from numpy calls as the unifying bridge."""
+        """Convert between devices, using to/from numpy calls as the unifying bridge,
+        or copying from one cuda device to another directly."""
         if device == self.device:
             return self
-        else:
-            return NDArray(self.numpy(), device=device)
+        if hasattr(self.device.mod, "copy_peer") and device.mod is self.device.mod:
+            out = NDArray.make(self.shape, device=device, dtype=self.dtype)
+            device.copy_peer(self.compact()._handle, out._handle)
+            return out
+        return NDArray(self.numpy(), device=device, dtype=self.dtype)
 
-    def numpy(self):
-        """convert to a numpy array"""
-        return self.device.to_numpy(
-            self._handle, self.shape, self.strides, self._offset
-        )
+    def astype(self, dtype):
+        """Convert to dtype, rounding to nearest even; self if it already is."""
+        if dtype == self.dtype:
+            return self
+        a = self.compact()
+        out = NDArray.make(self.shape, device=self.device, dtype=dtype)
+        self.device.astype(a._handle, out._handle)
+        return out
+
+    def numpy(self, copy=True):
+        """convert to a numpy array; with copy=False it shares memory with
+        this array where the backend can do that (cpu, float32), and is a copy
+        otherwise.  float16 arrays give float16 numpy arrays, and bfloat16
+        ones, which numpy has no type for, float32 ones."""
+        if self.dtype == "bfloat16":
+            return self.astype("float32").numpy()
+        to_numpy = self.device.to_numpy
+        if not copy and self.dtype == "float32" and hasattr(self.device.mod, "to_numpy_view"):
+            to_numpy = self.device.to_numpy_view
+        return to_numpy(self._handle, self.shape, self.strides, self._offset)
+
+    def __dlpack__(self, stream=None):
+        """Export as a DLPack capsule sharing memory with this array."""
+        if not hasattr(self.device.mod, "to_dlpack"):
+            raise BufferError(f"{self.device} arrays do not support DLPack")
+        args = (self._handle, self.shape, self.strides, self._offset)
+        if self.device.name.startswith("cuda"):
+            return self.device.to_dlpack(*args, stream)
+        return self.device.to_dlpack(*args)
+
+    def __dlpack_device__(self):
+        if not hasattr(self.device.mod, "dlpack_device"):
+            raise BufferError(f"{self.device} arrays do not support DLPack")
+        return self.device.dlpack_device()
 
     def is_compact(self):
         """Return true if array is compact in memory and internal size equals product
@@ -226,17 +338,18 @@ class NDArray:
         if self.is_compact():
             return self
         else:
-            out = NDArray.make(self.shape, device=self.device)
+            out = NDArray.make(self.shape, device=self.device, dtype=self.dtype)
             self.device.compact(
                 self._handle, out._handle, self.shape, self.strides, self._offset
             )
             return out
 
     def as_strided(self, shape, strides):
-        """Restride the matrix without copying memory."""
+        """Restride the matrix without copying memory.  The view starts where
+        self does, so views of a slice (permuted, broadcast) stay on it."""
         assert len(shape) == len(strides)
         return NDArray.make(
-            shape, strides=strides, device=self.device, handle=self._handle
+            shape, strides=strides, device=self.device, handle=self._handle, offset=self._offset
         )
 
     @property
@@ -410,7 +523,8 @@ class NDArray:
         new_strides = [stride * slice_tuple.step for stride, slice_tuple in zip(self._strides, idxs)]
         # 就从index为0入手推导offset，想想index都为0时应该拿到底层存储的哪个元素(因为index都为0时，strides不起作用，只有offset起作用)
         # ndarray.py中还有一个sum同名函数（名字取的不好），为了避免冲突要指定使用内置的sum
-        new_offset = builtins.sum([slice_tuple.start * stride for stride, slice_tuple in zip(self._strides, idxs)])
+        new_offset = self._offset + builtins.sum(
+            [slice_tuple.start * stride for stride, slice_tuple in zip(self._strides, idxs)])
         return self.make(shape=tuple(new_shape),
                          strides=tuple(new_strides),
                          device=self.device,
@@ -425,7 +539,7 @@ class NDArray:
         if isinstance(other, NDArray):
             assert prod(view.shape) == prod(other.shape)
             self.device.ewise_setitem(
-                other.compact()._handle,
+                other.astype(self.dtype).compact()._handle,
                 view._handle,
                 view.shape,
                 view.strides,
@@ -443,18 +557,108 @@ class NDArray:
 
     ### Collection of elementwise and scalar function: add, multiply, boolean, etc
 
-    def ewise_or_scalar(self, other, ewise_func, scalar_func):
+    def strided_func(self, func, ewise=False):
+        """Return the strided variant of the backend function func (which
+        reads non-compact operands in place, given their shape, strides and
+        offset), or None if the backend only implements the compact one.
+        The strided variants only exist for float32, and the element-wise
+        ones (ewise) also for the dtypes the backend lists in
+        ewise_strided_dtypes.
+        """
+        dtypes = getattr(self.device.mod, "ewise_strided_dtypes", ()) if ewise else ()
+        if self.dtype != "float32" and self.dtype not in dtypes:
+            return None
+        return getattr(self.device, func.__name__ + "_strided", None)
+
+    def promote(self, other):
+        """self and other converted to a common dtype: their own if they
+        agree, float32 otherwise."""
+        if self.dtype == other.dtype:
+            return self, other
+        return self.astype("float32"), other.astype("float32")
+
+    def ewise_or_scalar(self, other, ewise_func, scalar_func, out=None):
         """Run either an elementwise or scalar version of a function,
-        depending on whether "other" is an NDArray or scalar
+        depending on whether "other" is an NDArray or scalar.  Non-compact
+        operands (e.g. broadcasts) are read in place when the backend has a
+        strided version of the function, rather than compacted first.
+
+        With out (an array of the result's shape, which may be self or
+        other), the result is written there rather than to a new array.
         """
-        out = NDArray.make(self.shape, device=self.device)
+        if isinstance(other, NDArray) and other.dtype != self.dtype:
+            a, b = self.promote(other)
+            return a.ewise_or_scalar(b, ewise_func, scalar_func, out)
+        if out is not None and not self.writes_to(out):
+            return out.assign(self.ewise_or_scalar(other, ewise_func, scalar_func))
+        if out is None:
+            out = NDArray.make(self.shape, device=self.device, dtype=self.dtype)
+        a = self.unaliased(out)
         if isinstance(other, NDArray):
             assert self.shape == other.shape, "operation needs two equal-sized arrays"
-            ewise_func(self.compact()._handle, other.compact()._handle, out._handle)
+            b = other.unaliased(out)
+            strided = a.strided_func(ewise_func, ewise=True)
+            if strided is not None and not (a.is_compact() and b.is_compact()):
+                strided(a._handle, b._handle, out._handle, a.shape,
+                        a.strides, a._offset, b.strides, b._offset)
+            else:
+                ewise_func(a.compact()._handle, b.compact()._handle, out._handle)
         else:
-            scalar_func(self.compact()._handle, other, out._handle)
+            strided = a.strided_func(scalar_func, ewise=True)
+            if strided is not None and not a.is_compact():
+                strided(a._handle, other, out._handle, a.shape, a.strides, a._offset)
+            else:
+                scalar_func(a.compact()._handle, other, out._handle)
         return out
 
+    def unary(self, func, out=None):
+        """Run an elementwise function of one argument, reading a non-compact
+        array in place when the backend has a strided version of it.  With
+        out, the result is written there, as in ewise_or_scalar().
+        """
+        if out is not None and not self.writes_to(out):
+            return out.assign(self.unary(func))
+        if out is None:
+            out = NDArray.make(self.shape, device=self.device, dtype=self.dtype)
+        a = self.unaliased(out)
+        strided = a.strided_func(func, ewise=True)
+        if strided is not None and not a.is_compact():
+            strided(a._handle, out._handle, a.shape, a.strides, a._offset)
+        else:
+            func(a.compact()._handle, out._handle)
+        return out
+
+    def writes_to(self, out):
+        """Whether an element-wise result of self can be written to out by the
+        kernels directly, out being compact and of self's dtype.  Otherwise it
+        is computed into a new array and copied over."""
+        assert out.shape == self.shape and out.device == self.device, (
+            "out must have the shape of the result, on its device"
+        )
+        return out.is_compact() and out.dtype == self.dtype
+
+    def unaliased(self, out):
+        """self as an operand of a kernel writing to out: a compact copy if it
+        is a non-compact view of out's memory, whose items the kernel could
+        overwrite before reading them.  A compact view of it is read item
+        for item as out is written, which the element-wise kernels allow."""
+        if self._handle is out._handle and not self.is_compact():
+            return self.compact()
+        return self
+
+    def assign(self, other):
+        """Copy other (an array of self's shape, of any dtype) into self in
+        place, and return self."""
+        assert other.shape == self.shape
+        self.device.ewise_setitem(
+            other.astype(self.dtype).compact()._handle,
+            self._handle,
+            self.shape,
+            self.strides,
+            self._offset,
+        )
+        return self
+
     def __add__(self, other):
         return self.ewise_or_scalar(
             other, self.device.ewise_add, self.device.scalar_add
@@ -484,13 +688,11 @@ class NDArray:
         return self * (-1)
 
     def __pow__(self, other):
-        out = NDArray.make(self.shape, device=self.device)
-        self.device.scalar_power(self.compact()._handle, other, out._handle)
-        return out
+        return self.ewise_or_scalar(other, None, self.device.scalar_power)
 
-    def maximum(self, other):
+    def maximum(self, other, out=None):
         return self.ewise_or_scalar(
-            other, self.device.ewise_maximum, self.device.scalar_maximum
+            other, self.device.ewise_maximum, self.device.scalar_maximum, out
         )
 
     ### Binary operators all return (0.0, 1.0) floating point values, could of course be optimized
@@ -514,26 +716,61 @@ class NDArray:
 
     ### Elementwise functions
 
-    def log(self):
-        out = NDArray.make(self.shape, device=self.device)
-        self.device.ewise_log(self.compact()._handle, out._handle)
-        return out
+    def log(self, out=None):
+        return self.unary(self.device.ewise_log, out)
 
-    def exp(self):
-        out = NDArray.make(self.shape, device=self.device)
-        self.device.ewise_exp(self.compact()._handle, out._handle)
-        return out
+    def exp(self, out=None):
+        return self.unary(self.device.ewise_exp, out)
 
-    def tanh(self):
-        out = NDArray.make(self.shape, device=self.device)
-        self.device.ewise_tanh(self.compact()._handle, out._handle)
-        return out
+    def tanh(self, out=None):
+        return self.unary(self.device.ewise_tanh, out)
+
+    ### In-place variants, writing the result into self (which may be any
+    ### view, see ewise_or_scalar()) and returning it
+
+    def add_(self, other):
+        return self.ewise_or_scalar(
+            other, self.device.ewise_add, self.device.scalar_add, self
+        )
+
+    def sub_(self, other):
+        return self.add_(-other)
+
+    def mul_(self, other):
+        return self.ewise_or_scalar(
+            other, self.device.ewise_mul, self.device.scalar_mul, self
+        )
+
+    def div_(self, other):
+        return self.ewise_or_scalar(
+            other, self.device.ewise_div, self.device.scalar_div, self
+        )
+
+    def pow_(self, other):
+        return self.ewise_or_scalar(other, None, self.device.scalar_power, self)
+
+    def neg_(self):
+        return self.mul_(-1)
+
+    def maximum_(self, other):
+        return self.maximum(other, self)
+
+    def log_(self):
+        return self.log(self)
+
+    def exp_(self):
+        return self.exp(self)
+
+    def tanh_(self):
+        return self.tanh(self)
 
     ### Matrix multiplication
     def __matmul__(self, other):
         """Matrix multplication of two arrays.  This requires that both arrays
-        be 2D (i.e., we don't handle batch matrix multiplication), and that the
-        sizes match up properly for matrix multiplication.
+        be at least 2D, and that the sizes match up properly for matrix
+        multiplication.  Arrays of more than two dimensions are batches of
+        matrices over their leading dimensions, which broadcast against each
+        other as in numpy (see batched_matmul()).
 
         In the case of the CPU backend, you will implement an efficient "tiled"
         version of matrix multiplication for the case when all dimensions of
@@ -547,20 +784,36 @@ class NDArray:
         the GPU version will just work natively by tiling any input size).
         """
 
-        assert self.ndim == 2 and other.ndim == 2
+        assert self.ndim >= 2 and other.ndim >= 2
+        if self.dtype != other.dtype:
+            a, b = self.promote(other)
+            return a @ b
+        if self.ndim > 2 or other.ndim > 2:
+            return self.batched_matmul(other)
         assert self.shape[1] == other.shape[0]
 
         m, n, p = self.shape[0], self.shape[1], other.shape[1]
+        dtype = self.dtype
+
+        # non-compact operands (e.g. transposes) are read in place if the
+        # backend can, which saves compacting them (and the tiling copies);
+        # unlike the other strided variants, matmul_strided takes every dtype
+        matmul_strided = getattr(self.device, "matmul_strided", None)
+        if matmul_strided is not None and not (self.is_compact() and other.is_compact()):
+            out = NDArray.make((m, p), device=self.device, dtype=dtype)
+            matmul_strided(self._handle, other._handle, out._handle, m, n, p,
+                           self.strides, self._offset, other.strides, other._offset)
+            return out
 
-        # if the matrix is aligned, use tiled matrix multiplication
-        if hasattr(self.device, "matmul_tiled") and all(
+        # if the matrix is aligned, use tiled matrix multiplication (float32 only)
+        if dtype == "float32" and hasattr(self.device, "matmul_tiled") and all(
             d % self.device.__tile_size__ == 0 for d in (m, n, p)
         ):
 
             def tile(a, tile):
                 return a.as_strided(
                     (a.shape[0] // tile, a.shape[1] // tile, tile, tile),
-                    (a.shape[1] * tile, tile, self.shape[1], 1),
+                    (a.shape[1] * tile, tile, a.shape[1], 1),
                 )
 
             t = self.device.__tile_size__
@@ -576,50 +829,289 @@ class NDArray:
             )
 
         else:
-            out = NDArray.make((m, p), device=self.device)
+            out = NDArray.make((m, p), device=self.device, dtype=dtype)
             self.device.matmul(
                 self.compact()._handle, other.compact()._handle, out._handle, m, n, p
             )
             return out
 
+    def batched_matmul(self, other):
+        """Matrix multiplication over the last two dimensions of self and
+        other, with their leading (batch) dimensions broadcast together, as a
+        single backend call.  Broadcast operands (e.g. one weight matrix for a
+        whole batch) get zero batch strides rather than being copied, and
+        non-compact views are read in place.
+        """
+        assert self.shape[-1] == other.shape[-2]
+        m, n, p = self.shape[-2], self.shape[-1], other.shape[-1]
+        batch_shape = broadcast_shapes(self.shape[:-2], other.shape[:-2])
+        a = self.broadcast_to(batch_shape + (m, n))
+        b = other.broadcast_to(batch_shape + (n, p))
+        out = NDArray.make(batch_shape + (m, p), device=self.device, dtype=self.dtype)
+        self.device.matmul_batched(a._handle, b._handle, out._handle, batch_shape, m, n, p,
+                                   a.strides, a._offset, b.strides, b._offset)
+        return out
+
+    def matmul_epilogue(self, other, bias=None, activation=None, scale=1.0):
+        """activation(scale * (self @ other) + bias) for 2D self and other,
+        where bias is a vector of other.shape[1] values added to every row,
+        e.g. the forward pass of a Linear layer followed by a ReLU.  The
+        backend applies the scale, bias and activation to each output tile
+        of the product as it is stored, so this takes one pass over the
+        output instead of three, and the bias is never broadcast in memory.
+
+        Args:
+            bias: NDArray of other.shape[1] elements, or None
+            activation: None, "relu" or "tanh"
+        """
+        assert activation in EPILOGUE_ACTIVATIONS, "unknown activation %s" % activation
+        assert self.ndim == 2 and other.ndim == 2
+        assert self.shape[1] == other.shape[0]
+        if self.dtype != other.dtype:
+            a, b = self.promote(other)
+            return a.matmul_epilogue(b, bias, activation, scale)
+        m, n, p = self.shape[0], self.shape[1], other.shape[1]
+        if bias is not None:
+            # the bias is added in float32, whatever its dtype
+            assert bias.size == p, "bias needs one value per output column"
+            bias = bias.compact()._handle
+        out = NDArray.make((m, p), device=self.device, dtype=self.dtype)
+        self.device.matmul_epilogue(self._handle, other._handle, bias, out._handle, m, n, p,
+                                    self.strides, self._offset, other.strides, other._offset,
+                                    EPILOGUE_ACTIVATIONS[activation], scale)
+        return out
+
+    ### Quantized (int8) inference
+    def quantize(self):
+        """Quantize each row of a 2D array to int8, symmetrically.  Returns
+        (q, scales), with scales[i] = max(abs(self[i])) / 127 (1 for an
+        all-zero row) and q[i] = round(self[i] / scales[i])."""
+        assert self.ndim == 2
+        rows, cols = self.shape
+        a = self.astype("float32").compact()
+        q = NDArray.make(self.shape, device=self.device, dtype="int8")
+        scales = NDArray.make((rows,), device=self.device)
+        self.device.quantize_rows(a._handle, q._handle, scales._handle, rows, cols)
+        return q, scales
+
+    def dequantize(self, scales, dtype="float32"):
+        """self * scales[:, None] for a 2D int8 array and its row scales, the
+        inverse of quantize() up to rounding."""
+        assert self.dtype == "int8" and self.ndim == 2
+        rows, cols = self.shape
+        out = NDArray.make(self.shape, device=self.device, dtype=dtype)
+        self.device.dequantize_rows(self.compact()._handle, scales.compact()._handle,
+                                    out._handle, rows, cols)
+        return out
+
+    def matmul_int8(self, weight, bias=None, activation=None, out_scale=None):
+        """matmul_epilogue(weight.dequantize(), bias, activation), computed in
+        int8: the rows of self are quantized on the fly and multiplied with
+        the int8 weight, accumulating exactly in int32, and the product is
+        rescaled, biased and activated in float32 as it is stored.
+
+        Args:
+            weight: QuantizedWeight of shape (self.shape[1], p)
+            bias: NDArray of p elements, or None
+            activation: None, "relu" or "tanh"
+            out_scale: None for a result of self's dtype; otherwise the result
+                is requantized to an int8 array, round(result / out_scale)
+        """
+        assert activation in EPILOGUE_ACTIVATIONS, "unknown activation %s" % activation
+        assert self.ndim == 2 and self.shape[1] == weight.shape[0]
+        assert weight.device == self.device
+        m, n, p = self.shape[0], self.shape[1], weight.shape[1]
+        a, a_scales = self.quantize()
+        if bias is not None:
+            assert bias.size == p, "bias needs one value per output column"
+            bias = bias.compact()._handle
+        out_dtype = self.dtype if out_scale is None else "int8"
+        out = NDArray.make((m, p), device=self.device, dtype=out_dtype)
+        self.device.matmul_int8(a._handle, a_scales._handle, weight.data._handle,
+                                weight.scales._handle, bias, out._handle, m, n, p,
+                                EPILOGUE_ACTIVATIONS[activation],
+                                1.0 if out_scale is None else out_scale)
+        return out
+
     ### Reductions, i.e., sum/max over all element or over given axis
-    def reduce_view_out(self, axis):
-        """Return a view to the array set up for reduction functions and output array."""
+    def reduce_axes(self, axis):
+        """Normalize axis (None for all axes, an int, or a tuple/list of
+        possibly negative ints) to a sorted tuple of distinct axes."""
         if axis is None:
-            view = self.reshape((1,) * (self.ndim - 1) + (prod(self.shape),))
-            out = NDArray.make((1,) * self.ndim, device=self.device)
-        else:
-            if isinstance(axis, (tuple, list)):
-                assert len(axis) == 1, "Only support reduction over a single axis"
-                axis = axis[0]
-
+            return tuple(range(self.ndim))
+        if not isinstance(axis, (tuple, list)):
+            axis = (axis,)
+        return tuple(sorted(set(a + self.ndim if a < 0 else a for a in axis)))
+
+    def reduce(self, axis, func, keepdims):
+        """Reduce with func (the backend's reduce_sum or reduce_max) over the
+        given axes.
+
+        A single axis of a non-compact array is read in place by the strided
+        variant of func, if the backend has one.  Otherwise each run of
+        adjacent reduced axes of the compact array is reduced by one call to
+        the "_axis" variant of func, which views the array as
+        (outer, reduce, inner) and reduces the middle extent where it lies,
+        so no reduced axis has to be permuted to the end and copied first.
+        """
+        axes = self.reduce_axes(axis)
+        if not axes:
+            return self + 0
+        strided = self.strided_func(func)
+        if len(axes) == 1 and strided is not None and not self.is_compact():
             view = self.permute(
-                tuple([a for a in range(self.ndim) if a != axis]) + (axis,)
+                tuple([a for a in range(self.ndim) if a != axes[0]]) + (axes[0],)
             )
             out = NDArray.make(
-                tuple([1 if i == axis else s for i, s in enumerate(self.shape)]),
+                tuple([1 if i in axes else s for i, s in enumerate(self.shape)]),
                 device=self.device,
             )
-        return view, out
-
-    def sum(self, axis=None):
-        view, out = self.reduce_view_out(axis)
-        self.device.reduce_sum(view.compact()._handle, out._handle, view.shape[-1])
+            strided(view._handle, out._handle, view.shape, view.strides, view._offset)
+        else:
+            axis_func = getattr(self.device, func.__name__ + "_axis")
+            out = self.compact()
+            begin = 0
+            while begin < len(axes):
+                end = begin
+                while end + 1 < len(axes) and axes[end + 1] == axes[end] + 1:
+                    end += 1
+                lo, hi = axes[begin], axes[end] + 1
+                reduced = NDArray.make(
+                    out.shape[:lo] + (1,) * (hi - lo) + out.shape[hi:], device=self.device,
+                    dtype=self.dtype,
+                )
+                axis_func(
+                    out._handle,
+                    reduced._handle,
+                    prod(out.shape[:lo]),
+                    prod(out.shape[lo:hi]),
+                    prod(out.shape[hi:]),
+                )
+                out = reduced
+                begin = end + 1
+        if not keepdims:
+            out = out.reshape(tuple([s for i, s in enumerate(self.shape) if i not in axes]))
         return out
 
-    def max(self, axis=None):
-        view, out = self.reduce_view_out(axis)
-        self.device.reduce_max(view.compact()._handle, out._handle, view.shape[-1])
+    def sum(self, axis=None, keepdims=True):
+        """Sum over axis (None, an int or a tuple of ints).  Unlike numpy, the
+        reduced axes are kept with size 1 unless keepdims=False."""
+        return self.reduce(axis, self.device.reduce_sum, keepdims)
+
+    def max(self, axis=None, keepdims=True):
+        """Maximum over axis; see sum()."""
+        return self.reduce(axis, self.device.reduce_max, keepdims)
+
+    def softmax_layout(self, axis):
+        """Arrange for the softmax-family kernels, which work on the middle
+        axis of a compact (outer, reduce, inner) view, to see the given axes.
+
+        Adjacent axes are used where they lie; otherwise they are permuted to
+        the end first.  Returns (array, outer, reduce, inner, axes, perm),
+        where perm is the permutation applied, or None.
+        """
+        axes = self.reduce_axes(axis)
+        perm = None
+        if axes and axes[-1] - axes[0] + 1 != len(axes):
+            perm = tuple([a for a in range(self.ndim) if a not in axes]) + axes
+            view = self.permute(perm).compact()
+            lo, hi = self.ndim - len(axes), self.ndim
+        else:
+            view = self.compact()
+            lo, hi = (axes[0], axes[-1] + 1) if axes else (self.ndim, self.ndim)
+        return (view, prod(view.shape[:lo]), prod(view.shape[lo:hi]),
+                prod(view.shape[hi:]), axes, perm)
+
+    def softmax_apply(self, axis, func):
+        """Apply the elementwise softmax-family kernel func over axis and
+        return the result in the original axis order.  The kernels are
+        float32 only, so 16-bit arrays are converted there and back."""
+        if self.dtype != "float32":
+            return self.astype("float32").softmax_apply(axis, func).astype(self.dtype)
+        view, outer, reduce_size, inner, _, perm = self.softmax_layout(axis)
+        out = NDArray.make(view.shape, device=self.device)
+        func(view._handle, out._handle, outer, reduce_size, inner)
+        if perm is None:
+            return out
+        inverse = [0] * len(perm)
+        for i, p in enumerate(perm):
+            inverse[p] = i
+        return out.permute(tuple(inverse))
+
+    def logsumexp(self, axis=None, keepdims=True):
+        """log(sum(exp(self))) over axis in one stable pass; see sum()."""
+        if self.dtype != "float32":
+            return self.astype("float32").logsumexp(axis, keepdims).astype(self.dtype)
+        view, outer, reduce_size, inner, axes, _ = self.softmax_layout(axis)
+        out = NDArray.make(
+            tuple([1 if i in axes else s for i, s in enumerate(self.shape)]), device=self.device
+        )
+        self.device.logsumexp_axis(view._handle, out._handle, outer, reduce_size, inner)
+        if not keepdims:
+            out = out.reshape(tuple([s for i, s in enumerate(self.shape) if i not in axes]))
         return out
 
+    def log_softmax(self, axis=-1):
+        """self - logsumexp(self, axis), broadcast back over axis."""
+        return self.softmax_apply(axis, self.device.log_softmax_axis)
+
+    def softmax(self, axis=-1):
+        """exp(self) / sum(exp(self), axis), broadcast back over axis."""
+        return self.softmax_apply(axis, self.device.softmax_axis)
+
 
 def array(a, dtype="float32", device=None):
-    """Convenience methods to match numpy a bit more closely."""
-    dtype = "float32" if dtype is None else dtype
-    assert dtype == "float32"
+    """Convenience methods to match numpy a bit more closely.  dtype=None
+    keeps the dtype of an NDArray a (float32 for anything else)."""
+    assert dtype is None or dtype in DTYPES, "unsupported dtype %s" % dtype
+    return NDArray(a, device=device, dtype=dtype)
+
+
+def asarray(a, device=None):
+    """Like array(), but an NDArray on the cpu backend shares the memory of a
+    writeable float32 numpy array instead of copying it."""
+    device = device if device is not None else default_device()
+    if isinstance(a, np.ndarray) and hasattr(device.mod, "from_numpy_view"):
+        try:
+            handle, strides = device.from_numpy_view(a)
+        except ValueError:
+            return NDArray(a, device=device)
+        return NDArray.make(a.shape, strides=tuple(strides), device=device, handle=handle)
     return NDArray(a, device=device)
 
 
+def from_dlpack(x):
+    """An NDArray sharing the memory of any object implementing the DLPack
+    protocol (__dlpack__ and __dlpack_device__), on the cpu or cuda device."""
+    device_type, _ = x.__dlpack_device__()
+    if device_type in (1, 3):  # kDLCPU, kDLCUDAHost
+        device = cpu()
+        capsule = x.__dlpack__()
+    else:
+        device = cuda()
+        if not device.enabled():
+            raise BufferError("from_dlpack: the cuda backend is not available")
+        # the producer orders its work before our current stream (1 is the legacy default stream)
+        stream = device.current_stream().ptr()
+        capsule = x.__dlpack__(stream=stream if stream != 0 else 1)
+    handle, shape, strides = device.from_dlpack(capsule)
+    return NDArray.make(shape, strides=tuple(strides), device=device, handle=handle)
+
+
+def gather_rows(src, indices, device=None, dtype="float32", scale=1.0):
+    """An NDArray of scale * src[indices], for a (memory-mapped) uint8 or
+    float32 numpy array src: the rows are gathered and converted by the
+    backend straight into the new array, with no numpy batch in between and
+    with the GIL released (on cuda through a pinned buffer, uploaded on the
+    current stream)."""
+    device = device if device is not None else default_device()
+    src = np.ascontiguousarray(src)
+    indices = np.ascontiguousarray(indices, dtype=np.int64).reshape(-1)
+    out = NDArray.make((indices.shape[0],) + tuple(src.shape[1:]), device=device, dtype=dtype)
+    device.gather_rows(src, indices, out._handle, scale)
+    return out
+
+
 def empty(shape, dtype="float32", device=None):
     device = device if device is not None else default_device()
     return device.empty(shape, dtype)
@@ -638,21 +1130,492 @@ def reshape(array, new_shape):
     return array.reshape(new_shape)
 
 
-def maximum(a, b):
-    return a.maximum(b)
+def maximum(a, b, out=None):
+    return a.maximum(b, out)
+
+
+def add(a, b, out=None):
+    return a.ewise_or_scalar(b, a.device.ewise_add, a.device.scalar_add, out)
+
+
+def subtract(a, b, out=None):
+    return add(a, -b, out)
+
+
+def multiply(a, b, out=None):
+    return a.ewise_or_scalar(b, a.device.ewise_mul, a.device.scalar_mul, out)
+
+
+def divide(a, b, out=None):
+    return a.ewise_or_scalar(b, a.device.ewise_div, a.device.scalar_div, out)
+
+
+def softmax_cross_entropy(logits, labels, with_grad=False):
+    """Per-row cross-entropy of softmax(logits) against integer class labels.
+
+    logits is (rows, classes) and labels holds rows class indices.  Returns
+    (loss, grad): loss has shape (rows,), and grad, the gradient of the loss
+    with respect to the logits (softmax minus one-hot), comes from the same
+    pass when with_grad is set and is None otherwise.
+    """
+    assert logits.ndim == 2 and labels.size == logits.shape[0]
+    if logits.dtype != "float32":
+        loss, grad = softmax_cross_entropy(logits.astype("float32"), labels, with_grad)
+        return loss.astype(logits.dtype), None if grad is None else grad.astype(logits.dtype)
+    rows, classes = logits.shape
+    logits = logits.compact()
+    labels = labels.to(logits.device).astype("float32").compact()
+    loss = NDArray.make((rows,), device=logits.device)
+    grad = NDArray.make(logits.shape, device=logits.device) if with_grad else None
+    logits.device.softmax_cross_entropy(
+        logits._handle, labels._handle, loss._handle,
+        None if grad is None else grad._handle, rows, classes,
+    )
+    return loss, grad
+
+
+def log(a, out=None):
+    return a.log(out)
+
+
+def exp(a, out=None):
+    return a.exp(out)
+
+
+def tanh(a, out=None):
+    return a.tanh(out)
+
 
+def sum(a, axis=None, keepdims=True):
+    return a.sum(axis=axis, keepdims=keepdims)
 
-def log(a):
-    return a.log()
 
+# item types, see NDArray; the numpy backend only has float32
+DTYPES = ("float32", "float16", "bfloat16", "int8")
 
-def exp(a):
-    return a.exp()
+# matmul_epilogue() activations, in the order of enum EpilogueActivation in the backends
+EPILOGUE_ACTIVATIONS = {None: 0, "relu": 1, "tanh": 2}
 
 
-def tanh(a):
-    return a.tanh()
+class QuantizedWeight:
+    """An (in_features, out_features) weight matrix quantized to int8 with
+    one scale per output channel, for NDArray.matmul_int8().  data holds the
+    transpose, (out_features, in_features) int8, so that each channel is a
+    contiguous row, and scales the out_features float32 scales: a quarter
+    of the memory of the float32 weight."""
 
+    def __init__(self, weight):
+        assert weight.ndim == 2
+        self.shape = weight.shape
+        self.data, self.scales = weight.permute((1, 0)).quantize()
 
-def sum(a, axis=None):
-    return a.sum(axis=axis)
+    @property
+    def device(self):
+        return self.data.device
+
+    def to(self, device):
+        res = QuantizedWeight.__new__(QuantizedWeight)
+        res.shape = self.shape
+        res.data, res.scales = self.data.to(device), self.scales.to(device)
+        return res
+
+    def dequantize(self, dtype="float32"):
+        """The weight as a (non-compact) float array, up to rounding."""
+        return self.data.dequantize(self.scales, dtype).permute((1, 0))
+
+
+### Fused element-wise programs
+
+# ewise_fused() opcodes, in the order of enum FusedOpcode in the backends
+FUSED_OPCODES = {
+    name: i
+    for i, name in enumerate(
+        ["load", "scalar", "add", "sub", "mul", "div", "power", "maximum", "eq", "ge",
+         "neg", "log", "exp", "tanh"]
+    )
+}
+# limits of the strictest backend (the CUDA kernel takes the whole program as a parameter)
+FUSED_MAX_REGISTERS = 16
+FUSED_MAX_INSTRS = 64
+FUSED_MAX_INPUTS = 8
+FUSED_MAX_SCALARS = 16
+
+
+class FusedValue:
+    """A value of an element-wise program being recorded by fuse().  It has
+    the same element-wise operators as NDArray, but each of them only appends
+    a node to the program.
+    """
+
+    def __init__(self, recorder, node):
+        self._recorder = recorder
+        self._node = node
+
+    def _emit(self, op, *others, reverse=False):
+        args = [self] + [self._recorder.value(x) for x in others]
+        if reverse:
+            args = args[::-1]
+        return self._recorder.emit(op, *[x._node for x in args])
+
+    def __add__(self, other):
+        return self._emit("add", other)
+
+    __radd__ = __add__
+
+    def __sub__(self, other):
+        return self._emit("sub", other)
+
+    def __rsub__(self, other):
+        return self._emit("sub", other, reverse=True)
+
+    def __mul__(self, other):
+        return self._emit("mul", other)
+
+    __rmul__ = __mul__
+
+    def __truediv__(self, other):
+        return self._emit("div", other)
+
+    def __rtruediv__(self, other):
+        return self._emit("div", other, reverse=True)
+
+    def __neg__(self):
+        return self._emit("neg")
+
+    def __pow__(self, other):
+        return self._emit("power", other)
+
+    def maximum(self, other):
+        return self._emit("maximum", other)
+
+    def __eq__(self, other):
+        return self._emit("eq", other)
+
+    def __ge__(self, other):
+        return self._emit("ge", other)
+
+    def __ne__(self, other):
+        return 1 - (self == other)
+
+    def __gt__(self, other):
+        return (self >= other) * (self != other)
+
+    def __lt__(self, other):
+        return 1 - (self >= other)
+
+    def __le__(self, other):
+        return 1 - (self > other)
+
+    def log(self):
+        return self._emit("log")
+
+    def exp(self):
+        return self._emit("exp")
+
+    def tanh(self):
+        return self._emit("tanh")
+
+
+class FusedRecorder:
+    """Records the nodes of an element-wise program as SSA values, then
+    compiles them to the register bytecode of ewise_fused().
+    """
+
+    def __init__(self, num_inputs):
+        # (op, args): args are node indices, or the input/scalar index for load/scalar
+        self.nodes = []
+        self.scalars = []
+        self.scalar_nodes = {}
+        self.inputs = [self.emit("load", i) for i in range(num_inputs)]
+
+    def emit(self, op, *args):
+        self.nodes.append((op, args))
+        return FusedValue(self, len(self.nodes) - 1)
+
+    def value(self, x):
+        if isinstance(x, FusedValue):
+            assert x._recorder is self, "values of different fused programs cannot be mixed"
+            return x
+        x = float(x)
+        if x not in self.scalar_nodes:
+            self.scalar_nodes[x] = self.emit("scalar", len(self.scalars))
+            self.scalars.append(x)
+        return self.scalar_nodes[x]
+
+    def compile(self, result):
+        """Return the bytecode computing result (four ints per instruction),
+        or None if it does not fit the FUSED_MAX_* limits.  Nodes that do not
+        contribute to result are dropped, and registers are reused as soon as
+        their value is dead.
+        """
+        last_use = {result._node: len(self.nodes)}
+        for node in range(len(self.nodes) - 1, -1, -1):
+            op, args = self.nodes[node]
+            if node in last_use and op not in ("load", "scalar"):
+                for arg in args:
+                    last_use.setdefault(arg, node)
+        live = sorted(last_use)
+        if len(live) > FUSED_MAX_INSTRS or len(self.scalars) > FUSED_MAX_SCALARS:
+            return None
+
+        program, registers, free = [], {}, list(range(FUSED_MAX_REGISTERS))
+        for node in live:
+            op, args = self.nodes[node]
+            if op in ("load", "scalar"):
+                operands = [args[0], 0]
+            else:
+                operands = [registers[arg] for arg in args] + [0]
+                for arg in set(args):
+                    if last_use[arg] == node:
+                        free.append(registers[arg])
+            if not free:
+                return None
+            free.sort()
+            registers[node] = free.pop(0)
+            program += [FUSED_OPCODES[op], registers[node]] + operands[:2]
+        return program
+
+
+def broadcast_shapes(*shapes):
+    """The shape that all of shapes broadcast to, with numpy's rules."""
+    ndim = builtins.max(len(shape) for shape in shapes)
+    result = []
+    for i in range(-ndim, 0):
+        sizes = set(shape[i] for shape in shapes if len(shape) >= -i) - {1}
+        assert len(sizes) <= 1, "shapes %s cannot be broadcast together" % (shapes,)
+        result.append(sizes.pop() if sizes else 1)
+    return tuple(result)
+
+
+def fuse(fn, sum_axes=None):
+    """Turn an element-wise function of NDArrays into one that runs in a
+    single pass, with no intermediate arrays.
+
+    Each call traces fn with FusedValue placeholders to record its chain of
+    element-wise and scalar operators, and the backend's ewise_fused() then
+    evaluates the whole chain per element.  The arguments are broadcast to a
+    common shape (read in place, without compacting them first).  Programs
+    beyond the FUSED_MAX_* limits fall back to calling fn on the broadcast
+    arrays, and so do arrays other than float32.
+
+    With sum_axes (a tuple of axes), the result is summed over those axes in
+    the same pass by ewise_fused_sum(), keeping them with size 1 as
+    NDArray.sum() does, so the element-wise result is never stored either.
+
+    Example:
+        normalize = fuse(lambda x, mean, var: (x - mean) / (var + 1e-5) ** 0.5)
+        y = normalize(x, x.sum(axis=1) / n, var)
+        sq_dist = fuse(lambda x, y: (x - y) ** 2, sum_axes=(1,))
+    """
+
+    def fused(*arrays):
+        return run_fused(compile_fused(fn, len(arrays)), fn, arrays, sum_axes)
+
+    return fused
+
+
+def compile_fused(fn, num_inputs):
+    """Trace fn with num_inputs placeholders and return its ewise_fused()
+    (program, scalars), or None if it does not fit the FUSED_MAX_* limits.
+    The scalars are those fn used in this trace."""
+    if num_inputs > FUSED_MAX_INPUTS:
+        return None
+    recorder = FusedRecorder(num_inputs)
+    program = recorder.compile(recorder.value(fn(*recorder.inputs)))
+    return None if program is None else (program, recorder.scalars)
+
+
+def run_fused(compiled, fn, arrays, sum_axes=None):
+    """fn(*arrays), summed over sum_axes if not None (see fuse()), computed
+    by the compile_fused() result compiled; with None for that, or arrays
+    other than float32, by fn itself."""
+    device = arrays[0].device
+    shape = broadcast_shapes(*[a.shape for a in arrays])
+    views = [a if a.shape == shape else a.broadcast_to(shape) for a in arrays]
+    if sum_axes is not None:
+        sum_axes = tuple(sorted(set(a + len(shape) if a < 0 else a for a in sum_axes)))
+    if (compiled is None or not all(a.dtype == "float32" for a in arrays)
+            or (sum_axes and 0 in [shape[a] for a in sum_axes])):
+        out = fn(*views)
+        return out if not sum_axes else out.sum(axis=sum_axes)
+    program, scalars = compiled
+    if not sum_axes:
+        out = NDArray.make(shape, device=device)
+        device.ewise_fused(
+            [v._handle for v in views],
+            [list(v.strides) for v in views],
+            [v._offset for v in views],
+            scalars,
+            program,
+            out._handle,
+            list(shape),
+        )
+        return out
+    # the summed axes go last, where ewise_fused_sum() reduces
+    perm = tuple([a for a in range(len(shape)) if a not in sum_axes]) + sum_axes
+    views = [v.permute(perm) for v in views]
+    out = NDArray.make(tuple([1 if i in sum_axes else s for i, s in enumerate(shape)]),
+                       device=device)
+    device.ewise_fused_sum(
+        [v._handle for v in views],
+        [list(v.strides) for v in views],
+        [v._offset for v in views],
+        scalars,
+        program,
+        out._handle,
+        list(views[0].shape),
+        prod([shape[a] for a in sum_axes]),
+    )
+    return out
+
+
+def _optional_handle(a):
+    return None if a is None else a.compact()._handle
+
+
+def _float32(a):
+    # the normalization kernels are float32 only; 16-bit arrays are converted for them
+    return None if a is None else a.astype("float32")
+
+
+def layer_norm(x, weight=None, bias=None, eps=1e-5):
+    """Normalize each row of the 2D x to zero mean and unit variance, then
+    scale by weight and shift by bias (x.shape[1] items each, or None).
+
+    Returns (out, mean, inv_std), the last two with one item per row, to be
+    passed on to layer_norm_backward().
+    """
+    assert x.ndim == 2
+    if x.dtype != "float32":
+        out, mean, inv_std = layer_norm(_float32(x), _float32(weight), _float32(bias), eps)
+        return out.astype(x.dtype), mean, inv_std
+    rows, dim = x.shape
+    x = x.compact()
+    out = NDArray.make(x.shape, device=x.device)
+    mean = NDArray.make((rows,), device=x.device)
+    inv_std = NDArray.make((rows,), device=x.device)
+    x.device.layer_norm_forward(
+        x._handle, _optional_handle(weight), _optional_handle(bias), out._handle,
+        mean._handle, inv_std._handle, rows, dim, eps,
+    )
+    return out, mean, inv_std
+
+
+def layer_norm_backward(grad_out, x, weight, mean, inv_std):
+    """Gradients (grad_x, grad_weight, grad_bias) of layer_norm(), from the
+    mean and inv_std it returned; the last two have x.shape[1] items."""
+    if x.dtype != "float32":
+        grads = layer_norm_backward(_float32(grad_out), _float32(x), _float32(weight), mean,
+                                    inv_std)
+        return tuple(g.astype(x.dtype) for g in grads)
+    rows, dim = x.shape
+    grad_x = NDArray.make(x.shape, device=x.device)
+    grad_weight = NDArray.make((dim,), device=x.device)
+    grad_bias = NDArray.make((dim,), device=x.device)
+    x.device.layer_norm_backward(
+        grad_out.compact()._handle, x.compact()._handle, _optional_handle(weight),
+        mean._handle, inv_std._handle, grad_x._handle, grad_weight._handle, grad_bias._handle,
+        rows, dim,
+    )
+    return grad_x, grad_weight, grad_bias
+
+
+def batch_norm(x, weight=None, bias=None, running_mean=None, running_var=None, eps=1e-5,
+               momentum=0.1, training=True):
+    """Normalize each column of the 2D x over the batch, then scale by weight
+    and shift by bias (x.shape[1] items each, or None).
+
+    In training mode the batch statistics are used, and running_mean and
+    running_var (compact arrays of x.shape[1] items, if given) are updated in
+    place in the same pass, running = (1 - momentum) * running + momentum *
+    batch_statistic.  Otherwise the running statistics are used.  Returns
+    (out, mean, inv_std), to be passed on to batch_norm_backward().  The
+    running statistics are float32 whatever the dtype of x.
+    """
+    assert x.ndim == 2
+    if x.dtype != "float32":
+        out, mean, inv_std = batch_norm(_float32(x), _float32(weight), _float32(bias),
+                                        running_mean, running_var, eps, momentum, training)
+        return out.astype(x.dtype), mean, inv_std
+    rows, dim = x.shape
+    for running in (running_mean, running_var):
+        assert running is None or (running.is_compact() and running.device == x.device)
+    x = x.compact()
+    out = NDArray.make(x.shape, device=x.device)
+    mean = NDArray.make((dim,), device=x.device)
+    inv_std = NDArray.make((dim,), device=x.device)
+    x.device.batch_norm_forward(
+        x._handle, _optional_handle(weight), _optional_handle(bias), out._handle,
+        mean._handle, inv_std._handle, _optional_handle(running_mean),
+        _optional_handle(running_var), rows, dim, eps, momentum, training,
+    )
+    return out, mean, inv_std
+
+
+def batch_norm_backward(grad_out, x, weight, mean, inv_std, training=True):
+    """Gradients (grad_x, grad_weight, grad_bias) of batch_norm(), from the
+    mean and inv_std it returned; in evaluation mode the statistics are
+    treated as constants."""
+    if x.dtype != "float32":
+        grads = batch_norm_backward(_float32(grad_out), _float32(x), _float32(weight), mean,
+                                    inv_std, training)
+        return tuple(g.astype(x.dtype) for g in grads)
+    rows, dim = x.shape
+    grad_x = NDArray.make(x.shape, device=x.device)
+    grad_weight = NDArray.make((dim,), device=x.device)
+    grad_bias = NDArray.make((dim,), device=x.device)
+    x.device.batch_norm_backward(
+        grad_out.compact()._handle, x.compact()._handle, _optional_handle(weight),
+        mean._handle, inv_std._handle, grad_x._handle, grad_weight._handle, grad_bias._handle,
+        rows, dim, training,
+    )
+    return grad_x, grad_weight, grad_bias
+
+
+def _step_handles(kernel, params, grads, *states):
+    """The handles of params, grads and states (lists of arrays, item i of each
+    belonging to parameter i), grouped by device for one multi_*_step() call
+    each: [(device, [param handles, grad handles, state handles...])]."""
+    groups = {}
+    for i, p in enumerate(params):
+        for a in (p,) + tuple(s[i] for s in states):
+            assert a.is_compact() and a.dtype == "float32" and a.device == p.device, (
+                "%s: parameters and their state must be compact float32 arrays" % kernel
+            )
+        g = _float32(grads[i]).compact()
+        assert g.shape == p.shape and g.device == p.device
+        _, handles = groups.setdefault(
+            p.device.name, (p.device, [[] for _ in range(2 + len(states))])
+        )
+        for k, a in enumerate((p, g) + tuple(s[i] for s in states)):
+            handles[k].append(a._handle)
+    return list(groups.values())
+
+
+def sgd_step(params, grads, moments, lr, momentum=0.0, weight_decay=0.0):
+    """One step of needle.optim.SGD for all of params at once, updating params
+    and moments (their momentum buffers, zeros at first) in place:
+        u = momentum * u + (1 - momentum) * (grad + weight_decay * param)
+        param -= lr * u
+    params and moments are compact float32 arrays, and grads are made so if
+    they are not.  This is one multi_sgd_step() call per device, whatever the
+    number of parameters."""
+    for device, handles in _step_handles("sgd_step", params, grads, moments):
+        device.multi_sgd_step(*handles, lr, momentum, weight_decay)
+
+
+def adam_step(params, grads, m, v, step_counts, lr, beta1=0.9, beta2=0.999, eps=1e-8,
+              weight_decay=0.0):
+    """One step of needle.optim.Adam for all of params at once, updating params
+    and their moments m and v (zeros at first) in place, in one
+    multi_adam_step() call per device; see sgd_step().
+
+    step_counts maps the name of each device to a one-item array of the steps
+    taken on it, made as zero the first time.  The backend increments it and
+    takes the bias corrections from it on the device, so that a step captured
+    into a CUDA graph keeps counting when replayed."""
+    for device, handles in _step_handles("adam_step", params, grads, m, v):
+        if device.name not in step_counts:
+            step_counts[device.name] = full((1,), 0.0, device=device)
+        device.multi_adam_step(*handles, lr, beta1, beta2, eps, weight_decay,
+                               step_counts[device.name]._handle)
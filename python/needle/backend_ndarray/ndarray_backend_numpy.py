@@ -7,13 +7,27 @@ _datetype_size = np.dtype(_datatype).itemsize
 
 
 class Array:
-    def __init__(self, size):
+    def __init__(self, size, dtype="float32"):
+        if dtype != "float32":
+            raise ValueError("the numpy backend only supports float32, not %s" % dtype)
         self.array = np.empty(size, dtype=np.float32)
 
     @property
     def size(self):
         return self.array.size
 
+    @property
+    def dtype(self):
+        return "float32"
+
+
+def arena_view(arena, offset, size, dtype="float32"):
+    if dtype != "float32":
+        raise ValueError("the numpy backend only supports float32, not %s" % dtype)
+    view = Array.__new__(Array)
+    view.array = arena.array[offset // _datetype_size : offset // _datetype_size + size]
+    return view
+
 
 def to_numpy(a, shape, strides, offset):
     return np.lib.stride_tricks.as_strided(
@@ -25,6 +39,10 @@ def from_numpy(a, out):
     out.array[:] = a.flatten()
 
 
+def gather_rows(src, indices, out, scale=1.0):
+    out.array[:] = (src[indices].astype(np.float32) * np.float32(scale)).reshape(-1)
+
+
 def fill(out, val):
     out.array.fill(val)
 
@@ -109,9 +127,214 @@ def matmul(a, b, out, m, n, p):
     out.array[:] = (a.array.reshape(m, n) @ b.array.reshape(n, p)).reshape(-1)
 
 
+def matmul_batched(a, b, out, batch_shape, m, n, p, a_strides, a_offset, b_strides, b_offset):
+    a = to_numpy(a, tuple(batch_shape) + (m, n), a_strides, a_offset)
+    b = to_numpy(b, tuple(batch_shape) + (n, p), b_strides, b_offset)
+    out.array[:] = np.matmul(a, b).reshape(-1)
+
+
+def matmul_epilogue(a, b, bias, out, m, n, p, a_strides, a_offset, b_strides, b_offset,
+                    activation, scale):
+    res = to_numpy(a, (m, n), a_strides, a_offset) @ to_numpy(b, (n, p), b_strides, b_offset)
+    res = res * scale
+    if bias is not None:
+        res = res + bias.array[:p]
+    if activation == 1:
+        res = np.maximum(res, 0)
+    elif activation == 2:
+        res = np.tanh(res)
+    out.array[:] = res.reshape(-1)
+
+
 def reduce_max(a, out, reduce_size):
     out.array[:] = a.array[:].reshape(-1, reduce_size).max(axis=1)
 
 
 def reduce_sum(a, out, reduce_size):
     out.array[:] = a.array[:].reshape(-1, reduce_size).sum(axis=1)
+
+
+def reduce_max_axis(a, out, outer, reduce_size, inner):
+    out.array[:] = a.array[:].reshape(outer, reduce_size, inner).max(axis=1).flatten()
+
+
+def reduce_sum_axis(a, out, outer, reduce_size, inner):
+    out.array[:] = a.array[:].reshape(outer, reduce_size, inner).sum(axis=1).flatten()
+
+
+def _logsumexp(x, axis):
+    # -inf for rows of only -inf (fully masked), like the other backends
+    m = x.max(axis=axis, keepdims=True)
+    m = np.where(np.isneginf(m), 0, m)
+    with np.errstate(divide="ignore"):
+        return np.log(np.exp(x - m).sum(axis=axis, keepdims=True)) + m
+
+
+def _log_softmax(x, axis):
+    # fully masked rows get -inf (probabilities 0), not -inf - -inf = NaN
+    lse = _logsumexp(x, axis)
+    with np.errstate(invalid="ignore"):
+        return np.where(np.isneginf(lse), -np.inf, x - lse)
+
+
+def logsumexp_axis(a, out, outer, reduce_size, inner):
+    out.array[:] = _logsumexp(a.array[:].reshape(outer, reduce_size, inner), 1).flatten()
+
+
+def log_softmax_axis(a, out, outer, reduce_size, inner):
+    x = a.array[:].reshape(outer, reduce_size, inner)
+    out.array[:] = _log_softmax(x, 1).flatten()
+
+
+def softmax_axis(a, out, outer, reduce_size, inner):
+    x = a.array[:].reshape(outer, reduce_size, inner)
+    out.array[:] = np.exp(_log_softmax(x, 1)).flatten()
+
+
+def softmax_cross_entropy(logits, labels, loss, grad, rows, classes):
+    x = logits.array[:].reshape(rows, classes)
+    y = labels.array[:rows]
+    if np.any((y < 0) | (y >= classes) | (y != np.floor(y))):
+        raise ValueError("softmax_cross_entropy: label out of range")
+    y = y.astype(np.int64)
+    lse = _logsumexp(x, 1)
+    loss.array[:] = lse[:, 0] - x[np.arange(rows), y]
+    if grad is not None:
+        g = np.exp(x - lse)
+        g[np.arange(rows), y] -= 1
+        grad.array[:] = g.flatten()
+
+
+# ewise_fused() opcodes, in the order of FUSED_OPCODES in ndarray.py (load and scalar come first)
+_FUSED_BINARY = [np.add, np.subtract, np.multiply, np.divide, np.power, np.maximum,
+                 lambda x, y: (x == y).astype(np.float32), lambda x, y: (x >= y).astype(np.float32)]
+_FUSED_UNARY = [np.negative, np.log, np.exp, np.tanh]
+
+
+def _eval_fused(inputs, input_strides, input_offsets, scalars, program, shape):
+    regs = {}
+    for i in range(0, len(program), 4):
+        op, dst, a, b = program[i:i + 4]
+        if op == 0:
+            regs[dst] = to_numpy(inputs[a], shape, input_strides[a], input_offsets[a])
+        elif op == 1:
+            regs[dst] = np.float32(scalars[a])
+        elif op < 2 + len(_FUSED_BINARY):
+            regs[dst] = _FUSED_BINARY[op - 2](regs[a], regs[b])
+        else:
+            regs[dst] = _FUSED_UNARY[op - 2 - len(_FUSED_BINARY)](regs[a])
+    return np.broadcast_to(regs[dst], shape)
+
+
+def ewise_fused(inputs, input_strides, input_offsets, scalars, program, out, shape):
+    out.array[:] = _eval_fused(inputs, input_strides, input_offsets, scalars, program,
+                               shape).flatten()
+
+
+def ewise_fused_sum(inputs, input_strides, input_offsets, scalars, program, out, shape,
+                    reduce_size):
+    result = _eval_fused(inputs, input_strides, input_offsets, scalars, program, shape)
+    out.array[:] = result.reshape(-1, reduce_size).sum(axis=1)
+
+
+def _norm_affine(xhat, weight, bias):
+    if weight is not None:
+        xhat = xhat * weight.array[:xhat.shape[1]]
+    if bias is not None:
+        xhat = xhat + bias.array[:xhat.shape[1]]
+    return xhat
+
+
+def layer_norm_forward(x, weight, bias, out, mean, inv_std, rows, dim, eps):
+    a = x.array[:].reshape(rows, dim)
+    m = a.mean(axis=1)
+    s = 1 / np.sqrt(a.var(axis=1) + eps)
+    mean.array[:], inv_std.array[:] = m, s
+    out.array[:] = _norm_affine((a - m[:, None]) * s[:, None], weight, bias).flatten()
+
+
+def layer_norm_backward(grad_out, x, weight, mean, inv_std, grad_x, grad_weight, grad_bias,
+                        rows, dim):
+    g = grad_out.array[:].reshape(rows, dim)
+    s = inv_std.array[:, None]
+    xhat = (x.array[:].reshape(rows, dim) - mean.array[:, None]) * s
+    dy = g * weight.array[:] if weight is not None else g
+    grad_x.array[:] = (s * (dy - dy.mean(axis=1, keepdims=True)
+                            - xhat * (dy * xhat).mean(axis=1, keepdims=True))).flatten()
+    grad_weight.array[:] = (g * xhat).sum(axis=0)
+    grad_bias.array[:] = g.sum(axis=0)
+
+
+def batch_norm_forward(x, weight, bias, out, mean, inv_std, running_mean, running_var, rows,
+                       dim, eps, momentum, training):
+    a = x.array[:].reshape(rows, dim)
+    if training:
+        m, v = a.mean(axis=0), a.var(axis=0)
+        if running_mean is not None:
+            running_mean.array[:] = (1 - momentum) * running_mean.array + momentum * m
+        if running_var is not None:
+            running_var.array[:] = (1 - momentum) * running_var.array + momentum * v
+    else:
+        if running_mean is None or running_var is None:
+            raise ValueError("batch_norm_forward: evaluation needs the running statistics")
+        m, v = running_mean.array.copy(), running_var.array.copy()
+    mean.array[:], inv_std.array[:] = m, 1 / np.sqrt(v + eps)
+    out.array[:] = _norm_affine((a - mean.array) * inv_std.array, weight, bias).flatten()
+
+
+def batch_norm_backward(grad_out, x, weight, mean, inv_std, grad_x, grad_weight, grad_bias,
+                        rows, dim, training):
+    g = grad_out.array[:].reshape(rows, dim)
+    s = inv_std.array
+    xhat = (x.array[:].reshape(rows, dim) - mean.array) * s
+    w = weight.array if weight is not None else 1
+    grad_weight.array[:] = (g * xhat).sum(axis=0)
+    grad_bias.array[:] = g.sum(axis=0)
+    if training:
+        g = g - (grad_bias.array + xhat * grad_weight.array) / rows
+    grad_x.array[:] = (s * w * g).flatten()
+
+
+def _check_lists(kernel, *lists):
+    for arrays in lists:
+        if len(arrays) != len(lists[0]):
+            raise ValueError("%s: the lists differ in length" % kernel)
+        for t, (a, p) in enumerate(zip(arrays, lists[0])):
+            if a.size != p.size:
+                raise ValueError("%s: tensor %d differs in size from its parameter" % (kernel, t))
+
+
+def multi_sgd_step(params, grads, moments, lr, momentum, weight_decay):
+    _check_lists("sgd_step", params, grads, moments)
+    for p, g, u in zip(params, grads, moments):
+        u.array[:] = momentum * u.array + (1 - momentum) * (g.array + weight_decay * p.array)
+        p.array[:] -= lr * u.array
+
+
+def sgd_step(param, grad, moment, lr, momentum, weight_decay):
+    multi_sgd_step([param], [grad], [moment], lr, momentum, weight_decay)
+
+
+def multi_adam_step(params, grads, m, v, lr, beta1, beta2, eps, weight_decay, step_count):
+    if step_count.array.size != 1:
+        raise ValueError("adam_step: step_count must be one float32 item")
+    step_count.array[0] += 1
+    multi_adam_step_at(params, grads, m, v, lr, beta1, beta2, eps, weight_decay,
+                       int(step_count.array[0]))
+
+
+def multi_adam_step_at(params, grads, m, v, lr, beta1, beta2, eps, weight_decay, step):
+    _check_lists("adam_step", params, grads, m, v)
+    if step == 0:
+        raise ValueError("adam_step: steps count from 1")
+    for p, g, m_t, v_t in zip(params, grads, m, v):
+        g = g.array + weight_decay * p.array
+        m_t.array[:] = beta1 * m_t.array + (1 - beta1) * g
+        v_t.array[:] = beta2 * v_t.array + (1 - beta2) * g * g
+        m_hat = m_t.array / (1 - beta1 ** step)
+        v_hat = v_t.array / (1 - beta2 ** step)
+        p.array[:] -= lr * m_hat / (np.sqrt(v_hat) + eps)
+
+
+def adam_step(param, grad, m, v, lr, beta1, beta2, eps, weight_decay, step):
+    multi_adam_step_at([param], [grad], [m], [v], lr, beta1, beta2, eps, weight_decay, step)
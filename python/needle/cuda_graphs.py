@@ -0,0 +1,73 @@
+"""Training steps replayed as CUDA graphs.
+
+A small model's step is hundreds of tiny kernels, and launching them costs
+more than running them.  GraphedStep captures the whole step, forward,
+backward and optimizer update, into a CUDA graph once and then runs each
+later step as one launch of it:
+
+    step = needle.cuda_graphs.GraphedStep(train_step)
+    for X, y in loader:
+        loss = step(X, y)
+
+See Graph in ndarray_backend_cuda.cu for what capturing implies.
+"""
+from .autograd import Tensor
+from .backend_selection import array_api
+
+
+class GraphedStep:
+    """fn, a step taking and returning Tensors, run as a CUDA graph.
+
+    The first `warmup` calls with inputs of some shapes run fn as it is, so
+    that what it sets up on its first steps (optimizer state, lazy plans)
+    exists.  The next one captures fn, run on static copies of the inputs,
+    into a graph and replays it; from then on a call copies its inputs into
+    the static ones and replays the graph, returning the same Tensors each
+    time, with the data of this step.
+
+    The Python code of fn only runs during the capture.  So the host values
+    it hands to the kernels, such as the learning rate, stay what they were
+    then, and fn must not read results back to the host (.numpy()).  State
+    that changes from step to step has to live on the device, as Adam's step
+    count does.  Inputs that are not on a cuda device just run fn.
+    """
+
+    def __init__(self, fn, warmup=1):
+        self.fn = fn
+        self.warmup = warmup
+        self._entries = {}
+
+    def __call__(self, *inputs):
+        arrays = [x.realize_cached_data() for x in inputs]
+        device = getattr(arrays[0], "device", None)
+        if not hasattr(getattr(device, "mod", None), "Graph"):
+            return self.fn(*inputs)
+        key = tuple((a.shape, a.dtype, a.device.name) for a in arrays)
+        entry = self._entries.setdefault(key, {"calls": 0})
+        entry["calls"] += 1
+        if entry["calls"] <= self.warmup:
+            return self.fn(*inputs)
+        if "graph" not in entry:
+            entry["inputs"] = [
+                Tensor.make_const(array_api.empty(a.shape, a.dtype, a.device)) for a in arrays
+            ]
+        for static, array in zip(entry["inputs"], arrays):
+            static.cached_data.assign(array)
+        if "graph" not in entry:
+            graph = device.Graph()
+            with device.capture(graph):
+                outputs = self.fn(*entry["inputs"])
+                single = isinstance(outputs, Tensor)
+                outputs = (outputs,) if single else tuple(outputs)
+                for output in outputs:
+                    output.realize_cached_data()
+            # the outputs keep their data (in the graph's memory), not the graph behind them
+            entry["outputs"] = tuple(output.detach() for output in outputs)
+            entry["single"] = single
+            entry["graph"] = graph
+        entry["graph"].replay()
+        return entry["outputs"][0] if entry["single"] else entry["outputs"]
+
+    @property
+    def num_graphs(self):
+        return sum("graph" in entry for entry in self._entries.values())
@@ -1,5 +1,10 @@
+import collections
+import threading
+from concurrent.futures import ThreadPoolExecutor
+
 import numpy as np
 from ..autograd import Tensor
+from ..backend_selection import NDArray
 
 from typing import Iterator, Optional, List, Sized, Union, Iterable, Any
 
@@ -29,6 +34,12 @@ class Dataset:
                 x = tform(x)
         return x
 
+    def gather(self, indices, device=None):
+        """The samples at indices as one batch, a tuple of arrays (numpy
+        arrays, or NDArrays on device).  Datasets that can build a batch
+        faster than by indexing override this."""
+        return tuple(self[indices])
+
 
 class DataLoader:
     r"""
@@ -40,6 +51,12 @@ class DataLoader:
             (default: ``1``).
         shuffle (bool, optional): set to ``True`` to have the data reshuffled
             at every epoch (default: ``False``).
+        num_workers (int, optional): how many background threads load batches
+            ahead of the one being used; ``0`` loads each batch when it is
+            asked for (default: ``0``).
+        prefetch (int, optional): how many batches each worker loads ahead
+            (default: ``2``).
+        device (optional): the device the batches are put on.
      """
     dataset: Dataset
     batch_size: Optional[int]
@@ -49,23 +66,83 @@ class DataLoader:
         dataset: Dataset,
         batch_size: Optional[int] = 1,
         shuffle: bool = False,
+        num_workers: int = 0,
+        prefetch: int = 2,
+        device=None,
     ):
 
         self.dataset = dataset
         self.shuffle = shuffle
         self.batch_size = batch_size
+        self.num_workers = num_workers
+        self.prefetch = max(prefetch, 1)
+        self.device = device
         if not self.shuffle:
             self.ordering = np.array_split(np.arange(len(dataset)), 
                                            range(batch_size, len(dataset), batch_size))
+        self._pool = None
+        self._pending = collections.deque()
+        self._local = threading.local()
 
     def __iter__(self):
-        ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
-        ### END YOUR SOLUTION
+        if self.shuffle:
+            n = len(self.dataset)
+            self.ordering = np.array_split(np.random.permutation(n),
+                                           range(self.batch_size, n, self.batch_size))
+        self._close()
+        self._batches = iter(self.ordering)
+        if self.num_workers > 0:
+            self._pool = ThreadPoolExecutor(self.num_workers)
+            self._fill()
         return self
 
     def __next__(self):
-        ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
-        ### END YOUR SOLUTION
+        if self._pool is None:
+            return self._load(next(self._batches))
+        if not self._pending:
+            self._close()
+            raise StopIteration
+        batch, ready = self._pending.popleft().result()
+        self._fill()
+        if ready is not None:
+            # the batch was uploaded on a stream of the worker: order it before
+            # the work that uses it, and its memory before that work too
+            stream = self.device.current_stream()
+            stream.wait_event(ready)
+            for x in batch:
+                x.cached_data._handle.record_stream(stream)
+        return batch
+
+    def _fill(self):
+        # keep prefetch batches per worker in flight
+        while len(self._pending) < self.num_workers * self.prefetch:
+            indices = next(self._batches, None)
+            if indices is None:
+                break
+            self._pending.append(self._pool.submit(self._load_ahead, indices))
+
+    def _load(self, indices):
+        return tuple(
+            Tensor.make_const(x) if isinstance(x, NDArray)
+            else Tensor(x, device=self.device, requires_grad=False)
+            for x in self.dataset.gather(indices, self.device)
+        )
+
+    def _load_ahead(self, indices):
+        # on a worker: a cuda batch is uploaded on a stream of the worker's own,
+        # so that the copy overlaps the kernels of the training thread
+        if not hasattr(getattr(self.device, "mod", None), "Stream"):
+            return self._load(indices), None
+        if getattr(self._local, "stream", None) is None:
+            self._local.stream = self.device.Stream()
+        with self.device.stream(self._local.stream):
+            batch = self._load(indices)
+            return batch, self._local.stream.record_event()
 
+    def _close(self):
+        if self._pool is not None:
+            for future in self._pending:
+                future.cancel()
+            self._pool.shutdown(wait=True)
+            self._pool = None
+        self._pending.clear()
@@ -1,7 +1,46 @@
+import gzip
+import os
+import shutil
+import struct
 from typing import List, Optional
 from ..data_basic import Dataset
+from ...backend_selection import array_api
 import numpy as np
 
+
+def _uncompressed(filename):
+    """The path of an uncompressed copy of a gzip compressed file, made next
+    to it on first use (and again if the file is newer), or of the file
+    itself if it is not compressed."""
+    if not filename.endswith(".gz"):
+        return filename
+    path = filename[:-3]
+    if not os.path.exists(path) or os.path.getmtime(path) < os.path.getmtime(filename):
+        # written under a temporary name, so a concurrent reader never maps half a file
+        tmp = "%s.%d.tmp" % (path, os.getpid())
+        with gzip.open(filename, "rb") as src, open(tmp, "wb") as dst:
+            shutil.copyfileobj(src, dst, 1 << 20)
+        os.replace(tmp, path)
+    return path
+
+
+def _map_idx(filename):
+    """The uint8 array stored in an idx file (the format MNIST comes in),
+    memory-mapped from the uncompressed copy of it, so that only the pages
+    read are loaded (and shared by all processes reading it)."""
+    try:
+        data = np.memmap(_uncompressed(filename), dtype=np.uint8, mode="r")
+    except OSError:
+        # nowhere to write the copy: decompress into memory instead
+        with gzip.open(filename, "rb") as f:
+            data = np.frombuffer(f.read(), dtype=np.uint8)
+    zero, type_code, ndim = struct.unpack(">HBB", data[:4].tobytes())
+    if zero != 0 or type_code != 0x08:
+        raise ValueError("%s is not an idx file of unsigned bytes" % filename)
+    shape = struct.unpack(">%dI" % ndim, data[4 : 4 + 4 * ndim].tobytes())
+    return data[4 + 4 * ndim :].reshape(shape)
+
+
 class MNISTDataset(Dataset):
     def __init__(
         self,
@@ -9,16 +48,32 @@ class MNISTDataset(Dataset):
         label_filename: str,
         transforms: Optional[List] = None,
     ):
-        ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
-        ### END YOUR SOLUTION
+        super().__init__(transforms)
+        # the images stay uint8 on disk and are scaled to [0, 1] float32 as they are read
+        images = _map_idx(image_filename)
+        self.images = images.reshape(images.shape[0], -1)
+        self.image_shape = tuple(images.shape[1:]) + (1,)
+        self.labels = _map_idx(label_filename)
+        assert self.labels.shape[0] == self.images.shape[0]
 
     def __getitem__(self, index) -> object:
-        ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
-        ### END YOUR SOLUTION
+        X = self.images[index].astype(np.float32) / 255.0
+        y = self.labels[index]
+        if self.transforms is not None:
+            rows = X.reshape(-1, X.shape[-1])
+            X = np.stack(
+                [self.apply_transforms(x.reshape(self.image_shape)).reshape(-1) for x in rows]
+            ).reshape(X.shape)
+        return X, y
 
     def __len__(self) -> int:
-        ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
-        ### END YOUR SOLUTION
\ No newline at end of file
+        return self.images.shape[0]
+
+    def gather(self, indices, device=None):
+        # without transforms, the backend reads the batch straight from the mapped file
+        if self.transforms is not None or not hasattr(array_api, "gather_rows"):
+            return super().gather(indices, device)
+        return (
+            array_api.gather_rows(self.images, indices, device=device, scale=1.0 / 255),
+            array_api.gather_rows(self.labels, indices, device=device),
+        )
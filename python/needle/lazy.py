@@ -0,0 +1,326 @@
+"""Lazy evaluation of the graph, with element-wise fusion.
+
+In lazy mode (within `with needle.lazy.lazy_mode():`) an op only records
+its node.  Nothing is computed until a value is asked for, by .numpy(),
+.shape and the like, or by realize(), and then the whole unrealized part of
+the graph behind it is planned at once:
+
+- chains of element-wise ops (Op.elementwise) whose intermediate results
+  nothing else uses become one ewise_fused() call, reading broadcast_to
+  inputs in place rather than materializing them;
+- a summation of such a chain becomes one ewise_fused_sum() call, so the
+  chain's result is never stored either;
+- every other op runs its compute() as in eager mode.
+
+Only the nodes the values asked for depend on are computed, and of those
+only the ones that are not fused into a consumer are stored (in
+cached_data).  A fused-away node that is asked for later is computed again.
+
+Plans are cached by the structure of the graph (the ops, their parameters
+and how they are connected) and the shapes, dtypes and devices of the
+arrays it starts from, so a training step that builds the same graph every
+time is planned, and its fused programs traced, only once.
+"""
+import collections
+import contextlib
+import numbers
+
+import needle
+from . import autograd
+
+# the number of plans kept, least recently used first out
+PLAN_CACHE_SIZE = 256
+
+_plans = collections.OrderedDict()
+_plan_stats = {"hits": 0, "misses": 0}
+
+
+@contextlib.contextmanager
+def lazy_mode(enabled=True):
+    """Record ops without computing them within a with block."""
+    previous = autograd.LAZY_MODE
+    autograd.LAZY_MODE = enabled
+    try:
+        yield
+    finally:
+        autograd.LAZY_MODE = previous
+
+
+def realize(*values):
+    """Compute the given values (Tensors) in one plan, so that the parts of
+    the graph they share are computed once.  Returns the values."""
+    targets = [v for v in values if v.cached_data is None]
+    if targets:
+        graph = _Graph(targets)
+        plan = None
+        if graph.key is not None:
+            plan = _plans.get(graph.key)
+        if plan is None:
+            _plan_stats["misses"] += 1
+            plan = _Plan(graph)
+            if graph.key is not None:
+                _plans[graph.key] = plan
+                if len(_plans) > PLAN_CACHE_SIZE:
+                    _plans.popitem(last=False)
+        else:
+            _plan_stats["hits"] += 1
+            _plans.move_to_end(graph.key)
+        plan.run(graph)
+    return values[0] if len(values) == 1 else values
+
+
+def plan_cache_info():
+    return {"size": len(_plans), "hits": _plan_stats["hits"], "misses": _plan_stats["misses"]}
+
+
+def clear_plan_cache():
+    _plans.clear()
+    _plan_stats["hits"] = _plan_stats["misses"] = 0
+
+
+class _Uncacheable(Exception):
+    pass
+
+
+def _freeze(value):
+    # a hashable stand-in for an op parameter
+    if value is None or isinstance(value, (numbers.Number, str)):
+        return value
+    if isinstance(value, (tuple, list)):
+        return tuple(_freeze(v) for v in value)
+    raise _Uncacheable()
+
+
+def _op_key(op):
+    return (type(op),) + tuple(sorted((k, _freeze(v)) for k, v in vars(op).items()))
+
+
+def _leaf_key(data):
+    device = getattr(data, "device", None)
+    return (
+        tuple(getattr(data, "shape", ())),
+        str(getattr(data, "dtype", type(data).__name__)),
+        getattr(device, "name", str(device)),
+    )
+
+
+class _Graph:
+    """The unrealized nodes behind targets in topological order, the
+    realized values (leaves) they read, and the cache key of all that.
+    Inputs are referred to as ("n", index in nodes) or ("l", index in
+    leaves)."""
+
+    def __init__(self, targets):
+        self.nodes, self.leaves, self.inputs = [], [], []
+        refs = {}
+        for target in targets:
+            # iterative post-order DFS, graphs of a few thousand nodes are common
+            stack = [(target, False)]
+            while stack:
+                value, expanded = stack.pop()
+                if expanded:
+                    refs[id(value)] = ("n", len(self.nodes))
+                    self.nodes.append(value)
+                    continue
+                if id(value) in refs:
+                    continue
+                if value.cached_data is not None:
+                    refs[id(value)] = ("l", len(self.leaves))
+                    self.leaves.append(value)
+                    continue
+                refs[id(value)] = None  # in progress
+                stack.append((value, True))
+                for x in reversed(value.inputs):
+                    if id(x) not in refs:
+                        stack.append((x, False))
+        self.inputs = [tuple(refs[id(x)] for x in node.inputs) for node in self.nodes]
+        self.targets = tuple(refs[id(t)][1] for t in targets)
+        try:
+            self.key = (
+                tuple((_op_key(node.op), inputs) for node, inputs in zip(self.nodes, self.inputs)),
+                tuple(_leaf_key(leaf.cached_data) for leaf in self.leaves),
+                self.targets,
+            )
+        except _Uncacheable:
+            self.key = None
+
+
+class _Group:
+    """Nodes computed by one fused call: members in topological order, the
+    last of them (or the summation after them, sum_node) being the one
+    stored, and the inputs read as (ref, shape to broadcast to or None)."""
+
+    def __init__(self, root):
+        self.root = root
+        self.members = []
+        self.sum_node = None
+        self.inputs = []
+        self.compiled = None
+        self.traced = False
+
+
+class _Plan:
+    def __init__(self, graph):
+        nodes, inputs = graph.nodes, graph.inputs
+        n = len(nodes)
+        consumers = [set() for _ in range(n)]
+        for i in range(n):
+            for kind, j in inputs[i]:
+                if kind == "n":
+                    consumers[j].add(i)
+        targets = set(graph.targets)
+
+        def elementwise(i):
+            return isinstance(nodes[i], autograd.Tensor) and nodes[i].op.elementwise
+
+        def private(j, i):
+            # node j can be folded into its only consumer i
+            return consumers[j] == {i} and j not in targets
+
+        # grow groups from their consumers backwards
+        group_of = [None] * n
+        groups = []
+        for i in range(n - 1, -1, -1):
+            if group_of[i] is None:
+                op = nodes[i].op
+                if isinstance(op, needle.ops.Summation):
+                    kind, j = inputs[i][0]
+                    if kind == "n" and elementwise(j) and private(j, i):
+                        group = _Group(i)
+                        group.sum_node = i
+                        groups.append(group)
+                        group_of[i] = group
+                        group_of[j] = group
+                    continue
+                if not elementwise(i):
+                    continue
+                group = _Group(i)
+                groups.append(group)
+                group_of[i] = group
+            group = group_of[i]
+            if i == group.sum_node:
+                continue
+            group.members.append(i)
+            for kind, j in inputs[i]:
+                if kind == "n" and group_of[j] is None and elementwise(j) and private(j, i):
+                    group_of[j] = group
+
+        # one element-wise op on its own runs faster by its own kernel
+        self.groups = {}
+        for group in groups:
+            if len(group.members) + (group.sum_node is not None) < 2:
+                for i in group.members:
+                    group_of[i] = None
+                continue
+            group.members.reverse()
+            self.groups[group.root] = group
+
+        # inputs of the groups, with private broadcasts read in place
+        absorbed = set()
+        for group in self.groups.values():
+            members = set(group.members)
+            refs = {}
+            for i in group.members:
+                for ref in inputs[i]:
+                    kind, j = ref
+                    if kind == "n" and j in members:
+                        continue
+                    source = (ref, None)
+                    if (kind == "n" and isinstance(nodes[j].op, needle.ops.BroadcastTo)
+                            and private(j, i)):
+                        source = (inputs[j][0], tuple(nodes[j].op.shape))
+                        absorbed.add(j)
+                    if source not in refs:
+                        refs[source] = len(group.inputs)
+                        group.inputs.append(source)
+
+        # what runs, in order: nodes outside groups and the groups at their roots
+        self.steps = []
+        for i in range(n):
+            if i in self.groups:
+                self.steps.append(self.groups[i])
+            elif group_of[i] is None and i not in absorbed:
+                self.steps.append(i)
+
+    def run(self, graph):
+        nodes, inputs = graph.nodes, graph.inputs
+        values = [None] * len(nodes)
+
+        def value(ref):
+            kind, j = ref
+            return graph.leaves[j].cached_data if kind == "l" else values[j]
+
+        for step in self.steps:
+            if not isinstance(step, _Group):
+                node = nodes[step]
+                node.cached_data = node.op.compute(*[value(r) for r in inputs[step]])
+                values[step] = node.cached_data
+                continue
+            group = step
+            arrays = []
+            for ref, shape in group.inputs:
+                array = value(ref)
+                if shape is not None:
+                    array = autograd.array_api.broadcast_to(array, shape)
+                arrays.append(array)
+            fn = self._group_fn(group, graph)
+            result = None
+            if hasattr(getattr(arrays[0], "device", None), "ewise_fused"):
+                if not group.traced:
+                    group.traced = True
+                    try:
+                        group.compiled = needle.backend_ndarray.compile_fused(fn, len(arrays))
+                    except Exception:
+                        # an op that cannot be traced runs unfused (and raises its own errors)
+                        group.compiled = None
+                if group.compiled is not None:
+                    sum_axes = None
+                    if group.sum_node is not None:
+                        sum_axes = self._sum_axes(nodes[group.sum_node].op, arrays)
+                    result = needle.backend_ndarray.run_fused(group.compiled, fn, arrays,
+                                                              sum_axes)
+                    if sum_axes is not None:
+                        result = result.reshape(tuple(
+                            [s for i, s in enumerate(result.shape) if i not in sum_axes]))
+            if result is None:
+                result = fn(*arrays)
+                if group.sum_node is not None:
+                    result = nodes[group.sum_node].op.compute(result)
+            node = nodes[group.root]
+            node.cached_data = values[group.root] = result
+
+    @staticmethod
+    def _group_fn(group, graph):
+        # the members of group as a function of its inputs, for tracing or running unfused
+        nodes, inputs = graph.nodes, graph.inputs
+        position = {source: k for k, source in enumerate(group.inputs)}
+        members = set(group.members)
+
+        def fn(*args):
+            local = {}
+            for i in group.members:
+                operands = []
+                for ref in inputs[i]:
+                    kind, j = ref
+                    if kind == "n" and j in members:
+                        operands.append(local[j])
+                    elif (ref, None) in position:
+                        operands.append(args[position[(ref, None)]])
+                    else:
+                        # a broadcast read in place
+                        source = (inputs[j][0], tuple(nodes[j].op.shape))
+                        operands.append(args[position[source]])
+                local[i] = nodes[i].op.compute(*operands)
+            return local[group.members[-1]]
+
+        return fn
+
+    @staticmethod
+    def _sum_axes(op, arrays):
+        ndim = len(needle.backend_ndarray.broadcast_shapes(*[a.shape for a in arrays]))
+        axes = op.axes
+        if axes is None:
+            return tuple(range(ndim))
+        if isinstance(axes, int):
+            axes = (axes,)
+        return tuple(sorted(set(a + ndim if a < 0 else a for a in axes)))
@@ -0,0 +1,207 @@
+"""Static memory planning of a training step.
+
+Eagerly, every array of a step gets its memory when it is created, and a
+step's intermediates (activations kept for backward, gradients, the
+temporaries of the ops) all come and go on their own.  A MemoryPlanner
+instead records one step, run within `with planner.step():`, and learns from
+it when each array is created and freed.  The arrays that do not outlive the
+step are then given offsets in one arena per device, arrays whose lifetimes
+do not overlap sharing memory, and later steps take them from the arenas in
+the order the recorded step created them:
+
+    planner = needle.memory.MemoryPlanner()
+    for X, y in loader:
+        with planner.step():
+            loss = loss_fn(model(X), y)
+            loss.backward()
+            opt.step()
+    print(planner.report())
+
+A step that creates different arrays than the recorded one (another batch
+size, say) falls back to plain allocation from where it differs, and is
+recorded and planned again.  An array that lives longer than in the recorded
+step is never overwritten: an allocation whose memory is still in use gets
+memory of its own, and an arena whose arrays outlive the step is not reused
+by the next one.
+
+Activation recomputation (nn.Checkpoint) trades compute for memory further,
+by not keeping the activations of a segment of the model for backward.
+"""
+import contextlib
+import threading
+import weakref
+
+from .backend_ndarray import ndarray
+
+# item sizes of the dtypes, in bytes
+_ITEMSIZE = {"float32": 4, "float16": 2, "bfloat16": 2, "int8": 1}
+
+
+class _Buffer:
+    """One allocation of the recorded step: when it was created and freed,
+    counted in allocations and frees, and where it goes in its arena (None
+    for one that outlived the step)."""
+
+    def __init__(self, device, size, dtype, start):
+        self.device = device
+        self.key = (device.name, size, dtype)
+        self.nbytes = size * _ITEMSIZE.get(dtype, 4)
+        self.start = start
+        self.end = None
+        self.offset = None
+
+
+def _plan(buffers, alignment):
+    """Give the buffers offsets such that those alive at the same time do not
+    overlap, largest first, each at the lowest offset that fits; returns the
+    size of the arena."""
+    placed = []
+    arena_size = 0
+    for buf in sorted(buffers, key=lambda b: (-b.nbytes, b.start)):
+        nbytes = -(-buf.nbytes // alignment) * alignment
+        taken = sorted(
+            (p.offset, p.offset + -(-p.nbytes // alignment) * alignment)
+            for p in placed
+            if p.start < buf.end and buf.start < p.end
+        )
+        offset = 0
+        for lo, hi in taken:
+            if lo - offset >= nbytes:
+                break
+            offset = max(offset, hi)
+        buf.offset = offset
+        placed.append(buf)
+        arena_size = max(arena_size, offset + nbytes)
+    return arena_size
+
+
+class MemoryPlanner:
+    def __init__(self, alignment=256):
+        # offsets in the arenas are multiples of alignment (in bytes)
+        self.alignment = alignment
+        self._buffers = None
+        self._sizes = {}  # of the arena of each device, by name
+        self._arenas = {}  # device name -> (arena, views of it alive, by index)
+        self._report = {}
+        self._step = None
+
+    @contextlib.contextmanager
+    def step(self):
+        """Run one step within a with block, from its arenas if it was
+        planned, recording and planning it otherwise."""
+        assert self._step is None, "steps do not nest"
+        self._step = {"thread": threading.get_ident(), "clock": 0, "next": 0,
+                      "diverged": False, "hits": 0, "fallbacks": 0}
+        recording = self._buffers is None
+        if recording:
+            self._recorded = []
+        else:
+            self._open_arenas()
+        previous = ndarray.set_allocator(self._record if recording else self._replay)
+        try:
+            yield self
+        finally:
+            ndarray.set_allocator(previous)
+            step, self._step = self._step, None
+            if recording:
+                self._finish_recording()
+            else:
+                self._report["hits"] = step["hits"]
+                self._report["fallbacks"] = step["fallbacks"]
+                if step["diverged"] or step["next"] != len(self._buffers):
+                    # a different step: plan the next one afresh
+                    self._buffers = None
+
+    def report(self):
+        """Memory of the planned step's arrays that do not outlive it, in bytes:
+        naive_peak if they all stayed alive to the end of the step, live_peak
+        the most of them alive at once, planned_peak the size of the arenas;
+        and of the last step run from the arenas, the allocations served from
+        them (hits) and by plain allocation because their memory was still in
+        use (fallbacks)."""
+        return dict(self._report)
+
+    def reset(self):
+        """Forget the plan and the arenas; the next step is recorded again."""
+        self._buffers = None
+        self._arenas = {}
+
+    def _record(self, device, size, dtype):
+        handle = device.Array(size, dtype)
+        step = self._step
+        if step is None or threading.get_ident() != step["thread"]:
+            # e.g. a data loader thread
+            return handle
+        buf = _Buffer(device, size, dtype, step["clock"])
+        step["clock"] += 1
+        self._recorded.append(buf)
+        weakref.finalize(handle, self._recorded_free, step, buf)
+        return handle
+
+    def _recorded_free(self, step, buf):
+        # the finalizers of arrays freed after their step leave them as outliving it
+        if step is self._step:
+            buf.end = step["clock"]
+            step["clock"] += 1
+
+    def _finish_recording(self):
+        buffers, self._recorded = self._recorded, None
+        by_device = {}
+        for buf in buffers:
+            if buf.end is not None and buf.nbytes > 0:
+                by_device.setdefault(buf.key[0], []).append(buf)
+        self._sizes = {name: _plan(bufs, self.alignment) for name, bufs in by_device.items()}
+        naive = sum(buf.nbytes for bufs in by_device.values() for buf in bufs)
+        events = []
+        for bufs in by_device.values():
+            for buf in bufs:
+                events += [(buf.start, buf.nbytes), (buf.end, -buf.nbytes)]
+        live = live_peak = 0
+        for _, change in sorted(events):
+            live += change
+            live_peak = max(live_peak, live)
+        self._report = {
+            "naive_peak": naive,
+            "live_peak": live_peak,
+            "planned_peak": sum(self._sizes.values()),
+            "num_buffers": len(buffers),
+            "num_planned": sum(len(bufs) for bufs in by_device.values()),
+            "hits": 0,
+            "fallbacks": 0,
+        }
+        self._buffers = buffers
+        self._arenas = {}
+
+    def _open_arenas(self):
+        # an arena some of whose views are still alive cannot be reused: the
+        # step gets a new one, the old one lasting as long as its views do
+        devices = {buf.key[0]: buf.device for buf in self._buffers if buf.offset is not None}
+        for name, device in devices.items():
+            arena = self._arenas.get(name)
+            if arena is None or arena[1]:
+                size = -(-self._sizes[name] // 4)
+                self._arenas[name] = (device.Array(size, "float32"), {})
+
+    def _replay(self, device, size, dtype):
+        step = self._step
+        if step is None or threading.get_ident() != step["thread"] or step["diverged"]:
+            return device.Array(size, dtype)
+        index = step["next"]
+        step["next"] += 1
+        if index >= len(self._buffers) or self._buffers[index].key != (device.name, size, dtype):
+            step["diverged"] = True
+            return device.Array(size, dtype)
+        buf = self._buffers[index]
+        if buf.offset is None:
+            return device.Array(size, dtype)
+        arena, live = self._arenas[device.name]
+        lo, hi = buf.offset, buf.offset + buf.nbytes
+        if any(l < hi and lo < h for l, h in live.values()):
+            # an array living longer than in the recorded step still uses the memory
+            step["fallbacks"] += 1
+            return device.Array(size, dtype)
+        view = device.arena_view(arena, buf.offset, size, dtype)
+        live[index] = (lo, hi)
+        weakref.finalize(view, live.pop, index, None)
+        step["hits"] += 1
+        return view
@@ -1 +1,2 @@
 from .nn_basic import *
+from .nn_parallel import DataParallel
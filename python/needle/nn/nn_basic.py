@@ -1,14 +1,46 @@
 """The module.
 """
 from typing import List, Callable, Any
-from needle.autograd import Tensor
+import contextlib
+import needle
+from needle.autograd import Tensor, TensorOp
 from needle import ops
+from needle.backend_ndarray import QuantizedWeight
 import needle.init as init
 import numpy as np
 
 
+# whether setting a Parameter's grad calls its grad_hooks, see _grad_hooks_off()
+_GRAD_HOOKS = True
+
+
 class Parameter(Tensor):
-    """A special kind of tensor that represents parameters."""
+    """A special kind of tensor that represents parameters.  The functions in
+    its grad_hooks are called with it whenever its grad is set, as backward()
+    does once the gradient is complete (DataParallel reduces the gradients of
+    the parameters done while backward goes on this way)."""
+
+    @property
+    def grad(self):
+        return self.__dict__.get("_grad")
+
+    @grad.setter
+    def grad(self, value):
+        self._grad = value
+        if _GRAD_HOOKS:
+            for hook in self.__dict__.get("grad_hooks", ()):
+                hook(self)
+
+
+@contextlib.contextmanager
+def _grad_hooks_off():
+    """Set grads that are not the final ones within a with block."""
+    global _GRAD_HOOKS
+    previous, _GRAD_HOOKS = _GRAD_HOOKS, False
+    try:
+        yield
+    finally:
+        _GRAD_HOOKS = previous
 
 
 def _unpack_params(value: object) -> List[Tensor]:
@@ -97,6 +129,25 @@ class Linear(Module):
         ### END YOUR SOLUTION
 
 
+class QuantizedLinear(Module):
+    """Inference-only int8 copy of a trained Linear layer (and the activation
+    after it, if given): the weight is quantized per output channel once,
+    here, and the input per row on every call (see NDArray.matmul_int8).  It
+    has no parameters, and no gradient."""
+
+    def __init__(self, linear: Linear, activation=None):
+        super().__init__()
+        self.in_features = linear.in_features
+        self.out_features = linear.out_features
+        self.activation = activation
+        self.weight = QuantizedWeight(linear.weight.realize_cached_data())
+        bias = getattr(linear, "bias", None)
+        self.bias = None if bias is None else bias.detach()
+
+    def forward(self, X: Tensor) -> Tensor:
+        return ops.quantized_linear(X, self.weight, self.bias, self.activation)
+
+
 class Flatten(Module):
     def forward(self, X):
         ### BEGIN YOUR SOLUTION
@@ -117,9 +168,52 @@ class Sequential(Module):
         self.modules = modules
 
     def forward(self, x: Tensor) -> Tensor:
-        ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
-        ### END YOUR SOLUTION
+        for module in self.modules:
+            x = module(x)
+        return x
+
+
+class _Recompute(TensorOp):
+    """module(x) as one op of inputs (x, *module.parameters()), whose
+    intermediate results are not kept: the gradient runs module again."""
+
+    def __init__(self, module):
+        self.module = module
+
+    def compute(self, x, *params):
+        with needle.lazy.lazy_mode(False), needle.autograd.no_grad():
+            return self.module(Tensor.make_const(x)).realize_cached_data()
+
+    def gradient(self, out_grad, node):
+        params = self.module.parameters()
+        saved = [p.grad for p in params]
+        x = Tensor.make_const(node.inputs[0].realize_cached_data(), requires_grad=True)
+        with _grad_hooks_off():
+            with needle.lazy.lazy_mode(False):
+                self.module(x).backward(out_grad)
+            grads = [x.grad] + [
+                p.grad if p.grad is not None else init.zeros_like(p) for p in params
+            ]
+            # the gradients of the parameters are set by the backward pass this one is part of
+            for p, grad in zip(params, saved):
+                p.grad = grad
+        return tuple(grads)
+
+
+class Checkpoint(Module):
+    """Activation recomputation: module (typically a Sequential segment of the
+    model) runs without keeping its intermediate results for backward, and
+    the backward pass runs it once more to get them, trading a forward pass
+    of the segment for their memory.  Only its output is kept.  Random draws
+    (Dropout) are made anew by the second run, so such modules do not belong
+    in the segment."""
+
+    def __init__(self, module):
+        super().__init__()
+        self.module = module
+
+    def forward(self, x: Tensor) -> Tensor:
+        return _Recompute(self.module)(x, *self.module.parameters())
 
 
 class SoftmaxLoss(Module):
@@ -0,0 +1,248 @@
+"""Data-parallel training on several devices.
+
+DataParallel keeps a replica of a model on each device, runs each on its
+share of the batch, and averages the gradients of the replicas into the
+model's own parameters, for an optimizer of the model to step as usual:
+
+    devices = [ndl.cuda(i) for i in range(ndl.cuda().device_count())]
+    model = make_model(device=devices[0])
+    dp = nn.DataParallel(model, devices)
+    opt = optim.SGD(model.parameters(), lr=0.1)
+    for X, y in loader:
+        outputs = dp(X)
+        losses = [loss_fn(out, y_i) for out, y_i in zip(outputs, dp.scatter(y)[0])]
+        dp.backward(losses)
+        opt.step()
+
+The gradients are averaged in buckets of parameters, the last layers first:
+as soon as every replica has the gradients of a bucket, they are summed
+across the devices (by NCCL, or by peer copies, see all_reduce_sum in the
+cuda backend) on a stream of their own, while backward goes on with the
+earlier layers.
+"""
+import contextlib
+import copy
+from typing import List
+
+from needle.autograd import Tensor
+from .nn_basic import Module, Parameter
+
+# item sizes of the dtypes, in bytes
+_ITEMSIZE = {"float32": 4, "float16": 2, "bfloat16": 2, "int8": 1}
+
+
+def _replicate(value, device, memo):
+    """A copy of value with its tensors on device: modules are copied, their
+    parameters (and other tensors, such as running statistics) are new ones,
+    and whatever else they hold is shared."""
+    if id(value) in memo:
+        return memo[id(value)]
+    if isinstance(value, Parameter):
+        result = Parameter(Tensor.make_const(value.realize_cached_data().to(device)),
+                           requires_grad=value.requires_grad)
+    elif isinstance(value, Tensor):
+        result = Tensor.make_const(value.realize_cached_data().to(device))
+    elif isinstance(value, Module):
+        result = copy.copy(value)
+        memo[id(value)] = result
+        result.__dict__ = {k: _replicate(v, device, memo) for k, v in value.__dict__.items()}
+    elif isinstance(value, dict):
+        result = {k: _replicate(v, device, memo) for k, v in value.items()}
+    elif isinstance(value, (list, tuple)):
+        result = type(value)(_replicate(v, device, memo) for v in value)
+    else:
+        result = value
+    memo[id(value)] = result
+    return result
+
+
+class _Bucket:
+    """Parameters (by their index in parameters()) whose gradients are reduced
+    together, and which of them each replica has set the gradient of."""
+
+    def __init__(self, indices):
+        self.indices = indices
+        self.ready = set()  # (replica, index)
+        self.done = False
+
+
+class DataParallel(Module):
+    """module, whose parameters are on devices[0], run on all of devices.
+
+    Calling it splits each input along its first axis into one chunk per
+    device and returns the outputs of the replicas, one per device.  The
+    parameters of the other replicas are copied from module's first, so that
+    they have those the optimizer last stepped.  backward(losses) runs the
+    backward pass of each replica's loss, and leaves in module's parameters
+    the mean of the replicas' gradients, which is the gradient of the whole
+    batch when it splits evenly.  Other tensors of the replicas, such as the
+    running statistics of BatchNorm1d, are updated by module's replica only.
+
+    Gradients are reduced in buckets of up to bucket_size bytes.  On cuda
+    devices, distinct ones, this runs on a stream per device alongside the
+    backward pass, the buckets being flattened to one buffer each for the
+    all-reduce; other devices (several cpu() replicas, say) sum them one
+    parameter at a time, once a bucket is complete.
+    """
+
+    def __init__(self, module: Module, devices, bucket_size=25 << 20):
+        super().__init__()
+        assert len(devices) > 0, "DataParallel needs at least one device"
+        params = module.parameters()
+        assert all(p.device == devices[0] for p in params), (
+            "the module's parameters must be on the first device"
+        )
+        self.module = module
+        self.devices = list(devices)
+        self.replicas = [module] + [_replicate(module, d, {}) for d in self.devices[1:]]
+        self._params = [replica.parameters() for replica in self.replicas]
+        # cuda replicas on distinct devices reduce on streams of their own
+        self._overlap = len(set(d.name for d in self.devices)) == len(self.devices) and all(
+            hasattr(d.mod, "all_reduce_sum") for d in self.devices
+        )
+        self._streams = [d.Stream() for d in self.devices] if self._overlap else None
+
+        # the parameters of the last layers get their gradients first
+        self._buckets = []
+        self._bucket_of = {}
+        indices, nbytes = [], 0
+        for index in reversed(range(len(params))):
+            indices.append(index)
+            p = params[index]
+            nbytes += p.realize_cached_data().size * _ITEMSIZE.get(p.dtype, 4)
+            if nbytes >= bucket_size:
+                self._add_bucket(indices)
+                indices, nbytes = [], 0
+        if indices:
+            self._add_bucket(indices)
+        self._in_step = False
+        for replica, replica_params in enumerate(self._params):
+            for index, p in enumerate(replica_params):
+                p.__dict__.setdefault("grad_hooks", []).append(
+                    lambda p, replica=replica, index=index: self._grad_set(replica, index, p)
+                )
+
+    def _add_bucket(self, indices):
+        for index in indices:
+            self._bucket_of[index] = len(self._buckets)
+        self._buckets.append(_Bucket(list(indices)))
+
+    def parameters(self) -> List[Tensor]:
+        return self.module.parameters()
+
+    def scatter(self, *inputs):
+        """Each of inputs (Tensors) split along its first axis into one chunk per
+        device, on that device: a list of chunks per input."""
+        n = len(self.devices)
+        result = []
+        for x in inputs:
+            array = x.realize_cached_data()
+            batch = array.shape[0]
+            assert batch >= n, "a batch of %d cannot be split across %d devices" % (batch, n)
+            chunks, lo = [], 0
+            for i, device in enumerate(self.devices):
+                hi = lo + batch // n + (i < batch % n)
+                idxs = (slice(lo, hi),) + (slice(None),) * (array.ndim - 1)
+                chunks.append(Tensor.make_const(array[idxs].to(device)))
+                lo = hi
+            result.append(chunks)
+        return result
+
+    def forward(self, *inputs):
+        self._broadcast()
+        for bucket in self._buckets:
+            bucket.ready.clear()
+            bucket.done = False
+        self._in_step = True
+        chunks = self.scatter(*inputs)
+        return [replica(*args) for replica, args in zip(self.replicas, zip(*chunks))]
+
+    def backward(self, losses):
+        """Backward of the loss of each replica, then the remaining gradient
+        reductions; module's parameters have the averaged gradients after."""
+        for loss in losses:
+            loss.backward()
+        self.synchronize()
+
+    def synchronize(self):
+        """Reduce the buckets not reduced yet, whose parameters some replica
+        got no gradient for (taken as zero), and have the devices' streams wait
+        for the reductions."""
+        if not self._in_step:
+            return
+        for bucket in self._buckets:
+            if not bucket.done:
+                self._reduce(bucket)
+        if self._overlap:
+            for device, stream in zip(self.devices, self._streams):
+                device.current_stream().wait_stream(stream)
+        self._in_step = False
+
+    def _broadcast(self):
+        # the other replicas get the parameters the optimizer stepped in module, and
+        # lose the gradients of the last step
+        for replica_params in self._params[1:]:
+            for src, dst in zip(self._params[0], replica_params):
+                dst.realize_cached_data().assign(src.realize_cached_data().to(dst.device))
+                dst.grad = None
+
+    def _grad_set(self, replica, index, param):
+        bucket = self._buckets[self._bucket_of[index]]
+        if not self._in_step or bucket.done or param.grad is None:
+            return
+        bucket.ready.add((replica, index))
+        if len(bucket.ready) == len(bucket.indices) * len(self.replicas):
+            self._reduce(bucket)
+
+    def _reduce(self, bucket):
+        # done first: writing the averaged gradients back sets grads again
+        bucket.done = True
+        scale = 1.0 / len(self.replicas)
+        if not self._overlap:
+            for index in bucket.indices:
+                grads = [params[index].grad for params in self._params]
+                grads = [g.realize_cached_data() for g in grads if g is not None]
+                if not grads:
+                    continue
+                total = grads[0]
+                for g in grads[1:]:
+                    total = total + g.to(total.device)
+                total = (total * scale).to(self.devices[0])
+                self._params[0][index].grad = Tensor.make_const(total)
+            return
+        flats = []
+        compute = self.devices[0].current_stream()
+        with contextlib.ExitStack() as streams:
+            for device, stream, params in zip(self.devices, self._streams, self._params):
+                # after the backward work queued so far, which made the gradients
+                stream.wait_stream(device.current_stream())
+                streams.enter_context(device.stream(stream))
+                flats.append(self._flatten(device, params, bucket.indices, stream))
+            self.devices[0].all_reduce_sum([flat._handle for flat in flats])
+            # unflattened (and averaged) into gradients of their own on the first device,
+            # which its compute stream uses once synchronize() has it wait for this one
+            lo = 0
+            for index in bucket.indices:
+                p = self._params[0][index]
+                shape = p.shape
+                hi = lo + p.realize_cached_data().size
+                grad = (flats[0][lo:hi] * scale).reshape(shape)
+                grad._handle.record_stream(compute)
+                p.grad = Tensor.make_const(grad)
+                lo = hi
+
+    def _flatten(self, device, params, indices, stream):
+        sizes = [params[index].realize_cached_data().size for index in indices]
+        flat = device.empty((sum(sizes),), params[indices[0]].dtype)
+        lo = 0
+        for index, size in zip(indices, sizes):
+            grad = params[index].grad
+            if grad is None:
+                flat[lo : lo + size] = 0.0
+            else:
+                array = grad.realize_cached_data().compact()
+                # made on the compute stream, read on this one
+                array._handle.record_stream(stream)
+                flat[lo : lo + size] = array.reshape((size,))
+            lo += size
+        return flat
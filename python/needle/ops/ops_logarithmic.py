@@ -5,17 +5,28 @@ from ..autograd import TensorTuple, TensorTupleOp
 
 from .ops_mathematic import *
 
-import numpy as array_api
+from ..backend_selection import array_api, BACKEND
 
 class LogSoftmax(TensorOp):
     def compute(self, Z):
         ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
+        # 沿最后一维做log-softmax；nd后端一次kernel完成，不需要中间的max和exp数组
+        if BACKEND == "nd":
+            return Z.log_softmax(axis=-1)
+        max_z = Z.max(axis=-1, keepdims=True)
+        return Z - (array_api.log(array_api.exp(Z - max_z).sum(axis=-1, keepdims=True)) + max_z)
         ### END YOUR SOLUTION
 
     def gradient(self, out_grad, node):
         ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
+        # d/dZ = g - softmax(Z) * sum(g)，softmax直接由输出exp得到
+        g = out_grad.realize_cached_data()
+        softmax = array_api.exp(node.realize_cached_data())
+        if BACKEND == "nd":
+            g_sum = g.sum(axis=-1, keepdims=True).broadcast_to(g.shape)
+        else:
+            g_sum = g.sum(axis=-1, keepdims=True)
+        return Tensor.make_const(g - softmax * g_sum)
         ### END YOUR SOLUTION
 
 
@@ -29,15 +40,174 @@ class LogSumExp(TensorOp):
 
     def compute(self, Z):
         ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
+        # nd后端用单遍的在线logsumexp kernel（边扫描边更新max并缩放sum）
+        if BACKEND == "nd":
+            return Z.logsumexp(axis=self.axes, keepdims=False)
+        # 先减去最大值保证数值稳定
+        max_z = Z.max(axis=self.axes, keepdims=True)
+        out = array_api.log(array_api.exp(Z - max_z).sum(axis=self.axes, keepdims=True)) + max_z
+        return out.reshape(self.reduced_shape(Z.shape, keepdims=False))
         ### END YOUR SOLUTION
 
     def gradient(self, out_grad, node):
         ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
+        # logsumexp对Z的导数就是沿axes的softmax，out_grad在被reduce的维度上广播
+        Z = node.inputs[0].realize_cached_data()
+        g = out_grad.realize_cached_data().reshape(self.reduced_shape(Z.shape, keepdims=True))
+        if BACKEND == "nd":
+            return Tensor.make_const(g.broadcast_to(Z.shape) * Z.softmax(axis=self.axes))
+        lse = node.realize_cached_data().reshape(g.shape)
+        return Tensor.make_const(g * array_api.exp(Z - lse))
         ### END YOUR SOLUTION
 
+    def reduced_shape(self, shape, keepdims):
+        if self.axes is None:
+            axes = range(len(shape))
+        elif isinstance(self.axes, int):
+            axes = (self.axes % len(shape),)
+        else:
+            axes = [a % len(shape) for a in self.axes]
+        if keepdims:
+            return tuple([1 if i in axes else s for i, s in enumerate(shape)])
+        return tuple([s for i, s in enumerate(shape) if i not in axes])
+
 
 def logsumexp(a, axes=None):
     return LogSumExp(axes=axes)(a)
 
+
+class SoftmaxCrossEntropy(TensorOp):
+    """Mean cross-entropy of softmax(logits) against integer labels y.
+
+    On the nd backend the per-row losses and the gradient with respect to the
+    logits come from one pass of NDArray's softmax_cross_entropy(), and the
+    gradient is kept for the backward pass instead of being recomputed from
+    a one-hot matrix.
+    """
+
+    def compute(self, Z, y):
+        if BACKEND == "nd":
+            loss, self.grad = array_api.softmax_cross_entropy(Z, y, with_grad=True)
+            return loss.sum(keepdims=False) / Z.shape[0]
+        rows = Z.shape[0]
+        labels = y.astype("int64")
+        max_z = Z.max(axis=1, keepdims=True)
+        lse = array_api.log(array_api.exp(Z - max_z).sum(axis=1, keepdims=True)) + max_z
+        self.grad = array_api.exp(Z - lse)
+        self.grad[array_api.arange(rows), labels] -= 1
+        return (lse[:, 0] - Z[array_api.arange(rows), labels]).mean()
+
+    def gradient(self, out_grad, node):
+        Z, y = node.inputs
+        scale = float(out_grad.numpy()) / Z.shape[0]
+        return (Tensor.make_const(self.grad * scale),
+                Tensor.make_const(y.realize_cached_data() * 0))
+
+
+def softmax_cross_entropy(logits, y):
+    return SoftmaxCrossEntropy()(logits, y)
+
+
+class LayerNorm(TensorOp):
+    """Normalization of each row of a 2D input to zero mean and unit variance,
+    scaled by weight and shifted by bias, as in nn.LayerNorm1d.
+
+    On the nd backend the statistics and the output come from one kernel
+    (see backend_ndarray.layer_norm()), and the per-row mean and inverse
+    standard deviation are kept for a single-kernel backward pass.
+    """
+
+    def __init__(self, eps=1e-5):
+        self.eps = eps
+
+    def compute(self, x, weight, bias):
+        if BACKEND == "nd":
+            out, self.mean, self.inv_std = array_api.layer_norm(x, weight, bias, self.eps)
+            return out
+        self.mean = x.mean(axis=1, keepdims=True)
+        self.inv_std = 1 / array_api.sqrt(x.var(axis=1, keepdims=True) + self.eps)
+        return (x - self.mean) * self.inv_std * weight.reshape(-1) + bias.reshape(-1)
+
+    def gradient(self, out_grad, node):
+        x, weight, bias = [t.realize_cached_data() for t in node.inputs]
+        g = out_grad.realize_cached_data()
+        if BACKEND == "nd":
+            grad_x, grad_weight, grad_bias = array_api.layer_norm_backward(
+                g, x, weight, self.mean, self.inv_std
+            )
+        else:
+            xhat = (x - self.mean) * self.inv_std
+            dy = g * weight.reshape(-1)
+            grad_x = self.inv_std * (dy - dy.mean(axis=1, keepdims=True)
+                                     - xhat * (dy * xhat).mean(axis=1, keepdims=True))
+            grad_weight, grad_bias = (g * xhat).sum(axis=0), g.sum(axis=0)
+        return (Tensor.make_const(grad_x),
+                Tensor.make_const(grad_weight.reshape(weight.shape)),
+                Tensor.make_const(grad_bias.reshape(bias.shape)))
+
+
+def layer_norm(x, weight, bias, eps=1e-5):
+    return LayerNorm(eps)(x, weight, bias)
+
+
+class BatchNorm(TensorOp):
+    """Normalization of each column of a 2D input over the batch, scaled by
+    weight and shifted by bias, as in nn.BatchNorm1d.
+
+    In training mode the batch statistics are used and the running_mean and
+    running_var arrays (if given) are updated in place from them, in the
+    same pass on the nd backend (see backend_ndarray.batch_norm()); in
+    evaluation mode the running statistics are used.
+    """
+
+    def __init__(self, running_mean=None, running_var=None, eps=1e-5, momentum=0.1,
+                 training=True):
+        self.running_mean = running_mean
+        self.running_var = running_var
+        self.eps = eps
+        self.momentum = momentum
+        self.training = training
+
+    def compute(self, x, weight, bias):
+        if BACKEND == "nd":
+            out, self.mean, self.inv_std = array_api.batch_norm(
+                x, weight, bias, self.running_mean, self.running_var, self.eps, self.momentum,
+                self.training,
+            )
+            return out
+        if self.training:
+            self.mean, var = x.mean(axis=0), x.var(axis=0)
+            for running, stat in ((self.running_mean, self.mean), (self.running_var, var)):
+                if running is not None:
+                    running[:] = (1 - self.momentum) * running + self.momentum * stat.reshape(
+                        running.shape)
+        else:
+            self.mean, var = self.running_mean.reshape(-1), self.running_var.reshape(-1)
+        self.inv_std = 1 / array_api.sqrt(var + self.eps)
+        return (x - self.mean) * self.inv_std * weight.reshape(-1) + bias.reshape(-1)
+
+    def gradient(self, out_grad, node):
+        x, weight, bias = [t.realize_cached_data() for t in node.inputs]
+        g = out_grad.realize_cached_data()
+        if BACKEND == "nd":
+            grad_x, grad_weight, grad_bias = array_api.batch_norm_backward(
+                g, x, weight, self.mean, self.inv_std, self.training
+            )
+        else:
+            xhat = (x - self.mean) * self.inv_std
+            grad_weight, grad_bias = (g * xhat).sum(axis=0), g.sum(axis=0)
+            if self.training:
+                g = g - (grad_bias + xhat * grad_weight) / x.shape[0]
+            grad_x = self.inv_std * weight.reshape(-1) * g
+        return (Tensor.make_const(grad_x),
+                Tensor.make_const(grad_weight.reshape(weight.shape)),
+                Tensor.make_const(grad_bias.reshape(bias.shape)))
+
+
+def batch_norm(x, weight, bias, running_mean=None, running_var=None, eps=1e-5, momentum=0.1,
+               training=True):
+    """running_mean and running_var are Tensors whose data is updated in place
+    in training mode."""
+    running_mean = None if running_mean is None else running_mean.realize_cached_data()
+    running_var = None if running_var is None else running_var.realize_cached_data()
+    return BatchNorm(running_mean, running_var, eps, momentum, training)(x, weight, bias)
@@ -15,6 +15,8 @@ import numpy as array_api
 
 
 class EWiseAdd(TensorOp):
+    elementwise = True
+
     def compute(self, a: NDArray, b: NDArray):
         return a + b
 
@@ -27,6 +29,8 @@ def add(a, b):
 
 
 class AddScalar(TensorOp):
+    elementwise = True
+
     def __init__(self, scalar):
         self.scalar = scalar
 
@@ -42,6 +46,8 @@ def add_scalar(a, scalar):
 
 
 class EWiseMul(TensorOp):
+    elementwise = True
+
     def compute(self, a: NDArray, b: NDArray):
         return a * b
 
@@ -55,6 +61,8 @@ def multiply(a, b):
 
 
 class MulScalar(TensorOp):
+    elementwise = True
+
     def __init__(self, scalar):
         self.scalar = scalar
 
@@ -72,6 +80,8 @@ def mul_scalar(a, scalar):
 class EWisePow(TensorOp):
     """Op to element-wise raise a tensor to a power."""
 
+    elementwise = True
+
     def compute(self, a: NDArray, b: NDArray) -> NDArray:
         return a**b
 
@@ -93,6 +103,8 @@ def power(a, b):
 class PowerScalar(TensorOp):
     """Op raise a tensor to an (integer) power."""
 
+    elementwise = True
+
     def __init__(self, scalar: int):
         self.scalar = scalar
 
@@ -114,6 +126,8 @@ def power_scalar(a, scalar):
 class EWiseDiv(TensorOp):
     """Op to element-wise divide two nodes."""
 
+    elementwise = True
+
     def compute(self, a, b):
         ### BEGIN YOUR SOLUTION
         raise NotImplementedError()
@@ -130,6 +144,8 @@ def divide(a, b):
 
 
 class DivScalar(TensorOp):
+    elementwise = True
+
     def __init__(self, scalar):
         self.scalar = scalar
 
@@ -211,7 +227,8 @@ class Summation(TensorOp):
 
     def compute(self, a):
         ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
+        # 后端直接在原位置沿(多个)轴做reduce，不需要先permute+compact
+        return a.sum(axis=self.axes, keepdims=False)
         ### END YOUR SOLUTION
 
     def gradient(self, out_grad, node):
@@ -241,6 +258,8 @@ def matmul(a, b):
 
 
 class Negate(TensorOp):
+    elementwise = True
+
     def compute(self, a):
         ### BEGIN YOUR SOLUTION
         raise NotImplementedError()
@@ -257,6 +276,8 @@ def negate(a):
 
 
 class Log(TensorOp):
+    elementwise = True
+
     def compute(self, a):
         ### BEGIN YOUR SOLUTION
         raise NotImplementedError()
@@ -273,6 +294,8 @@ def log(a):
 
 
 class Exp(TensorOp):
+    elementwise = True
+
     def compute(self, a):
         ### BEGIN YOUR SOLUTION
         raise NotImplementedError()
@@ -289,6 +312,8 @@ def exp(a):
 
 
 class ReLU(TensorOp):
+    elementwise = True
+
     def compute(self, a):
         ### BEGIN YOUR SOLUTION
         raise NotImplementedError()
@@ -302,3 +327,67 @@ class ReLU(TensorOp):
 
 def relu(a):
     return ReLU()(a)
+
+
+class FusedLinear(TensorOp):
+    """activation(X @ W + b) as a single op, run through NDArray.matmul_epilogue()
+    so that a Linear layer and the activation after it take one pass over the
+    output, with no broadcast copy of the bias."""
+
+    def __init__(self, activation: Optional[str] = None):
+        assert activation in (None, "relu", "tanh")
+        self.activation = activation
+
+    def compute(self, X, W, b=None):
+        if hasattr(X, "matmul_epilogue"):
+            return X.matmul_epilogue(W, b, self.activation)
+        out = X @ W
+        if b is not None:
+            out = out + b.reshape((1, -1))
+        if self.activation == "relu":
+            out = array_api.maximum(out, 0)
+        elif self.activation == "tanh":
+            out = array_api.tanh(out)
+        return out
+
+    def gradient(self, out_grad, node):
+        X, W = node.inputs[0], node.inputs[1]
+        out = node.realize_cached_data()
+        if self.activation == "relu":
+            out_grad = out_grad * Tensor.make_const(out > 0)
+        elif self.activation == "tanh":
+            out_grad = out_grad * Tensor.make_const(1 - out * out)
+        grads = (matmul(out_grad, transpose(W)), matmul(transpose(X), out_grad))
+        if len(node.inputs) == 3:
+            grads += (reshape(summation(out_grad, axes=(0,)), node.inputs[2].shape),)
+        return grads
+
+
+def fused_linear(X, W, b=None, activation=None):
+    if b is None:
+        return FusedLinear(activation)(X, W)
+    return FusedLinear(activation)(X, W, b)
+
+
+class QuantizedLinear(TensorOp):
+    """activation(X @ W + b) for inference, with W held as an int8
+    QuantizedWeight and run through NDArray.matmul_int8(): X is quantized per
+    row on the fly and the product accumulated in int32.  There is no
+    gradient; quantize a trained layer's weight once, then serve with it."""
+
+    def __init__(self, weight, activation: Optional[str] = None):
+        assert activation in (None, "relu", "tanh")
+        self.weight = weight
+        self.activation = activation
+
+    def compute(self, X, b=None):
+        return X.matmul_int8(self.weight, b, self.activation)
+
+    def gradient(self, out_grad, node):
+        raise NotImplementedError("quantized_linear is inference only")
+
+
+def quantized_linear(X, weight, b=None, activation=None):
+    if b is None:
+        return QuantizedLinear(weight, activation)(X)
+    return QuantizedLinear(weight, activation)(X, b)
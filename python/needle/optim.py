@@ -1,6 +1,7 @@
 """Optimization module"""
 import needle as ndl
 import numpy as np
+from .backend_selection import array_api
 
 
 class Optimizer:
@@ -14,6 +15,24 @@ class Optimizer:
         for p in self.params:
             p.grad = None
 
+    def _step_arrays(self, *states):
+        """The arrays of the parameters that have a gradient, their gradients and
+        their optimizer states (dicts from parameter to array, filled with zeros the
+        first time), for the fused sgd_step()/adam_step() of the backend, which
+        update the arrays of the parameters and the states in place."""
+        params = [p for p in self.params if p.grad is not None]
+        arrays = []
+        for p in params:
+            data = p.realize_cached_data()
+            if not data.is_compact():
+                data = p.cached_data = data.compact()
+            arrays.append(data)
+            for state in states:
+                if p not in state:
+                    state[p] = array_api.full(data.shape, 0.0, device=data.device)
+        grads = [p.grad.realize_cached_data() for p in params]
+        return arrays, grads, [[state[p] for p in params] for state in states]
+
 
 class SGD(Optimizer):
     def __init__(self, params, lr=0.01, momentum=0.0, weight_decay=0.0):
@@ -25,7 +44,9 @@ class SGD(Optimizer):
 
     def step(self):
         ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
+        # one fused kernel call for all the parameters, instead of a few tensor ops for each
+        arrays, grads, (moments,) = self._step_arrays(self.u)
+        array_api.sgd_step(arrays, grads, moments, self.lr, self.momentum, self.weight_decay)
         ### END YOUR SOLUTION
 
     def clip_grad_norm(self, max_norm=0.25):
@@ -53,12 +74,20 @@ class Adam(Optimizer):
         self.beta2 = beta2
         self.eps = eps
         self.weight_decay = weight_decay
-        self.t = 0
+        # the steps taken, per device, counted on the device (see adam_step() in ndarray.py)
+        self.step_counts = {}
 
         self.m = {}
         self.v = {}
 
+    @property
+    def t(self):
+        """The number of steps taken, read back from the device."""
+        return max([int(count.numpy()[0]) for count in self.step_counts.values()], default=0)
+
     def step(self):
         ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
+        arrays, grads, (m, v) = self._step_arrays(self.m, self.v)
+        array_api.adam_step(arrays, grads, m, v, self.step_counts, self.lr, self.beta1,
+                            self.beta2, self.eps, self.weight_decay)
         ### END YOUR SOLUTION
@@ -2,9 +2,35 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include "ndarray_dlpack.h"
+#include "ndarray_profiler.h"
+
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 namespace needle {
 namespace cpu {
@@ -16,440 +42,829 @@ const size_t ELEM_SIZE = sizeof(scalar_t);
 
 
 /**
- * This is a utility structure for maintaining an array aligned to ALIGNMENT boundaries in
- * memory.  This alignment should be at least TILE * ELEM_SIZE, though we make it even larger
- * here by default.
+ * Pooled host allocator behind AlignedArray.
+ *
+ * Every intermediate of the CPU backend is an AlignedArray, and with small batches the cost of
+ * posix_memalign/free (and of faulting fresh pages in) becomes comparable to the compute.  Freed
+ * buffers are therefore cached by size class and handed out again:
+ *   - request sizes are rounded up to one of four classes per power of two (so at most 25% is
+ *     wasted), starting at ALIGNMENT; every block keeps the ALIGNMENT alignment;
+ *   - classes up to HOST_POOL_THREAD_MAX_SIZE are cached in lock-free thread-local lists of up to
+ *     HOST_POOL_THREAD_MAX_BLOCKS blocks each, everything else (and the overflow) in a shared
+ *     mutex-protected pool that holds at most HOST_POOL_MAX_CACHED bytes;
+ *   - requests above HOST_POOL_MAX_SIZE are not pooled at all;
+ *   - optionally, blocks of at least HUGE_PAGE_SIZE are aligned to it and advised to use
+ *     transparent huge pages, which cuts page faults and TLB misses for large activations.
+ *
+ * The pool can be disabled (e.g. to let a memory checker see every allocation) with the
+ * NEEDLE_HOST_POOL=0 environment variable or set_memory_pool(False); huge pages are enabled with
+ * NEEDLE_HUGE_PAGES=1 or set_huge_pages(True).
  */
-struct AlignedArray {
-  AlignedArray(const size_t size) {
-    int ret = posix_memalign((void**)&ptr, ALIGNMENT, size * ELEM_SIZE);
-    if (ret != 0) throw std::bad_alloc();
-    this->size = size;
+const size_t HOST_POOL_MAX_SIZE = 256 << 20;
+const size_t HOST_POOL_THREAD_MAX_SIZE = 1 << 20;
+const size_t HOST_POOL_THREAD_MAX_BLOCKS = 32;
+const size_t HOST_POOL_MAX_CACHED = (size_t)1 << 30;
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+// enough classes for HOST_POOL_MAX_SIZE = ALIGNMENT << 20, four per power of two
+const int HOST_POOL_NUM_CLASSES = 84;
+
+inline bool EnvFlag(const char* name, bool default_value) {
+  const char* value = std::getenv(name);
+  if (value == nullptr || value[0] == '\0') return default_value;
+  return std::strcmp(value, "0") != 0;
+}
+
+class HostAllocator {
+ public:
+  // size class of blocks that did not come from the pool
+  static const int UNPOOLED = -1;
+
+  struct Stats {
+    size_t bytes_in_use;  // in pooled blocks handed out to arrays
+    size_t bytes_cached;  // in free blocks kept by the pool
+    size_t num_allocs;
+    size_t num_pool_hits;  // allocations served from a cached block
+  };
+
+  HostAllocator()
+      : enabled_(EnvFlag("NEEDLE_HOST_POOL", true)),
+        huge_pages_(EnvFlag("NEEDLE_HUGE_PAGES", false)),
+        bytes_in_use_(0), bytes_cached_(0), num_allocs_(0), num_pool_hits_(0) {}
+
+  void* Allocate(size_t bytes, int* size_class) {
+    if (!enabled_ || bytes > HOST_POOL_MAX_SIZE) {
+      *size_class = UNPOOLED;
+      return SystemAlloc(bytes);
+    }
+    int cls = SizeClass(bytes);
+    size_t size = ClassSize(cls);
+    *size_class = cls;
+    num_allocs_++;
+    bytes_in_use_ += size;
+    void* ptr = nullptr;
+    if (size <= HOST_POOL_THREAD_MAX_SIZE) {
+      std::vector<void*>& list = LocalCache().free_lists[cls];
+      if (!list.empty()) {
+        ptr = list.back();
+        list.pop_back();
+      }
+    }
+    if (ptr == nullptr) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!free_lists_[cls].empty()) {
+        ptr = free_lists_[cls].back();
+        free_lists_[cls].pop_back();
+      }
+    }
+    if (ptr == nullptr) return SystemAlloc(size);
+    num_pool_hits_++;
+    bytes_cached_ -= size;
+    return ptr;
   }
-  ~AlignedArray() { free(ptr); }
-  size_t ptr_as_int() {return (size_t)ptr; }
-  scalar_t* ptr;
-  size_t size;
-};
 
+  void Free(void* ptr, int size_class) {
+    if (size_class == UNPOOLED) {
+      free(ptr);
+      return;
+    }
+    size_t size = ClassSize(size_class);
+    bytes_in_use_ -= size;
+    if (!enabled_) {
+      free(ptr);
+      return;
+    }
+    if (size <= HOST_POOL_THREAD_MAX_SIZE) {
+      std::vector<void*>& list = LocalCache().free_lists[size_class];
+      if (list.size() < HOST_POOL_THREAD_MAX_BLOCKS) {
+        list.push_back(ptr);
+        bytes_cached_ += size;
+        return;
+      }
+    }
+    Release(ptr, size_class);
+  }
 
+  void EmptyCache() {
+    /**
+     * Free every cached block of the shared pool and of the calling thread's lists (the lists of
+     * other threads are only returned to the shared pool when those threads exit).
+     */
+    ThreadCache& cache = LocalCache();
+    for (int cls = 0; cls < HOST_POOL_NUM_CLASSES; cls++) {
+      for (void* ptr : cache.free_lists[cls]) free(ptr);
+      bytes_cached_ -= cache.free_lists[cls].size() * ClassSize(cls);
+      cache.free_lists[cls].clear();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int cls = 0; cls < HOST_POOL_NUM_CLASSES; cls++) {
+      for (void* ptr : free_lists_[cls]) free(ptr);
+      bytes_cached_ -= free_lists_[cls].size() * ClassSize(cls);
+      free_lists_[cls].clear();
+    }
+  }
 
-void Fill(AlignedArray* out, scalar_t val) {
-  /**
-   * Fill the values of an aligned array with val
-   */
-  for (int i = 0; i < out->size; i++) {
-    out->ptr[i] = val;
+  void SetEnabled(bool enabled) {
+    enabled_ = enabled;
+    if (!enabled) EmptyCache();
   }
-}
 
+  void SetHugePages(bool huge_pages) { huge_pages_ = huge_pages; }
 
-size_t getLocation(const std::vector<int32_t> &strides, size_t offset, const std::vector<int32_t> &indices_vector) {
-    size_t loc = offset;
-    for (size_t i = 0; i < indices_vector.size(); i++) {
-        loc += strides[i] * indices_vector[i];
-    }
-    return loc;
-}
+  Stats GetStats() const {
+    Stats stats = {bytes_in_use_, bytes_cached_, num_allocs_, num_pool_hits_};
+    return stats;
+  }
 
-void updateIndices(const std::vector<int32_t> &shape, std::vector<int32_t> &indices_vector) {
-    // 从最后一维开始，未达到最大值就只将该维度加1，达到就重置为0并向前移动.
-    for (size_t i = indices_vector.size() - 1;; i--) {
-        if (indices_vector[i] < shape[i] - 1) {
-            indices_vector[i]++;
-            break;
+ private:
+  struct ThreadCache {
+    explicit ThreadCache(HostAllocator* owner) : owner(owner) {}
+    ~ThreadCache() {
+      // hand the blocks of an exiting thread over to the shared pool
+      for (int cls = 0; cls < HOST_POOL_NUM_CLASSES; cls++) {
+        for (void* ptr : free_lists[cls]) {
+          owner->bytes_cached_ -= ClassSize(cls);
+          owner->Release(ptr, cls);
         }
-        // 当所有维度都达到最大值时说明遍历已经完成
-        else if (i == 0)
-            break;
-        else
-            indices_vector[i] = 0;
+      }
     }
-}
+    HostAllocator* owner;
+    std::vector<void*> free_lists[HOST_POOL_NUM_CLASSES];
+  };
 
-void Compact(const AlignedArray& a, AlignedArray* out, std::vector<int32_t> shape,
-             std::vector<int32_t> strides, size_t offset) {
-  /**
-   * Compact an array in memory
-   *
-   * Args:
-   *   a: non-compact representation of the array, given as input
-   *   out: compact version of the array to be written
-   *   shape: shapes of each dimension for a and out
-   *   strides: strides of the *a* array (not out, which has compact strides)
-   *   offset: offset of the *a* array (not out, which has zero offset, being compact)
-   *
-   * Returns:
-   *  void (you need to modify out directly, rather than returning anything; this is true for all the
-   *  function will implement here, so we won't repeat this note.)
-   */
-  /// BEGIN SOLUTION
-  std::vector<int32_t> indices_vector(shape.size(),0);
+  ThreadCache& LocalCache() {
+    static thread_local ThreadCache cache(this);
+    return cache;
+  }
 
-  // out已经分配好了空间，out->size就是compact后底层存储的size
-  for (size_t i = 0; i < out->size; i++) {
-      size_t loc = getLocation(strides, offset, indices_vector);
-      out->ptr[i] = a.ptr[loc];
-      updateIndices(shape, indices_vector);
+  static int SizeClass(size_t bytes) {
+    // classes are 1, 2, 3, 4 units of ALIGNMENT, then 5..8, 10..16 (step 2), 20..32 (step 4), ...
+    size_t units = std::max<size_t>(1, (bytes + ALIGNMENT - 1) / ALIGNMENT);
+    if (units <= 4) return units - 1;
+    size_t m = units - 1;
+    int shift = 0;
+    while ((m >> shift) >= 8) shift++;
+    return shift * 4 + (int)(m >> shift);
   }
-  /// END SOLUTION
-}
 
-void EwiseSetitem(const AlignedArray& a, AlignedArray* out, std::vector<int32_t> shape,
-                  std::vector<int32_t> strides, size_t offset) {
-  /**
-   * Set items in a (non-compact) array
-   *
-   * Args:
-   *   a: _compact_ array whose items will be written to out
-   *   out: non-compact array whose items are to be written
-   *   shape: shapes of each dimension for a and out
-   *   strides: strides of the *out* array (not a, which has compact strides)
-   *   offset: offset of the *out* array (not a, which has zero offset, being compact)
-   */
-  /// BEGIN SOLUTION
-  // 实现与compact类似，只不过根据offset和strides遍历的是out中的元素
-  std::vector<int32_t> indices_vector(shape.size(),0);
-  for (size_t i = 0; i < a.size; i++) {
-      size_t loc = getLocation(strides, offset, indices_vector);
-      out->ptr[loc] = a.ptr[i];
-      updateIndices(shape, indices_vector);
-  }
-  /// END SOLUTION
-}
+  static size_t ClassSize(int cls) {
+    if (cls < 4) return (size_t)(cls + 1) * ALIGNMENT;
+    int shift = cls / 4 - 1;
+    return (size_t)(cls % 4 + 5) * ALIGNMENT << shift;
+  }
 
-void ScalarSetitem(const size_t size, scalar_t val, AlignedArray* out, std::vector<int32_t> shape,
-                   std::vector<int32_t> strides, size_t offset) {
-  /**
-   * Set items is a (non-compact) array
-   *
-   * Args:
-   *   size: number of elements to write in out array (note that this will note be the same as
-   *         out.size, because out is a non-compact subset array);  it _will_ be the same as the
-   *         product of items in shape, but convenient to just pass it here.
-   *   val: scalar value to write to
-   *   out: non-compact array whose items are to be written
-   *   shape: shapes of each dimension of out
-   *   strides: strides of the out array
-   *   offset: offset of the out array
-   */
+  void Release(void* ptr, int cls) {
+    // put a free block into the shared pool, or give it back to the system if the pool is full
+    size_t size = ClassSize(cls);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!enabled_ || bytes_cached_ + size > HOST_POOL_MAX_CACHED) {
+      free(ptr);
+      return;
+    }
+    free_lists_[cls].push_back(ptr);
+    bytes_cached_ += size;
+  }
 
-  /// BEGIN SOLUTION
-  std::vector<int32_t> indices_vector(shape.size(),0);
-  for (size_t i = 0; i < size; i++) {
-      size_t loc = getLocation(strides, offset, indices_vector);
-      out->ptr[loc] = val;
-      updateIndices(shape, indices_vector);
+  void* SystemAlloc(size_t bytes) {
+    bool huge = huge_pages_ && bytes >= HUGE_PAGE_SIZE;
+    void* ptr;
+    if (posix_memalign(&ptr, huge ? HUGE_PAGE_SIZE : ALIGNMENT, bytes) != 0) {
+      // retry once without anything cached
+      EmptyCache();
+      if (posix_memalign(&ptr, huge ? HUGE_PAGE_SIZE : ALIGNMENT, bytes) != 0)
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge) madvise(ptr, bytes / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+#endif
+    return ptr;
   }
-  /// END SOLUTION
+
+  std::atomic<bool> enabled_, huge_pages_;
+  std::atomic<size_t> bytes_in_use_, bytes_cached_, num_allocs_, num_pool_hits_;
+  std::mutex mutex_;
+  std::vector<void*> free_lists_[HOST_POOL_NUM_CLASSES];
+};
+
+HostAllocator& HostPool() {
+  // never destroyed, so arrays (and thread caches) released during shutdown can still use it
+  static HostAllocator* allocator = new HostAllocator();
+  return *allocator;
 }
 
-void EwiseAdd(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
-  /**
-   * Set entries in out to be the sum of correspondings entires in a and b.
-   */
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = a.ptr[i] + b.ptr[i];
+
+/**
+ * Element types.  An array stores float32, float16 or bfloat16 items, but the 16-bit types are
+ * storage formats only: the kernels convert them to float as they load them, compute and
+ * accumulate (matmul, reductions) in float, and round back to nearest even as they store.  This
+ * halves the memory traffic of the bandwidth-bound kernels, which is where the time goes.
+ *
+ * int8 arrays hold quantized values (see the quantized kernels), whose scales live in separate
+ * float32 arrays; besides those kernels only compact, ewise_setitem and astype (which rounds and
+ * saturates to [-128, 127]) take them.
+ */
+enum DType { DTYPE_FLOAT32, DTYPE_FLOAT16, DTYPE_BFLOAT16, DTYPE_INT8 };
+
+struct float16_t {
+  uint16_t bits;
+};
+struct bfloat16_t {
+  uint16_t bits;
+};
+
+inline DType ParseDType(const std::string& name) {
+  if (name == "float32") return DTYPE_FLOAT32;
+  if (name == "float16") return DTYPE_FLOAT16;
+  if (name == "bfloat16") return DTYPE_BFLOAT16;
+  if (name == "int8") return DTYPE_INT8;
+  throw std::invalid_argument("unsupported dtype " + name +
+                              " (expected float32, float16, bfloat16 or int8)");
+}
+
+inline const char* DTypeName(DType dtype) {
+  switch (dtype) {
+    case DTYPE_FLOAT16: return "float16";
+    case DTYPE_BFLOAT16: return "bfloat16";
+    case DTYPE_INT8: return "int8";
+    default: return "float32";
   }
 }
 
-void ScalarAdd(const AlignedArray& a, scalar_t val, AlignedArray* out) {
-  /**
-   * Set entries in out to be the sum of corresponding entry in a plus the scalar val.
-   */
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = a.ptr[i] + val;
+inline size_t DTypeSize(DType dtype) {
+  switch (dtype) {
+    case DTYPE_FLOAT32: return 4;
+    case DTYPE_INT8: return 1;
+    default: return 2;
   }
 }
 
+inline uint32_t FloatBits(scalar_t x) {
+  uint32_t bits;
+  std::memcpy(&bits, &x, sizeof(bits));
+  return bits;
+}
+
+inline scalar_t BitsFloat(uint32_t bits) {
+  scalar_t x;
+  std::memcpy(&x, &bits, sizeof(x));
+  return x;
+}
 
 /**
- * In the code the follows, use the above template to create analogous element-wise
- * and and scalar operators for the following functions.  See the numpy backend for
- * examples of how they should work.
- *   - EwiseMul, ScalarMul
- *   - EwiseDiv, ScalarDiv
- *   - ScalarPower
- *   - EwiseMaximum, ScalarMaximum
- *   - EwiseEq, ScalarEq
- *   - EwiseGe, ScalarGe
- *   - EwiseLog
- *   - EwiseExp
- *   - EwiseTanh
- *
- * If you implement all these naively, there will be a lot of repeated code, so
- * you are welcome (but not required), to use macros or templates to define these
- * functions (however you want to do so, as long as the functions match the proper)
- * signatures above.
+ * Scalar conversions, exact towards float and rounding to nearest even away from it (with
+ * overflow to inf, gradual underflow and NaN kept NaN).  The half-precision ones are the
+ * branch-free bit manipulations of the FP16 library (github.com/Maratyszcza/FP16), which lean on
+ * float arithmetic to do the rounding; the vectorized row versions are in the kernels.
  */
+inline scalar_t ToFloat(scalar_t x) { return x; }
+
+inline scalar_t ToFloat(float16_t x) {
+  uint32_t w = (uint32_t)x.bits << 16;
+  uint32_t sign = w & 0x80000000u, two_w = w + w;
+  // normal halves: move exponent and mantissa into place, then rebias by multiplying by 2^-112
+  scalar_t normalized = BitsFloat((two_w >> 4) + (0xe0u << 23)) * BitsFloat(0x7800000u);
+  // subnormal halves: 0.5 + m * 2^-24 (exactly representable), minus 0.5
+  scalar_t denormalized = BitsFloat((two_w >> 17) | (126u << 23)) - 0.5f;
+  return BitsFloat(sign | (two_w < (1u << 27) ? FloatBits(denormalized) : FloatBits(normalized)));
+}
 
-// Element-wise multiplication
-void EwiseMul(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = a.ptr[i] * b.ptr[i];
-  }
+inline scalar_t ToFloat(bfloat16_t x) { return BitsFloat((uint32_t)x.bits << 16); }
+
+inline scalar_t ToFloat(int8_t x) { return x; }
+
+template <typename T>
+T FromFloat(scalar_t x);
+
+template <>
+inline scalar_t FromFloat<scalar_t>(scalar_t x) {
+  return x;
 }
 
-// Scalar multiplication
-void ScalarMul(const AlignedArray& a, scalar_t val, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = a.ptr[i] * val;
-  }
+template <>
+inline float16_t FromFloat<float16_t>(scalar_t x) {
+  // scale by 2^112 then 2^-110 so that the addition below rounds at the half's precision
+  scalar_t base = (std::fabs(x) * BitsFloat(0x77800000u)) * BitsFloat(0x08800000u);
+  uint32_t w = FloatBits(x), shl1_w = w + w, sign = w & 0x80000000u;
+  uint32_t bias = std::max(shl1_w & 0xff000000u, 0x71000000u);
+  base = BitsFloat((bias >> 1) + 0x07800000u) + base;
+  uint32_t bits = FloatBits(base);
+  uint32_t nonsign = ((bits >> 13) & 0x00007c00u) + (bits & 0x00000fffu);
+  float16_t res = {(uint16_t)((sign >> 16) | (shl1_w > 0xff000000u ? 0x7e00u : nonsign))};
+  return res;
 }
 
-// Element-wise division
-void EwiseDiv(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = a.ptr[i] / b.ptr[i];
+template <>
+inline bfloat16_t FromFloat<bfloat16_t>(scalar_t x) {
+  uint32_t bits = FloatBits(x);
+  if ((bits & 0x7fffffffu) > 0x7f800000u) {
+    bfloat16_t nan = {(uint16_t)((bits >> 16) | 0x40)};  // keep it a (quiet) NaN
+    return nan;
   }
+  bfloat16_t res = {(uint16_t)((bits + 0x7fffu + ((bits >> 16) & 1)) >> 16)};
+  return res;
 }
 
-// Scalar division
-void ScalarDiv(const AlignedArray& a, scalar_t val, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = a.ptr[i] / val;
-  }
+template <>
+inline int8_t FromFloat<int8_t>(scalar_t x) {
+  // the comparisons also send NaN to 0
+  x = std::nearbyint(x);
+  return x >= 127 ? 127 : x <= -128 ? -128 : x == x ? (int8_t)x : 0;
 }
 
-// Scalar power
-void ScalarPower(const AlignedArray& a, scalar_t val, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = pow(a.ptr[i], val);
-  }
+[[noreturn]] inline void RejectInt8() {
+  throw std::invalid_argument(
+      "int8 arrays only go through compact, setitem, astype and the quantized kernels");
 }
 
-// Element-wise maximum
-void EwiseMaximum(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = std::max(a.ptr[i], b.ptr[i]);
+/**
+ * Run the statement(s) with the typedef T set to the item type of dtype, e.g.
+ *   DISPATCH_DTYPE(out->dtype, T, FillItems(out->data<T>(), out->size, FromFloat<T>(val)));
+ * for the floating point dtypes; int8 arrays are turned away.
+ */
+#define DISPATCH_DTYPE(dtype, T, ...)   \
+  switch (dtype) {                      \
+    case DTYPE_INT8:                    \
+      RejectInt8();                     \
+    case DTYPE_FLOAT16: {               \
+      typedef float16_t T;              \
+      __VA_ARGS__;                      \
+      break;                            \
+    }                                   \
+    case DTYPE_BFLOAT16: {              \
+      typedef bfloat16_t T;             \
+      __VA_ARGS__;                      \
+      break;                            \
+    }                                   \
+    default: {                          \
+      typedef scalar_t T;               \
+      __VA_ARGS__;                      \
+      break;                            \
+    }                                   \
   }
-}
 
-// Scalar maximum
-void ScalarMaximum(const AlignedArray& a, scalar_t val, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = std::max(a.ptr[i], val);
+
+/**
+ * This is a utility structure for maintaining an array aligned to ALIGNMENT boundaries in
+ * memory.  This alignment should be at least TILE * ELEM_SIZE, though we make it even larger
+ * here by default.  size counts items, of dtype; ptr is typed for the float32 kernels, the
+ * others go through data<T>().
+ */
+struct AlignedArray {
+  AlignedArray(const size_t size, DType dtype = DTYPE_FLOAT32) : dtype(dtype) {
+    ptr = (scalar_t*)HostPool().Allocate(size * DTypeSize(dtype), &size_class);
+    this->size = size;
+    if (profiler::Enabled())
+      profiler::Global().RecordAlloc(size * DTypeSize(dtype), HostPool().GetStats().bytes_in_use);
   }
+  // wrap memory owned by someone else (a numpy array, a DLPack tensor), which is given back by
+  // calling release; such memory need not be aligned
+  AlignedArray(scalar_t* ptr, size_t size, std::function<void()> release)
+      : ptr(ptr), size(size), size_class(HostAllocator::UNPOOLED), dtype(DTYPE_FLOAT32),
+        release(release) {}
+  ~AlignedArray() {
+    if (release) {
+      release();
+    } else {
+      HostPool().Free(ptr, size_class);
+      if (profiler::Enabled()) profiler::Global().RecordFree(HostPool().GetStats().bytes_in_use);
+    }
+  }
+  size_t ptr_as_int() {return (size_t)ptr; }
+  template <typename T>
+  T* data() const { return (T*)ptr; }
+  size_t itemsize() const { return DTypeSize(dtype); }
+  scalar_t* ptr;
+  size_t size;
+  int size_class;  // of the block in HostPool()
+  DType dtype;
+  std::function<void()> release;
+};
+
+inline void CheckDType(const AlignedArray& a, const AlignedArray& out, const char* kernel) {
+  if (a.dtype != out.dtype)
+    throw std::invalid_argument(std::string(kernel) + ": arrays of different dtypes (" +
+                                DTypeName(a.dtype) + ", " + DTypeName(out.dtype) + ")");
 }
 
-// Element-wise equality
-void EwiseEq(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = scalar_t(a.ptr[i] == b.ptr[i]);
-  }
+inline void CheckFloat32(const AlignedArray& a, const char* kernel) {
+  // for the kernels that only exist in float32; NDArray upcasts their operands first
+  if (a.dtype != DTYPE_FLOAT32)
+    throw std::invalid_argument(std::string(kernel) + ": only float32 arrays are supported, not " +
+                                DTypeName(a.dtype));
 }
 
-// Scalar equality
-void ScalarEq(const AlignedArray& a, scalar_t val, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = scalar_t(a.ptr[i] == val);
-  }
+inline void CheckInt8(const AlignedArray& a, const char* kernel) {
+  if (a.dtype != DTYPE_INT8)
+    throw std::invalid_argument(std::string(kernel) + ": expected an int8 array, not " +
+                                DTypeName(a.dtype));
 }
 
-// Element-wise greater than or equal to
-void EwiseGe(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = scalar_t(a.ptr[i] >= b.ptr[i]);
+
+/**
+ * A persistent pool of worker threads used to parallelize the kernels in this file.  The workers
+ * are started once (when the module is loaded, or when set_num_threads() is called) and then
+ * sleep on a condition variable between calls, so a parallel kernel only pays for a wakeup rather
+ * than for creating threads.
+ *
+ * ParallelFor() splits [0, total) into chunks of at least `grain` items, which the calling thread
+ * and the workers claim dynamically until all of them are done.  Ranges that fit in one chunk,
+ * and calls made from inside another ParallelFor(), simply run inline on the calling thread.
+ */
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t num_threads) : job_(nullptr), generation_(0), stop_(false) {
+    Start(num_threads);
   }
-}
+  ~ThreadPool() { Stop(); }
 
-// Scalar greater than or equal to
-void ScalarGe(const AlignedArray& a, scalar_t val, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = scalar_t(a.ptr[i] >= val);
+  size_t NumThreads() const { return workers_.size() + 1; }
+
+  void SetNumThreads(size_t num_threads) {
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    Stop();
+    Start(num_threads);
   }
-}
 
-// Element-wise logarithm
-void EwiseLog(const AlignedArray& a, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = log(a.ptr[i]);
+  void ParallelFor(size_t total, size_t grain, const std::function<void(size_t, size_t)>& fn) {
+    grain = std::max<size_t>(grain, 1);
+    if (total <= grain || workers_.empty() || in_parallel_region()) {
+      if (total > 0) fn(0, total);
+      return;
+    }
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    Job job;
+    job.fn = &fn;
+    job.total = total;
+    // a few chunks per thread so that uneven chunks still balance out
+    job.chunk = std::max(grain, (total + 4 * NumThreads() - 1) / (4 * NumThreads()));
+    job.num_chunks = (total + job.chunk - 1) / job.chunk;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job_ = &job;
+      generation_++;
+    }
+    wake_.notify_all();
+    RunChunks(&job);
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [&job] { return job.active == 0; });
+      job_ = nullptr;
+    }
+    if (job.error) std::rethrow_exception(job.error);
+  }
+
+ private:
+  struct Job {
+    Job() : fn(nullptr), total(0), chunk(0), num_chunks(0), next(0), active(0) {}
+    const std::function<void(size_t, size_t)>* fn;
+    size_t total, chunk, num_chunks;
+    std::atomic<size_t> next;
+    size_t active;  // workers currently attached to the job, guarded by mutex_
+    std::exception_ptr error;  // first exception thrown by a chunk, guarded by mutex_
+  };
+
+  static bool& in_parallel_region() {
+    static thread_local bool flag = false;
+    return flag;
+  }
+
+  void RunChunks(Job* job) {
+    in_parallel_region() = true;
+    for (size_t c = job->next.fetch_add(1); c < job->num_chunks; c = job->next.fetch_add(1)) {
+      size_t begin = c * job->chunk;
+      try {
+        (*job->fn)(begin, std::min(job->total, begin + job->chunk));
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!job->error) job->error = std::current_exception();
+      }
+    }
+    in_parallel_region() = false;
+  }
+
+  void WorkerLoop() {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      wake_.wait(lock, [this, &seen] { return stop_ || (job_ != nullptr && generation_ != seen); });
+      if (stop_) return;
+      seen = generation_;
+      Job* job = job_;
+      job->active++;
+      lock.unlock();
+      RunChunks(job);
+      lock.lock();
+      if (--job->active == 0) done_.notify_all();
+    }
+  }
+
+  void Start(size_t num_threads) {
+    stop_ = false;
+    for (size_t i = 1; i < std::max<size_t>(num_threads, 1); i++)
+      workers_.emplace_back(&ThreadPool::WorkerLoop, this);
   }
-}
 
-// Element-wise exponential
-void EwiseExp(const AlignedArray& a, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = exp(a.ptr[i]);
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (size_t i = 0; i < workers_.size(); i++) workers_[i].join();
+    workers_.clear();
   }
+
+  std::vector<std::thread> workers_;
+  std::mutex run_mutex_;  // serializes ParallelFor() calls coming from different threads
+  std::mutex mutex_;
+  std::condition_variable wake_, done_;
+  Job* job_;
+  uint64_t generation_;
+  bool stop_;
+};
+
+size_t DefaultNumThreads() {
+  const char* env = std::getenv("NEEDLE_NUM_THREADS");
+  if (env != nullptr && std::atoi(env) > 0) return std::atoi(env);
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+ThreadPool& Pool() {
+  static ThreadPool pool(DefaultNumThreads());
+  return pool;
+}
+
+// Elementwise kernels on arrays smaller than this many items run on a single thread
+const size_t ELEMENTWISE_GRAIN = 1 << 15;
+
+inline void ParallelFor(size_t total, size_t grain, const std::function<void(size_t, size_t)>& fn) {
+  Pool().ParallelFor(total, grain, fn);
 }
 
-// Element-wise hyperbolic tangent
-void EwiseTanh(const AlignedArray& a, AlignedArray* out) {
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = tanh(a.ptr[i]);
+
+/**
+ * Runtime instruction set dispatch.
+ *
+ * The kernels (ndarray_backend_cpu_kernels.h) are compiled once for each level below, and the best
+ * one that the processor, and the OS, which has to save the wider registers, supports is bound
+ * when the module is imported.  So one build runs at full speed on any x86-64 machine rather than
+ * only on (processors like) the one it was built on.  The choice is reported as __cpu_isa__, the
+ * usable levels as __cpu_isas__, and it can be overridden with e.g. NEEDLE_CPU_ISA=sse4.2 for
+ * comparing the paths.  Other architectures get just the baseline copy (NEON on aarch64).
+ */
+#define NEEDLE_ISA_GENERIC 0
+#define NEEDLE_ISA_SSE42 1
+#define NEEDLE_ISA_AVX2 2
+#define NEEDLE_ISA_AVX512 3
+#define NEEDLE_ISA_NEON 4
+
+#define NEEDLE_PRAGMA(x) NEEDLE_PRAGMA_(x)
+#define NEEDLE_PRAGMA_(x) _Pragma(#x)
+
+struct CpuFeatures {
+  bool sse42, avx2, fma, f16c, avx512f, avx512bw, avx512vnni;
+};
+
+CpuFeatures DetectCpuFeatures() {
+  CpuFeatures features = {false, false, false, false, false, false, false};
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int max_leaf = __get_cpuid_max(0, nullptr), eax, ebx, ecx, edx;
+  if (max_leaf < 1) return features;
+  __cpuid(1, eax, ebx, ecx, edx);
+  features.sse42 = (ecx & bit_SSE4_2) != 0;
+  // the ymm (and zmm) registers are only usable if the OS saves them on a context switch, i.e.
+  // XCR0 has the SSE and AVX state bits (and the three AVX-512 ones)
+  uint64_t xcr0 = 0;
+  if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+    uint32_t lo, hi;
+    __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    xcr0 = ((uint64_t)hi << 32) | lo;
+  }
+  bool ymm_state = (xcr0 & 0x06) == 0x06, zmm_state = (xcr0 & 0xe6) == 0xe6;
+  features.fma = ymm_state && (ecx & bit_FMA);
+  features.f16c = ymm_state && (ecx & bit_F16C);
+  if (max_leaf >= 7) {
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    features.avx2 = ymm_state && (ebx & bit_AVX2);
+    features.avx512f = zmm_state && (ebx & bit_AVX512F);
+    features.avx512bw = zmm_state && (ebx & bit_AVX512BW);
+    features.avx512vnni = zmm_state && (ecx & bit_AVX512VNNI);
   }
+#endif
+  return features;
 }
 
+const CpuFeatures& HostCpuFeatures() {
+  // for the kernels that pick an extension beyond their copy's level at run time (int8 GEMM)
+  static const CpuFeatures features = DetectCpuFeatures();
+  return features;
+}
 
-void Matmul(const AlignedArray& a, const AlignedArray& b, AlignedArray* out, uint32_t m, uint32_t n,
-            uint32_t p) {
-  /**
-   * Multiply two (compact) matrices into an output (also compact) matrix.  For this implementation
-   * you can use the "naive" three-loop algorithm.
-   *
-   * Args:
-   *   a: compact 2D array of size m x n
-   *   b: compact 2D array of size n x p
-   *   out: compact 2D array of size m x p to write the output to
-   *   m: rows of a / out
-   *   n: columns of a / rows of b
-   *   p: columns of b / out
-   */
+// the bytes an array argument of a kernel accounts for in the profiler (see SumArgBytes())
+inline uint64_t ArgBytes(const AlignedArray& a) { return a.size * a.itemsize(); }
+inline uint64_t ArgBytes(AlignedArray* a) { return a ? ArgBytes(*a) : 0; }
+inline uint64_t ArgBytes(const AlignedArray* a) { return a ? ArgBytes(*a) : 0; }
+inline uint64_t ArgBytes(const std::vector<AlignedArray*>& arrays) {
+  uint64_t total = 0;
+  for (AlignedArray* a : arrays) total += ArgBytes(a);
+  return total;
+}
 
-  /// BEGIN SOLUTION
-  for (uint32_t i = 0; i < m; i++) {
-      for (uint32_t j = 0; j < p; j++) {
-          out->ptr[i * p + j] = 0;
-          for (uint32_t k = 0; k < n; k++) {
-              out->ptr[i * p + j] += a.ptr[i * n + k] * b.ptr[k * p + j];
-          }
-      }
+/**
+ * What DefineKernels() binds in place of each kernel: while the profiler is enabled the call is
+ * timed and recorded under the name it is bound as, otherwise it goes straight through.
+ */
+template <typename... Args>
+struct ProfiledKernel {
+  const char* name;
+  void (*fn)(Args...);
+
+  void operator()(Args... args) const {
+    if (!profiler::Enabled()) return fn(std::forward<Args>(args)...);
+    uint64_t bytes = profiler::SumArgBytes(args...);
+    double start = profiler::NowUs();
+    fn(std::forward<Args>(args)...);
+    profiler::Global().RecordKernel(name, start, profiler::NowUs() - start, bytes);
   }
-  /// END SOLUTION
+};
+
+template <typename... Args>
+ProfiledKernel<Args...> Profiled(const char* name, void (*fn)(Args...)) {
+  return ProfiledKernel<Args...>{name, fn};
 }
 
-inline void AlignedDot(const float* __restrict__ a,
-                       const float* __restrict__ b,
-                       float* __restrict__ out) {
+// the baseline copy, for the compiler's default target
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define NEEDLE_ISA NEEDLE_ISA_NEON
+#define NEEDLE_BASELINE_ISA "neon"
+#else
+#define NEEDLE_ISA NEEDLE_ISA_GENERIC
+#define NEEDLE_BASELINE_ISA "generic"
+#endif
+namespace baseline {
+#include "ndarray_backend_cpu_kernels.h"
+}  // namespace baseline
+#undef NEEDLE_ISA
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NEEDLE_X86_DISPATCH
+#define NEEDLE_ISA NEEDLE_ISA_SSE42
+namespace sse42 {
+#include "ndarray_backend_cpu_kernels.h"
+}  // namespace sse42
+#undef NEEDLE_ISA
+#define NEEDLE_ISA NEEDLE_ISA_AVX2
+namespace avx2 {
+#include "ndarray_backend_cpu_kernels.h"
+}  // namespace avx2
+#undef NEEDLE_ISA
+#define NEEDLE_ISA NEEDLE_ISA_AVX512
+namespace avx512 {
+#include "ndarray_backend_cpu_kernels.h"
+}  // namespace avx512
+#undef NEEDLE_ISA
+#endif
+
+struct KernelSet {
+  const char* name;
+  bool (*supported)(const CpuFeatures&);
+  void (*define)(pybind11::module&);
+};
 
-  /**
-   * Multiply together two TILE x TILE matrices, and _add _the result to out (it is important to add
-   * the result to the existing out, which you should not set to zero beforehand).  We are including
-   * the compiler flags here that enable the compile to properly use vector operators to implement
-   * this function.  Specifically, the __restrict__ keyword indicates to the compile that a, b, and
-   * out don't have any overlapping memory (which is necessary in order for vector operations to be
-   * equivalent to their non-vectorized counterparts (imagine what could happen otherwise if a, b,
-   * and out had overlapping memory).  Similarly the __builtin_assume_aligned keyword tells the
-   * compiler that the input array will be aligned to the appropriate blocks in memory, which also
-   * helps the compiler vectorize the code.
-   *
-   * Args:
-   *   a: compact 2D array of size TILE x TILE
-   *   b: compact 2D array of size TILE x TILE
-   *   out: compact 2D array of size TILE x TILE to write to
-   */
+// the copies of the kernels, best first
+const KernelSet KERNEL_SETS[] = {
+#ifdef NEEDLE_X86_DISPATCH
+    {"avx512", [](const CpuFeatures& f) { return f.avx512f && f.avx2 && f.fma && f.f16c; },
+     avx512::DefineKernels},
+    {"avx2", [](const CpuFeatures& f) { return f.avx2 && f.fma && f.f16c; },
+     avx2::DefineKernels},
+    {"sse4.2", [](const CpuFeatures& f) { return f.sse42; }, sse42::DefineKernels},
+#endif
+    {NEEDLE_BASELINE_ISA, [](const CpuFeatures&) { return true; }, baseline::DefineKernels},
+};
 
-  a = (const float*)__builtin_assume_aligned(a, TILE * ELEM_SIZE);
-  b = (const float*)__builtin_assume_aligned(b, TILE * ELEM_SIZE);
-  out = (float*)__builtin_assume_aligned(out, TILE * ELEM_SIZE);
-
-  /// BEGIN SOLUTION
-  for (uint32_t i = 0; i < TILE; i++) {
-      for (uint32_t j = 0; j < TILE; j++) {
-          // 不要将out[i * TILE + j]设置为0，因为out已经是现有的累加结果
-          for (uint32_t k = 0; k < TILE; k++) {
-              out[i * TILE + j] += a[i * TILE + k] * b[k * TILE + j];
-          }
-      }
+std::vector<const KernelSet*> SupportedKernelSets() {
+  const CpuFeatures& features = HostCpuFeatures();
+  std::vector<const KernelSet*> sets;
+  for (const KernelSet& set : KERNEL_SETS) {
+    if (set.supported(features)) sets.push_back(&set);
   }
-  /// END SOLUTION
+  return sets;
 }
 
-// python3 -m pytest -v -k "matmul_tiled"
-void MatmulTiled(const AlignedArray& a, const AlignedArray& b, AlignedArray* out, uint32_t m,
-                 uint32_t n, uint32_t p) {
+const KernelSet& SelectKernelSet(const std::vector<const KernelSet*>& supported) {
   /**
-   * Matrix multiplication on tiled representations of array.  In this setting, a, b, and out
-   * are all *4D* compact arrays of the appropriate size, e.g. a is an array of size
-   *   a[m/TILE][n/TILE][TILE][TILE]
-   * You should do the multiplication tile-by-tile to improve performance of the array (i.e., this
-   * function should call `AlignedDot()` implemented above).
-   *
-   * Note that this function will only be called when m, n, p are all multiples of TILE, so you can
-   * assume that this division happens without any remainder.
-   *
-   * Args:
-   *   a: compact 4D array of size m/TILE x n/TILE x TILE x TILE
-   *   b: compact 4D array of size n/TILE x p/TILE x TILE x TILE
-   *   out: compact 4D array of size m/TILE x p/TILE x TILE x TILE to write to
-   *   m: rows of a / out
-   *   n: columns of a / rows of b
-   *   p: columns of b / out
-   *
+   * The best supported set, or the one named by NEEDLE_CPU_ISA.  Naming one this processor can't
+   * run fails the import, rather than crashing on the first illegal instruction.
    */
-  /// BEGIN SOLUTION
-  std::vector<float> tile_a(TILE * TILE);
-  std::vector<float> tile_b(TILE * TILE);
-  // 把原来(m, n)和(n, p)的矩阵乘变成(m / TILE, n / TILE)和(n / TILE, p / TILE)的分块矩阵乘
-  // 你会发现代码实现的格式是差不多的。虽然复杂但是整个流程还是很好记的
-  for (uint32_t i = 0; i < m / TILE; i++) {
-      for (uint32_t j = 0; j < p / TILE; j++) {
-          std::vector<float> tmp_res(TILE * TILE, 0);
-          for (uint32_t k = 0; k < n / TILE; k++) {
-              // make tile
-              for (uint32_t ii = 0; ii < TILE; ii++) {
-                  for (uint32_t jj = 0; jj < TILE; jj++) {
-                      // 可以把4D array看成是每个元素为2D TILE的 2D Array
-                      // 获得a[i, k]和b[k, j]对应的2D TILE
-                      // 基于stride format求index
-                      tile_a[ii * TILE + jj] = a.ptr[i * n * TILE + k * TILE * TILE + ii * TILE + jj];
-                      tile_b[ii * TILE + jj] = b.ptr[k * p * TILE + j * TILE * TILE + ii * TILE + jj];
-                  }
-              }
-              // tile mul
-              AlignedDot(tile_a.data(), tile_b.data(), tmp_res.data());
-          }
-          // 把分块结果写回out[i, j]对应的2D TILE
-          for (uint32_t ii = 0; ii < TILE; ii++) {
-              for (uint32_t jj = 0; jj < TILE; jj++) {
-                  out->ptr[i * p * TILE + j * TILE * TILE + ii * TILE + jj] = tmp_res[ii * TILE + jj];
-              }
-          }
-      }
+  const char* forced = std::getenv("NEEDLE_CPU_ISA");
+  if (forced == nullptr || forced[0] == '\0') return *supported[0];
+  std::string names;
+  for (const KernelSet* set : supported) {
+    if (std::strcmp(set->name, forced) == 0) return *set;
+    names += (names.empty() ? "" : ", ") + std::string(set->name);
   }
-  /// END SOLUTION
+  throw std::runtime_error(std::string("NEEDLE_CPU_ISA=") + forced +
+                           " is not supported on this cpu (supported: " + names + ")");
 }
 
-// Because summing over individual axes can be a bit tricky, even for compact arrays
-// these functions in Python simplify things by permuting the last axis to be the one reduced over
-// (this is what the reduce_view_out() function in NDArray does), then compacting the array.
-// So for your ReduceMax() and ReduceSum() functions you implement in C++
-// you can assume that both the input and output arrays are contiguous in memory
-// and you want to just reduce over contiguous elements of size reduce_size as passed to the C++ functions.
-// 已经经过了预处理，要reduce的维度总是被排列到了最后一维
-void ReduceMax(const AlignedArray& a, AlignedArray* out, size_t reduce_size) {
+
+/**
+ * Zero-copy interop.  from_numpy/to_numpy copy, so that an NDArray and a numpy array never
+ * alias by accident; the functions below share the memory instead, keeping its owner alive for
+ * as long as the other side uses it.
+ */
+pybind11::tuple ArrayFromNumpyView(pybind11::array a) {
   /**
-   * Reduce by taking maximum over `reduce_size` contiguous blocks.
-   *
-   * Args:
-   *   a: compact array of size a.size = out.size * reduce_size to reduce over
-   *   out: compact array to write into
-   *   reduce_size: size of the dimension to reduce over
+   * Wrap the memory of a writeable float32 numpy array as an Array, returned together with the
+   * strides of a (in items) to view it with.
    */
+  namespace py = pybind11;
+  if (!py::isinstance<py::array_t<scalar_t>>(a))
+    throw std::invalid_argument("from_numpy_view: only float32 arrays can be shared");
+  if (!a.writeable()) throw std::invalid_argument("from_numpy_view: array is read-only");
+  std::vector<int32_t> strides(a.ndim());
+  size_t size = a.size() == 0 ? 0 : 1;
+  for (py::ssize_t i = 0; i < a.ndim(); i++) {
+    if (a.strides(i) < 0 || a.strides(i) % ELEM_SIZE != 0)
+      throw std::invalid_argument("from_numpy_view: strides must be non-negative multiples of 4");
+    strides[i] = a.strides(i) / ELEM_SIZE;
+    if (size > 0) size += (a.shape(i) - 1) * strides[i];
+  }
+  py::object owner = a;
+  AlignedArray* array = new AlignedArray((scalar_t*)a.mutable_data(), size, [owner]() {});
+  return py::make_tuple(py::cast(array, py::return_value_policy::take_ownership), strides);
+}
 
-  /// BEGIN SOLUTION
-  size_t cnt = 0;
-  for (size_t i = 0; i < a.size; i+=reduce_size) {
-      scalar_t max_num = a.ptr[i];
-      for (size_t j = i + 1; j < i + reduce_size; j++) {
-          max_num = std::max(max_num, a.ptr[j]);
-      }
-      out->ptr[cnt++] = max_num;
+pybind11::tuple ArrayFromDLPack(pybind11::capsule capsule) {
+  // take over a CPU tensor, returned as (Array, shape, strides)
+  namespace py = pybind11;
+  dlpack::Imported imported = dlpack::Import(capsule, {kDLCPU, kDLCUDAHost});
+  AlignedArray* array = new AlignedArray(imported.data, imported.size, imported.release);
+  return py::make_tuple(py::cast(array, py::return_value_policy::take_ownership),
+                        imported.shape, imported.strides);
+}
+
+
+/**
+ * Batch gathering for the data loader.  The rows of a (memory-mapped) numpy array picked by a
+ * batch of indices are converted and copied straight into an Array, with the GIL released, so
+ * that loader threads gather the next batches while the training thread computes.  The copy
+ * runs on the calling thread only: the loader's threads are the parallelism, and the pool stays
+ * free for the kernels.
+ */
+template <typename S, typename T>
+void GatherRowsAs(const S* src, const int64_t* indices, size_t num_indices, size_t row_size,
+                  float scale, T* out) {
+  for (size_t i = 0; i < num_indices; i++) {
+    const S* row = src + (size_t)indices[i] * row_size;
+    T* dst = out + i * row_size;
+    for (size_t j = 0; j < row_size; j++) dst[j] = FromFloat<T>(scale * (scalar_t)row[j]);
+  }
+}
+
+template <typename S>
+void GatherRowsFrom(const S* src, const int64_t* indices, size_t num_indices, size_t row_size,
+                    float scale, AlignedArray* out) {
+  if (out->dtype == DTYPE_INT8) {
+    GatherRowsAs(src, indices, num_indices, row_size, scale, out->data<int8_t>());
+    return;
   }
-  /// END SOLUTION
+  DISPATCH_DTYPE(out->dtype, T, {
+    GatherRowsAs(src, indices, num_indices, row_size, scale, out->data<T>());
+  });
 }
 
-void ReduceSum(const AlignedArray& a, AlignedArray* out, size_t reduce_size) {
+void GatherRows(pybind11::array src, pybind11::array_t<int64_t> indices, AlignedArray* out,
+                float scale) {
   /**
-   * Reduce by taking sum over `reduce_size` contiguous blocks.
-   *
-   * Args:
-   *   a: compact array of size a.size = out.size * reduce_size to reduce over
-   *   out: compact array to write into
-   *   reduce_size: size of the dimension to reduce over
+   * out[i, ...] = scale * src[indices[i], ...], for a C-contiguous uint8 or float32 src of at
+   * least one dimension and int64 indices, out holding len(indices) rows of src.
    */
-
-  /// BEGIN SOLUTION
-  size_t cnt = 0;
-  for (size_t i = 0; i < a.size; i+=reduce_size) {
-      scalar_t sum_res = 0;
-      for (size_t j = i; j < i + reduce_size; j++) {
-          sum_res += a.ptr[j];
-      }
-      out->ptr[cnt++] = sum_res;
+  namespace py = pybind11;
+  bool is_uint8 = py::isinstance<py::array_t<uint8_t>>(src);
+  if (!is_uint8 && !py::isinstance<py::array_t<scalar_t>>(src))
+    throw std::invalid_argument("gather_rows: src must be a uint8 or float32 array");
+  if (src.ndim() < 1 || !(src.flags() & py::array::c_style))
+    throw std::invalid_argument("gather_rows: src must be a C-contiguous array");
+  if (indices.ndim() != 1 || !(indices.flags() & py::array::c_style))
+    throw std::invalid_argument("gather_rows: indices must be a contiguous 1-d array");
+  size_t num_rows = src.shape(0);
+  size_t row_size = num_rows == 0 ? 0 : src.size() / num_rows;
+  size_t num_indices = indices.size();
+  if (out->size != num_indices * row_size)
+    throw std::invalid_argument("gather_rows: out must hold len(indices) rows of src");
+  const int64_t* index = indices.data();
+  for (size_t i = 0; i < num_indices; i++) {
+    if (index[i] < 0 || (size_t)index[i] >= num_rows)
+      throw std::invalid_argument("gather_rows: index out of range");
+  }
+  const void* data = src.data();
+  py::gil_scoped_release release;
+  if (is_uint8) {
+    GatherRowsFrom((const uint8_t*)data, index, num_indices, row_size, scale, out);
+  } else {
+    GatherRowsFrom((const scalar_t*)data, index, num_indices, row_size, scale, out);
   }
-  /// END SOLUTION
 }
 
 }  // namespace cpu
@@ -463,53 +878,117 @@ PYBIND11_MODULE(ndarray_backend_cpu, m) {
   m.attr("__device_name__") = "cpu";
   m.attr("__tile_size__") = TILE;
 
+  // bind the kernels compiled for this processor (see KERNEL_SETS)
+  std::vector<const KernelSet*> supported = SupportedKernelSets();
+  const KernelSet& kernels = SelectKernelSet(supported);
+  py::list isas;
+  for (const KernelSet* set : supported) isas.append(set->name);
+  m.attr("__cpu_isa__") = kernels.name;
+  m.attr("__cpu_isas__") = py::tuple(isas);
+
+  // start the worker threads now rather than on the first parallel call
+  Pool();
+  m.def("set_num_threads", [](size_t num_threads) { Pool().SetNumThreads(num_threads); });
+  m.def("get_num_threads", []() { return Pool().NumThreads(); });
+
+  m.def("memory_stats", []() {
+    HostAllocator::Stats stats = HostPool().GetStats();
+    py::dict res;
+    res["bytes_in_use"] = stats.bytes_in_use;
+    res["bytes_cached"] = stats.bytes_cached;
+    res["num_allocs"] = stats.num_allocs;
+    res["num_pool_hits"] = stats.num_pool_hits;
+    res["hit_rate"] = stats.num_allocs ? (double)stats.num_pool_hits / stats.num_allocs : 0.0;
+    return res;
+  });
+  m.def("empty_cache", []() { HostPool().EmptyCache(); });
+  m.def("set_memory_pool", [](bool enabled) { HostPool().SetEnabled(enabled); });
+  m.def("set_huge_pages", [](bool enabled) { HostPool().SetHugePages(enabled); });
+
+  // the opt-in profiler (see ndarray_profiler.h)
+  m.def("profiler_enable", [](bool enabled) { profiler::SetEnabled(enabled); },
+        py::arg("enabled") = true);
+  m.def("profiler_enabled", []() { return profiler::Enabled(); });
+  m.def("profiler_reset", []() { profiler::Global().Reset(); });
+  m.def("profiler_stats", []() { return profiler::Global().Stats(); });
+  m.def("profiler_export_trace", [](const std::string& path) {
+    profiler::Global().ExportTrace(path, "needle cpu");
+  });
+
   py::class_<AlignedArray>(m, "Array")
-      .def(py::init<size_t>(), py::return_value_policy::take_ownership)
+      .def(py::init([](size_t size, const std::string& dtype) {
+             return new AlignedArray(size, ParseDType(dtype));
+           }),
+           py::arg("size"), py::arg("dtype") = "float32")
       .def("ptr", &AlignedArray::ptr_as_int)
-      .def_readonly("size", &AlignedArray::size);
+      .def_readonly("size", &AlignedArray::size)
+      .def_property_readonly("dtype", [](const AlignedArray& a) { return DTypeName(a.dtype); })
+      .def_property_readonly("itemsize", &AlignedArray::itemsize);
+
+  // an array of size items of dtype in the memory of arena, offset bytes in, which keeps arena
+  // alive; the arrays of a planned training step share arenas this way (see needle/memory.py)
+  m.def("arena_view", [](py::object arena, size_t offset, size_t size, const std::string& dtype) {
+    const AlignedArray& a = arena.cast<const AlignedArray&>();
+    DType type = ParseDType(dtype);
+    if (offset % DTypeSize(type) != 0 || offset + size * DTypeSize(type) > a.size * a.itemsize())
+      throw std::invalid_argument("arena_view: the view must lie within the arena, aligned");
+    AlignedArray* view = new AlignedArray((scalar_t*)((char*)a.ptr + offset), size, [arena]() {});
+    view->dtype = type;
+    return view;
+  }, py::return_value_policy::take_ownership);
 
   // return numpy array (with copying for simplicity, otherwise garbage
-  // collection is a pain)
+  // collection is a pain); float16 and int8 arrays come back as such, bfloat16 ones, which numpy
+  // has no type for, have to be converted to float32 first
   m.def("to_numpy", [](const AlignedArray& a, std::vector<size_t> shape,
                        std::vector<size_t> strides, size_t offset) {
+    if (a.dtype == DTYPE_BFLOAT16)
+      throw std::invalid_argument("to_numpy: convert bfloat16 arrays to float32 first");
+    size_t itemsize = a.itemsize();
     std::vector<size_t> numpy_strides = strides;
     std::transform(numpy_strides.begin(), numpy_strides.end(), numpy_strides.begin(),
-                   [](size_t& c) { return c * ELEM_SIZE; });
-    return py::array_t<scalar_t>(shape, numpy_strides, a.ptr + offset);
+                   [itemsize](size_t& c) { return c * itemsize; });
+    return py::array(py::dtype(DTypeName(a.dtype)), shape, numpy_strides,
+                     (char*)a.ptr + offset * itemsize);
   });
 
-  // convert from numpy (with copying)
+  // convert from numpy (with copying), rounding to the dtype of out
   m.def("from_numpy", [](py::array_t<scalar_t> a, AlignedArray* out) {
-    std::memcpy(out->ptr, a.request().ptr, out->size * ELEM_SIZE);
+    const scalar_t* src = (const scalar_t*)a.request().ptr;
+    if (out->dtype == DTYPE_INT8) {
+      int8_t* dst = out->data<int8_t>();
+      for (size_t i = 0; i < out->size; i++) dst[i] = FromFloat<int8_t>(src[i]);
+      return;
+    }
+    DISPATCH_DTYPE(out->dtype, T, {
+      T* dst = out->data<T>();
+      for (size_t i = 0; i < out->size; i++) dst[i] = FromFloat<T>(src[i]);
+    });
+  });
+
+  m.def("gather_rows", GatherRows, py::arg("src"), py::arg("indices"), py::arg("out"),
+        py::arg("scale") = 1.0f);
+
+  // numpy views and DLPack capsules sharing the memory of an array (see ArrayFromNumpyView())
+  m.def("to_numpy_view", [](py::object array, std::vector<size_t> shape,
+                            std::vector<size_t> strides, size_t offset) {
+    const AlignedArray& a = array.cast<const AlignedArray&>();
+    CheckFloat32(a, "to_numpy_view");
+    std::vector<size_t> numpy_strides = strides;
+    std::transform(numpy_strides.begin(), numpy_strides.end(), numpy_strides.begin(),
+                   [](size_t& c) { return c * ELEM_SIZE; });
+    // with array as its base, the numpy array shares the buffer (and keeps it alive)
+    return py::array_t<scalar_t>(shape, numpy_strides, a.ptr + offset, array);
+  });
+  m.def("from_numpy_view", ArrayFromNumpyView);
+  m.def("to_dlpack", [](py::object array, std::vector<int32_t> shape,
+                        std::vector<int32_t> strides, size_t offset) {
+    const AlignedArray& a = array.cast<const AlignedArray&>();
+    CheckFloat32(a, "to_dlpack");
+    return dlpack::Export(array, a.ptr + offset, DLDevice{kDLCPU, 0}, shape, strides);
   });
+  m.def("from_dlpack", ArrayFromDLPack);
+  m.def("dlpack_device", []() { return py::make_tuple((int)kDLCPU, 0); });
 
-  m.def("fill", Fill);
-  m.def("compact", Compact);
-  m.def("ewise_setitem", EwiseSetitem);
-  m.def("scalar_setitem", ScalarSetitem);
-  m.def("ewise_add", EwiseAdd);
-  m.def("scalar_add", ScalarAdd);
-
-   m.def("ewise_mul", EwiseMul);
-   m.def("scalar_mul", ScalarMul);
-   m.def("ewise_div", EwiseDiv);
-   m.def("scalar_div", ScalarDiv);
-   m.def("scalar_power", ScalarPower);
-
-   m.def("ewise_maximum", EwiseMaximum);
-   m.def("scalar_maximum", ScalarMaximum);
-   m.def("ewise_eq", EwiseEq);
-   m.def("scalar_eq", ScalarEq);
-   m.def("ewise_ge", EwiseGe);
-   m.def("scalar_ge", ScalarGe);
-
-   m.def("ewise_log", EwiseLog);
-   m.def("ewise_exp", EwiseExp);
-   m.def("ewise_tanh", EwiseTanh);
-
-   m.def("matmul", Matmul);
-   m.def("matmul_tiled", MatmulTiled);
-
-   m.def("reduce_max", ReduceMax);
-   m.def("reduce_sum", ReduceSum);
+  kernels.define(m);
 }
@@ -0,0 +1,3264 @@
+/**
+ * The kernels of the CPU backend, compiled once per instruction set.
+ *
+ * ndarray_backend_cpu.cc includes this file several times, each time inside its own namespace
+ * (needle::cpu::avx2 and so on) and with NEEDLE_ISA set to one of the NEEDLE_ISA_* levels.  The
+ * x86 copies are compiled under a target("...") pragma rather than with -m flags, so the code
+ * shared by all of them (the allocator, the thread pool, the pybind11 glue and whatever standard
+ * library templates they instantiate) stays runnable on any x86-64 processor; which copy is bound
+ * into the Python module is decided by cpuid when the module is imported (see KERNEL_SETS).
+ *
+ * Hence there is no include guard, and no #include: everything used below is included by
+ * ndarray_backend_cpu.cc before the first pass.
+ */
+#if NEEDLE_ISA == NEEDLE_ISA_AVX512
+#define NEEDLE_TARGET "avx512f,avx2,fma,f16c"
+#elif NEEDLE_ISA == NEEDLE_ISA_AVX2
+#define NEEDLE_TARGET "avx2,fma,f16c"
+#elif NEEDLE_ISA == NEEDLE_ISA_SSE42
+#define NEEDLE_TARGET "sse4.2"
+#endif
+
+#if defined(NEEDLE_TARGET) && defined(__clang__)
+NEEDLE_PRAGMA(clang attribute push(__attribute__((target(NEEDLE_TARGET))), apply_to = function))
+#elif defined(NEEDLE_TARGET)
+#pragma GCC push_options
+NEEDLE_PRAGMA(GCC target(NEEDLE_TARGET))
+#endif
+
+template <typename T>
+void FillItems(T* out_ptr, size_t size, T val) {
+  ParallelFor(size, ELEMENTWISE_GRAIN, [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) out_ptr[i] = val;
+  });
+}
+
+void Fill(AlignedArray* out, scalar_t val) {
+  /**
+   * Fill the values of an aligned array with val
+   */
+  DISPATCH_DTYPE(out->dtype, T, FillItems(out->data<T>(), out->size, FromFloat<T>(val)));
+}
+
+
+/**
+ * Strided layouts for Compact() and the setitem calls.
+ *
+ * Before touching any data, the (shape, strides, offset) of the strided side is simplified:
+ * singleton dimensions are dropped and adjacent dimensions are merged whenever the outer one
+ * steps exactly over the inner one (stride[i] == stride[i+1] * shape[i+1]).  A fully compact
+ * view collapses to a single unit-stride dimension, a row slice to rows of unit stride, a
+ * broadcast to dimensions of stride 0, and so on.  The kernels then pick a specialized loop for
+ * the innermost dimension (memcpy, fill, or a plain strided loop), a cache-blocked transpose for
+ * the 2D transposed case, and walk the outer dimensions with an incremental pointer instead of
+ * recomputing every location from the full index.
+ */
+struct StridedLayout {
+  std::vector<size_t> shape;
+  std::vector<size_t> strides;
+  size_t offset;
+  size_t size() const {
+    size_t size = 1;
+    for (size_t i = 0; i < shape.size(); i++) size *= shape[i];
+    return size;
+  }
+};
+
+StridedLayout CollapseLayout(const std::vector<int32_t>& shape,
+                             const std::vector<int32_t>& strides, size_t offset) {
+  StridedLayout layout;
+  layout.offset = offset;
+  for (size_t i = 0; i < shape.size(); i++) {
+    if (shape[i] == 0) {
+      // nothing to copy; a single empty run keeps all the callers on their trivial path
+      layout.shape.assign(1, 0);
+      layout.strides.assign(1, 1);
+      return layout;
+    }
+    if (shape[i] == 1) continue;
+    if (!layout.shape.empty() &&
+        layout.strides.back() == (size_t)strides[i] * shape[i]) {
+      layout.shape.back() *= shape[i];
+      layout.strides.back() = strides[i];
+    } else {
+      layout.shape.push_back(shape[i]);
+      layout.strides.push_back(strides[i]);
+    }
+  }
+  if (layout.shape.empty()) {
+    layout.shape.push_back(1);
+    layout.strides.push_back(1);
+  }
+  return layout;
+}
+
+void CollapseLayoutPair(const std::vector<int32_t>& shape, const std::vector<int32_t>& a_strides,
+                        size_t a_offset, const std::vector<int32_t>& b_strides, size_t b_offset,
+                        StridedLayout* a, StridedLayout* b) {
+  /**
+   * Collapse two strided views of the same shape together, merging a pair of adjacent dimensions
+   * only when it can be merged in both, so that the collapsed layouts still walk in lockstep.
+   */
+  a->shape.clear();
+  a->strides.clear();
+  b->strides.clear();
+  a->offset = a_offset;
+  b->offset = b_offset;
+  for (size_t i = 0; i < shape.size(); i++) {
+    if (shape[i] == 0) {
+      a->shape.assign(1, 0);
+      a->strides.assign(1, 1);
+      b->strides.assign(1, 1);
+      break;
+    }
+    if (shape[i] == 1) continue;
+    if (!a->shape.empty() && a->strides.back() == (size_t)a_strides[i] * shape[i] &&
+        b->strides.back() == (size_t)b_strides[i] * shape[i]) {
+      a->shape.back() *= shape[i];
+      a->strides.back() = a_strides[i];
+      b->strides.back() = b_strides[i];
+    } else {
+      a->shape.push_back(shape[i]);
+      a->strides.push_back(a_strides[i]);
+      b->strides.push_back(b_strides[i]);
+    }
+  }
+  if (a->shape.empty()) {
+    a->shape.push_back(1);
+    a->strides.push_back(1);
+    b->strides.push_back(1);
+  }
+  b->shape = a->shape;
+}
+
+template <typename RowFunc>
+void ForEachRowPair(const StridedLayout& a, const StridedLayout& b, size_t row_cost,
+                    RowFunc row_func) {
+  /**
+   * Call row_func(row, a_loc, b_loc) for every row of the innermost dimension of two layouts of
+   * the same (collapsed) shape, where row is the index of the row in compact order and a_loc,
+   * b_loc the strided locations of its first element in each.  Rows are split across the thread
+   * pool, row_cost being the work per row in items; within a chunk the outer dimensions are
+   * walked incrementally.
+   */
+  size_t outer_ndim = a.shape.size() - 1;
+  size_t num_rows = a.size() / a.shape[outer_ndim];
+  const std::vector<size_t>& shape = a.shape;
+  ParallelFor(num_rows, std::max<size_t>(1, ELEMENTWISE_GRAIN / std::max<size_t>(row_cost, 1)),
+              [&](size_t begin, size_t end) {
+    std::vector<size_t> index(outer_ndim);
+    size_t a_loc = a.offset, b_loc = b.offset;
+    for (size_t d = outer_ndim, rest = begin; d-- > 0; rest /= shape[d]) {
+      index[d] = rest % shape[d];
+      a_loc += index[d] * a.strides[d];
+      b_loc += index[d] * b.strides[d];
+    }
+    for (size_t row = begin; row < end; row++) {
+      row_func(row, a_loc, b_loc);
+      for (size_t d = outer_ndim; d-- > 0;) {
+        a_loc += a.strides[d];
+        b_loc += b.strides[d];
+        if (++index[d] < shape[d]) break;
+        a_loc -= a.strides[d] * shape[d];
+        b_loc -= b.strides[d] * shape[d];
+        index[d] = 0;
+      }
+    }
+  });
+}
+
+template <typename RowFunc>
+void ForEachRow(const StridedLayout& layout, RowFunc row_func) {
+  // ForEachRowPair() over a single layout: row_func(row, loc)
+  ForEachRowPair(layout, layout, layout.shape.back(),
+                 [&](size_t row, size_t loc, size_t) { row_func(row, loc); });
+}
+
+const size_t TRANSPOSE_BLOCK = 32;
+
+template <typename Func>
+void ForEachTransposedBlock(size_t rows, size_t cols, Func func) {
+  /**
+   * Visit a rows x cols index space in TRANSPOSE_BLOCK x TRANSPOSE_BLOCK blocks, calling
+   * func(i, j) with the column index j outermost within each block, so that both the unit-stride
+   * side and the transposed side of the copy stay inside a few cache lines per block.
+   */
+  size_t row_blocks = (rows + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+  size_t grain = std::max<size_t>(1, ELEMENTWISE_GRAIN / (TRANSPOSE_BLOCK * cols));
+  ParallelFor(row_blocks, grain, [&](size_t begin, size_t end) {
+    for (size_t ib = begin * TRANSPOSE_BLOCK; ib < std::min(rows, end * TRANSPOSE_BLOCK);
+         ib += TRANSPOSE_BLOCK) {
+      size_t i_end = std::min(rows, ib + TRANSPOSE_BLOCK);
+      for (size_t jb = 0; jb < cols; jb += TRANSPOSE_BLOCK) {
+        size_t j_end = std::min(cols, jb + TRANSPOSE_BLOCK);
+        for (size_t j = jb; j < j_end; j++)
+          for (size_t i = ib; i < i_end; i++) func(i, j);
+      }
+    }
+  });
+}
+
+inline bool IsTransposed2D(const StridedLayout& layout) {
+  return layout.shape.size() == 2 && layout.strides[0] == 1 && layout.strides[1] > 1;
+}
+
+template <typename T>
+void CompactItems(const AlignedArray& a, AlignedArray* out, const std::vector<int32_t>& shape,
+                  const std::vector<int32_t>& strides, size_t offset) {
+  StridedLayout layout = CollapseLayout(shape, strides, offset);
+  const T* src = a.data<T>();
+  T* dst = out->data<T>();
+  size_t inner = layout.shape.back();
+  size_t inner_stride = layout.strides.back();
+
+  if (layout.shape.size() == 1) {
+    // a single (possibly strided or broadcast) run: split it directly across the pool
+    ParallelFor(inner, ELEMENTWISE_GRAIN, [=](size_t begin, size_t end) {
+      const T* s = src + offset + begin * inner_stride;
+      if (inner_stride == 1) {
+        std::memcpy(dst + begin, s, (end - begin) * sizeof(T));
+      } else if (inner_stride == 0) {
+        std::fill(dst + begin, dst + end, *s);
+      } else {
+        for (size_t i = begin; i < end; i++, s += inner_stride) dst[i] = *s;
+      }
+    });
+  } else if (IsTransposed2D(layout)) {
+    size_t rows = layout.shape[0], col_stride = layout.strides[1];
+    ForEachTransposedBlock(rows, inner, [=](size_t i, size_t j) {
+      dst[i * inner + j] = src[offset + i + j * col_stride];
+    });
+  } else {
+    ForEachRow(layout, [=](size_t row, size_t loc) {
+      T* d = dst + row * inner;
+      if (inner_stride == 1) {
+        std::memcpy(d, src + loc, inner * sizeof(T));
+      } else if (inner_stride == 0) {
+        std::fill(d, d + inner, src[loc]);
+      } else {
+        for (size_t j = 0; j < inner; j++) d[j] = src[loc + j * inner_stride];
+      }
+    });
+  }
+}
+
+void Compact(const AlignedArray& a, AlignedArray* out, const std::vector<int32_t>& shape,
+             const std::vector<int32_t>& strides, size_t offset) {
+  /**
+   * Compact an array in memory
+   *
+   * Args:
+   *   a: non-compact representation of the array, given as input
+   *   out: compact version of the array to be written
+   *   shape: shapes of each dimension for a and out
+   *   strides: strides of the *a* array (not out, which has compact strides)
+   *   offset: offset of the *a* array (not out, which has zero offset, being compact)
+   *
+   * Returns:
+   *  void (you need to modify out directly, rather than returning anything; this is true for all the
+   *  function will implement here, so we won't repeat this note.)
+   */
+  CheckDType(a, *out, "compact");
+  if (out->dtype == DTYPE_INT8) {
+    CompactItems<int8_t>(a, out, shape, strides, offset);
+    return;
+  }
+  DISPATCH_DTYPE(out->dtype, T, CompactItems<T>(a, out, shape, strides, offset));
+}
+
+template <typename T>
+void EwiseSetitemItems(const AlignedArray& a, AlignedArray* out,
+                       const std::vector<int32_t>& shape, const std::vector<int32_t>& strides,
+                       size_t offset) {
+  StridedLayout layout = CollapseLayout(shape, strides, offset);
+  const T* src = a.data<T>();
+  T* dst = out->data<T>();
+  size_t inner = layout.shape.back();
+  size_t inner_stride = layout.strides.back();
+
+  if (layout.shape.size() == 1 && inner_stride != 0) {
+    ParallelFor(inner, ELEMENTWISE_GRAIN, [=](size_t begin, size_t end) {
+      T* d = dst + offset + begin * inner_stride;
+      if (inner_stride == 1) {
+        std::memcpy(d, src + begin, (end - begin) * sizeof(T));
+      } else {
+        for (size_t i = begin; i < end; i++, d += inner_stride) *d = src[i];
+      }
+    });
+  } else if (IsTransposed2D(layout)) {
+    size_t rows = layout.shape[0], col_stride = layout.strides[1];
+    ForEachTransposedBlock(rows, inner, [=](size_t i, size_t j) {
+      dst[offset + i + j * col_stride] = src[i * inner + j];
+    });
+  } else if (inner_stride == 0) {
+    // several source items land on the same destination; keep the sequential "last one wins"
+    ForEachRow(layout, [=](size_t row, size_t loc) { dst[loc] = src[row * inner + inner - 1]; });
+  } else {
+    ForEachRow(layout, [=](size_t row, size_t loc) {
+      const T* s = src + row * inner;
+      if (inner_stride == 1) {
+        std::memcpy(dst + loc, s, inner * sizeof(T));
+      } else {
+        for (size_t j = 0; j < inner; j++) dst[loc + j * inner_stride] = s[j];
+      }
+    });
+  }
+}
+
+void EwiseSetitem(const AlignedArray& a, AlignedArray* out, const std::vector<int32_t>& shape,
+                  const std::vector<int32_t>& strides, size_t offset) {
+  /**
+   * Set items in a (non-compact) array
+   *
+   * Args:
+   *   a: _compact_ array whose items will be written to out
+   *   out: non-compact array whose items are to be written
+   *   shape: shapes of each dimension for a and out
+   *   strides: strides of the *out* array (not a, which has compact strides)
+   *   offset: offset of the *out* array (not a, which has zero offset, being compact)
+   */
+  CheckDType(a, *out, "ewise_setitem");
+  if (out->dtype == DTYPE_INT8) {
+    EwiseSetitemItems<int8_t>(a, out, shape, strides, offset);
+    return;
+  }
+  DISPATCH_DTYPE(out->dtype, T, EwiseSetitemItems<T>(a, out, shape, strides, offset));
+}
+
+template <typename T>
+void ScalarSetitemItems(T val, AlignedArray* out, const std::vector<int32_t>& shape,
+                        const std::vector<int32_t>& strides, size_t offset) {
+  StridedLayout layout = CollapseLayout(shape, strides, offset);
+  T* dst = out->data<T>();
+  size_t inner = layout.shape.back();
+  size_t inner_stride = layout.strides.back();
+
+  if (layout.shape.size() == 1) {
+    ParallelFor(inner, ELEMENTWISE_GRAIN, [=](size_t begin, size_t end) {
+      T* d = dst + offset + begin * inner_stride;
+      if (inner_stride == 1) {
+        std::fill(d, d + (end - begin), val);
+      } else {
+        for (size_t i = begin; i < end; i++, d += inner_stride) *d = val;
+      }
+    });
+  } else {
+    ForEachRow(layout, [=](size_t row, size_t loc) {
+      if (inner_stride == 1) {
+        std::fill(dst + loc, dst + loc + inner, val);
+      } else {
+        for (size_t j = 0; j < inner; j++) dst[loc + j * inner_stride] = val;
+      }
+    });
+  }
+}
+
+void ScalarSetitem(const size_t size, scalar_t val, AlignedArray* out,
+                   const std::vector<int32_t>& shape, const std::vector<int32_t>& strides,
+                   size_t offset) {
+  /**
+   * Set items is a (non-compact) array
+   *
+   * Args:
+   *   size: number of elements to write in out array (note that this will note be the same as
+   *         out.size, because out is a non-compact subset array);  it _will_ be the same as the
+   *         product of items in shape, but convenient to just pass it here.
+   *   val: scalar value to write to
+   *   out: non-compact array whose items are to be written
+   *   shape: shapes of each dimension of out
+   *   strides: strides of the out array
+   *   offset: offset of the out array
+   */
+  DISPATCH_DTYPE(out->dtype, T,
+                 ScalarSetitemItems(FromFloat<T>(val), out, shape, strides, offset));
+}
+
+/**
+ * Single-precision exp, log and tanh for the element-wise kernels, as short polynomials that run
+ * in SIMD registers (AVX-512, AVX2 + FMA, SSE4.2 or NEON, whichever NEEDLE_ISA this copy of the
+ * kernels is for), where libm's versions are one call per element that keeps the loops from
+ * vectorizing.  The algorithms are
+ * written once, over the V* primitives below, and also instantiated for plain floats, which
+ * handle the tail of each row, so every element gets the same result wherever it lands.
+ * Against double-precision exp/log/tanh, rounded, over every finite float:
+ *   exp:  at most 1 ulp off; overflows to inf above ~88.72, gradual underflow through the
+ *         denormals, 0 below ~-103.97, exp(NaN) = NaN
+ *   log:  at most 1 ulp off (denormals included); log(0) = -inf, log(inf) = inf,
+ *         log(x < 0) = log(NaN) = NaN
+ *   tanh: at most 1 ulp off; tanh(+-inf) = +-1, tanh(NaN) = NaN
+ * The polynomials are Cephes' (expf, logf, tanhf).
+ */
+#if NEEDLE_ISA == NEEDLE_ISA_AVX512
+#define NEEDLE_SIMD
+#define NEEDLE_FMA
+typedef __m512 VecF;
+typedef __mmask16 MaskF;
+const size_t VEC_WIDTH = 16;
+inline VecF VLoad(const scalar_t* p) { return _mm512_loadu_ps(p); }
+inline void VStore(scalar_t* p, VecF x) { _mm512_storeu_ps(p, x); }
+inline VecF VSplat(VecF, scalar_t x) { return _mm512_set1_ps(x); }
+inline VecF VAdd(VecF x, VecF y) { return _mm512_add_ps(x, y); }
+inline VecF VSub(VecF x, VecF y) { return _mm512_sub_ps(x, y); }
+inline VecF VMul(VecF x, VecF y) { return _mm512_mul_ps(x, y); }
+inline VecF VDiv(VecF x, VecF y) { return _mm512_div_ps(x, y); }
+inline VecF VSqrt(VecF x) { return _mm512_sqrt_ps(x); }
+inline VecF VFma(VecF x, VecF y, VecF z) { return _mm512_fmadd_ps(x, y, z); }
+inline VecF VMin(VecF x, VecF y) { return _mm512_min_ps(x, y); }
+inline VecF VMax(VecF x, VecF y) { return _mm512_max_ps(x, y); }
+inline VecF VRound(VecF x) {
+  return _mm512_roundscale_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+inline VecF VFloor(VecF x) {
+  return _mm512_roundscale_ps(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+}
+inline VecF VAnd(VecF x, uint32_t bits) {
+  return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(x), _mm512_set1_epi32(bits)));
+}
+inline VecF VOr(VecF x, VecF y) {
+  return _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(x), _mm512_castps_si512(y)));
+}
+inline VecF VPow2(VecF n) {
+  __m512i e = _mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127));
+  return _mm512_castsi512_ps(_mm512_slli_epi32(e, 23));
+}
+inline VecF VExponent(VecF x) {
+  __m512i e = _mm512_srli_epi32(_mm512_castps_si512(x), 23);
+  return _mm512_cvtepi32_ps(_mm512_sub_epi32(e, _mm512_set1_epi32(127)));
+}
+inline MaskF VLess(VecF x, VecF y) { return _mm512_cmp_ps_mask(x, y, _CMP_LT_OQ); }
+inline MaskF VEqual(VecF x, VecF y) { return _mm512_cmp_ps_mask(x, y, _CMP_EQ_OQ); }
+inline MaskF VIsNan(VecF x) { return _mm512_cmp_ps_mask(x, x, _CMP_UNORD_Q); }
+inline VecF VSelect(MaskF m, VecF x, VecF y) { return _mm512_mask_blend_ps(m, y, x); }
+#elif NEEDLE_ISA == NEEDLE_ISA_AVX2
+#define NEEDLE_SIMD
+#define NEEDLE_FMA
+typedef __m256 VecF;
+typedef __m256 MaskF;
+const size_t VEC_WIDTH = 8;
+inline VecF VLoad(const scalar_t* p) { return _mm256_loadu_ps(p); }
+inline void VStore(scalar_t* p, VecF x) { _mm256_storeu_ps(p, x); }
+inline VecF VSplat(VecF, scalar_t x) { return _mm256_set1_ps(x); }
+inline VecF VAdd(VecF x, VecF y) { return _mm256_add_ps(x, y); }
+inline VecF VSub(VecF x, VecF y) { return _mm256_sub_ps(x, y); }
+inline VecF VMul(VecF x, VecF y) { return _mm256_mul_ps(x, y); }
+inline VecF VDiv(VecF x, VecF y) { return _mm256_div_ps(x, y); }
+inline VecF VSqrt(VecF x) { return _mm256_sqrt_ps(x); }
+inline VecF VFma(VecF x, VecF y, VecF z) { return _mm256_fmadd_ps(x, y, z); }
+inline VecF VMin(VecF x, VecF y) { return _mm256_min_ps(x, y); }
+inline VecF VMax(VecF x, VecF y) { return _mm256_max_ps(x, y); }
+inline VecF VRound(VecF x) {
+  return _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+inline VecF VFloor(VecF x) { return _mm256_floor_ps(x); }
+inline VecF VAnd(VecF x, uint32_t bits) {
+  return _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(bits)));
+}
+inline VecF VOr(VecF x, VecF y) { return _mm256_or_ps(x, y); }
+inline VecF VPow2(VecF n) {
+  __m256i e = _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127));
+  return _mm256_castsi256_ps(_mm256_slli_epi32(e, 23));
+}
+inline VecF VExponent(VecF x) {
+  __m256i e = _mm256_srli_epi32(_mm256_castps_si256(x), 23);
+  return _mm256_cvtepi32_ps(_mm256_sub_epi32(e, _mm256_set1_epi32(127)));
+}
+inline MaskF VLess(VecF x, VecF y) { return _mm256_cmp_ps(x, y, _CMP_LT_OQ); }
+inline MaskF VEqual(VecF x, VecF y) { return _mm256_cmp_ps(x, y, _CMP_EQ_OQ); }
+inline MaskF VIsNan(VecF x) { return _mm256_cmp_ps(x, x, _CMP_UNORD_Q); }
+inline VecF VSelect(MaskF m, VecF x, VecF y) { return _mm256_blendv_ps(y, x, m); }
+#elif NEEDLE_ISA == NEEDLE_ISA_SSE42
+#define NEEDLE_SIMD
+typedef __m128 VecF;
+typedef __m128 MaskF;
+const size_t VEC_WIDTH = 4;
+inline VecF VLoad(const scalar_t* p) { return _mm_loadu_ps(p); }
+inline void VStore(scalar_t* p, VecF x) { _mm_storeu_ps(p, x); }
+inline VecF VSplat(VecF, scalar_t x) { return _mm_set1_ps(x); }
+inline VecF VAdd(VecF x, VecF y) { return _mm_add_ps(x, y); }
+inline VecF VSub(VecF x, VecF y) { return _mm_sub_ps(x, y); }
+inline VecF VMul(VecF x, VecF y) { return _mm_mul_ps(x, y); }
+inline VecF VDiv(VecF x, VecF y) { return _mm_div_ps(x, y); }
+inline VecF VSqrt(VecF x) { return _mm_sqrt_ps(x); }
+inline VecF VFma(VecF x, VecF y, VecF z) { return _mm_add_ps(_mm_mul_ps(x, y), z); }
+inline VecF VMin(VecF x, VecF y) { return _mm_min_ps(x, y); }
+inline VecF VMax(VecF x, VecF y) { return _mm_max_ps(x, y); }
+inline VecF VRound(VecF x) {
+  return _mm_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+inline VecF VFloor(VecF x) { return _mm_floor_ps(x); }
+inline VecF VAnd(VecF x, uint32_t bits) {
+  return _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(bits)));
+}
+inline VecF VOr(VecF x, VecF y) { return _mm_or_ps(x, y); }
+inline VecF VPow2(VecF n) {
+  __m128i e = _mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127));
+  return _mm_castsi128_ps(_mm_slli_epi32(e, 23));
+}
+inline VecF VExponent(VecF x) {
+  __m128i e = _mm_srli_epi32(_mm_castps_si128(x), 23);
+  return _mm_cvtepi32_ps(_mm_sub_epi32(e, _mm_set1_epi32(127)));
+}
+inline MaskF VLess(VecF x, VecF y) { return _mm_cmplt_ps(x, y); }
+inline MaskF VEqual(VecF x, VecF y) { return _mm_cmpeq_ps(x, y); }
+inline MaskF VIsNan(VecF x) { return _mm_cmpunord_ps(x, x); }
+inline VecF VSelect(MaskF m, VecF x, VecF y) { return _mm_blendv_ps(y, x, m); }
+#elif NEEDLE_ISA == NEEDLE_ISA_NEON
+#define NEEDLE_SIMD
+#define NEEDLE_FMA
+typedef float32x4_t VecF;
+typedef uint32x4_t MaskF;
+const size_t VEC_WIDTH = 4;
+inline VecF VLoad(const scalar_t* p) { return vld1q_f32(p); }
+inline void VStore(scalar_t* p, VecF x) { vst1q_f32(p, x); }
+inline VecF VSplat(VecF, scalar_t x) { return vdupq_n_f32(x); }
+inline VecF VAdd(VecF x, VecF y) { return vaddq_f32(x, y); }
+inline VecF VSub(VecF x, VecF y) { return vsubq_f32(x, y); }
+inline VecF VMul(VecF x, VecF y) { return vmulq_f32(x, y); }
+inline VecF VDiv(VecF x, VecF y) { return vdivq_f32(x, y); }
+inline VecF VSqrt(VecF x) { return vsqrtq_f32(x); }
+inline VecF VFma(VecF x, VecF y, VecF z) { return vfmaq_f32(z, x, y); }
+inline VecF VMin(VecF x, VecF y) { return vminq_f32(x, y); }
+inline VecF VMax(VecF x, VecF y) { return vmaxq_f32(x, y); }
+inline VecF VRound(VecF x) { return vrndnq_f32(x); }
+inline VecF VFloor(VecF x) { return vrndmq_f32(x); }
+inline VecF VAnd(VecF x, uint32_t bits) {
+  return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(x), vdupq_n_u32(bits)));
+}
+inline VecF VOr(VecF x, VecF y) {
+  return vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(x), vreinterpretq_u32_f32(y)));
+}
+inline VecF VPow2(VecF n) {
+  int32x4_t e = vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127));
+  return vreinterpretq_f32_s32(vshlq_n_s32(e, 23));
+}
+inline VecF VExponent(VecF x) {
+  int32x4_t e = vreinterpretq_s32_u32(vshrq_n_u32(vreinterpretq_u32_f32(x), 23));
+  return vcvtq_f32_s32(vsubq_s32(e, vdupq_n_s32(127)));
+}
+inline MaskF VLess(VecF x, VecF y) { return vcltq_f32(x, y); }
+inline MaskF VEqual(VecF x, VecF y) { return vceqq_f32(x, y); }
+inline MaskF VIsNan(VecF x) { return vmvnq_u32(vceqq_f32(x, x)); }
+inline VecF VSelect(MaskF m, VecF x, VecF y) { return vbslq_f32(m, x, y); }
+#endif
+
+// the same primitives on single floats; VMin/VMax return y if either is NaN, as minps does
+inline scalar_t VSplat(scalar_t, scalar_t x) { return x; }
+inline scalar_t VAdd(scalar_t x, scalar_t y) { return x + y; }
+inline scalar_t VSub(scalar_t x, scalar_t y) { return x - y; }
+inline scalar_t VMul(scalar_t x, scalar_t y) { return x * y; }
+inline scalar_t VDiv(scalar_t x, scalar_t y) { return x / y; }
+inline scalar_t VSqrt(scalar_t x) { return std::sqrt(x); }
+#ifdef NEEDLE_FMA
+inline scalar_t VFma(scalar_t x, scalar_t y, scalar_t z) { return std::fma(x, y, z); }
+#else
+inline scalar_t VFma(scalar_t x, scalar_t y, scalar_t z) { return x * y + z; }
+#endif
+inline scalar_t VMin(scalar_t x, scalar_t y) { return x < y ? x : y; }
+inline scalar_t VMax(scalar_t x, scalar_t y) { return x > y ? x : y; }
+inline scalar_t VRound(scalar_t x) { return std::nearbyint(x); }
+inline scalar_t VFloor(scalar_t x) { return std::floor(x); }
+inline scalar_t VAnd(scalar_t x, uint32_t bits) {
+  uint32_t u;
+  std::memcpy(&u, &x, sizeof(u));
+  u &= bits;
+  std::memcpy(&x, &u, sizeof(u));
+  return x;
+}
+inline scalar_t VOr(scalar_t x, scalar_t y) {
+  uint32_t u, v;
+  std::memcpy(&u, &x, sizeof(u));
+  std::memcpy(&v, &y, sizeof(v));
+  u |= v;
+  std::memcpy(&x, &u, sizeof(u));
+  return x;
+}
+inline scalar_t VPow2(scalar_t n) {
+  uint32_t u = uint32_t(int32_t(n) + 127) << 23;
+  scalar_t x;
+  std::memcpy(&x, &u, sizeof(u));
+  return x;
+}
+inline scalar_t VExponent(scalar_t x) {
+  uint32_t u;
+  std::memcpy(&u, &x, sizeof(u));
+  return scalar_t(int32_t(u >> 23) - 127);
+}
+inline bool VLess(scalar_t x, scalar_t y) { return x < y; }
+inline bool VEqual(scalar_t x, scalar_t y) { return x == y; }
+inline bool VIsNan(scalar_t x) { return x != x; }
+inline scalar_t VSelect(bool m, scalar_t x, scalar_t y) { return m ? x : y; }
+
+template <typename V>
+inline V Poly(V x, const scalar_t* coeffs, size_t n) {
+  // coeffs[0] * x^(n-1) + ... + coeffs[n-1], by Horner's rule
+  V p = VSplat(x, coeffs[0]);
+  for (size_t i = 1; i < n; i++) p = VFma(p, x, VSplat(x, coeffs[i]));
+  return p;
+}
+
+template <typename V>
+inline V Exp(V x) {
+  // e^x = 2^n e^r with n = round(x / ln 2) and |r| <= ln(2) / 2, e^r = 1 + r + r^2 P(r).  2^n is
+  // applied as two factors so that results down in the denormals, and up at n = 128, are exact
+  // up to their one rounding.
+  static const scalar_t coeffs[] = {1.9875691500e-4f, 1.3981999507e-3f, 8.3334519073e-3f,
+                                    4.1665795894e-2f, 1.6666665459e-1f, 5.0000001201e-1f};
+  x = VMin(VSplat(x, 88.8f), VMax(VSplat(x, -104.0f), x));  // NaN stays NaN
+  V n = VRound(VMul(x, VSplat(x, 1.44269504088896341f)));
+  V r = VFma(n, VSplat(x, -0.693359375f), x);  // ln 2 in two parts, so n * 0.693359375 is exact
+  r = VFma(n, VSplat(x, 2.12194440e-4f), r);
+  V p = VFma(Poly(r, coeffs, 6), VMul(r, r), VAdd(r, VSplat(x, 1)));
+  V n1 = VFloor(VMul(n, VSplat(x, 0.5f)));
+  return VMul(VMul(p, VPow2(n1)), VPow2(VSub(n, n1)));
+}
+
+template <typename V>
+inline V Log(V x) {
+  // x = m 2^e with m in [sqrt(1/2), sqrt(2)), log(x) = log1p(m - 1) + e ln 2, where log1p(f) =
+  // f - f^2 / 2 + f^3 P(f).  Denormals are scaled by 2^23 into the normal range first.
+  static const scalar_t coeffs[] = {7.0376836292e-2f, -1.1514610310e-1f, 1.1676998740e-1f,
+                                    -1.2420140846e-1f, 1.4249322787e-1f, -1.6668057665e-1f,
+                                    2.0000714765e-1f, -2.4999993993e-1f, 3.3333331174e-1f};
+  V zero = VSplat(x, 0);
+  auto tiny = VLess(x, VSplat(x, 1.17549435e-38f));
+  V y = VSelect(tiny, VMul(x, VSplat(x, 8388608.0f)), x);
+  V e = VSub(VExponent(y), VSelect(tiny, VSplat(x, 23), zero));
+  V m = VOr(VAnd(y, 0x007fffff), VSplat(x, 1));  // in [1, 2)
+  auto big = VLess(VSplat(x, 1.41421356f), m);
+  m = VSelect(big, VMul(m, VSplat(x, 0.5f)), m);
+  e = VSelect(big, VAdd(e, VSplat(x, 1)), e);
+  V f = VSub(m, VSplat(x, 1));
+  V f2 = VMul(f, f);
+  V r = VMul(VMul(f, f2), Poly(f, coeffs, 9));
+  r = VFma(e, VSplat(x, -2.12194440e-4f), r);
+  r = VFma(f2, VSplat(x, -0.5f), r);
+  r = VFma(e, VSplat(x, 0.693359375f), VAdd(f, r));
+  r = VSelect(VEqual(x, zero), VSplat(x, -INFINITY), r);
+  r = VSelect(VEqual(x, VSplat(x, INFINITY)), x, r);
+  r = VSelect(VLess(x, zero), VSplat(x, NAN), r);
+  return VSelect(VIsNan(x), x, r);
+}
+
+template <typename V>
+inline V Tanh(V x) {
+  // x + x^3 P(x^2) for |x| < 0.625, otherwise 1 - 2 / (e^(2|x|) + 1) with the sign of x, which
+  // saturates to +-1 once e^(2|x|) overflows
+  static const scalar_t coeffs[] = {-5.70498872745e-3f, 2.06390887954e-2f, -5.37397155531e-2f,
+                                    1.33314422036e-1f, -3.33332819422e-1f};
+  V a = VAnd(x, 0x7fffffff);
+  V z = VMul(x, x);
+  V small = VFma(VMul(Poly(z, coeffs, 5), z), x, x);
+  V one = VSplat(x, 1);
+  V large = VSub(one, VDiv(VSplat(x, 2), VAdd(Exp(VAdd(a, a)), one)));
+  large = VOr(large, VAnd(x, 0x80000000));
+  return VSelect(VLess(a, VSplat(x, 0.625f)), small, large);
+}
+
+/**
+ * The element-wise operators, as function objects so that the compact and the strided entry
+ * points below share one definition of each.
+ */
+struct AddOp {
+  scalar_t operator()(scalar_t x, scalar_t y) const { return x + y; }
+};
+struct MulOp {
+  scalar_t operator()(scalar_t x, scalar_t y) const { return x * y; }
+};
+struct DivOp {
+  scalar_t operator()(scalar_t x, scalar_t y) const { return x / y; }
+};
+struct PowerOp {
+  scalar_t operator()(scalar_t x, scalar_t y) const { return std::pow(x, y); }
+};
+struct MaximumOp {
+  scalar_t operator()(scalar_t x, scalar_t y) const { return std::max(x, y); }
+};
+struct EqOp {
+  scalar_t operator()(scalar_t x, scalar_t y) const { return scalar_t(x == y); }
+};
+struct GeOp {
+  scalar_t operator()(scalar_t x, scalar_t y) const { return scalar_t(x >= y); }
+};
+struct LogOp {
+  scalar_t operator()(scalar_t x) const { return Log(x); }
+#ifdef NEEDLE_SIMD
+  VecF operator()(VecF x) const { return Log(x); }
+#endif
+};
+struct ExpOp {
+  scalar_t operator()(scalar_t x) const { return Exp(x); }
+#ifdef NEEDLE_SIMD
+  VecF operator()(VecF x) const { return Exp(x); }
+#endif
+};
+struct TanhOp {
+  scalar_t operator()(scalar_t x) const { return Tanh(x); }
+#ifdef NEEDLE_SIMD
+  VecF operator()(VecF x) const { return Tanh(x); }
+#endif
+};
+
+/**
+ * ScalarPower() shortcuts for common exponents, which are exact (x^2, x^-1) or within an ulp of
+ * correctly rounded, at a fraction of the cost of powf.  sqrt differs from powf(x, 0.5) only in
+ * sqrt(-0) = -0 and sqrt(-inf) = NaN.
+ */
+struct SquareOp {
+  scalar_t operator()(scalar_t x) const { return x * x; }
+};
+struct CubeOp {
+  scalar_t operator()(scalar_t x) const { return x * x * x; }
+};
+struct ReciprocalOp {
+  scalar_t operator()(scalar_t x) const { return 1 / x; }
+};
+struct SqrtOp {
+  scalar_t operator()(scalar_t x) const { return std::sqrt(x); }
+};
+struct RsqrtOp {
+  scalar_t operator()(scalar_t x) const { return 1 / std::sqrt(x); }
+};
+struct IdentityOp {
+  scalar_t operator()(scalar_t x) const { return x; }
+};
+struct OneOp {
+  scalar_t operator()(scalar_t) const { return 1; }  // powf(x, 0) is 1 even for NaN
+};
+
+template <typename Apply>
+bool PowerShortcut(scalar_t val, const Apply& apply) {
+  // run apply(op) with the shortcut op for x^val and return true, if there is one
+  if (val == 2) {
+    apply(SquareOp());
+  } else if (val == 0.5f) {
+    apply(SqrtOp());
+  } else if (val == 1) {
+    apply(IdentityOp());
+  } else if (val == 0) {
+    apply(OneOp());
+  } else if (val == -1) {
+    apply(ReciprocalOp());
+  } else if (val == 3) {
+    apply(CubeOp());
+  } else if (val == -0.5f) {
+    apply(RsqrtOp());
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * out[j] = op(a[j]) over a contiguous row (out may be a).  The transcendental operators, which
+ * have a VecF overload, take VEC_WIDTH items at a time.
+ */
+template <typename Op>
+inline void MapRow(scalar_t* out, const scalar_t* a, size_t len, Op op) {
+  for (size_t j = 0; j < len; j++) out[j] = op(a[j]);
+}
+
+template <typename Op>
+inline void MapRowSimd(scalar_t* out, const scalar_t* a, size_t len, Op op) {
+  size_t j = 0;
+#ifdef NEEDLE_SIMD
+  for (; j + VEC_WIDTH <= len; j += VEC_WIDTH) VStore(out + j, op(VLoad(a + j)));
+#endif
+  for (; j < len; j++) out[j] = op(a[j]);
+}
+
+inline void MapRow(scalar_t* out, const scalar_t* a, size_t len, LogOp op) {
+  MapRowSimd(out, a, len, op);
+}
+inline void MapRow(scalar_t* out, const scalar_t* a, size_t len, ExpOp op) {
+  MapRowSimd(out, a, len, op);
+}
+inline void MapRow(scalar_t* out, const scalar_t* a, size_t len, TanhOp op) {
+  MapRowSimd(out, a, len, op);
+}
+
+/**
+ * Rows of float16/bfloat16 items to float and back, rounding to nearest even.  With F16C (the
+ * AVX2 and AVX-512 copies) the half-precision ones take 8 items per instruction; the bfloat16
+ * ones are plain shifts that the compiler vectorizes.
+ */
+inline void ConvertRow(const scalar_t* src, scalar_t* dst, size_t len) {
+  if (src != dst) std::memcpy(dst, src, len * ELEM_SIZE);
+}
+
+inline void ConvertRow(const float16_t* src, scalar_t* dst, size_t len) {
+  size_t j = 0;
+#if NEEDLE_ISA == NEEDLE_ISA_AVX2 || NEEDLE_ISA == NEEDLE_ISA_AVX512
+  for (; j + 8 <= len; j += 8)
+    _mm256_storeu_ps(dst + j, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + j))));
+#endif
+  for (; j < len; j++) dst[j] = ToFloat(src[j]);
+}
+
+inline void ConvertRow(const scalar_t* src, float16_t* dst, size_t len) {
+  size_t j = 0;
+#if NEEDLE_ISA == NEEDLE_ISA_AVX2 || NEEDLE_ISA == NEEDLE_ISA_AVX512
+  for (; j + 8 <= len; j += 8)
+    _mm_storeu_si128((__m128i*)(dst + j),
+                     _mm256_cvtps_ph(_mm256_loadu_ps(src + j), _MM_FROUND_TO_NEAREST_INT));
+#endif
+  for (; j < len; j++) dst[j] = FromFloat<float16_t>(src[j]);
+}
+
+inline void ConvertRow(const bfloat16_t* src, scalar_t* dst, size_t len) {
+  for (size_t j = 0; j < len; j++) dst[j] = ToFloat(src[j]);
+}
+
+inline void ConvertRow(const scalar_t* src, bfloat16_t* dst, size_t len) {
+  for (size_t j = 0; j < len; j++) dst[j] = FromFloat<bfloat16_t>(src[j]);
+}
+
+inline void ConvertRow(const int8_t* src, scalar_t* dst, size_t len) {
+  for (size_t j = 0; j < len; j++) dst[j] = src[j];
+}
+
+inline void ConvertRow(const scalar_t* src, int8_t* dst, size_t len) {
+  for (size_t j = 0; j < len; j++) dst[j] = FromFloat<int8_t>(src[j]);
+}
+
+// Items converted at a time by the float16/bfloat16 paths, into scratch rows on the stack
+const size_t CONVERT_BLOCK = 512;
+
+template <typename Src, typename Dst>
+void ConvertItems(const Src* src, Dst* dst, size_t size) {
+  ParallelFor(size, ELEMENTWISE_GRAIN, [=](size_t begin, size_t end) {
+    alignas(64) scalar_t x[CONVERT_BLOCK];
+    for (size_t i = begin; i < end; i += CONVERT_BLOCK) {
+      size_t len = std::min(CONVERT_BLOCK, end - i);
+      ConvertRow(src + i, x, len);
+      ConvertRow(x, dst + i, len);
+    }
+  });
+}
+
+void AsType(const AlignedArray& a, AlignedArray* out) {
+  /**
+   * Convert the a.size items of a to the dtype of out (to int8 by rounding and saturating).
+   */
+  if (a.dtype == DTYPE_INT8 && out->dtype == DTYPE_INT8) {
+    std::memcpy(out->ptr, a.ptr, a.size);
+  } else if (a.dtype == DTYPE_INT8) {
+    DISPATCH_DTYPE(out->dtype, Dst, ConvertItems(a.data<int8_t>(), out->data<Dst>(), a.size));
+  } else if (out->dtype == DTYPE_INT8) {
+    DISPATCH_DTYPE(a.dtype, Src, ConvertItems(a.data<Src>(), out->data<int8_t>(), a.size));
+  } else {
+    DISPATCH_DTYPE(a.dtype, Src,
+                   DISPATCH_DTYPE(out->dtype, Dst,
+                                  ConvertItems(a.data<Src>(), out->data<Dst>(), a.size)));
+  }
+}
+
+/**
+ * The rows that the element-wise helpers below apply their function over.  Float16/bfloat16 rows
+ * are converted to float a CONVERT_BLOCK at a time, go through the float32 row, and are rounded
+ * back; the float32 overloads, being more specialized, are the ones float32 arrays take.
+ */
+template <typename Func>
+inline void EwiseRow(scalar_t* out, const scalar_t* a, const scalar_t* b, size_t len, Func func) {
+  for (size_t j = 0; j < len; j++) out[j] = func(a[j], b[j]);
+}
+
+template <typename T, typename Func>
+inline void EwiseRow(T* out, const T* a, const T* b, size_t len, Func func) {
+  alignas(64) scalar_t x[CONVERT_BLOCK], y[CONVERT_BLOCK];
+  for (size_t j = 0; j < len; j += CONVERT_BLOCK) {
+    size_t n = std::min(CONVERT_BLOCK, len - j);
+    ConvertRow(a + j, x, n);
+    ConvertRow(b + j, y, n);
+    EwiseRow(x, x, y, n, func);
+    ConvertRow(x, out + j, n);
+  }
+}
+
+template <typename Func>
+inline void ScalarRow(scalar_t* out, const scalar_t* a, scalar_t val, size_t len, Func func) {
+  for (size_t j = 0; j < len; j++) out[j] = func(a[j], val);
+}
+
+template <typename T, typename Func>
+inline void ScalarRow(T* out, const T* a, scalar_t val, size_t len, Func func) {
+  alignas(64) scalar_t x[CONVERT_BLOCK];
+  for (size_t j = 0; j < len; j += CONVERT_BLOCK) {
+    size_t n = std::min(CONVERT_BLOCK, len - j);
+    ConvertRow(a + j, x, n);
+    ScalarRow(x, x, val, n, func);
+    ConvertRow(x, out + j, n);
+  }
+}
+
+template <typename T, typename Op>
+inline void MapRow(T* out, const T* a, size_t len, Op op) {
+  alignas(64) scalar_t x[CONVERT_BLOCK];
+  for (size_t j = 0; j < len; j += CONVERT_BLOCK) {
+    size_t n = std::min(CONVERT_BLOCK, len - j);
+    ConvertRow(a + j, x, n);
+    MapRow(x, x, n, op);
+    ConvertRow(x, out + j, n);
+  }
+}
+
+/**
+ * Helpers that apply a per-element function over compact arrays, split across the thread pool.
+ * The element-wise and scalar operators below are all written in terms of these.
+ */
+template <typename T, typename Func>
+void EwiseItems(const T* a_ptr, const T* b_ptr, T* out_ptr, size_t size, Func func) {
+  ParallelFor(size, ELEMENTWISE_GRAIN, [=](size_t begin, size_t end) {
+    EwiseRow(out_ptr + begin, a_ptr + begin, b_ptr + begin, end - begin, func);
+  });
+}
+
+template <typename Func>
+void EwiseApply(const AlignedArray& a, const AlignedArray& b, AlignedArray* out, Func func) {
+  CheckDType(a, *out, "ewise");
+  CheckDType(b, *out, "ewise");
+  DISPATCH_DTYPE(out->dtype, T,
+                 EwiseItems(a.data<T>(), b.data<T>(), out->data<T>(), a.size, func));
+}
+
+template <typename T, typename Func>
+void ScalarItems(const T* a_ptr, scalar_t val, T* out_ptr, size_t size, Func func) {
+  ParallelFor(size, ELEMENTWISE_GRAIN, [=](size_t begin, size_t end) {
+    ScalarRow(out_ptr + begin, a_ptr + begin, val, end - begin, func);
+  });
+}
+
+template <typename Func>
+void ScalarApply(const AlignedArray& a, scalar_t val, AlignedArray* out, Func func) {
+  CheckDType(a, *out, "scalar");
+  DISPATCH_DTYPE(out->dtype, T, ScalarItems(a.data<T>(), val, out->data<T>(), a.size, func));
+}
+
+template <typename T, typename Func>
+void UnaryItems(const T* a_ptr, T* out_ptr, size_t size, Func func) {
+  ParallelFor(size, ELEMENTWISE_GRAIN, [=](size_t begin, size_t end) {
+    MapRow(out_ptr + begin, a_ptr + begin, end - begin, func);
+  });
+}
+
+template <typename Func>
+void UnaryApply(const AlignedArray& a, AlignedArray* out, Func func) {
+  CheckDType(a, *out, "unary");
+  DISPATCH_DTYPE(out->dtype, T, UnaryItems(a.data<T>(), out->data<T>(), a.size, func));
+}
+
+struct CompactUnary {
+  // UnaryApply() as a function object, for PowerShortcut()
+  template <typename Op>
+  void operator()(Op op) const { UnaryApply(a, out, op); }
+  const AlignedArray& a;
+  AlignedArray* out;
+};
+
+void EwiseAdd(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
+  /**
+   * Set entries in out to be the sum of correspondings entires in a and b.
+   */
+  EwiseApply(a, b, out, AddOp());
+}
+
+void ScalarAdd(const AlignedArray& a, scalar_t val, AlignedArray* out) {
+  /**
+   * Set entries in out to be the sum of corresponding entry in a plus the scalar val.
+   */
+  ScalarApply(a, val, out, AddOp());
+}
+
+
+/**
+ * In the code the follows, use the above template to create analogous element-wise
+ * and and scalar operators for the following functions.  See the numpy backend for
+ * examples of how they should work.
+ *   - EwiseMul, ScalarMul
+ *   - EwiseDiv, ScalarDiv
+ *   - ScalarPower
+ *   - EwiseMaximum, ScalarMaximum
+ *   - EwiseEq, ScalarEq
+ *   - EwiseGe, ScalarGe
+ *   - EwiseLog
+ *   - EwiseExp
+ *   - EwiseTanh
+ *
+ * If you implement all these naively, there will be a lot of repeated code, so
+ * you are welcome (but not required), to use macros or templates to define these
+ * functions (however you want to do so, as long as the functions match the proper)
+ * signatures above.
+ */
+
+// Element-wise multiplication
+void EwiseMul(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
+  EwiseApply(a, b, out, MulOp());
+}
+
+// Scalar multiplication
+void ScalarMul(const AlignedArray& a, scalar_t val, AlignedArray* out) {
+  ScalarApply(a, val, out, MulOp());
+}
+
+// Element-wise division
+void EwiseDiv(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
+  EwiseApply(a, b, out, DivOp());
+}
+
+// Scalar division
+void ScalarDiv(const AlignedArray& a, scalar_t val, AlignedArray* out) {
+  ScalarApply(a, val, out, DivOp());
+}
+
+// Scalar power
+void ScalarPower(const AlignedArray& a, scalar_t val, AlignedArray* out) {
+  CompactUnary apply = {a, out};
+  if (!PowerShortcut(val, apply)) ScalarApply(a, val, out, PowerOp());
+}
+
+// Element-wise maximum
+void EwiseMaximum(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
+  EwiseApply(a, b, out, MaximumOp());
+}
+
+// Scalar maximum
+void ScalarMaximum(const AlignedArray& a, scalar_t val, AlignedArray* out) {
+  ScalarApply(a, val, out, MaximumOp());
+}
+
+// Element-wise equality
+void EwiseEq(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
+  EwiseApply(a, b, out, EqOp());
+}
+
+// Scalar equality
+void ScalarEq(const AlignedArray& a, scalar_t val, AlignedArray* out) {
+  ScalarApply(a, val, out, EqOp());
+}
+
+// Element-wise greater than or equal to
+void EwiseGe(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
+  EwiseApply(a, b, out, GeOp());
+}
+
+// Scalar greater than or equal to
+void ScalarGe(const AlignedArray& a, scalar_t val, AlignedArray* out) {
+  ScalarApply(a, val, out, GeOp());
+}
+
+// Element-wise logarithm
+void EwiseLog(const AlignedArray& a, AlignedArray* out) {
+  UnaryApply(a, out, LogOp());
+}
+
+// Element-wise exponential
+void EwiseExp(const AlignedArray& a, AlignedArray* out) {
+  UnaryApply(a, out, ExpOp());
+}
+
+// Element-wise hyperbolic tangent
+void EwiseTanh(const AlignedArray& a, AlignedArray* out) {
+  UnaryApply(a, out, TanhOp());
+}
+
+/**
+ * Strided variants of the element-wise, scalar and unary operators.  Instead of compact inputs
+ * they take the (shape, strides, offset) of every input view, exactly as Compact() does, and read
+ * the views in place, so broadcast (zero-stride), permuted and sliced operands need no compact()
+ * copy first.  out is always compact with the given shape.
+ *
+ * The layouts are collapsed together first, then each row of the innermost dimension goes
+ * through ApplyRow(), which has separate loops for the common unit-stride and broadcast cases so
+ * that those still vectorize.
+ */
+template <typename Op>
+inline void ApplyRow(scalar_t* out, const scalar_t* a, size_t a_stride, const scalar_t* b,
+                     size_t b_stride, size_t len, Op op) {
+  if (a_stride == 1 && b_stride == 1) {
+    for (size_t j = 0; j < len; j++) out[j] = op(a[j], b[j]);
+  } else if (a_stride == 1 && b_stride == 0) {
+    scalar_t y = b[0];
+    for (size_t j = 0; j < len; j++) out[j] = op(a[j], y);
+  } else if (a_stride == 0 && b_stride == 1) {
+    scalar_t x = a[0];
+    for (size_t j = 0; j < len; j++) out[j] = op(x, b[j]);
+  } else {
+    for (size_t j = 0; j < len; j++) out[j] = op(a[j * a_stride], b[j * b_stride]);
+  }
+}
+
+template <typename Op>
+inline void ApplyRow(scalar_t* out, const scalar_t* a, size_t a_stride, size_t len, Op op) {
+  if (a_stride == 1) {
+    MapRow(out, a, len, op);
+  } else if (a_stride == 0) {
+    std::fill(out, out + len, op(a[0]));
+  } else {
+    for (size_t j = 0; j < len; j++) out[j] = op(a[j * a_stride]);
+  }
+}
+
+template <typename Op>
+void EwiseStrided(const AlignedArray& a, const AlignedArray& b, AlignedArray* out,
+                  const std::vector<int32_t>& shape, const std::vector<int32_t>& a_strides,
+                  size_t a_offset, const std::vector<int32_t>& b_strides, size_t b_offset) {
+  CheckFloat32(a, "ewise_strided");
+  CheckFloat32(b, "ewise_strided");
+  StridedLayout a_layout, b_layout;
+  CollapseLayoutPair(shape, a_strides, a_offset, b_strides, b_offset, &a_layout, &b_layout);
+  const scalar_t* a_ptr = a.ptr;
+  const scalar_t* b_ptr = b.ptr;
+  scalar_t* out_ptr = out->ptr;
+  size_t inner = a_layout.shape.back();
+  size_t a_stride = a_layout.strides.back(), b_stride = b_layout.strides.back();
+  Op op;
+
+  if (a_layout.shape.size() == 1) {
+    ParallelFor(inner, ELEMENTWISE_GRAIN, [=](size_t begin, size_t end) {
+      ApplyRow(out_ptr + begin, a_ptr + a_offset + begin * a_stride, a_stride,
+               b_ptr + b_offset + begin * b_stride, b_stride, end - begin, op);
+    });
+  } else {
+    ForEachRowPair(a_layout, b_layout, inner, [=](size_t row, size_t a_loc, size_t b_loc) {
+      ApplyRow(out_ptr + row * inner, a_ptr + a_loc, a_stride, b_ptr + b_loc, b_stride, inner,
+               op);
+    });
+  }
+}
+
+template <typename Op>
+void UnaryStridedApply(const AlignedArray& a, AlignedArray* out, const std::vector<int32_t>& shape,
+                       const std::vector<int32_t>& strides, size_t offset, Op op) {
+  CheckFloat32(a, "unary_strided");
+  StridedLayout layout = CollapseLayout(shape, strides, offset);
+  const scalar_t* a_ptr = a.ptr;
+  scalar_t* out_ptr = out->ptr;
+  size_t inner = layout.shape.back();
+  size_t stride = layout.strides.back();
+
+  if (layout.shape.size() == 1) {
+    ParallelFor(inner, ELEMENTWISE_GRAIN, [=](size_t begin, size_t end) {
+      ApplyRow(out_ptr + begin, a_ptr + offset + begin * stride, stride, end - begin, op);
+    });
+  } else {
+    ForEachRow(layout, [=](size_t row, size_t loc) {
+      ApplyRow(out_ptr + row * inner, a_ptr + loc, stride, inner, op);
+    });
+  }
+}
+
+template <typename Op>
+void UnaryStrided(const AlignedArray& a, AlignedArray* out, const std::vector<int32_t>& shape,
+                  const std::vector<int32_t>& strides, size_t offset) {
+  UnaryStridedApply(a, out, shape, strides, offset, Op());
+}
+
+template <typename Op>
+struct BindScalar {
+  // Op with its second argument fixed, so scalar operators can go through UnaryStridedApply()
+  scalar_t operator()(scalar_t x) const { return op(x, val); }
+  scalar_t val;
+  Op op;
+};
+
+template <typename Op>
+void ScalarStrided(const AlignedArray& a, scalar_t val, AlignedArray* out,
+                   const std::vector<int32_t>& shape, const std::vector<int32_t>& strides,
+                   size_t offset) {
+  BindScalar<Op> bound;
+  bound.val = val;
+  UnaryStridedApply(a, out, shape, strides, offset, bound);
+}
+
+struct StridedUnary {
+  // UnaryStridedApply() as a function object, for PowerShortcut()
+  template <typename Op>
+  void operator()(Op op) const { UnaryStridedApply(a, out, shape, strides, offset, op); }
+  const AlignedArray& a;
+  AlignedArray* out;
+  const std::vector<int32_t>& shape;
+  const std::vector<int32_t>& strides;
+  size_t offset;
+};
+
+void ScalarPowerStrided(const AlignedArray& a, scalar_t val, AlignedArray* out,
+                        const std::vector<int32_t>& shape, const std::vector<int32_t>& strides,
+                        size_t offset) {
+  StridedUnary apply = {a, out, shape, strides, offset};
+  if (!PowerShortcut(val, apply)) ScalarStrided<PowerOp>(a, val, out, shape, strides, offset);
+}
+
+
+/**
+ * Fused element-wise programs.
+ *
+ * A chain of element-wise and scalar operators, recorded on the Python side by fuse() in
+ * ndarray.py, arrives as a small register bytecode: each instruction is four int32s
+ * (opcode, dst, a, b), where for FUSED_LOAD `a` indexes the inputs, for FUSED_SCALAR the scalars,
+ * and otherwise `a` and `b` are source registers.  The result is the last instruction's dst.
+ *
+ * EwiseFused() runs the whole program in a single pass over the output, so none of the
+ * intermediates is ever materialized.  The output is cut into blocks of FUSED_BLOCK elements
+ * along the innermost dimension, every register holds one block (so the interpreter dispatch is
+ * paid once per block, and each instruction is a plain loop that vectorizes), and the inputs are
+ * read in place from their own (strides, offset) over the common shape, so broadcast operands
+ * such as a per-row mean cost nothing extra.
+ */
+enum FusedOpcode {
+  // must match FUSED_OPCODES in ndarray.py
+  FUSED_LOAD,
+  FUSED_SCALAR,
+  FUSED_ADD,
+  FUSED_SUB,
+  FUSED_MUL,
+  FUSED_DIV,
+  FUSED_POWER,
+  FUSED_MAXIMUM,
+  FUSED_EQ,
+  FUSED_GE,
+  FUSED_NEG,
+  FUSED_LOG,
+  FUSED_EXP,
+  FUSED_TANH,
+  FUSED_NUM_OPCODES
+};
+
+const size_t FUSED_MAX_REGISTERS = 16;
+const size_t FUSED_BLOCK = 256;
+
+struct SubOp {
+  scalar_t operator()(scalar_t x, scalar_t y) const { return x - y; }
+};
+struct NegOp {
+  scalar_t operator()(scalar_t x) const { return -x; }
+};
+
+struct FusedInstr {
+  int32_t op, dst;
+  int32_t a, b;  // source registers
+  int32_t index;  // of the input (FUSED_LOAD) or the scalar (FUSED_SCALAR)
+};
+
+template <typename Op>
+inline void FusedBinary(scalar_t* dst, const scalar_t* x, const scalar_t* y, size_t len, Op op) {
+  // dst may alias x or y (registers are reused), which is fine element by element
+  for (size_t j = 0; j < len; j++) dst[j] = op(x[j], y[j]);
+}
+
+template <typename Op>
+inline void FusedUnary(scalar_t* dst, const scalar_t* x, size_t len, Op op) {
+  MapRow(dst, x, len, op);
+}
+
+std::vector<FusedInstr> ParseFusedProgram(const std::vector<AlignedArray*>& inputs,
+                                          const std::vector<std::vector<int32_t>>& input_strides,
+                                          const std::vector<size_t>& input_offsets,
+                                          const std::vector<scalar_t>& scalars,
+                                          const std::vector<int32_t>& program,
+                                          const AlignedArray& out, const char* kernel) {
+  // check the arguments of a fused kernel and decode its program
+  CheckFloat32(out, kernel);
+  for (const AlignedArray* input : inputs) CheckFloat32(*input, kernel);
+  size_t num_inputs = inputs.size();
+  if (input_strides.size() != num_inputs || input_offsets.size() != num_inputs)
+    throw std::invalid_argument(std::string(kernel) +
+                                ": one strides/offset entry is needed per input");
+  if (program.empty() || program.size() % 4 != 0)
+    throw std::invalid_argument(std::string(kernel) + ": malformed program");
+  std::vector<FusedInstr> instrs;
+  for (size_t pc = 0; pc < program.size(); pc += 4) {
+    FusedInstr instr = {program[pc], program[pc + 1], 0, 0, 0};
+    int32_t a = program[pc + 2], b = program[pc + 3];
+    const int32_t num_regs = FUSED_MAX_REGISTERS;
+    bool ok = instr.op >= 0 && instr.op < FUSED_NUM_OPCODES && instr.dst >= 0 &&
+              instr.dst < num_regs;
+    if (instr.op == FUSED_LOAD) {
+      ok = ok && a >= 0 && (size_t)a < num_inputs;
+      instr.index = a;
+    } else if (instr.op == FUSED_SCALAR) {
+      ok = ok && a >= 0 && (size_t)a < scalars.size();
+      instr.index = a;
+    } else {
+      ok = ok && a >= 0 && a < num_regs;
+      instr.a = a;
+      if (instr.op < FUSED_NEG) {
+        ok = ok && b >= 0 && b < num_regs;
+        instr.b = b;
+      }
+    }
+    if (!ok) throw std::invalid_argument(std::string(kernel) + ": invalid instruction");
+    instrs.push_back(instr);
+  }
+  return instrs;
+}
+
+size_t CollapseFusedShape(const std::vector<int32_t>& shape,
+                          const std::vector<std::vector<int32_t>>& input_strides, size_t split,
+                          std::vector<size_t>* dims, std::vector<std::vector<size_t>>* strides) {
+  /**
+   * Collapse all the views of a fused kernel together, merging dimensions only where every input
+   * allows it, and never merging dimension split into the one before (split == shape.size() for
+   * no such boundary).  Returns the number of collapsed dimensions before the boundary; dims is
+   * left empty for an empty shape.
+   */
+  size_t num_inputs = input_strides.size();
+  size_t split_dim = 0;
+  strides->assign(num_inputs, std::vector<size_t>());
+  for (size_t i = 0; i < shape.size(); i++) {
+    if (shape[i] == 0) {
+      dims->clear();
+      return 0;
+    }
+    if (i == split) split_dim = dims->size();
+    if (shape[i] == 1) continue;
+    // the first dimension after the boundary starts a new one
+    bool merge = !dims->empty() && !(i >= split && dims->size() == split_dim);
+    for (size_t k = 0; k < num_inputs && merge; k++)
+      merge = (*strides)[k].back() == (size_t)input_strides[k][i] * shape[i];
+    if (merge) {
+      dims->back() *= shape[i];
+      for (size_t k = 0; k < num_inputs; k++) (*strides)[k].back() = input_strides[k][i];
+    } else {
+      dims->push_back(shape[i]);
+      for (size_t k = 0; k < num_inputs; k++) (*strides)[k].push_back(input_strides[k][i]);
+    }
+  }
+  if (split >= shape.size()) split_dim = dims->size();
+  if (dims->empty()) {
+    dims->push_back(1);
+    for (size_t k = 0; k < num_inputs; k++) (*strides)[k].push_back(1);
+  }
+  return split_dim;
+}
+
+inline const scalar_t* RunFusedBlock(const std::vector<FusedInstr>& instrs,
+                                     scalar_t (*regs)[FUSED_BLOCK],
+                                     const std::vector<AlignedArray*>& inputs,
+                                     const std::vector<scalar_t>& scalars, const size_t* locs,
+                                     const std::vector<std::vector<size_t>>& strides, size_t len) {
+  // run the program over len items of the innermost dimension, the inputs starting at locs;
+  // returns the register holding the result
+  for (const FusedInstr& instr : instrs) {
+    scalar_t* dst = regs[instr.dst];
+    const scalar_t* x = regs[instr.a];
+    const scalar_t* y = regs[instr.b];
+    switch (instr.op) {
+      case FUSED_LOAD: {
+        const scalar_t* src = inputs[instr.index]->ptr + locs[instr.index];
+        size_t stride = strides[instr.index].back();
+        if (stride == 1) {
+          std::memcpy(dst, src, len * ELEM_SIZE);
+        } else if (stride == 0) {
+          std::fill(dst, dst + len, src[0]);
+        } else {
+          for (size_t j = 0; j < len; j++) dst[j] = src[j * stride];
+        }
+        break;
+      }
+      case FUSED_SCALAR: std::fill(dst, dst + len, scalars[instr.index]); break;
+      case FUSED_ADD: FusedBinary(dst, x, y, len, AddOp()); break;
+      case FUSED_SUB: FusedBinary(dst, x, y, len, SubOp()); break;
+      case FUSED_MUL: FusedBinary(dst, x, y, len, MulOp()); break;
+      case FUSED_DIV: FusedBinary(dst, x, y, len, DivOp()); break;
+      case FUSED_POWER: FusedBinary(dst, x, y, len, PowerOp()); break;
+      case FUSED_MAXIMUM: FusedBinary(dst, x, y, len, MaximumOp()); break;
+      case FUSED_EQ: FusedBinary(dst, x, y, len, EqOp()); break;
+      case FUSED_GE: FusedBinary(dst, x, y, len, GeOp()); break;
+      case FUSED_NEG: FusedUnary(dst, x, len, NegOp()); break;
+      case FUSED_LOG: FusedUnary(dst, x, len, LogOp()); break;
+      case FUSED_EXP: FusedUnary(dst, x, len, ExpOp()); break;
+      case FUSED_TANH: FusedUnary(dst, x, len, TanhOp()); break;
+    }
+  }
+  return regs[instrs.back().dst];
+}
+
+void EwiseFused(const std::vector<AlignedArray*>& inputs,
+                const std::vector<std::vector<int32_t>>& input_strides,
+                const std::vector<size_t>& input_offsets, const std::vector<scalar_t>& scalars,
+                const std::vector<int32_t>& program, AlignedArray* out,
+                const std::vector<int32_t>& shape) {
+  /**
+   * Args:
+   *   inputs: arrays read by FUSED_LOAD
+   *   input_strides, input_offsets: the view of each input over shape (0 strides broadcast)
+   *   scalars: constants read by FUSED_SCALAR
+   *   program: the bytecode, four int32s per instruction
+   *   out: compact output array with the given shape
+   */
+  std::vector<FusedInstr> instrs = ParseFusedProgram(inputs, input_strides, input_offsets,
+                                                     scalars, program, *out, "ewise_fused");
+  size_t num_inputs = inputs.size();
+  std::vector<size_t> dims;
+  std::vector<std::vector<size_t>> strides;
+  CollapseFusedShape(shape, input_strides, shape.size(), &dims, &strides);
+  if (dims.empty()) return;
+
+  size_t outer_ndim = dims.size() - 1;
+  size_t inner = dims.back();
+  size_t blocks_per_row = (inner + FUSED_BLOCK - 1) / FUSED_BLOCK;
+  size_t num_rows = out->size / inner;
+  scalar_t* out_ptr = out->ptr;
+
+  ParallelFor(num_rows * blocks_per_row, std::max<size_t>(1, ELEMENTWISE_GRAIN / FUSED_BLOCK),
+              [&](size_t begin, size_t end) {
+    alignas(64) scalar_t regs[FUSED_MAX_REGISTERS][FUSED_BLOCK];
+    std::vector<size_t> locs(num_inputs);
+    for (size_t task = begin; task < end; task++) {
+      size_t row = task / blocks_per_row;
+      size_t col = task % blocks_per_row * FUSED_BLOCK;
+      size_t len = std::min(FUSED_BLOCK, inner - col);
+      for (size_t k = 0; k < num_inputs; k++) locs[k] = input_offsets[k] + col * strides[k].back();
+      for (size_t d = outer_ndim, rest = row; d-- > 0; rest /= dims[d]) {
+        size_t index = rest % dims[d];
+        for (size_t k = 0; k < num_inputs; k++) locs[k] += index * strides[k][d];
+      }
+      const scalar_t* result =
+          RunFusedBlock(instrs, regs, inputs, scalars, locs.data(), strides, len);
+      std::memcpy(out_ptr + row * inner + col, result, len * ELEM_SIZE);
+    }
+  });
+}
+
+void EwiseFusedSum(const std::vector<AlignedArray*>& inputs,
+                   const std::vector<std::vector<int32_t>>& input_strides,
+                   const std::vector<size_t>& input_offsets, const std::vector<scalar_t>& scalars,
+                   const std::vector<int32_t>& program, AlignedArray* out,
+                   const std::vector<int32_t>& shape, size_t reduce_size) {
+  /**
+   * EwiseFused() summed over the trailing axes of shape in the same pass, so the element-wise
+   * result is never stored: out[i] is the sum of results [i * reduce_size, (i + 1) * reduce_size)
+   * of the program over shape.  Reducing other axes is a matter of permuting the input views
+   * first (see fuse() in ndarray.py).
+   *
+   * Each task sums one FUSED_BLOCK of one output into a partial, and the partials of an output
+   * are then added in order, so a full reduction is as parallel as a row-wise one and the result
+   * does not depend on the number of threads.
+   *
+   * Args:
+   *   as for EwiseFused(), but out is compact with prod(shape) / reduce_size items
+   *   reduce_size: the number of items summed into each output, the product of the sizes of
+   *     the trailing axes of shape that are reduced
+   */
+  size_t total = 1;
+  for (int32_t size : shape) total *= size;
+  size_t split = shape.size(), trailing = 1;
+  while (split > 0 && trailing < reduce_size) trailing *= shape[--split];
+  if (reduce_size == 0 || trailing != reduce_size || out->size * reduce_size != total)
+    throw std::invalid_argument("ewise_fused_sum: reduce_size must be the size of trailing axes "
+                                "of shape, and out have the remaining items");
+  if (reduce_size == 1) return EwiseFused(inputs, input_strides, input_offsets, scalars, program,
+                                          out, shape);
+  std::vector<FusedInstr> instrs = ParseFusedProgram(inputs, input_strides, input_offsets,
+                                                     scalars, program, *out, "ewise_fused_sum");
+  size_t num_inputs = inputs.size();
+  std::vector<size_t> dims;
+  std::vector<std::vector<size_t>> strides;
+  size_t split_dim = CollapseFusedShape(shape, input_strides, split, &dims, &strides);
+  if (dims.empty()) return;
+
+  // reduce_size > 1, so the last collapsed dimension is a reduced one
+  size_t inner = dims.back();
+  size_t blocks_per_row = (inner + FUSED_BLOCK - 1) / FUSED_BLOCK;
+  size_t tasks_per_out = reduce_size / inner * blocks_per_row;
+  std::vector<double> partials(out->size * tasks_per_out);
+
+  ParallelFor(partials.size(), std::max<size_t>(1, ELEMENTWISE_GRAIN / FUSED_BLOCK),
+              [&](size_t begin, size_t end) {
+    alignas(64) scalar_t regs[FUSED_MAX_REGISTERS][FUSED_BLOCK];
+    std::vector<size_t> locs(num_inputs);
+    for (size_t task = begin; task < end; task++) {
+      size_t item = task / tasks_per_out;
+      size_t row = task % tasks_per_out / blocks_per_row;
+      size_t col = task % blocks_per_row * FUSED_BLOCK;
+      size_t len = std::min(FUSED_BLOCK, inner - col);
+      for (size_t k = 0; k < num_inputs; k++) locs[k] = input_offsets[k] + col * strides[k].back();
+      // the reduced dimensions from row, the kept ones from the output item
+      for (size_t d = dims.size() - 1, rest = row; d-- > split_dim; rest /= dims[d]) {
+        size_t index = rest % dims[d];
+        for (size_t k = 0; k < num_inputs; k++) locs[k] += index * strides[k][d];
+      }
+      for (size_t d = split_dim, rest = item; d-- > 0; rest /= dims[d]) {
+        size_t index = rest % dims[d];
+        for (size_t k = 0; k < num_inputs; k++) locs[k] += index * strides[k][d];
+      }
+      const scalar_t* result =
+          RunFusedBlock(instrs, regs, inputs, scalars, locs.data(), strides, len);
+      scalar_t sum = 0;
+      for (size_t j = 0; j < len; j++) sum += result[j];
+      partials[task] = sum;
+    }
+  });
+  scalar_t* out_ptr = out->ptr;
+  ParallelFor(out->size, std::max<size_t>(1, ELEMENTWISE_GRAIN / tasks_per_out),
+              [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      double sum = 0;
+      for (size_t t = 0; t < tasks_per_out; t++) sum += partials[i * tasks_per_out + t];
+      out_ptr[i] = (scalar_t)sum;
+    }
+  });
+}
+
+
+/**
+ * GEMM engine shared by Matmul() and MatmulTiled().
+ *
+ * This follows the usual Goto/BLIS blocking scheme.  A KC x NC panel of b is packed into
+ * NR-wide column strips (kept in L2/L3), an MC x KC panel of a is packed into MR-tall row strips
+ * (kept in L2), and a register-blocked MR x NR micro-kernel streams one strip of each from L1,
+ * accumulating with FMA (a multiply and an add on SSE4.2).  Packing zero-pads the last strip of
+ * each panel to a full MR / NR, so the micro-kernel never sees a ragged edge; only the final store
+ * into out is clipped.  Because of this, any m, n, p can go through the packed path, not just
+ * multiples of TILE.
+ *
+ * The operands are accessed through small "view" structs so the same engine can read and write
+ * ordinary row-major matrices, the 4D tiled layout used by MatmulTiled(), and arbitrarily strided
+ * views (MatmulStrided()); since the packing step copies every panel anyway, a strided operand
+ * costs no extra pass over memory.  Large products
+ * are split across the thread pool by output panel.
+ */
+#if NEEDLE_ISA == NEEDLE_ISA_AVX512
+const uint32_t GEMM_MR = 8;
+const uint32_t GEMM_NR = 32;
+const uint32_t GEMM_KC = 128;
+#elif NEEDLE_ISA == NEEDLE_ISA_AVX2
+const uint32_t GEMM_MR = 6;
+const uint32_t GEMM_NR = 16;
+const uint32_t GEMM_KC = 256;
+#elif NEEDLE_ISA == NEEDLE_ISA_SSE42
+const uint32_t GEMM_MR = 6;
+const uint32_t GEMM_NR = 8;
+const uint32_t GEMM_KC = 256;
+#elif NEEDLE_ISA == NEEDLE_ISA_NEON
+const uint32_t GEMM_MR = 8;
+const uint32_t GEMM_NR = 8;
+const uint32_t GEMM_KC = 512;
+#else
+const uint32_t GEMM_MR = 4;
+const uint32_t GEMM_NR = 16;
+const uint32_t GEMM_KC = 256;
+#endif
+// MC must be a multiple of MR and NC a multiple of NR for every configuration above
+const uint32_t GEMM_MC = 96;
+const uint32_t GEMM_NC = 2048;
+
+struct RowMajorView {
+  RowMajorView(scalar_t* ptr, uint32_t cols) : ptr(ptr), cols(cols) {}
+  scalar_t& operator()(uint32_t i, uint32_t j) const { return ptr[(size_t)i * cols + j]; }
+  scalar_t* ptr;
+  uint32_t cols;
+};
+
+struct TiledView {
+  // element (i, j) of a rows x cols matrix stored as [rows/TILE][cols/TILE][TILE][TILE]
+  TiledView(scalar_t* ptr, uint32_t cols) : ptr(ptr), cols(cols) {}
+  scalar_t& operator()(uint32_t i, uint32_t j) const {
+    return ptr[(size_t)(i / TILE) * cols * TILE + (j / TILE) * TILE * TILE + (i % TILE) * TILE +
+               j % TILE];
+  }
+  scalar_t* ptr;
+  uint32_t cols;
+};
+
+struct StridedView {
+  // element (i, j) of an arbitrarily strided matrix, e.g. a transposed or sliced NDArray view
+  StridedView(scalar_t* ptr, size_t row_stride, size_t col_stride)
+      : ptr(ptr), row_stride(row_stride), col_stride(col_stride) {}
+  scalar_t& operator()(uint32_t i, uint32_t j) const {
+    return ptr[i * row_stride + j * col_stride];
+  }
+  scalar_t* ptr;
+  size_t row_stride, col_stride;
+};
+
+template <typename T>
+struct ConvertView {
+  // StridedView() of float16/bfloat16 items, read as floats (for the operands only)
+  ConvertView(const T* ptr, size_t row_stride, size_t col_stride)
+      : ptr(ptr), row_stride(row_stride), col_stride(col_stride) {}
+  scalar_t operator()(uint32_t i, uint32_t j) const {
+    return ToFloat(ptr[i * row_stride + j * col_stride]);
+  }
+  const T* ptr;
+  size_t row_stride, col_stride;
+};
+
+struct PackBuffer {
+  /**
+   * A fixed-size aligned scratch buffer.  The packing buffers are allocated once per thread and
+   * reused by every call, rather than allocating scratch space per tile.
+   */
+  explicit PackBuffer(size_t size) {
+    if (posix_memalign((void**)&ptr, ALIGNMENT, size * ELEM_SIZE) != 0) throw std::bad_alloc();
+  }
+  ~PackBuffer() { free(ptr); }
+  scalar_t* ptr;
+};
+
+scalar_t* ThreadPackA() {
+  static thread_local PackBuffer buffer(GEMM_MC * GEMM_KC);
+  return buffer.ptr;
+}
+
+scalar_t* ThreadPackB() {
+  static thread_local PackBuffer buffer(GEMM_KC * GEMM_NC);
+  return buffer.ptr;
+}
+
+// Products with fewer multiply-adds than this are not worth splitting across threads
+const size_t GEMM_PARALLEL_MIN_FLOPS = 64 * 64 * 64;
+
+template <typename AView>
+void PackA(const AView& a, uint32_t i0, uint32_t k0, uint32_t mc, uint32_t kc, scalar_t* dst) {
+  /**
+   * Pack a[i0:i0+mc, k0:k0+kc] into consecutive MR x kc strips, each stored k-major (the MR values
+   * of one column are contiguous), zero-padding the rows past mc.
+   */
+  for (uint32_t ir = 0; ir < mc; ir += GEMM_MR) {
+    uint32_t mr = std::min(GEMM_MR, mc - ir);
+    for (uint32_t r = 0; r < GEMM_MR; r++) {
+      if (r < mr) {
+        for (uint32_t k = 0; k < kc; k++) dst[k * GEMM_MR + r] = a(i0 + ir + r, k0 + k);
+      } else {
+        for (uint32_t k = 0; k < kc; k++) dst[k * GEMM_MR + r] = 0;
+      }
+    }
+    dst += GEMM_MR * kc;
+  }
+}
+
+template <typename BView>
+void PackB(const BView& b, uint32_t k0, uint32_t j0, uint32_t kc, uint32_t nc, scalar_t* dst) {
+  /**
+   * Pack b[k0:k0+kc, j0:j0+nc] into consecutive kc x NR strips, each stored row-major (the NR
+   * values of one row are contiguous), zero-padding the columns past nc.
+   */
+  for (uint32_t jr = 0; jr < nc; jr += GEMM_NR) {
+    uint32_t nr = std::min(GEMM_NR, nc - jr);
+    for (uint32_t k = 0; k < kc; k++) {
+      scalar_t* row = dst + k * GEMM_NR;
+      if (nr == GEMM_NR) {
+        for (uint32_t c = 0; c < GEMM_NR; c++) row[c] = b(k0 + k, j0 + jr + c);
+      } else {
+        for (uint32_t c = 0; c < nr; c++) row[c] = b(k0 + k, j0 + jr + c);
+        for (uint32_t c = nr; c < GEMM_NR; c++) row[c] = 0;
+      }
+    }
+    dst += GEMM_NR * kc;
+  }
+}
+
+inline void MicroKernel(uint32_t kc, const scalar_t* __restrict__ a,
+                        const scalar_t* __restrict__ b, scalar_t* __restrict__ c) {
+  /**
+   * Compute c = a * b for one packed MR x kc strip of a and one packed kc x NR strip of b, keeping
+   * the whole MR x NR accumulator in registers.  c is a compact MR x NR buffer (overwritten, not
+   * accumulated into), aligned to ALIGNMENT like the packed strips.
+   */
+  a = (const scalar_t*)__builtin_assume_aligned(a, 64);
+  b = (const scalar_t*)__builtin_assume_aligned(b, 64);
+  c = (scalar_t*)__builtin_assume_aligned(c, 64);
+
+#if NEEDLE_ISA == NEEDLE_ISA_AVX512
+#define GEMM_ROW(r)                                  \
+  {                                                  \
+    __m512 av = _mm512_set1_ps(a[r]);                \
+    c##r##0 = _mm512_fmadd_ps(av, b0, c##r##0);     \
+    c##r##1 = _mm512_fmadd_ps(av, b1, c##r##1);     \
+  }
+#define GEMM_STORE(r)                                \
+  _mm512_store_ps(c + r * GEMM_NR, c##r##0);         \
+  _mm512_store_ps(c + r * GEMM_NR + 16, c##r##1);
+  __m512 c00 = _mm512_setzero_ps(), c01 = c00, c10 = c00, c11 = c00, c20 = c00, c21 = c00,
+         c30 = c00, c31 = c00, c40 = c00, c41 = c00, c50 = c00, c51 = c00, c60 = c00, c61 = c00,
+         c70 = c00, c71 = c00;
+  for (uint32_t k = 0; k < kc; k++) {
+    __m512 b0 = _mm512_load_ps(b);
+    __m512 b1 = _mm512_load_ps(b + 16);
+    GEMM_ROW(0) GEMM_ROW(1) GEMM_ROW(2) GEMM_ROW(3) GEMM_ROW(4) GEMM_ROW(5) GEMM_ROW(6)
+    GEMM_ROW(7)
+    a += GEMM_MR;
+    b += GEMM_NR;
+  }
+  GEMM_STORE(0) GEMM_STORE(1) GEMM_STORE(2) GEMM_STORE(3) GEMM_STORE(4) GEMM_STORE(5)
+  GEMM_STORE(6) GEMM_STORE(7)
+#undef GEMM_ROW
+#undef GEMM_STORE
+
+#elif NEEDLE_ISA == NEEDLE_ISA_AVX2
+#define GEMM_ROW(r)                                  \
+  {                                                  \
+    __m256 av = _mm256_broadcast_ss(a + r);          \
+    c##r##0 = _mm256_fmadd_ps(av, b0, c##r##0);     \
+    c##r##1 = _mm256_fmadd_ps(av, b1, c##r##1);     \
+  }
+#define GEMM_STORE(r)                                \
+  _mm256_store_ps(c + r * GEMM_NR, c##r##0);         \
+  _mm256_store_ps(c + r * GEMM_NR + 8, c##r##1);
+  __m256 c00 = _mm256_setzero_ps(), c01 = c00, c10 = c00, c11 = c00, c20 = c00, c21 = c00,
+         c30 = c00, c31 = c00, c40 = c00, c41 = c00, c50 = c00, c51 = c00;
+  for (uint32_t k = 0; k < kc; k++) {
+    __m256 b0 = _mm256_load_ps(b);
+    __m256 b1 = _mm256_load_ps(b + 8);
+    GEMM_ROW(0) GEMM_ROW(1) GEMM_ROW(2) GEMM_ROW(3) GEMM_ROW(4) GEMM_ROW(5)
+    a += GEMM_MR;
+    b += GEMM_NR;
+  }
+  GEMM_STORE(0) GEMM_STORE(1) GEMM_STORE(2) GEMM_STORE(3) GEMM_STORE(4) GEMM_STORE(5)
+#undef GEMM_ROW
+#undef GEMM_STORE
+
+#elif NEEDLE_ISA == NEEDLE_ISA_SSE42
+#define GEMM_ROW(r)                                        \
+  {                                                        \
+    __m128 av = _mm_set1_ps(a[r]);                         \
+    c##r##0 = _mm_add_ps(_mm_mul_ps(av, b0), c##r##0);     \
+    c##r##1 = _mm_add_ps(_mm_mul_ps(av, b1), c##r##1);     \
+  }
+#define GEMM_STORE(r)                                      \
+  _mm_store_ps(c + r * GEMM_NR, c##r##0);                  \
+  _mm_store_ps(c + r * GEMM_NR + 4, c##r##1);
+  __m128 c00 = _mm_setzero_ps(), c01 = c00, c10 = c00, c11 = c00, c20 = c00, c21 = c00,
+         c30 = c00, c31 = c00, c40 = c00, c41 = c00, c50 = c00, c51 = c00;
+  for (uint32_t k = 0; k < kc; k++) {
+    __m128 b0 = _mm_load_ps(b);
+    __m128 b1 = _mm_load_ps(b + 4);
+    GEMM_ROW(0) GEMM_ROW(1) GEMM_ROW(2) GEMM_ROW(3) GEMM_ROW(4) GEMM_ROW(5)
+    a += GEMM_MR;
+    b += GEMM_NR;
+  }
+  GEMM_STORE(0) GEMM_STORE(1) GEMM_STORE(2) GEMM_STORE(3) GEMM_STORE(4) GEMM_STORE(5)
+#undef GEMM_ROW
+#undef GEMM_STORE
+
+#elif NEEDLE_ISA == NEEDLE_ISA_NEON
+#define GEMM_ROW(r, alane, lane)                           \
+  c##r##0 = vfmaq_laneq_f32(c##r##0, b0, alane, lane);     \
+  c##r##1 = vfmaq_laneq_f32(c##r##1, b1, alane, lane);
+#define GEMM_STORE(r)                                      \
+  vst1q_f32(c + r * GEMM_NR, c##r##0);                     \
+  vst1q_f32(c + r * GEMM_NR + 4, c##r##1);
+  float32x4_t c00 = vdupq_n_f32(0), c01 = c00, c10 = c00, c11 = c00, c20 = c00, c21 = c00,
+              c30 = c00, c31 = c00, c40 = c00, c41 = c00, c50 = c00, c51 = c00, c60 = c00,
+              c61 = c00, c70 = c00, c71 = c00;
+  for (uint32_t k = 0; k < kc; k++) {
+    float32x4_t a0 = vld1q_f32(a), a1 = vld1q_f32(a + 4);
+    float32x4_t b0 = vld1q_f32(b), b1 = vld1q_f32(b + 4);
+    GEMM_ROW(0, a0, 0) GEMM_ROW(1, a0, 1) GEMM_ROW(2, a0, 2) GEMM_ROW(3, a0, 3)
+    GEMM_ROW(4, a1, 0) GEMM_ROW(5, a1, 1) GEMM_ROW(6, a1, 2) GEMM_ROW(7, a1, 3)
+    a += GEMM_MR;
+    b += GEMM_NR;
+  }
+  GEMM_STORE(0) GEMM_STORE(1) GEMM_STORE(2) GEMM_STORE(3) GEMM_STORE(4) GEMM_STORE(5)
+  GEMM_STORE(6) GEMM_STORE(7)
+#undef GEMM_ROW
+#undef GEMM_STORE
+
+#else
+  // portable fallback, written so that the compiler can vectorize the j loop
+  scalar_t acc[GEMM_MR * GEMM_NR] = {0};
+  for (uint32_t k = 0; k < kc; k++) {
+    for (uint32_t i = 0; i < GEMM_MR; i++) {
+      for (uint32_t j = 0; j < GEMM_NR; j++) acc[i * GEMM_NR + j] += a[i] * b[j];
+    }
+    a += GEMM_MR;
+    b += GEMM_NR;
+  }
+  for (uint32_t i = 0; i < GEMM_MR * GEMM_NR; i++) c[i] = acc[i];
+#endif
+}
+
+/**
+ * Epilogues, applied by the store of the last k-panel while a tile is still in registers/L1:
+ * epilogue(j, x) maps the finished value x of output column j to what is stored.
+ */
+struct NoEpilogue {
+  scalar_t operator()(uint32_t, scalar_t x) const { return x; }
+};
+
+enum EpilogueActivation {
+  // must match EPILOGUE_ACTIVATIONS in ndarray.py
+  ACTIVATION_NONE,
+  ACTIVATION_RELU,
+  ACTIVATION_TANH
+};
+
+struct BiasActivation {
+  // activation(scale * x + bias[j]), the forward pass of a Linear layer (+ ReLU/Tanh)
+  scalar_t operator()(uint32_t j, scalar_t x) const {
+    x = x * scale + (bias != nullptr ? bias[j] : 0);
+    switch (activation) {
+      case ACTIVATION_RELU: return std::max(x, scalar_t(0));
+      case ACTIVATION_TANH: return scalar_t(tanh(x));
+      default: return x;
+    }
+  }
+  const scalar_t* bias;
+  scalar_t scale;
+  int32_t activation;
+};
+
+template <typename CView, typename Epilogue>
+inline void StoreTile(const CView& out, uint32_t i0, uint32_t j0, uint32_t mr, uint32_t nr,
+                      const scalar_t* tile, bool accumulate, bool last,
+                      const Epilogue& epilogue) {
+  /**
+   * Write the valid mr x nr corner of a micro-kernel result back to out, adding to the current
+   * contents for every k-panel after the first, and applying the epilogue on the last one.
+   */
+  for (uint32_t i = 0; i < mr; i++) {
+    const scalar_t* row = tile + i * GEMM_NR;
+    if (!last) {
+      if (accumulate) {
+        for (uint32_t j = 0; j < nr; j++) out(i0 + i, j0 + j) += row[j];
+      } else {
+        for (uint32_t j = 0; j < nr; j++) out(i0 + i, j0 + j) = row[j];
+      }
+    } else if (accumulate) {
+      for (uint32_t j = 0; j < nr; j++)
+        out(i0 + i, j0 + j) = epilogue(j0 + j, out(i0 + i, j0 + j) + row[j]);
+    } else {
+      for (uint32_t j = 0; j < nr; j++) out(i0 + i, j0 + j) = epilogue(j0 + j, row[j]);
+    }
+  }
+}
+
+template <typename AView, typename BView, typename CView, typename Epilogue = NoEpilogue>
+void Gemm(const AView& a, const BView& b, const CView& out, uint32_t m, uint32_t n, uint32_t p,
+          const Epilogue& epilogue = Epilogue()) {
+  /**
+   * out = epilogue(a * b) for an m x n matrix a and an n x p matrix b, accessed through the given
+   * views.
+   *
+   * For each KC x NC panel, the threads first pack b cooperatively (one NR strip per task) into
+   * the calling thread's buffer, then split the output panel into (MC block, group of NR strips)
+   * tasks; each task packs its own block of a into its thread's buffer.
+   */
+  if (n == 0) {
+    for (uint32_t i = 0; i < m; i++)
+      for (uint32_t j = 0; j < p; j++) out(i, j) = epilogue(j, 0);
+    return;
+  }
+  bool parallel = (size_t)m * n * p >= GEMM_PARALLEL_MIN_FLOPS;
+  size_t num_threads = parallel ? Pool().NumThreads() : 1;
+  scalar_t* b_pack = ThreadPackB();
+
+  for (uint32_t j0 = 0; j0 < p; j0 += GEMM_NC) {
+    uint32_t nc = std::min(GEMM_NC, p - j0);
+    size_t num_strips = (nc + GEMM_NR - 1) / GEMM_NR;
+    size_t num_blocks = (m + GEMM_MC - 1) / GEMM_MC;
+    size_t num_groups = std::min(num_strips, (2 * num_threads + num_blocks - 1) / num_blocks);
+    size_t strips_per_group = (num_strips + num_groups - 1) / num_groups;
+    num_groups = (num_strips + strips_per_group - 1) / strips_per_group;
+    size_t num_tasks = num_blocks * num_groups;
+
+    for (uint32_t k0 = 0; k0 < n; k0 += GEMM_KC) {
+      uint32_t kc = std::min(GEMM_KC, n - k0);
+      ParallelFor(num_strips, parallel ? 1 : num_strips, [&](size_t begin, size_t end) {
+        for (size_t s = begin; s < end; s++) {
+          uint32_t jr = s * GEMM_NR;
+          PackB(b, k0, j0 + jr, kc, std::min(GEMM_NR, nc - jr), b_pack + jr * kc);
+        }
+      });
+      ParallelFor(num_tasks, parallel ? 1 : num_tasks, [&](size_t begin, size_t end) {
+        alignas(64) scalar_t tile[GEMM_MR * GEMM_NR];
+        scalar_t* a_pack = ThreadPackA();
+        for (size_t t = begin; t < end; t++) {
+          uint32_t i0 = (t / num_groups) * GEMM_MC;
+          uint32_t mc = std::min(GEMM_MC, m - i0);
+          uint32_t jr_begin = (t % num_groups) * strips_per_group * GEMM_NR;
+          uint32_t jr_end = std::min<uint32_t>(nc, jr_begin + strips_per_group * GEMM_NR);
+          PackA(a, i0, k0, mc, kc, a_pack);
+          for (uint32_t jr = jr_begin; jr < jr_end; jr += GEMM_NR) {
+            const scalar_t* b_strip = b_pack + jr * kc;
+            for (uint32_t ir = 0; ir < mc; ir += GEMM_MR) {
+              MicroKernel(kc, a_pack + ir * kc, b_strip, tile);
+              StoreTile(out, i0 + ir, j0 + jr, std::min(GEMM_MR, mc - ir),
+                        std::min(GEMM_NR, nc - jr), tile, k0 > 0, k0 + kc == n, epilogue);
+            }
+          }
+        }
+      });
+    }
+  }
+}
+
+template <typename Epilogue>
+void GemmItems(const scalar_t* a, size_t a_row, size_t a_col, const scalar_t* b, size_t b_row,
+               size_t b_col, scalar_t* out, uint32_t m, uint32_t n, uint32_t p,
+               const Epilogue& epilogue) {
+  // out (compact, m x p) = epilogue(a * b) for strided a (m x n) and b (n x p)
+  Gemm(StridedView((scalar_t*)a, a_row, a_col), StridedView((scalar_t*)b, b_row, b_col),
+       RowMajorView(out, p), m, n, p, epilogue);
+}
+
+template <typename T, typename Epilogue>
+void GemmItems(const T* a, size_t a_row, size_t a_col, const T* b, size_t b_row, size_t b_col,
+               T* out, uint32_t m, uint32_t n, uint32_t p, const Epilogue& epilogue) {
+  /**
+   * The same on float16/bfloat16 matrices: the packing steps convert a and b to float, and the
+   * product is accumulated over all of n in a float scratch matrix, which is only rounded to out
+   * once it is finished.
+   */
+  AlignedArray acc((size_t)m * p);
+  Gemm(ConvertView<T>(a, a_row, a_col), ConvertView<T>(b, b_row, b_col), RowMajorView(acc.ptr, p),
+       m, n, p, epilogue);
+  ConvertItems(acc.ptr, out, acc.size);
+}
+
+void Matmul(const AlignedArray& a, const AlignedArray& b, AlignedArray* out, uint32_t m, uint32_t n,
+            uint32_t p) {
+  /**
+   * Multiply two (compact) matrices into an output (also compact) matrix.  This goes through the
+   * packed GEMM engine above, which handles any m, n, p (including ones that are not a multiple
+   * of TILE).
+   *
+   * Args:
+   *   a: compact 2D array of size m x n
+   *   b: compact 2D array of size n x p
+   *   out: compact 2D array of size m x p to write the output to
+   *   m: rows of a / out
+   *   n: columns of a / rows of b
+   *   p: columns of b / out
+   */
+  CheckDType(a, *out, "matmul");
+  CheckDType(b, *out, "matmul");
+  if (out->dtype != DTYPE_FLOAT32) {
+    DISPATCH_DTYPE(out->dtype, T,
+                   GemmItems(a.data<T>(), n, 1, b.data<T>(), p, 1, out->data<T>(), m, n, p,
+                             NoEpilogue()));
+    return;
+  }
+  Gemm(RowMajorView(a.ptr, n), RowMajorView(b.ptr, p), RowMajorView(out->ptr, p), m, n, p);
+}
+
+// python3 -m pytest -v -k "matmul_tiled"
+void MatmulTiled(const AlignedArray& a, const AlignedArray& b, AlignedArray* out, uint32_t m,
+                 uint32_t n, uint32_t p) {
+  /**
+   * Matrix multiplication on tiled representations of array.  In this setting, a, b, and out
+   * are all *4D* compact arrays of the appropriate size, e.g. a is an array of size
+   *   a[m/TILE][n/TILE][TILE][TILE]
+   * The tiled layout is read and written directly by the packing and store steps of the GEMM
+   * engine, so no per-tile scratch copies are made.
+   *
+   * Note that this function will only be called when m, n, p are all multiples of TILE, so you can
+   * assume that this division happens without any remainder.
+   *
+   * Args:
+   *   a: compact 4D array of size m/TILE x n/TILE x TILE x TILE
+   *   b: compact 4D array of size n/TILE x p/TILE x TILE x TILE
+   *   out: compact 4D array of size m/TILE x p/TILE x TILE x TILE to write to
+   *   m: rows of a / out
+   *   n: columns of a / rows of b
+   *   p: columns of b / out
+   *
+   */
+  CheckFloat32(a, "matmul_tiled");
+  CheckFloat32(b, "matmul_tiled");
+  CheckFloat32(*out, "matmul_tiled");
+  Gemm(TiledView(a.ptr, n), TiledView(b.ptr, p), TiledView(out->ptr, p), m, n, p);
+}
+
+void MatmulStrided(const AlignedArray& a, const AlignedArray& b, AlignedArray* out, uint32_t m,
+                   uint32_t n, uint32_t p, const std::vector<int32_t>& a_strides, size_t a_offset,
+                   const std::vector<int32_t>& b_strides, size_t b_offset) {
+  /**
+   * Matmul() on possibly non-compact a (m x n, strides a_strides, offset a_offset) and b (n x p),
+   * read in place by the packing step; out is compact.
+   */
+  CheckDType(a, *out, "matmul_strided");
+  CheckDType(b, *out, "matmul_strided");
+  DISPATCH_DTYPE(out->dtype, T,
+                 GemmItems(a.data<T>() + a_offset, a_strides[0], a_strides[1],
+                           b.data<T>() + b_offset, b_strides[0], b_strides[1], out->data<T>(), m,
+                           n, p, NoEpilogue()));
+}
+
+void MatmulEpilogue(const AlignedArray& a, const AlignedArray& b, const AlignedArray* bias,
+                    AlignedArray* out, uint32_t m, uint32_t n, uint32_t p,
+                    const std::vector<int32_t>& a_strides, size_t a_offset,
+                    const std::vector<int32_t>& b_strides, size_t b_offset, int32_t activation,
+                    scalar_t scale) {
+  /**
+   * out = activation(scale * (a @ b) + bias) in one pass: MatmulStrided() with the scale, the
+   * bias (a compact vector of p values added to every row, or None) and the activation applied
+   * to each output tile as it is stored, instead of as separate passes over out.
+   */
+  if (activation < ACTIVATION_NONE || activation > ACTIVATION_TANH)
+    throw std::invalid_argument("matmul_epilogue: unknown activation");
+  CheckDType(a, *out, "matmul_epilogue");
+  CheckDType(b, *out, "matmul_epilogue");
+  std::unique_ptr<AlignedArray> bias_float;
+  if (bias != nullptr && bias->dtype != DTYPE_FLOAT32) {
+    // the epilogue adds the bias in float
+    bias_float.reset(new AlignedArray(bias->size));
+    AsType(*bias, bias_float.get());
+    bias = bias_float.get();
+  }
+  BiasActivation epilogue = {bias != nullptr ? bias->ptr : nullptr, scale, activation};
+  DISPATCH_DTYPE(out->dtype, T,
+                 GemmItems(a.data<T>() + a_offset, a_strides[0], a_strides[1],
+                           b.data<T>() + b_offset, b_strides[0], b_strides[1], out->data<T>(), m,
+                           n, p, epilogue));
+}
+
+void MatmulBatched(const AlignedArray& a, const AlignedArray& b, AlignedArray* out,
+                   const std::vector<int32_t>& batch_shape, uint32_t m, uint32_t n, uint32_t p,
+                   const std::vector<int32_t>& a_strides, size_t a_offset,
+                   const std::vector<int32_t>& b_strides, size_t b_offset) {
+  /**
+   * A batch of products out[z] = a[z] * b[z] over the batch dimensions batch_shape, in one call.
+   * a is a (batch_shape..., m, n) view and b a (batch_shape..., n, p) view, with one stride per
+   * dimension in a_strides / b_strides (a batch stride of 0 broadcasts that operand over the
+   * dimension, e.g. one weight matrix against a batch of inputs); out is compact.
+   *
+   * Products big enough for the GEMM engine to split across the thread pool run one after the
+   * other; smaller ones (e.g. per-head attention scores) are instead spread over the pool a
+   * batch at a time, each running single-threaded.
+   */
+  size_t batch_ndim = batch_shape.size();
+  std::vector<size_t> dims, a_batch, b_batch;
+  size_t batch = 1;
+  for (size_t d = 0; d < batch_ndim; d++) {
+    batch *= batch_shape[d];
+    if (batch_shape[d] == 1) continue;
+    if (!dims.empty() && a_batch.back() == (size_t)a_strides[d] * batch_shape[d] &&
+        b_batch.back() == (size_t)b_strides[d] * batch_shape[d]) {
+      dims.back() *= batch_shape[d];
+      a_batch.back() = a_strides[d];
+      b_batch.back() = b_strides[d];
+    } else {
+      dims.push_back(batch_shape[d]);
+      a_batch.push_back(a_strides[d]);
+      b_batch.push_back(b_strides[d]);
+    }
+  }
+  if (batch == 0) return;
+  CheckDType(a, *out, "matmul_batched");
+  CheckDType(b, *out, "matmul_batched");
+  size_t a_row = a_strides[batch_ndim], a_col = a_strides[batch_ndim + 1];
+  size_t b_row = b_strides[batch_ndim], b_col = b_strides[batch_ndim + 1];
+
+  auto multiply = [&](size_t z) {
+    size_t a_loc = a_offset, b_loc = b_offset;
+    for (size_t d = dims.size(), rest = z; d-- > 0; rest /= dims[d]) {
+      a_loc += rest % dims[d] * a_batch[d];
+      b_loc += rest % dims[d] * b_batch[d];
+    }
+    DISPATCH_DTYPE(out->dtype, T,
+                   GemmItems(a.data<T>() + a_loc, a_row, a_col, b.data<T>() + b_loc, b_row, b_col,
+                             out->data<T>() + z * m * p, m, n, p, NoEpilogue()));
+  };
+  size_t flops = std::max<size_t>(1, (size_t)m * n * p);
+  if (flops >= GEMM_PARALLEL_MIN_FLOPS) {
+    for (size_t z = 0; z < batch; z++) multiply(z);
+  } else {
+    ParallelFor(batch, GEMM_PARALLEL_MIN_FLOPS / flops, [&](size_t begin, size_t end) {
+      for (size_t z = begin; z < end; z++) multiply(z);
+    });
+  }
+}
+
+/**
+ * Quantized (int8) inference.
+ *
+ * A Linear layer's n x p weight is stored transposed, as a p x n int8 matrix with one float32
+ * scale per output channel (row j holds w[:, j] / w_scale[j], rounded), and the activations are
+ * quantized a row at a time on the fly in the same way.  Then every output is an int8 dot product
+ * of a row of a and a row of w, contiguous along k, accumulated exactly in int32 and rescaled
+ * once:
+ *   out[i][j] = activation(acc[i][j] * a_scale[i] * w_scale[j] + bias[j])
+ * or that divided by out_scale and rounded to int8 again (requantized) for an int8 consumer.
+ * The quantization is symmetric, to [-127, 127], so no product overflows 16 bits either.
+ *
+ * The dot products run MR rows of a against NR channels of w at once.  With AVX-512 VNNI,
+ * vpdpbusd multiplies 64 u8 x s8 pairs per instruction; a is flipped to u8 by adding 128, and
+ * 128 * sum_k w[j][k] is subtracted again from each sum.  Whether the processor has it is checked
+ * at run time, since the avx512 copy of the kernels only assumes AVX-512F.  Without it, the int8
+ * values are widened to 16 bits and multiplied pairwise (pmaddwd, or vmull/vpadal on NEON).
+ */
+const uint32_t INT8_BLOCK_M = 64;
+const uint32_t INT8_BLOCK_P = 64;
+
+#if NEEDLE_ISA == NEEDLE_ISA_AVX512 || NEEDLE_ISA == NEEDLE_ISA_AVX2
+typedef __m256i I8Acc;
+typedef __m256i I8Wide;
+const uint32_t INT8_STEP = 16;
+inline I8Acc I8Zero() { return _mm256_setzero_si256(); }
+inline I8Wide I8Widen(const int8_t* p) {
+  return _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)p));
+}
+inline I8Acc I8DotAdd(I8Acc acc, I8Wide a, I8Wide b) {
+  return _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+}
+inline int32_t I8Sum(I8Acc x) {
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+  return _mm_cvtsi128_si32(s);
+}
+#elif NEEDLE_ISA == NEEDLE_ISA_SSE42
+typedef __m128i I8Acc;
+typedef __m128i I8Wide;
+const uint32_t INT8_STEP = 8;
+inline I8Acc I8Zero() { return _mm_setzero_si128(); }
+inline I8Wide I8Widen(const int8_t* p) {
+  return _mm_cvtepi8_epi16(_mm_loadl_epi64((const __m128i*)p));
+}
+inline I8Acc I8DotAdd(I8Acc acc, I8Wide a, I8Wide b) {
+  return _mm_add_epi32(acc, _mm_madd_epi16(a, b));
+}
+inline int32_t I8Sum(I8Acc x) {
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, 0x4e));
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, 0xb1));
+  return _mm_cvtsi128_si32(x);
+}
+#elif NEEDLE_ISA == NEEDLE_ISA_NEON
+typedef int32x4_t I8Acc;
+typedef int8x8_t I8Wide;
+const uint32_t INT8_STEP = 8;
+inline I8Acc I8Zero() { return vdupq_n_s32(0); }
+inline I8Wide I8Widen(const int8_t* p) { return vld1_s8(p); }
+inline I8Acc I8DotAdd(I8Acc acc, I8Wide a, I8Wide b) { return vpadalq_s16(acc, vmull_s8(a, b)); }
+inline int32_t I8Sum(I8Acc x) { return vaddvq_s32(x); }
+#else
+typedef int32_t I8Acc;
+typedef int32_t I8Wide;
+const uint32_t INT8_STEP = 1;
+inline I8Acc I8Zero() { return 0; }
+inline I8Wide I8Widen(const int8_t* p) { return *p; }
+inline I8Acc I8DotAdd(I8Acc acc, I8Wide a, I8Wide b) { return acc + a * b; }
+inline int32_t I8Sum(I8Acc x) { return x; }
+#endif
+
+struct Int8TileWidened {
+  // 2 rows x 4 channels, INT8_STEP values of k at a time
+  enum { MR = 2, NR = 4, STEP = INT8_STEP, UNSIGNED_A = 0 };
+  static int32_t RowSum(const int8_t*, uint32_t) { return 0; }  // a is signed, no compensation
+  void operator()(const int8_t* const* a, const int8_t* const* w, uint32_t len,
+                  int32_t* out) const {
+    /**
+     * out (MR x NR) = the dot products of the rows a[r] and w[c] over their first len values (a
+     * multiple of STEP).
+     */
+#define INT8_COL(c)                                \
+  {                                                \
+    I8Wide wv = I8Widen(w[c] + k);                 \
+    acc0##c = I8DotAdd(acc0##c, a0, wv);           \
+    acc1##c = I8DotAdd(acc1##c, a1, wv);           \
+  }
+#define INT8_STORE(r)                              \
+  out[r * NR] = I8Sum(acc##r##0);                  \
+  out[r * NR + 1] = I8Sum(acc##r##1);              \
+  out[r * NR + 2] = I8Sum(acc##r##2);              \
+  out[r * NR + 3] = I8Sum(acc##r##3);
+    I8Acc acc00 = I8Zero(), acc01 = acc00, acc02 = acc00, acc03 = acc00, acc10 = acc00,
+          acc11 = acc00, acc12 = acc00, acc13 = acc00;
+    for (uint32_t k = 0; k < len; k += STEP) {
+      I8Wide a0 = I8Widen(a[0] + k), a1 = I8Widen(a[1] + k);
+      INT8_COL(0) INT8_COL(1) INT8_COL(2) INT8_COL(3)
+    }
+    INT8_STORE(0) INT8_STORE(1)
+#undef INT8_COL
+#undef INT8_STORE
+  }
+};
+
+#if NEEDLE_ISA == NEEDLE_ISA_AVX512
+#define NEEDLE_VNNI_TARGET __attribute__((target("avx512f,avx512bw,avx512vnni,avx2,fma,f16c")))
+struct Int8TileVnni {
+  // 4 rows x 4 channels, 64 values of k at a time; only called if the processor has VNNI
+  enum { MR = 4, NR = 4, STEP = 64, UNSIGNED_A = 1 };
+  NEEDLE_VNNI_TARGET static int32_t Sum(__m512i x) {
+    // once per tile, so through memory (GCC warns about its own _mm512_reduce_add_epi32)
+    alignas(64) int32_t lanes[16];
+    _mm512_store_si512(lanes, x);
+    int32_t sum = 0;
+    for (int32_t lane : lanes) sum += lane;
+    return sum;
+  }
+  NEEDLE_VNNI_TARGET static int32_t RowSum(const int8_t* w, uint32_t len) {
+    // the sum of w[0:len], as a dot product with ones, for the compensation of the flipped a
+    const __m512i ones = _mm512_set1_epi8(1);
+    __m512i acc = _mm512_setzero_si512();
+    for (uint32_t k = 0; k < len; k += STEP)
+      acc = _mm512_dpbusd_epi32(acc, ones, _mm512_loadu_si512(w + k));
+    return Sum(acc);
+  }
+  NEEDLE_VNNI_TARGET void operator()(const int8_t* const* a, const int8_t* const* w, uint32_t len,
+                  int32_t* out) const {
+#define VNNI_COL(c)                                   \
+  {                                                   \
+    __m512i wv = _mm512_loadu_si512(w[c] + k);        \
+    acc0##c = _mm512_dpbusd_epi32(acc0##c, a0, wv);   \
+    acc1##c = _mm512_dpbusd_epi32(acc1##c, a1, wv);   \
+    acc2##c = _mm512_dpbusd_epi32(acc2##c, a2, wv);   \
+    acc3##c = _mm512_dpbusd_epi32(acc3##c, a3, wv);   \
+  }
+#define VNNI_STORE(r)                                 \
+  out[r * NR] = Sum(acc##r##0);                       \
+  out[r * NR + 1] = Sum(acc##r##1);                   \
+  out[r * NR + 2] = Sum(acc##r##2);                   \
+  out[r * NR + 3] = Sum(acc##r##3);
+    const __m512i flip = _mm512_set1_epi8((char)0x80);
+    __m512i acc00 = _mm512_setzero_si512(), acc01 = acc00, acc02 = acc00, acc03 = acc00,
+            acc10 = acc00, acc11 = acc00, acc12 = acc00, acc13 = acc00, acc20 = acc00,
+            acc21 = acc00, acc22 = acc00, acc23 = acc00, acc30 = acc00, acc31 = acc00,
+            acc32 = acc00, acc33 = acc00;
+    for (uint32_t k = 0; k < len; k += STEP) {
+      __m512i a0 = _mm512_xor_si512(_mm512_loadu_si512(a[0] + k), flip);
+      __m512i a1 = _mm512_xor_si512(_mm512_loadu_si512(a[1] + k), flip);
+      __m512i a2 = _mm512_xor_si512(_mm512_loadu_si512(a[2] + k), flip);
+      __m512i a3 = _mm512_xor_si512(_mm512_loadu_si512(a[3] + k), flip);
+      VNNI_COL(0) VNNI_COL(1) VNNI_COL(2) VNNI_COL(3)
+    }
+    VNNI_STORE(0) VNNI_STORE(1) VNNI_STORE(2) VNNI_STORE(3)
+#undef VNNI_COL
+#undef VNNI_STORE
+  }
+};
+#undef NEEDLE_VNNI_TARGET
+#endif
+
+template <typename Tile, typename Store>
+void GemmInt8(const int8_t* a, const int8_t* w, uint32_t m, uint32_t n, uint32_t p,
+              const Tile& tile, const Store& store) {
+  /**
+   * store(i, j, acc) the int32 dot product acc of row i of a (m x n) and row j of w (p x n), both
+   * compact.  The work is split into INT8_BLOCK_M x INT8_BLOCK_P blocks of the output, ordered so
+   * that the tasks running at the same time mostly share a block of w.  The last few values of k,
+   * short of a whole STEP, and the rows/channels past the last whole tile (which the tile
+   * recomputes from clamped pointers) are finished here.
+   */
+  uint32_t len = n / Tile::STEP * Tile::STEP;
+  size_t row_blocks = (m + INT8_BLOCK_M - 1) / INT8_BLOCK_M;
+  size_t num_tasks = row_blocks * ((p + INT8_BLOCK_P - 1) / INT8_BLOCK_P);
+  bool parallel = (size_t)m * n * p >= GEMM_PARALLEL_MIN_FLOPS;
+  // with an unsigned a (a ^ 0x80 = a + 128), every dot product over the tile's part of k comes
+  // out too large by 128 * sum(w[j]), computed once per channel rather than once per block
+  std::vector<int32_t> comp(Tile::UNSIGNED_A ? p : 0);
+  if (Tile::UNSIGNED_A) {
+    ParallelFor(p, parallel ? 1 : p, [&](size_t begin, size_t end) {
+      for (size_t j = begin; j < end; j++) comp[j] = 128 * Tile::RowSum(w + j * n, len);
+    });
+  }
+  ParallelFor(num_tasks, parallel ? 1 : num_tasks, [&](size_t begin, size_t end) {
+    int32_t acc[Tile::MR * Tile::NR];
+    const int8_t* a_rows[Tile::MR];
+    const int8_t* w_rows[Tile::NR];
+    for (size_t t = begin; t < end; t++) {
+      uint32_t i0 = (t % row_blocks) * INT8_BLOCK_M, i1 = std::min(m, i0 + INT8_BLOCK_M);
+      uint32_t j0 = (t / row_blocks) * INT8_BLOCK_P, j1 = std::min(p, j0 + INT8_BLOCK_P);
+      for (uint32_t jr = j0; jr < j1; jr += Tile::NR) {
+        uint32_t nr = std::min<uint32_t>(Tile::NR, j1 - jr);
+        for (uint32_t c = 0; c < Tile::NR; c++)
+          w_rows[c] = w + (size_t)(jr + std::min(c, nr - 1)) * n;
+        for (uint32_t ir = i0; ir < i1; ir += Tile::MR) {
+          uint32_t mr = std::min<uint32_t>(Tile::MR, i1 - ir);
+          for (uint32_t r = 0; r < Tile::MR; r++)
+            a_rows[r] = a + (size_t)(ir + std::min(r, mr - 1)) * n;
+          tile(a_rows, w_rows, len, acc);
+          for (uint32_t r = 0; r < mr; r++) {
+            for (uint32_t c = 0; c < nr; c++) {
+              int32_t x = acc[r * Tile::NR + c] - (Tile::UNSIGNED_A ? comp[jr + c] : 0);
+              for (uint32_t k = len; k < n; k++) x += a_rows[r][k] * w_rows[c][k];
+              store(ir + r, jr + c, x);
+            }
+          }
+        }
+      }
+    }
+  });
+}
+
+template <typename Store>
+void GemmInt8(const int8_t* a, const int8_t* w, uint32_t m, uint32_t n, uint32_t p,
+              const Store& store) {
+#if NEEDLE_ISA == NEEDLE_ISA_AVX512
+  if (HostCpuFeatures().avx512bw && HostCpuFeatures().avx512vnni) {
+    GemmInt8(a, w, m, n, p, Int8TileVnni(), store);
+    return;
+  }
+#endif
+  GemmInt8(a, w, m, n, p, Int8TileWidened(), store);
+}
+
+void QuantizeRows(const AlignedArray& a, AlignedArray* out, AlignedArray* scales, uint32_t rows,
+                  uint32_t cols) {
+  /**
+   * Quantize each row of the compact rows x cols float32 matrix a to int8, symmetrically:
+   * scales[i] = max_k |a[i][k]| / 127 and out[i][k] = round(a[i][k] / scales[i]).  An all-zero
+   * row gets scale 1.  For a weight, a is its transpose, so that the rows are output channels.
+   */
+  CheckFloat32(a, "quantize_rows");
+  CheckInt8(*out, "quantize_rows");
+  CheckFloat32(*scales, "quantize_rows");
+  ParallelFor(rows, ELEMENTWISE_GRAIN / std::max<uint32_t>(cols, 1), [&](size_t begin,
+                                                                           size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const scalar_t* row = a.ptr + i * cols;
+      int8_t* q = out->data<int8_t>() + i * cols;
+      scalar_t amax = 0;
+      for (uint32_t k = 0; k < cols; k++) amax = std::max(amax, std::fabs(row[k]));
+      scalar_t scale = amax > 0 ? amax / 127 : 1, inv_scale = 1 / scale;
+      for (uint32_t k = 0; k < cols; k++) q[k] = FromFloat<int8_t>(row[k] * inv_scale);
+      scales->ptr[i] = scale;
+    }
+  });
+}
+
+void DequantizeRows(const AlignedArray& a, const AlignedArray& scales, AlignedArray* out,
+                    uint32_t rows, uint32_t cols) {
+  // out[i][k] = a[i][k] * scales[i], the inverse of QuantizeRows() up to rounding
+  CheckInt8(a, "dequantize_rows");
+  CheckFloat32(scales, "dequantize_rows");
+  DISPATCH_DTYPE(out->dtype, T, {
+    T* dst = out->data<T>();
+    ParallelFor(rows, ELEMENTWISE_GRAIN / std::max<uint32_t>(cols, 1), [&](size_t begin,
+                                                                             size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        const int8_t* q = a.data<int8_t>() + i * cols;
+        for (uint32_t k = 0; k < cols; k++)
+          dst[i * cols + k] = FromFloat<T>(q[k] * scales.ptr[i]);
+      }
+    });
+  });
+}
+
+void MatmulInt8(const AlignedArray& a, const AlignedArray& a_scales, const AlignedArray& w,
+                const AlignedArray& w_scales, const AlignedArray* bias, AlignedArray* out,
+                uint32_t m, uint32_t n, uint32_t p, int32_t activation, scalar_t out_scale) {
+  /**
+   * The int8 Linear layer above: a (m x n) and w (p x n) are compact int8 matrices quantized per
+   * row with scales a_scales (m) and w_scales (p); bias is a compact vector of p values or None.
+   * A float out (of any float dtype) gets the rescaled result with the bias and activation
+   * applied; an int8 out gets it requantized, round(result / out_scale).
+   */
+  if (activation < ACTIVATION_NONE || activation > ACTIVATION_TANH)
+    throw std::invalid_argument("matmul_int8: unknown activation");
+  CheckInt8(a, "matmul_int8");
+  CheckInt8(w, "matmul_int8");
+  CheckFloat32(a_scales, "matmul_int8");
+  CheckFloat32(w_scales, "matmul_int8");
+  std::unique_ptr<AlignedArray> bias_float;
+  if (bias != nullptr && bias->dtype != DTYPE_FLOAT32) {
+    bias_float.reset(new AlignedArray(bias->size));
+    AsType(*bias, bias_float.get());
+    bias = bias_float.get();
+  }
+  BiasActivation epilogue = {bias != nullptr ? bias->ptr : nullptr, 1, activation};
+  const scalar_t* a_scale = a_scales.ptr;
+  const scalar_t* w_scale = w_scales.ptr;
+  if (out->dtype == DTYPE_INT8) {
+    if (!(out_scale > 0)) throw std::invalid_argument("matmul_int8: out_scale must be positive");
+    int8_t* dst = out->data<int8_t>();
+    scalar_t inv_scale = 1 / out_scale;
+    GemmInt8(a.data<int8_t>(), w.data<int8_t>(), m, n, p,
+             [=](uint32_t i, uint32_t j, int32_t acc) {
+               scalar_t x = epilogue(j, acc * (a_scale[i] * w_scale[j]));
+               dst[(size_t)i * p + j] = FromFloat<int8_t>(x * inv_scale);
+             });
+    return;
+  }
+  DISPATCH_DTYPE(out->dtype, T, {
+    T* dst = out->data<T>();
+    GemmInt8(a.data<int8_t>(), w.data<int8_t>(), m, n, p,
+             [=](uint32_t i, uint32_t j, int32_t acc) {
+               scalar_t x = epilogue(j, acc * (a_scale[i] * w_scale[j]));
+               dst[(size_t)i * p + j] = FromFloat<T>(x);
+             });
+  });
+}
+
+template <typename T, typename Func>
+inline scalar_t ReduceRange(const T* row, size_t len, Func combine) {
+  // combine over row[0:len] (len >= 1), in float whatever the item type
+  scalar_t res = ToFloat(row[0]);
+  for (size_t j = 1; j < len; j++) res = combine(res, ToFloat(row[j]));
+  return res;
+}
+
+template <typename T, typename Func>
+void ReduceRowItems(const T* a_ptr, T* out_ptr, size_t num_rows, size_t reduce_size,
+                    Func combine) {
+  size_t num_threads = Pool().NumThreads();
+  if (num_rows >= num_threads || reduce_size < 2 * ELEMENTWISE_GRAIN) {
+    size_t grain = std::max<size_t>(1, ELEMENTWISE_GRAIN / std::max<size_t>(reduce_size, 1));
+    ParallelFor(num_rows, grain, [=](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++)
+        out_ptr[i] = FromFloat<T>(ReduceRange(a_ptr + i * reduce_size, reduce_size, combine));
+    });
+    return;
+  }
+  size_t num_slices = std::min(num_threads, reduce_size / ELEMENTWISE_GRAIN);
+  std::vector<scalar_t> partial(num_slices);
+  for (size_t i = 0; i < num_rows; i++) {
+    const T* row = a_ptr + i * reduce_size;
+    ParallelFor(num_slices, 1, [&](size_t begin, size_t end) {
+      for (size_t s = begin; s < end; s++) {
+        size_t lo = s * reduce_size / num_slices, hi = (s + 1) * reduce_size / num_slices;
+        partial[s] = ReduceRange(row + lo, hi - lo, combine);
+      }
+    });
+    out_ptr[i] = FromFloat<T>(ReduceRange(partial.data(), num_slices, combine));
+  }
+}
+
+bool ReduceEmpty(AlignedArray* out, size_t reduce_size, bool is_sum, const char* name) {
+  /**
+   * Whether a reduction of reduce_size items per output has nothing to read.  Then an empty sum
+   * is 0, as in numpy, and out is filled with it (a reused buffer would otherwise be returned
+   * as it is), while an empty max has no identity and raises.
+   */
+  if (out->size == 0) return true;
+  if (reduce_size != 0) return false;
+  if (!is_sum)
+    throw std::invalid_argument(std::string(name) + ": zero-size reduction has no identity");
+  Fill(out, 0);
+  return true;
+}
+
+template <typename Func>
+void ReduceRows(const AlignedArray& a, AlignedArray* out, size_t reduce_size, Func combine) {
+  /**
+   * Reduce each of the out->size contiguous rows of length reduce_size in a with `combine`.
+   * Rows are split across the thread pool; when there are fewer rows than threads (e.g. summing
+   * the whole array into one value) each row is instead split into per-thread slices whose
+   * partial results are combined at the end.  Float16/bfloat16 rows are reduced in float, and
+   * only the result is rounded.
+   */
+  CheckDType(a, *out, "reduce");
+  DISPATCH_DTYPE(out->dtype, T,
+                 ReduceRowItems(a.data<T>(), out->data<T>(), out->size, reduce_size, combine));
+}
+
+// Because summing over individual axes can be a bit tricky, even for compact arrays
+// these functions in Python simplify things by permuting the last axis to be the one reduced over
+// (this is what the reduce_view_out() function in NDArray does), then compacting the array.
+// So for your ReduceMax() and ReduceSum() functions you implement in C++
+// you can assume that both the input and output arrays are contiguous in memory
+// and you want to just reduce over contiguous elements of size reduce_size as passed to the C++ functions.
+// 已经经过了预处理，要reduce的维度总是被排列到了最后一维
+void ReduceMax(const AlignedArray& a, AlignedArray* out, size_t reduce_size) {
+  /**
+   * Reduce by taking maximum over `reduce_size` contiguous blocks.
+   *
+   * Args:
+   *   a: compact array of size a.size = out.size * reduce_size to reduce over
+   *   out: compact array to write into
+   *   reduce_size: size of the dimension to reduce over
+   */
+
+  /// BEGIN SOLUTION
+  if (ReduceEmpty(out, reduce_size, false, "reduce_max")) return;
+  ReduceRows(a, out, reduce_size, [](scalar_t x, scalar_t y) { return std::max(x, y); });
+  /// END SOLUTION
+}
+
+void ReduceSum(const AlignedArray& a, AlignedArray* out, size_t reduce_size) {
+  /**
+   * Reduce by taking sum over `reduce_size` contiguous blocks.
+   *
+   * Args:
+   *   a: compact array of size a.size = out.size * reduce_size to reduce over
+   *   out: compact array to write into
+   *   reduce_size: size of the dimension to reduce over
+   */
+
+  /// BEGIN SOLUTION
+  if (ReduceEmpty(out, reduce_size, true, "reduce_sum")) return;
+  ReduceRows(a, out, reduce_size, [](scalar_t x, scalar_t y) { return x + y; });
+  /// END SOLUTION
+}
+
+template <typename Func>
+void ReduceStrided(const AlignedArray& a, AlignedArray* out, const std::vector<int32_t>& shape,
+                   const std::vector<int32_t>& strides, size_t offset, Func combine) {
+  /**
+   * Reduce a strided view over its last dimension, reading it in place.  The outer dimensions
+   * are collapsed like in Compact().  When the reduced dimension is not unit-stride (e.g. summing
+   * over axis 0 of a row-major matrix) each row of outputs is accumulated one input row at a
+   * time, so the inner loop still runs along memory instead of jumping by the reduced stride.
+   */
+  CheckFloat32(a, "reduce_strided");
+  std::vector<int32_t> outer_shape(shape.begin(), shape.end() - 1);
+  std::vector<int32_t> outer_strides(strides.begin(), strides.end() - 1);
+  StridedLayout layout = CollapseLayout(outer_shape, outer_strides, offset);
+  size_t reduce_size = shape.back(), reduce_stride = strides.back();
+  size_t inner = layout.shape.back(), inner_stride = layout.strides.back();
+  const scalar_t* a_ptr = a.ptr;
+  scalar_t* out_ptr = out->ptr;
+  if (out->size == 0 || reduce_size == 0) return;
+
+  ForEachRowPair(layout, layout, inner * reduce_size, [=](size_t row, size_t loc, size_t) {
+    scalar_t* dst = out_ptr + row * inner;
+    const scalar_t* src = a_ptr + loc;
+    if (reduce_stride == 1 || inner == 1) {
+      for (size_t j = 0; j < inner; j++) {
+        const scalar_t* s = src + j * inner_stride;
+        scalar_t res = s[0];
+        for (size_t k = 1; k < reduce_size; k++) res = combine(res, s[k * reduce_stride]);
+        dst[j] = res;
+      }
+      return;
+    }
+    for (size_t j = 0; j < inner; j++) dst[j] = src[j * inner_stride];
+    for (size_t k = 1; k < reduce_size; k++) {
+      const scalar_t* s = src + k * reduce_stride;
+      if (inner_stride == 1) {
+        for (size_t j = 0; j < inner; j++) dst[j] = combine(dst[j], s[j]);
+      } else {
+        for (size_t j = 0; j < inner; j++) dst[j] = combine(dst[j], s[j * inner_stride]);
+      }
+    }
+  });
+}
+
+void ReduceMaxStrided(const AlignedArray& a, AlignedArray* out, const std::vector<int32_t>& shape,
+                      const std::vector<int32_t>& strides, size_t offset) {
+  // ReduceMax() over the last dimension of a non-compact view of a
+  if (ReduceEmpty(out, shape.back(), false, "reduce_max_strided")) return;
+  ReduceStrided(a, out, shape, strides, offset,
+                [](scalar_t x, scalar_t y) { return std::max(x, y); });
+}
+
+void ReduceSumStrided(const AlignedArray& a, AlignedArray* out, const std::vector<int32_t>& shape,
+                      const std::vector<int32_t>& strides, size_t offset) {
+  // ReduceSum() over the last dimension of a non-compact view of a
+  if (ReduceEmpty(out, shape.back(), true, "reduce_sum_strided")) return;
+  ReduceStrided(a, out, shape, strides, offset, [](scalar_t x, scalar_t y) { return x + y; });
+}
+
+// Output columns reduced together by one task of ReduceAxis(), sized to keep them in L1
+const size_t REDUCE_COLUMN_BLOCK = 1024;
+
+template <typename T, typename Func>
+void ReduceAxisItems(const T* a_ptr, T* out_ptr, size_t outer, size_t reduce_size, size_t inner,
+                     Func combine) {
+  size_t col_blocks = (inner + REDUCE_COLUMN_BLOCK - 1) / REDUCE_COLUMN_BLOCK;
+  size_t block_cost = std::min(inner, REDUCE_COLUMN_BLOCK) * reduce_size;
+  ParallelFor(outer * col_blocks, std::max<size_t>(1, ELEMENTWISE_GRAIN / block_cost),
+              [=](size_t begin, size_t end) {
+    alignas(64) scalar_t acc[REDUCE_COLUMN_BLOCK], row[REDUCE_COLUMN_BLOCK];
+    for (size_t task = begin; task < end; task++) {
+      size_t o = task / col_blocks;
+      size_t j0 = (task % col_blocks) * REDUCE_COLUMN_BLOCK;
+      size_t len = std::min(inner - j0, REDUCE_COLUMN_BLOCK);
+      const T* src = a_ptr + o * reduce_size * inner + j0;
+      ConvertRow(src, acc, len);
+      for (size_t r = 1; r < reduce_size; r++) {
+        ConvertRow(src + r * inner, row, len);
+        for (size_t j = 0; j < len; j++) acc[j] = combine(acc[j], row[j]);
+      }
+      ConvertRow(acc, out_ptr + o * inner + j0, len);
+    }
+  });
+}
+
+template <typename Func>
+void ReduceAxis(const AlignedArray& a, AlignedArray* out, size_t outer, size_t reduce_size,
+                size_t inner, Func combine) {
+  /**
+   * Reduce a compact array viewed as (outer, reduce_size, inner) over its middle axis, into a
+   * compact (outer, inner) out, without permuting the reduced axis to the end first.  For
+   * inner > 1 every (outer index, block of REDUCE_COLUMN_BLOCK columns) is one task, which
+   * accumulates the reduce_size input rows of the block one after another; all the reads and
+   * writes then run along memory, and even outer == 1 (e.g. reducing axis 0 of a matrix) is
+   * split across the pool.
+   */
+  if (inner == 1) {
+    ReduceRows(a, out, reduce_size, combine);
+    return;
+  }
+  if (out->size == 0 || reduce_size == 0) return;
+  if (out->dtype != DTYPE_FLOAT32) {
+    // accumulated in float scratch rows instead of in out
+    CheckDType(a, *out, "reduce_axis");
+    DISPATCH_DTYPE(out->dtype, T,
+                   ReduceAxisItems(a.data<T>(), out->data<T>(), outer, reduce_size, inner,
+                                   combine));
+    return;
+  }
+  const scalar_t* a_ptr = a.ptr;
+  scalar_t* out_ptr = out->ptr;
+  size_t col_blocks = (inner + REDUCE_COLUMN_BLOCK - 1) / REDUCE_COLUMN_BLOCK;
+  size_t block_cost = std::min(inner, REDUCE_COLUMN_BLOCK) * reduce_size;
+  ParallelFor(outer * col_blocks, std::max<size_t>(1, ELEMENTWISE_GRAIN / block_cost),
+              [=](size_t begin, size_t end) {
+    for (size_t task = begin; task < end; task++) {
+      size_t o = task / col_blocks;
+      size_t j0 = (task % col_blocks) * REDUCE_COLUMN_BLOCK;
+      size_t len = std::min(inner - j0, REDUCE_COLUMN_BLOCK);
+      scalar_t* dst = out_ptr + o * inner + j0;
+      const scalar_t* src = a_ptr + o * reduce_size * inner + j0;
+      std::memcpy(dst, src, len * ELEM_SIZE);
+      for (size_t r = 1; r < reduce_size; r++) {
+        const scalar_t* s = src + r * inner;
+        for (size_t j = 0; j < len; j++) dst[j] = combine(dst[j], s[j]);
+      }
+    }
+  });
+}
+
+void ReduceMaxAxis(const AlignedArray& a, AlignedArray* out, size_t outer, size_t reduce_size,
+                   size_t inner) {
+  // ReduceMax() over the middle axis of a viewed as (outer, reduce_size, inner)
+  if (ReduceEmpty(out, reduce_size, false, "reduce_max_axis")) return;
+  ReduceAxis(a, out, outer, reduce_size, inner,
+             [](scalar_t x, scalar_t y) { return std::max(x, y); });
+}
+
+void ReduceSumAxis(const AlignedArray& a, AlignedArray* out, size_t outer, size_t reduce_size,
+                   size_t inner) {
+  // ReduceSum() over the middle axis of a viewed as (outer, reduce_size, inner)
+  if (ReduceEmpty(out, reduce_size, true, "reduce_sum_axis")) return;
+  ReduceAxis(a, out, outer, reduce_size, inner, [](scalar_t x, scalar_t y) { return x + y; });
+}
+
+/**
+ * The softmax family over the middle axis of a compact (outer, reduce_size, inner) array:
+ * logsumexp, log-softmax and softmax, plus softmax cross-entropy against integer labels.
+ *
+ * Each row's statistics come from a single online pass: a running max m and a running sum s of
+ * exp(x - m), rescaled by exp(m_old - m_new) whenever the max grows.  Every exponent is <= 0, so
+ * this is as stable as subtracting the max first, but reads the input once and allocates
+ * nothing.  The normalized outputs take one more pass over the row while it is still in cache.
+ * As in ReduceAxis(), inner > 1 runs over blocks of REDUCE_COLUMN_BLOCK columns at a time.
+ */
+enum SoftmaxMode { SOFTMAX_LOGSUMEXP, SOFTMAX_LOG, SOFTMAX_PROB };
+
+struct OnlineLogSumExp {
+  OnlineLogSumExp() : max(-INFINITY), sum(0) {}
+  void Add(scalar_t x) {
+    if (x == -INFINITY) return;  // adds nothing, and exp(-inf - -inf) would be NaN
+    if (x > max) {
+      sum = sum * std::exp(max - x) + 1;
+      max = x;
+    } else {
+      sum += std::exp(x - max);
+    }
+  }
+  scalar_t Value() const { return max + std::log(sum); }
+  scalar_t max, sum;
+};
+
+inline scalar_t SoftmaxOutput(scalar_t x, scalar_t lse, int mode) {
+  // a row of only -inf (fully masked) has probabilities 0, where x - lse would be NaN
+  if (lse == -INFINITY) return mode == SOFTMAX_LOG ? -INFINITY : 0;
+  return mode == SOFTMAX_LOG ? x - lse : std::exp(x - lse);
+}
+
+void SoftmaxAxis(const AlignedArray& a, AlignedArray* out, size_t outer, size_t reduce_size,
+                 size_t inner, int mode) {
+  /**
+   * Args:
+   *   out: (outer, inner) for SOFTMAX_LOGSUMEXP, otherwise the same shape as a
+   */
+  CheckFloat32(a, "softmax");
+  if (outer * inner == 0 || reduce_size == 0) return;
+  const scalar_t* a_ptr = a.ptr;
+  scalar_t* out_ptr = out->ptr;
+
+  if (inner == 1) {
+    ParallelFor(outer, std::max<size_t>(1, ELEMENTWISE_GRAIN / reduce_size),
+                [=](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        const scalar_t* row = a_ptr + i * reduce_size;
+        OnlineLogSumExp stats;
+        for (size_t j = 0; j < reduce_size; j++) stats.Add(row[j]);
+        scalar_t lse = stats.Value();
+        if (mode == SOFTMAX_LOGSUMEXP) {
+          out_ptr[i] = lse;
+        } else {
+          scalar_t* dst = out_ptr + i * reduce_size;
+          for (size_t j = 0; j < reduce_size; j++) dst[j] = SoftmaxOutput(row[j], lse, mode);
+        }
+      }
+    });
+    return;
+  }
+
+  size_t col_blocks = (inner + REDUCE_COLUMN_BLOCK - 1) / REDUCE_COLUMN_BLOCK;
+  size_t block_cost = std::min(inner, REDUCE_COLUMN_BLOCK) * reduce_size;
+  ParallelFor(outer * col_blocks, std::max<size_t>(1, ELEMENTWISE_GRAIN / block_cost),
+              [=](size_t begin, size_t end) {
+    OnlineLogSumExp stats[REDUCE_COLUMN_BLOCK];
+    scalar_t lse[REDUCE_COLUMN_BLOCK];
+    for (size_t task = begin; task < end; task++) {
+      size_t o = task / col_blocks;
+      size_t j0 = (task % col_blocks) * REDUCE_COLUMN_BLOCK;
+      size_t len = std::min(inner - j0, REDUCE_COLUMN_BLOCK);
+      const scalar_t* src = a_ptr + o * reduce_size * inner + j0;
+      for (size_t j = 0; j < len; j++) stats[j] = OnlineLogSumExp();
+      for (size_t r = 0; r < reduce_size; r++)
+        for (size_t j = 0; j < len; j++) stats[j].Add(src[r * inner + j]);
+      for (size_t j = 0; j < len; j++) lse[j] = stats[j].Value();
+      if (mode == SOFTMAX_LOGSUMEXP) {
+        std::memcpy(out_ptr + o * inner + j0, lse, len * ELEM_SIZE);
+        continue;
+      }
+      scalar_t* dst = out_ptr + o * reduce_size * inner + j0;
+      for (size_t r = 0; r < reduce_size; r++)
+        for (size_t j = 0; j < len; j++)
+          dst[r * inner + j] = SoftmaxOutput(src[r * inner + j], lse[j], mode);
+    }
+  });
+}
+
+void LogSumExpAxis(const AlignedArray& a, AlignedArray* out, size_t outer, size_t reduce_size,
+                   size_t inner) {
+  SoftmaxAxis(a, out, outer, reduce_size, inner, SOFTMAX_LOGSUMEXP);
+}
+
+void LogSoftmaxAxis(const AlignedArray& a, AlignedArray* out, size_t outer, size_t reduce_size,
+                    size_t inner) {
+  SoftmaxAxis(a, out, outer, reduce_size, inner, SOFTMAX_LOG);
+}
+
+void SoftmaxProbAxis(const AlignedArray& a, AlignedArray* out, size_t outer, size_t reduce_size,
+                     size_t inner) {
+  SoftmaxAxis(a, out, outer, reduce_size, inner, SOFTMAX_PROB);
+}
+
+void SoftmaxCrossEntropy(const AlignedArray& logits, const AlignedArray& labels,
+                         AlignedArray* loss, AlignedArray* grad, size_t rows, size_t classes) {
+  /**
+   * Per-row cross-entropy of softmax(logits) against integer labels:
+   *   loss[i] = logsumexp(logits[i]) - logits[i, labels[i]]
+   * and, unless grad is None, its gradient with respect to the logits,
+   *   grad[i] = softmax(logits[i]) - one_hot(labels[i]),
+   * from the same online pass, so the loss and backward need neither a one-hot matrix nor any
+   * intermediates.
+   *
+   * Args:
+   *   logits: compact rows x classes array
+   *   labels: rows class indices (stored as floats, like every needle array)
+   *   loss: rows output values
+   *   grad: rows x classes output array, or None
+   */
+  CheckFloat32(logits, "softmax_cross_entropy");
+  const scalar_t* logits_ptr = logits.ptr;
+  const scalar_t* labels_ptr = labels.ptr;
+  scalar_t* loss_ptr = loss->ptr;
+  scalar_t* grad_ptr = grad != nullptr ? grad->ptr : nullptr;
+  ParallelFor(rows, std::max<size_t>(1, ELEMENTWISE_GRAIN / std::max<size_t>(classes, 1)),
+              [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const scalar_t* row = logits_ptr + i * classes;
+      scalar_t label = labels_ptr[i];
+      if (!(label >= 0 && label < classes) || label != std::floor(label))
+        throw std::invalid_argument("softmax_cross_entropy: label out of range");
+      size_t y = (size_t)label;
+      OnlineLogSumExp stats;
+      for (size_t j = 0; j < classes; j++) stats.Add(row[j]);
+      scalar_t lse = stats.Value();
+      loss_ptr[i] = lse - row[y];
+      if (grad_ptr != nullptr) {
+        scalar_t* dst = grad_ptr + i * classes;
+        for (size_t j = 0; j < classes; j++) dst[j] = std::exp(row[j] - lse);
+        dst[y] -= 1;
+      }
+    }
+  });
+}
+
+/**
+ * Normalization layers over a compact rows x dim array,
+ *   out = (x - mean) * inv_std * weight + bias,  inv_std = 1 / sqrt(var + eps),
+ * with the statistics taken over each row (LayerNorm) or over each column (BatchNorm).  The
+ * statistics come from a single Welford pass (a running count, mean and sum of squared
+ * deviations m2, which does not cancel the way sum(x^2) - sum(x)^2 does), and mean and inv_std
+ * are saved for the backward pass, which with xhat = (x - mean) * inv_std and
+ * dy = grad_out * weight is
+ *   grad_x = inv_std * (dy - mean(dy) - xhat * mean(dy * xhat))
+ * along the normalized axis, and grad_weight = sum(grad_out * xhat), grad_bias = sum(grad_out)
+ * along the other.  weight and bias may be None for a normalization without affine transform.
+ */
+struct Welford {
+  Welford() : count(0), mean(0), m2(0) {}
+  void Add(scalar_t x) {
+    count += 1;
+    scalar_t delta = x - mean;
+    mean += delta / count;
+    m2 += delta * (x - mean);
+  }
+  void Merge(const Welford& other) {
+    // Chan et al.'s pairwise update, for statistics accumulated over separate chunks of rows
+    if (other.count == 0) return;
+    scalar_t total = count + other.count;
+    scalar_t delta = other.mean - mean;
+    mean += delta * (other.count / total);
+    m2 += other.m2 + delta * delta * (count * other.count / total);
+    count = total;
+  }
+  scalar_t Variance() const { return m2 / count; }
+  scalar_t count, mean, m2;
+};
+
+struct GradSums {
+  GradSums() : grad(0), grad_xhat(0) {}
+  void Merge(const GradSums& other) {
+    grad += other.grad;
+    grad_xhat += other.grad_xhat;
+  }
+  scalar_t grad, grad_xhat;
+};
+
+inline scalar_t Affine(scalar_t xhat, const scalar_t* weight, const scalar_t* bias, size_t j) {
+  return (weight != nullptr ? xhat * weight[j] : xhat) + (bias != nullptr ? bias[j] : 0);
+}
+
+template <typename Stat, typename AddRow>
+std::vector<Stat> ColumnStatistics(size_t rows, size_t dim, const AddRow& add_row) {
+  /**
+   * Per-column statistics of a rows x dim array.  The rows are split into at most 4 chunks per
+   * thread, each chunk accumulates its own dim Stats with add_row(stats, r) for each of its rows
+   * (reading along memory), and the chunks are then merged in order, so that even a few long
+   * columns (a batch of many samples of few features) keep the whole pool busy.
+   */
+  size_t chunks = std::min(std::min(rows, 4 * Pool().NumThreads()),
+                           std::max<size_t>(1, rows * dim / ELEMENTWISE_GRAIN));
+  chunks = std::max<size_t>(chunks, 1);
+  std::vector<Stat> partial(chunks * dim);
+  ParallelFor(chunks, 1, [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; c++) {
+      Stat* stats = partial.data() + c * dim;
+      for (size_t r = c * rows / chunks; r < (c + 1) * rows / chunks; r++) add_row(stats, r);
+    }
+  });
+  for (size_t c = 1; c < chunks; c++)
+    for (size_t j = 0; j < dim; j++) partial[j].Merge(partial[c * dim + j]);
+  partial.resize(dim);
+  return partial;
+}
+
+void LayerNormForward(const AlignedArray& x, const AlignedArray* weight, const AlignedArray* bias,
+                      AlignedArray* out, AlignedArray* mean, AlignedArray* inv_std, size_t rows,
+                      size_t dim, scalar_t eps) {
+  /**
+   * Normalize each row of x over its dim items.
+   *
+   * Args:
+   *   weight, bias: dim items, or None
+   *   out: rows x dim output
+   *   mean, inv_std: rows outputs, saved for LayerNormBackward()
+   */
+  CheckFloat32(x, "layer_norm_forward");
+  if (rows == 0 || dim == 0) return;
+  const scalar_t* x_ptr = x.ptr;
+  const scalar_t* w_ptr = weight != nullptr ? weight->ptr : nullptr;
+  const scalar_t* b_ptr = bias != nullptr ? bias->ptr : nullptr;
+  scalar_t* out_ptr = out->ptr;
+  scalar_t* mean_ptr = mean->ptr;
+  scalar_t* inv_std_ptr = inv_std->ptr;
+  ParallelFor(rows, std::max<size_t>(1, ELEMENTWISE_GRAIN / dim), [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const scalar_t* row = x_ptr + i * dim;
+      Welford stats;
+      for (size_t j = 0; j < dim; j++) stats.Add(row[j]);
+      scalar_t m = stats.mean, s = 1 / std::sqrt(stats.Variance() + eps);
+      mean_ptr[i] = m;
+      inv_std_ptr[i] = s;
+      scalar_t* dst = out_ptr + i * dim;
+      for (size_t j = 0; j < dim; j++) dst[j] = Affine((row[j] - m) * s, w_ptr, b_ptr, j);
+    }
+  });
+}
+
+void LayerNormBackward(const AlignedArray& grad_out, const AlignedArray& x,
+                       const AlignedArray* weight, const AlignedArray& mean,
+                       const AlignedArray& inv_std, AlignedArray* grad_x,
+                       AlignedArray* grad_weight, AlignedArray* grad_bias, size_t rows,
+                       size_t dim) {
+  /**
+   * Gradients of LayerNormForward() with respect to x (rows x dim) and to weight and bias (dim
+   * items each, computed whether or not the forward pass had them), from its saved mean and
+   * inv_std.
+   */
+  CheckFloat32(x, "layer_norm_backward");
+  if (rows == 0 || dim == 0) return;
+  const scalar_t* g_ptr = grad_out.ptr;
+  const scalar_t* x_ptr = x.ptr;
+  const scalar_t* w_ptr = weight != nullptr ? weight->ptr : nullptr;
+  const scalar_t* mean_ptr = mean.ptr;
+  const scalar_t* inv_std_ptr = inv_std.ptr;
+  scalar_t* dx_ptr = grad_x->ptr;
+  ParallelFor(rows, std::max<size_t>(1, ELEMENTWISE_GRAIN / dim), [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const scalar_t* g = g_ptr + i * dim;
+      const scalar_t* row = x_ptr + i * dim;
+      scalar_t m = mean_ptr[i], s = inv_std_ptr[i];
+      scalar_t sum_dy = 0, sum_dy_xhat = 0;
+      for (size_t j = 0; j < dim; j++) {
+        scalar_t dy = w_ptr != nullptr ? g[j] * w_ptr[j] : g[j];
+        sum_dy += dy;
+        sum_dy_xhat += dy * (row[j] - m) * s;
+      }
+      scalar_t mean_dy = sum_dy / dim, mean_dy_xhat = sum_dy_xhat / dim;
+      scalar_t* dx = dx_ptr + i * dim;
+      for (size_t j = 0; j < dim; j++) {
+        scalar_t dy = w_ptr != nullptr ? g[j] * w_ptr[j] : g[j];
+        dx[j] = s * (dy - mean_dy - (row[j] - m) * s * mean_dy_xhat);
+      }
+    }
+  });
+
+  std::vector<GradSums> sums =
+      ColumnStatistics<GradSums>(rows, dim, [=](GradSums* stats, size_t r) {
+        const scalar_t* g = g_ptr + r * dim;
+        const scalar_t* row = x_ptr + r * dim;
+        scalar_t m = mean_ptr[r], s = inv_std_ptr[r];
+        for (size_t j = 0; j < dim; j++) {
+          stats[j].grad += g[j];
+          stats[j].grad_xhat += g[j] * (row[j] - m) * s;
+        }
+      });
+  for (size_t j = 0; j < dim; j++) {
+    grad_weight->ptr[j] = sums[j].grad_xhat;
+    grad_bias->ptr[j] = sums[j].grad;
+  }
+}
+
+void BatchNormForward(const AlignedArray& x, const AlignedArray* weight, const AlignedArray* bias,
+                      AlignedArray* out, AlignedArray* mean, AlignedArray* inv_std,
+                      AlignedArray* running_mean, AlignedArray* running_var, size_t rows,
+                      size_t dim, scalar_t eps, scalar_t momentum, bool training) {
+  /**
+   * Normalize each column of x over the batch of its rows items.  In training mode the batch
+   * statistics are used, and the running statistics (if not None) are updated from them as
+   *   running = (1 - momentum) * running + momentum * batch_statistic,
+   * with the biased batch variance, as in nn.BatchNorm1d.  Otherwise the running statistics
+   * are used, and must be given.
+   *
+   * Args:
+   *   weight, bias: dim items, or None
+   *   out: rows x dim output
+   *   mean, inv_std: dim outputs, saved for BatchNormBackward()
+   *   running_mean, running_var: dim items, updated in place in training mode
+   */
+  CheckFloat32(x, "batch_norm_forward");
+  if (dim == 0) return;
+  if (!training && (running_mean == nullptr || running_var == nullptr))
+    throw std::invalid_argument("batch_norm_forward: evaluation needs the running statistics");
+  const scalar_t* x_ptr = x.ptr;
+  const scalar_t* w_ptr = weight != nullptr ? weight->ptr : nullptr;
+  const scalar_t* b_ptr = bias != nullptr ? bias->ptr : nullptr;
+  scalar_t* out_ptr = out->ptr;
+  scalar_t* mean_ptr = mean->ptr;
+  scalar_t* inv_std_ptr = inv_std->ptr;
+  if (training) {
+    if (rows == 0) return;
+    std::vector<Welford> stats = ColumnStatistics<Welford>(rows, dim, [=](Welford* s, size_t r) {
+      const scalar_t* row = x_ptr + r * dim;
+      for (size_t j = 0; j < dim; j++) s[j].Add(row[j]);
+    });
+    for (size_t j = 0; j < dim; j++) {
+      scalar_t var = stats[j].Variance();
+      mean_ptr[j] = stats[j].mean;
+      inv_std_ptr[j] = 1 / std::sqrt(var + eps);
+      if (running_mean != nullptr)
+        running_mean->ptr[j] = (1 - momentum) * running_mean->ptr[j] + momentum * stats[j].mean;
+      if (running_var != nullptr)
+        running_var->ptr[j] = (1 - momentum) * running_var->ptr[j] + momentum * var;
+    }
+  } else {
+    for (size_t j = 0; j < dim; j++) {
+      mean_ptr[j] = running_mean->ptr[j];
+      inv_std_ptr[j] = 1 / std::sqrt(running_var->ptr[j] + eps);
+    }
+  }
+  ParallelFor(rows, std::max<size_t>(1, ELEMENTWISE_GRAIN / dim), [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const scalar_t* row = x_ptr + i * dim;
+      scalar_t* dst = out_ptr + i * dim;
+      for (size_t j = 0; j < dim; j++)
+        dst[j] = Affine((row[j] - mean_ptr[j]) * inv_std_ptr[j], w_ptr, b_ptr, j);
+    }
+  });
+}
+
+void BatchNormBackward(const AlignedArray& grad_out, const AlignedArray& x,
+                       const AlignedArray* weight, const AlignedArray& mean,
+                       const AlignedArray& inv_std, AlignedArray* grad_x,
+                       AlignedArray* grad_weight, AlignedArray* grad_bias, size_t rows,
+                       size_t dim, bool training) {
+  /**
+   * Gradients of BatchNormForward() with respect to x (rows x dim) and to weight and bias (dim
+   * items each), from its saved mean and inv_std.  In evaluation mode the statistics are
+   * constants, and grad_x is just grad_out * weight * inv_std.
+   */
+  CheckFloat32(x, "batch_norm_backward");
+  if (rows == 0 || dim == 0) return;
+  const scalar_t* g_ptr = grad_out.ptr;
+  const scalar_t* x_ptr = x.ptr;
+  const scalar_t* w_ptr = weight != nullptr ? weight->ptr : nullptr;
+  const scalar_t* mean_ptr = mean.ptr;
+  const scalar_t* inv_std_ptr = inv_std.ptr;
+  scalar_t* dx_ptr = grad_x->ptr;
+  scalar_t* dw_ptr = grad_weight->ptr;
+  scalar_t* db_ptr = grad_bias->ptr;
+
+  std::vector<GradSums> sums =
+      ColumnStatistics<GradSums>(rows, dim, [=](GradSums* stats, size_t r) {
+        const scalar_t* g = g_ptr + r * dim;
+        const scalar_t* row = x_ptr + r * dim;
+        for (size_t j = 0; j < dim; j++) {
+          stats[j].grad += g[j];
+          stats[j].grad_xhat += g[j] * (row[j] - mean_ptr[j]) * inv_std_ptr[j];
+        }
+      });
+  for (size_t j = 0; j < dim; j++) {
+    dw_ptr[j] = sums[j].grad_xhat;
+    db_ptr[j] = sums[j].grad;
+  }
+  scalar_t keep = training ? 1 : 0;
+  ParallelFor(rows, std::max<size_t>(1, ELEMENTWISE_GRAIN / dim), [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const scalar_t* g = g_ptr + i * dim;
+      const scalar_t* row = x_ptr + i * dim;
+      scalar_t* dx = dx_ptr + i * dim;
+      for (size_t j = 0; j < dim; j++) {
+        scalar_t s = inv_std_ptr[j], w = w_ptr != nullptr ? w_ptr[j] : 1;
+        scalar_t xhat = (row[j] - mean_ptr[j]) * s;
+        dx[j] = s * w * (g[j] - keep * (db_ptr[j] + xhat * dw_ptr[j]) / rows);
+      }
+    }
+  });
+}
+
+/**
+ * Optimizer steps, updating the parameters and their state in place in one pass over the items,
+ * with the rules of needle.optim (weight decay added to the gradient):
+ *   SGD:   g = grad + weight_decay * param,  u = momentum * u + (1 - momentum) * g,
+ *          param -= lr * u
+ *   Adam:  g as above,  m = beta1 * m + (1 - beta1) * g,  v = beta2 * v + (1 - beta2) * g^2,
+ *          param -= lr * (m / (1 - beta1^t)) / (sqrt(v / (1 - beta2^t)) + eps)
+ * The multi_ variants take lists of tensors (compact, float32) and run all of them in a single
+ * ParallelFor over their concatenated items, so that a model of many small layers pays for one
+ * dispatch per step rather than for a few per parameter.  The updates are written once over the
+ * V* primitives, for VEC_WIDTH items at a time and for the single items at the ends.
+ */
+std::vector<size_t> TensorListStarts(const std::vector<const std::vector<AlignedArray*>*>& lists,
+                                     const char* kernel) {
+  // where each tensor starts in the concatenation, after checking that the lists match
+  const std::vector<AlignedArray*>& first = *lists[0];
+  for (const std::vector<AlignedArray*>* list : lists) {
+    if (list->size() != first.size())
+      throw std::invalid_argument(std::string(kernel) + ": the lists differ in length");
+    for (size_t t = 0; t < first.size(); t++) {
+      CheckFloat32(*(*list)[t], kernel);
+      if ((*list)[t]->size != first[t]->size)
+        throw std::invalid_argument(std::string(kernel) + ": tensor " + std::to_string(t) +
+                                    " differs in size from its parameter");
+    }
+  }
+  std::vector<size_t> starts(first.size() + 1, 0);
+  for (size_t t = 0; t < first.size(); t++) starts[t + 1] = starts[t] + first[t]->size;
+  return starts;
+}
+
+template <typename Update>
+void ForEachTensorRange(const std::vector<size_t>& starts, Update update) {
+  // update(t, begin, end) for items [begin, end) of tensor t, over all the tensors at once
+  ParallelFor(starts.back(), ELEMENTWISE_GRAIN, [&](size_t begin, size_t end) {
+    size_t t = std::upper_bound(starts.begin(), starts.end(), begin) - starts.begin() - 1;
+    for (; begin < end; t++) {
+      size_t stop = std::min(end, starts[t + 1]);
+      if (stop > begin) update(t, begin - starts[t], stop - starts[t]);
+      begin = stop;
+    }
+  });
+}
+
+struct OptimizerConsts {
+  scalar_t lr, momentum, weight_decay;           // SGD
+  scalar_t beta1, beta2, eps, m_scale, v_scale;  // and Adam, m_scale = 1 / (1 - beta1^t) etc.
+};
+
+template <typename V>
+inline void SgdUpdate(V& p, V g, V& u, const OptimizerConsts& c) {
+  V grad = VFma(VSplat(p, c.weight_decay), p, g);
+  u = VFma(VSplat(p, c.momentum), u, VMul(VSplat(p, 1 - c.momentum), grad));
+  p = VSub(p, VMul(VSplat(p, c.lr), u));
+}
+
+template <typename V>
+inline void AdamUpdate(V& p, V g, V& m, V& v, const OptimizerConsts& c) {
+  V grad = VFma(VSplat(p, c.weight_decay), p, g);
+  m = VFma(VSplat(p, c.beta1), m, VMul(VSplat(p, 1 - c.beta1), grad));
+  v = VFma(VSplat(p, c.beta2), v, VMul(VSplat(p, 1 - c.beta2), VMul(grad, grad)));
+  V step = VDiv(VMul(VSplat(p, c.lr * c.m_scale), m),
+                VAdd(VSqrt(VMul(v, VSplat(p, c.v_scale))), VSplat(p, c.eps)));
+  p = VSub(p, step);
+}
+
+void MultiSgdStep(const std::vector<AlignedArray*>& params,
+                  const std::vector<AlignedArray*>& grads,
+                  const std::vector<AlignedArray*>& moments, scalar_t lr, scalar_t momentum,
+                  scalar_t weight_decay) {
+  std::vector<size_t> starts = TensorListStarts({&params, &grads, &moments}, "sgd_step");
+  OptimizerConsts c = {lr, momentum, weight_decay, 0, 0, 0, 0, 0};
+  ForEachTensorRange(starts, [&](size_t t, size_t begin, size_t end) {
+    scalar_t* p = params[t]->ptr;
+    const scalar_t* g = grads[t]->ptr;
+    scalar_t* u = moments[t]->ptr;
+    size_t i = begin;
+#ifdef NEEDLE_SIMD
+    for (; i + VEC_WIDTH <= end; i += VEC_WIDTH) {
+      VecF p_i = VLoad(p + i), u_i = VLoad(u + i);
+      SgdUpdate(p_i, VLoad(g + i), u_i, c);
+      VStore(p + i, p_i);
+      VStore(u + i, u_i);
+    }
+#endif
+    for (; i < end; i++) SgdUpdate(p[i], g[i], u[i], c);
+  });
+}
+
+void SgdStep(AlignedArray* param, const AlignedArray& grad, AlignedArray* moment, scalar_t lr,
+             scalar_t momentum, scalar_t weight_decay) {
+  MultiSgdStep({param}, {const_cast<AlignedArray*>(&grad)}, {moment}, lr, momentum,
+               weight_decay);
+}
+
+void MultiAdamStepAt(const std::vector<AlignedArray*>& params,
+                     const std::vector<AlignedArray*>& grads, const std::vector<AlignedArray*>& m,
+                     const std::vector<AlignedArray*>& v, scalar_t lr, scalar_t beta1,
+                     scalar_t beta2, scalar_t eps, scalar_t weight_decay, uint32_t step) {
+  /**
+   * step is the number of the step being taken, counting from 1, for the bias corrections.
+   */
+  std::vector<size_t> starts = TensorListStarts({&params, &grads, &m, &v}, "adam_step");
+  if (step == 0) throw std::invalid_argument("adam_step: steps count from 1");
+  OptimizerConsts c = {lr, 0, weight_decay, beta1, beta2, eps,
+                       1 / (1 - std::pow(beta1, (scalar_t)step)),
+                       1 / (1 - std::pow(beta2, (scalar_t)step))};
+  ForEachTensorRange(starts, [&](size_t t, size_t begin, size_t end) {
+    scalar_t* p = params[t]->ptr;
+    const scalar_t* g = grads[t]->ptr;
+    scalar_t* m_ptr = m[t]->ptr;
+    scalar_t* v_ptr = v[t]->ptr;
+    size_t i = begin;
+#ifdef NEEDLE_SIMD
+    for (; i + VEC_WIDTH <= end; i += VEC_WIDTH) {
+      VecF p_i = VLoad(p + i), m_i = VLoad(m_ptr + i), v_i = VLoad(v_ptr + i);
+      AdamUpdate(p_i, VLoad(g + i), m_i, v_i, c);
+      VStore(p + i, p_i);
+      VStore(m_ptr + i, m_i);
+      VStore(v_ptr + i, v_i);
+    }
+#endif
+    for (; i < end; i++) AdamUpdate(p[i], g[i], m_ptr[i], v_ptr[i], c);
+  });
+}
+
+void MultiAdamStep(const std::vector<AlignedArray*>& params,
+                   const std::vector<AlignedArray*>& grads, const std::vector<AlignedArray*>& m,
+                   const std::vector<AlignedArray*>& v, scalar_t lr, scalar_t beta1,
+                   scalar_t beta2, scalar_t eps, scalar_t weight_decay, AlignedArray* step_count) {
+  /**
+   * MultiAdamStepAt() for the step after the step_count[0] taken so far, which is incremented.
+   * The CUDA backend keeps the count on the device so that replays of a captured step advance it.
+   */
+  if (step_count->size != 1 || step_count->dtype != DTYPE_FLOAT32)
+    throw std::invalid_argument("adam_step: step_count must be one float32 item");
+  scalar_t step = ++step_count->ptr[0];
+  MultiAdamStepAt(params, grads, m, v, lr, beta1, beta2, eps, weight_decay, (uint32_t)step);
+}
+
+void AdamStep(AlignedArray* param, const AlignedArray& grad, AlignedArray* m, AlignedArray* v,
+              scalar_t lr, scalar_t beta1, scalar_t beta2, scalar_t eps, scalar_t weight_decay,
+              uint32_t step) {
+  MultiAdamStepAt({param}, {const_cast<AlignedArray*>(&grad)}, {m}, {v}, lr, beta1, beta2, eps,
+                  weight_decay, step);
+}
+
+/**
+ * Bind this copy of the kernels into the module.  Only the copy chosen at import time is ever
+ * bound (and hence run).
+ */
+void DefineKernels(pybind11::module& m) {
+  m.def("fill", Profiled("fill", Fill));
+  m.def("compact", Profiled("compact", Compact));
+  m.def("ewise_setitem", Profiled("ewise_setitem", EwiseSetitem));
+  m.def("scalar_setitem", Profiled("scalar_setitem", ScalarSetitem));
+  m.def("astype", Profiled("astype", AsType));
+  m.def("ewise_add", Profiled("ewise_add", EwiseAdd));
+  m.def("scalar_add", Profiled("scalar_add", ScalarAdd));
+  m.def("ewise_mul", Profiled("ewise_mul", EwiseMul));
+  m.def("scalar_mul", Profiled("scalar_mul", ScalarMul));
+  m.def("ewise_div", Profiled("ewise_div", EwiseDiv));
+  m.def("scalar_div", Profiled("scalar_div", ScalarDiv));
+  m.def("scalar_power", Profiled("scalar_power", ScalarPower));
+
+  m.def("ewise_maximum", Profiled("ewise_maximum", EwiseMaximum));
+  m.def("scalar_maximum", Profiled("scalar_maximum", ScalarMaximum));
+  m.def("ewise_eq", Profiled("ewise_eq", EwiseEq));
+  m.def("scalar_eq", Profiled("scalar_eq", ScalarEq));
+  m.def("ewise_ge", Profiled("ewise_ge", EwiseGe));
+  m.def("scalar_ge", Profiled("scalar_ge", ScalarGe));
+
+  m.def("ewise_log", Profiled("ewise_log", EwiseLog));
+  m.def("ewise_exp", Profiled("ewise_exp", EwiseExp));
+  m.def("ewise_tanh", Profiled("ewise_tanh", EwiseTanh));
+
+  m.def("matmul", Profiled("matmul", Matmul));
+  m.def("matmul_tiled", Profiled("matmul_tiled", MatmulTiled));
+
+  m.def("reduce_max", Profiled("reduce_max", ReduceMax));
+  m.def("reduce_sum", Profiled("reduce_sum", ReduceSum));
+  m.def("reduce_max_axis", Profiled("reduce_max_axis", ReduceMaxAxis));
+  m.def("reduce_sum_axis", Profiled("reduce_sum_axis", ReduceSumAxis));
+  m.def("logsumexp_axis", Profiled("logsumexp_axis", LogSumExpAxis));
+  m.def("log_softmax_axis", Profiled("log_softmax_axis", LogSoftmaxAxis));
+  m.def("softmax_axis", Profiled("softmax_axis", SoftmaxProbAxis));
+  m.def("softmax_cross_entropy", Profiled("softmax_cross_entropy", SoftmaxCrossEntropy));
+  m.def("layer_norm_forward", Profiled("layer_norm_forward", LayerNormForward));
+  m.def("layer_norm_backward", Profiled("layer_norm_backward", LayerNormBackward));
+  m.def("batch_norm_forward", Profiled("batch_norm_forward", BatchNormForward));
+  m.def("batch_norm_backward", Profiled("batch_norm_backward", BatchNormBackward));
+  m.def("sgd_step", Profiled("sgd_step", SgdStep));
+  m.def("adam_step", Profiled("adam_step", AdamStep));
+  m.def("multi_sgd_step", Profiled("multi_sgd_step", MultiSgdStep));
+  m.def("multi_adam_step", Profiled("multi_adam_step", MultiAdamStep));
+
+  // strided variants, reading non-compact inputs in place (see EwiseStrided())
+  m.def("ewise_add_strided", Profiled("ewise_add_strided", EwiseStrided<AddOp>));
+  m.def("scalar_add_strided", Profiled("scalar_add_strided", ScalarStrided<AddOp>));
+  m.def("ewise_mul_strided", Profiled("ewise_mul_strided", EwiseStrided<MulOp>));
+  m.def("scalar_mul_strided", Profiled("scalar_mul_strided", ScalarStrided<MulOp>));
+  m.def("ewise_div_strided", Profiled("ewise_div_strided", EwiseStrided<DivOp>));
+  m.def("scalar_div_strided", Profiled("scalar_div_strided", ScalarStrided<DivOp>));
+  m.def("scalar_power_strided", Profiled("scalar_power_strided", ScalarPowerStrided));
+  m.def("ewise_maximum_strided", Profiled("ewise_maximum_strided", EwiseStrided<MaximumOp>));
+  m.def("scalar_maximum_strided", Profiled("scalar_maximum_strided", ScalarStrided<MaximumOp>));
+  m.def("ewise_eq_strided", Profiled("ewise_eq_strided", EwiseStrided<EqOp>));
+  m.def("scalar_eq_strided", Profiled("scalar_eq_strided", ScalarStrided<EqOp>));
+  m.def("ewise_ge_strided", Profiled("ewise_ge_strided", EwiseStrided<GeOp>));
+  m.def("scalar_ge_strided", Profiled("scalar_ge_strided", ScalarStrided<GeOp>));
+  m.def("ewise_log_strided", Profiled("ewise_log_strided", UnaryStrided<LogOp>));
+  m.def("ewise_exp_strided", Profiled("ewise_exp_strided", UnaryStrided<ExpOp>));
+  m.def("ewise_tanh_strided", Profiled("ewise_tanh_strided", UnaryStrided<TanhOp>));
+  m.def("matmul_strided", Profiled("matmul_strided", MatmulStrided));
+  m.def("matmul_batched", Profiled("matmul_batched", MatmulBatched));
+  m.def("matmul_epilogue", Profiled("matmul_epilogue", MatmulEpilogue));
+  m.def("quantize_rows", Profiled("quantize_rows", QuantizeRows));
+  m.def("dequantize_rows", Profiled("dequantize_rows", DequantizeRows));
+  m.def("matmul_int8", Profiled("matmul_int8", MatmulInt8));
+  m.def("reduce_max_strided", Profiled("reduce_max_strided", ReduceMaxStrided));
+  m.def("reduce_sum_strided", Profiled("reduce_sum_strided", ReduceSumStrided));
+
+  // a chain of element-wise operators in one pass (see EwiseFused() and fuse() in ndarray.py)
+  m.def("ewise_fused", Profiled("ewise_fused", EwiseFused));
+  m.def("ewise_fused_sum", Profiled("ewise_fused_sum", EwiseFusedSum));
+}
+
+#if defined(NEEDLE_TARGET) && defined(__clang__)
+#pragma clang attribute pop
+#elif defined(NEEDLE_TARGET)
+#pragma GCC pop_options
+#endif
+#undef NEEDLE_TARGET
+#undef NEEDLE_SIMD
+#undef NEEDLE_FMA
@@ -1,10 +1,34 @@
+#include <cuda_bf16.h>
+#include <cuda_fp16.h>
 #include <cuda_runtime.h>
+#include <mma.h>
+#ifdef NEEDLE_NCCL
+#include <nccl.h>
+#endif
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include "ndarray_dlpack.h"
+#include "ndarray_profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace needle {
 namespace cuda {
@@ -15,19 +39,962 @@ namespace cuda {
 typedef float scalar_t;
 const size_t ELEM_SIZE = sizeof(scalar_t);
 
+inline void CheckCuda(cudaError_t err) {
+  if (err != cudaSuccess) throw std::runtime_error(cudaGetErrorString(err));
+}
+
+/**
+ * Element types.  An array stores float32, float16 or bfloat16 items, but the 16-bit types are
+ * storage formats only: the kernels convert them to float as they load them, compute and
+ * accumulate (matmul, reductions) in float, and round to nearest even as they store.  The one
+ * exception is the tensor core path of Matmul(), which multiplies 16-bit fragments directly, still
+ * accumulating in float.
+ *
+ * int8 arrays hold quantized values (see the quantized kernels), whose scales live in separate
+ * float32 arrays; besides those kernels only compact, ewise_setitem and astype (which rounds and
+ * saturates to [-128, 127]) take them.
+ */
+enum DType { DTYPE_FLOAT32, DTYPE_FLOAT16, DTYPE_BFLOAT16, DTYPE_INT8 };
+
+typedef __half float16_t;
+typedef __nv_bfloat16 bfloat16_t;
+
+inline DType ParseDType(const std::string& name) {
+  if (name == "float32") return DTYPE_FLOAT32;
+  if (name == "float16") return DTYPE_FLOAT16;
+  if (name == "bfloat16") return DTYPE_BFLOAT16;
+  if (name == "int8") return DTYPE_INT8;
+  throw std::invalid_argument("unsupported dtype " + name +
+                              " (expected float32, float16, bfloat16 or int8)");
+}
+
+inline const char* DTypeName(DType dtype) {
+  switch (dtype) {
+    case DTYPE_FLOAT16: return "float16";
+    case DTYPE_BFLOAT16: return "bfloat16";
+    case DTYPE_INT8: return "int8";
+    default: return "float32";
+  }
+}
+
+inline size_t DTypeSize(DType dtype) {
+  switch (dtype) {
+    case DTYPE_FLOAT32: return 4;
+    case DTYPE_INT8: return 1;
+    default: return 2;
+  }
+}
+
+__device__ __forceinline__ scalar_t ToFloat(scalar_t x) { return x; }
+__device__ __forceinline__ scalar_t ToFloat(float16_t x) { return __half2float(x); }
+__device__ __forceinline__ scalar_t ToFloat(bfloat16_t x) { return __bfloat162float(x); }
+__device__ __forceinline__ scalar_t ToFloat(int8_t x) { return x; }
+
+template <typename T>
+__device__ __forceinline__ T FromFloat(scalar_t x);
+
+template <>
+__device__ __forceinline__ scalar_t FromFloat<scalar_t>(scalar_t x) {
+  return x;
+}
+
+template <>
+__device__ __forceinline__ float16_t FromFloat<float16_t>(scalar_t x) {
+  return __float2half_rn(x);
+}
+
+template <>
+__device__ __forceinline__ bfloat16_t FromFloat<bfloat16_t>(scalar_t x) {
+  return __float2bfloat16_rn(x);
+}
+
+template <>
+__device__ __forceinline__ int8_t FromFloat<int8_t>(scalar_t x) {
+  // saturating, with NaN to 0
+  return x != x ? 0 : (int8_t)__float2int_rn(fminf(fmaxf(x, -128.0f), 127.0f));
+}
+
+[[noreturn]] inline void RejectInt8() {
+  throw std::invalid_argument(
+      "int8 arrays only go through compact, setitem, astype and the quantized kernels");
+}
+
+/**
+ * Run the statement(s) with the typedef T set to the item type of dtype, e.g.
+ *   DISPATCH_DTYPE(out->dtype, T, FillKernel<T><<<...>>>(out->data<T>(), val, out->size));
+ * for the floating point dtypes; int8 arrays are turned away.
+ */
+#define DISPATCH_DTYPE(dtype, T, ...)   \
+  switch (dtype) {                      \
+    case DTYPE_INT8:                    \
+      RejectInt8();                     \
+    case DTYPE_FLOAT16: {               \
+      typedef float16_t T;              \
+      __VA_ARGS__;                      \
+      break;                            \
+    }                                   \
+    case DTYPE_BFLOAT16: {              \
+      typedef bfloat16_t T;             \
+      __VA_ARGS__;                      \
+      break;                            \
+    }                                   \
+    default: {                          \
+      typedef scalar_t T;               \
+      __VA_ARGS__;                      \
+      break;                            \
+    }                                   \
+  }
+
+////////////////////////////////////////////////////////////////////////////////
+// Streams and events
+////////////////////////////////////////////////////////////////////////////////
+
+class Stream {
+  /**
+   * A CUDA stream, as exposed to Python.  Every kernel and copy of this module is issued on the
+   * current stream of the current device (CurrentStream()), which is the default stream unless
+   * set_stream() picked another one for the calling thread; so work queued from different
+   * threads on different streams, e.g. uploading the next batch while the previous step
+   * computes, can overlap.  A Stream with a null handle stands for the default stream and does
+   * not own it.
+   */
+ public:
+  Stream(bool non_blocking, int priority) : owned_(true) {
+    CheckCuda(cudaGetDevice(&device_));
+    CheckCuda(cudaStreamCreateWithPriority(
+        &stream_, non_blocking ? cudaStreamNonBlocking : cudaStreamDefault, priority));
+  }
+  Stream(cudaStream_t stream, int device) : stream_(stream), device_(device), owned_(false) {}
+  ~Stream() {
+    if (!owned_) return;
+    // the allocator may still cache blocks under this handle, which a later stream can get
+    // again, so let the work queued here finish first
+    cudaStreamSynchronize(stream_);
+    cudaStreamDestroy(stream_);
+  }
+  Stream(const Stream&) = delete;
+  Stream& operator=(const Stream&) = delete;
+
+  cudaStream_t handle() const { return stream_; }
+  int device() const { return device_; }
+  size_t ptr_as_int() const { return (size_t)stream_; }
+
+  void Synchronize() const { CheckCuda(cudaStreamSynchronize(stream_)); }
+
+  bool Query() const {
+    cudaError_t err = cudaStreamQuery(stream_);
+    if (err == cudaErrorNotReady) return false;
+    CheckCuda(err);
+    return true;
+  }
+
+ private:
+  cudaStream_t stream_;
+  int device_;
+  bool owned_;
+};
+
+class Event {
+  /**
+   * A CUDA event, recorded on a stream to let the host or another stream wait for the work
+   * queued on it so far.  Timing is off unless asked for, which makes the event cheaper.
+   */
+ public:
+  explicit Event(bool enable_timing) {
+    CheckCuda(cudaEventCreateWithFlags(&event_,
+                                       enable_timing ? cudaEventDefault : cudaEventDisableTiming));
+  }
+  ~Event() { cudaEventDestroy(event_); }
+  Event(const Event&) = delete;
+  Event& operator=(const Event&) = delete;
+
+  cudaEvent_t handle() const { return event_; }
+
+  void Record(cudaStream_t stream) { CheckCuda(cudaEventRecord(event_, stream)); }
+
+  void Synchronize() const { CheckCuda(cudaEventSynchronize(event_)); }
+
+  bool Query() const {
+    cudaError_t err = cudaEventQuery(event_);
+    if (err == cudaErrorNotReady) return false;
+    CheckCuda(err);
+    return true;
+  }
+
+  float ElapsedTime(const Event& end) const {
+    // in milliseconds, both events must have been created with timing enabled
+    float ms;
+    CheckCuda(cudaEventElapsedTime(&ms, event_, end.event_));
+    return ms;
+  }
+
+ private:
+  cudaEvent_t event_;
+};
+
+int CurrentDevice() {
+  int device;
+  CheckCuda(cudaGetDevice(&device));
+  return device;
+}
+
+class DeviceGuard {
+  /**
+   * Makes device current, unless it is negative, for as long as the guard lives.  Every array
+   * remembers the device it was allocated on, and its kernels run there (see ProfiledKernel)
+   * whichever device the calling thread has current.  With nothrow, failing to switch (as
+   * while freeing during shutdown) is ignored, for destructors.
+   */
+ public:
+  explicit DeviceGuard(int device, bool nothrow = false) : previous_(-1) {
+    if (device < 0) return;
+    int current;
+    cudaError_t err = cudaGetDevice(&current);
+    if (err == cudaSuccess && current != device) {
+      err = cudaSetDevice(device);
+      if (err == cudaSuccess) previous_ = current;
+    }
+    if (err != cudaSuccess) {
+      cudaGetLastError();
+      if (!nothrow) CheckCuda(err);
+    }
+  }
+  ~DeviceGuard() {
+    if (previous_ >= 0) cudaSetDevice(previous_);
+  }
+  DeviceGuard(const DeviceGuard&) = delete;
+  DeviceGuard& operator=(const DeviceGuard&) = delete;
+
+ private:
+  int previous_;
+};
+
+std::shared_ptr<Stream>& CurrentStreamSlot(int device) {
+  // one current stream per device, and per thread, so a loader thread can use its own
+  static thread_local std::vector<std::shared_ptr<Stream>> current;
+  if ((size_t)device >= current.size()) current.resize(device + 1);
+  return current[device];
+}
+
+cudaStream_t CurrentStream() {
+  const std::shared_ptr<Stream>& stream = CurrentStreamSlot(CurrentDevice());
+  return stream ? stream->handle() : 0;
+}
+
+std::shared_ptr<Stream> GetCurrentStream() {
+  int device = CurrentDevice();
+  std::shared_ptr<Stream> stream = CurrentStreamSlot(device);
+  return stream ? stream : std::make_shared<Stream>((cudaStream_t)0, device);
+}
+
+void SetCurrentStream(std::shared_ptr<Stream> stream) {
+  // the default stream is stored as null, so that it is never kept alive here
+  CurrentStreamSlot(stream->device()) = stream->handle() ? stream : nullptr;
+}
+
+std::shared_ptr<Event> RecordEvent(const Stream& stream, bool enable_timing) {
+  std::shared_ptr<Event> event = std::make_shared<Event>(enable_timing);
+  event->Record(stream.handle());
+  return event;
+}
+
+void WaitEvent(const Stream& stream, const Event& event) {
+  // later work on stream waits for event on the device, the host does not block
+  CheckCuda(cudaStreamWaitEvent(stream.handle(), event.handle(), 0));
+}
+
+void WaitStream(const Stream& stream, const Stream& other) {
+  // later work on stream waits for everything queued on other so far
+  Event event(false);
+  event.Record(other.handle());
+  WaitEvent(stream, event);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Caching device allocator
+////////////////////////////////////////////////////////////////////////////////
+
+// Requests are rounded up to a multiple of this many bytes
+#define ALLOC_ROUND 512
+// Requests of up to this size are served from ALLOC_SMALL_SEGMENT segments, larger ones from
+// segments of their own size rounded up to ALLOC_LARGE_ROUND
+#define ALLOC_SMALL_SIZE (1 << 20)
+#define ALLOC_SMALL_SEGMENT (2 << 20)
+#define ALLOC_LARGE_ROUND (2 << 20)
+
+class CachingAllocator {
+  /**
+   * cudaMalloc and cudaFree are slow and both synchronize the device, while a training step
+   * creates and drops hundreds of temporaries.  Device memory is therefore requested in
+   * segments, which are carved into blocks; a freed block stays cached and is handed out again
+   * by a later allocation of (roughly) the same size.
+   *
+   * Free blocks are kept in two pools ordered by (device, stream, size, address), one for small
+   * requests and one for large ones, and an allocation takes the smallest cached block of its
+   * device that fits.  If that block is bigger than needed it is split, the remainder going back
+   * to the pool; on free a block is merged with its free neighbours in the same segment, so a
+   * segment fragmented by many small tensors becomes whole again.  A block is only reused by
+   * allocations on the stream it was allocated on: kernels on one stream run in order, so memory
+   * freed on the host after launching its last kernel can be reused by the next launch on that
+   * stream without synchronizing, but not by another stream.  An array that is also used on
+   * other streams has them added with RecordStream(); freeing it then records an event on each
+   * of those streams, and the block only returns to the pool once all of these events have
+   * completed.
+   *
+   * When cudaMalloc fails, the cache is emptied and the request retried once.  EmptyCache()
+   * returns all fully free segments to the driver.
+   *
+   * While a stream is captured into a CUDA graph (see Graph), its allocations and the blocks
+   * freed on it go to a pool of the graph's own instead, keyed by a token standing in for the
+   * stream: replays of the graph use the memory the captured kernels were given, so no
+   * allocation outside the graph may get it while the graph lives.  Once the graph is gone the
+   * pool's blocks return to the stream's, as they are freed.
+   */
+ public:
+  struct Stats {
+    size_t bytes_in_use = 0;    // in blocks handed out to CudaArrays
+    size_t bytes_reserved = 0;  // in all segments obtained from cudaMalloc
+    size_t num_allocs = 0;
+    size_t num_cache_hits = 0;  // allocations served without calling cudaMalloc
+    size_t num_segments = 0;
+  };
+
+  void* Allocate(size_t bytes, cudaStream_t stream) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!pending_frees_.empty()) ProcessPendingFrees();
+    auto capture = capture_pools_.find(stream);
+    if (capture != capture_pools_.end()) stream = capture->second;
+    // the default stream has the same handle on every device
+    int device = CurrentDevice();
+    size_t size = std::max<size_t>(1, (bytes + ALLOC_ROUND - 1) / ALLOC_ROUND) * ALLOC_ROUND;
+    bool small = size <= ALLOC_SMALL_SIZE;
+    BlockPool& pool = small ? small_pool_ : large_pool_;
+    stats_.num_allocs++;
+
+    Block key(nullptr, size, device, stream, small);
+    auto it = pool.lower_bound(&key);
+    Block* block;
+    if (it != pool.end() && (*it)->device == device && (*it)->stream == stream) {
+      block = *it;
+      pool.erase(it);
+      stats_.num_cache_hits++;
+    } else {
+      size_t segment_size =
+          small ? ALLOC_SMALL_SEGMENT
+                : (size + ALLOC_LARGE_ROUND - 1) / ALLOC_LARGE_ROUND * ALLOC_LARGE_ROUND;
+      block = new Block(MallocSegment(segment_size), segment_size, device, stream, small);
+    }
+
+    // keep the rest of the block for later requests if it is big enough to be useful
+    size_t remaining = block->size - size;
+    if (remaining >= (small ? ALLOC_ROUND : ALLOC_SMALL_SIZE)) {
+      Block* rest = new Block(block->ptr + size, remaining, device, stream, small);
+      rest->prev = block;
+      rest->next = block->next;
+      if (block->next) block->next->prev = rest;
+      block->next = rest;
+      block->size = size;
+      pool.insert(rest);
+    }
+    block->allocated = true;
+    active_[block->ptr] = block;
+    stats_.bytes_in_use += block->size;
+    return block->ptr;
+  }
+
+  void Free(void* ptr) {
+    if (ptr == nullptr) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = active_.find((char*)ptr);
+    if (it == active_.end()) throw std::runtime_error("Freeing memory not owned by the allocator");
+    Block* block = it->second;
+    active_.erase(it);
+    stats_.bytes_in_use -= block->size;
+    if (block->stream_uses.empty()) {
+      Release(block);
+      return;
+    }
+    // still allocated (so never merged into a neighbour) until the other streams are done
+    DeviceGuard guard(block->device, true);
+    for (cudaStream_t stream : block->stream_uses) {
+      cudaEvent_t event;
+      CheckCuda(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+      CheckCuda(cudaEventRecord(event, stream));
+      pending_frees_.push_back(std::make_pair(event, block));
+      block->pending_events++;
+    }
+    block->stream_uses.clear();
+  }
+
+  void RecordStream(void* ptr, cudaStream_t stream) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = active_.find((char*)ptr);
+    if (it == active_.end())
+      throw std::runtime_error("Recording memory not owned by the allocator");
+    Block* block = it->second;
+    if (stream == block->stream) return;
+    if (std::find(block->stream_uses.begin(), block->stream_uses.end(), stream) ==
+        block->stream_uses.end())
+      block->stream_uses.push_back(stream);
+  }
+
+  void EmptyCache() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& pending : pending_frees_) cudaEventSynchronize(pending.first);
+    ProcessPendingFrees();
+    ReleaseFreeSegments(&small_pool_);
+    ReleaseFreeSegments(&large_pool_);
+  }
+
+  Stats GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+
+  void BeginCapture(cudaStream_t stream, cudaStream_t pool) {
+    // allocations and frees on stream go to pool until EndCapture(stream)
+    std::lock_guard<std::mutex> lock(mutex_);
+    capture_pools_[stream] = pool;
+  }
+
+  void EndCapture(cudaStream_t stream) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capture_pools_.erase(stream);
+  }
+
+  void ReleasePool(cudaStream_t pool, cudaStream_t stream) {
+    // the graph owning pool is gone (and its work done): its blocks belong to stream again
+    std::lock_guard<std::mutex> lock(mutex_);
+    released_pools_[pool] = stream;
+    for (BlockPool* blocks : {&small_pool_, &large_pool_}) {
+      std::vector<Block*> moved;
+      for (auto it = blocks->begin(); it != blocks->end();) {
+        if ((*it)->stream == pool) {
+          moved.push_back(*it);
+          it = blocks->erase(it);
+        } else {
+          ++it;
+        }
+      }
+      // re-keyed as they are; they merge with their neighbours as those are freed
+      for (Block* block : moved) {
+        block->stream = stream;
+        blocks->insert(block);
+      }
+    }
+  }
+
+ private:
+  struct Block {
+    Block(char* ptr, size_t size, int device, cudaStream_t stream, bool small)
+        : ptr(ptr), size(size), device(device), stream(stream), small(small) {}
+    char* ptr;
+    size_t size;
+    int device;
+    cudaStream_t stream;
+    bool small;  // whether the block belongs to the small pool
+    bool allocated = false;
+    std::vector<cudaStream_t> stream_uses;  // other streams the block is used on
+    int pending_events = 0;  // recorded on stream_uses when the block was freed
+    // neighbouring blocks of the same segment
+    Block* prev = nullptr;
+    Block* next = nullptr;
+  };
+
+  struct BlockLess {
+    bool operator()(const Block* a, const Block* b) const {
+      if (a->device != b->device) return a->device < b->device;
+      if (a->stream != b->stream) return (size_t)a->stream < (size_t)b->stream;
+      if (a->size != b->size) return a->size < b->size;
+      return (size_t)a->ptr < (size_t)b->ptr;
+    }
+  };
+  typedef std::set<Block*, BlockLess> BlockPool;
+
+  void Release(Block* block) {
+    // return a block that is no longer used by any stream to its pool, which is that of the
+    // graph capturing its stream, if any (see BeginCapture())
+    block->allocated = false;
+    auto released = released_pools_.find(block->stream);
+    if (released != released_pools_.end()) block->stream = released->second;
+    auto capture = capture_pools_.find(block->stream);
+    if (capture != capture_pools_.end()) block->stream = capture->second;
+    BlockPool& pool = block->small ? small_pool_ : large_pool_;
+    // neighbours in another stream's (or graph's) pool stay apart
+    if (block->prev && !block->prev->allocated && block->prev->stream == block->stream)
+      block = Merge(pool, block, block->prev);
+    if (block->next && !block->next->allocated && block->next->stream == block->stream)
+      block = Merge(pool, block, block->next);
+    pool.insert(block);
+  }
+
+  void ProcessPendingFrees() {
+    size_t kept = 0;
+    for (size_t i = 0; i < pending_frees_.size(); i++) {
+      cudaEvent_t event = pending_frees_[i].first;
+      Block* block = pending_frees_[i].second;
+      if (cudaEventQuery(event) == cudaErrorNotReady) {
+        pending_frees_[kept++] = pending_frees_[i];
+        continue;
+      }
+      cudaEventDestroy(event);
+      if (--block->pending_events == 0) Release(block);
+    }
+    pending_frees_.resize(kept);
+  }
+
+  Block* Merge(BlockPool& pool, Block* block, Block* neighbour) {
+    /**
+     * Merge a block being freed (not in the pool) with a free neighbour (in the pool) and return
+     * the merged block, which is not in the pool either.
+     */
+    pool.erase(neighbour);
+    Block* first = neighbour == block->prev ? neighbour : block;
+    Block* second = first == block ? neighbour : block;
+    first->size += second->size;
+    first->next = second->next;
+    if (second->next) second->next->prev = first;
+    delete second;
+    return first;
+  }
+
+  char* MallocSegment(size_t size) {
+    void* ptr;
+    cudaError_t err = cudaMalloc(&ptr, size);
+    if (err != cudaSuccess) {
+      // drop the cached segments and try once more before giving up
+      cudaGetLastError();
+      ReleaseFreeSegments(&small_pool_);
+      ReleaseFreeSegments(&large_pool_);
+      err = cudaMalloc(&ptr, size);
+      if (err != cudaSuccess) throw std::runtime_error(cudaGetErrorString(err));
+    }
+    stats_.bytes_reserved += size;
+    stats_.num_segments++;
+    return (char*)ptr;
+  }
+
+  void ReleaseFreeSegments(BlockPool* pool) {
+    for (auto it = pool->begin(); it != pool->end();) {
+      Block* block = *it;
+      if (block->prev == nullptr && block->next == nullptr) {
+        DeviceGuard guard(block->device, true);
+        cudaFree(block->ptr);
+        stats_.bytes_reserved -= block->size;
+        stats_.num_segments--;
+        delete block;
+        it = pool->erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  BlockPool small_pool_, large_pool_;
+  std::unordered_map<char*, Block*> active_;
+  std::vector<std::pair<cudaEvent_t, Block*>> pending_frees_;
+  std::unordered_map<cudaStream_t, cudaStream_t> capture_pools_;  // captured stream -> pool
+  std::unordered_map<cudaStream_t, cudaStream_t> released_pools_;  // pool -> its stream
+  Stats stats_;
+};
+
+CachingAllocator& Allocator() {
+  // never destroyed: freeing device memory during interpreter shutdown, after the CUDA context
+  // may already be gone, would only produce errors
+  static CachingAllocator* allocator = new CachingAllocator();
+  return *allocator;
+}
+
+// Pinned host buffers are rounded up to a power of two of at least this many bytes
+#define PINNED_MIN_SIZE 4096
+
+class PinnedHostAllocator {
+  /**
+   * Page-locked host memory for the host side of to_numpy/from_numpy.  Only copies from and to
+   * pinned memory are truly asynchronous (pageable memory is first staged by the driver, with
+   * the host waiting), but cudaMallocHost is even slower than cudaMalloc, so the buffers are
+   * cached by (power of two) size.  A buffer that an asynchronous copy may still be reading is
+   * freed together with an event recorded after that copy, and only reused once it completed.
+   */
+ public:
+  void* Allocate(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!pending_frees_.empty()) ProcessPendingFrees();
+    size_t size = PINNED_MIN_SIZE;
+    while (size < bytes) size <<= 1;
+    std::vector<void*>& free_list = free_lists_[size];
+    if (!free_list.empty()) {
+      void* ptr = free_list.back();
+      free_list.pop_back();
+      return ptr;
+    }
+    void* ptr;
+    if (cudaMallocHost(&ptr, size) != cudaSuccess) {
+      cudaGetLastError();
+      ReleaseCached();
+      if (cudaMallocHost(&ptr, size) != cudaSuccess) {
+        cudaGetLastError();
+        throw std::bad_alloc();
+      }
+    }
+    sizes_[ptr] = size;
+    bytes_reserved_ += size;
+    return ptr;
+  }
+
+  void Free(void* ptr, cudaEvent_t after = nullptr) {
+    // the allocator takes over the event, if any
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (after != nullptr) {
+      pending_frees_.push_back(std::make_pair(after, ptr));
+      return;
+    }
+    free_lists_[sizes_.at(ptr)].push_back(ptr);
+  }
+
+  void EmptyCache() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ReleaseCached();
+  }
+
+  size_t BytesReserved() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_reserved_;
+  }
+
+ private:
+  void ProcessPendingFrees() {
+    size_t kept = 0;
+    for (size_t i = 0; i < pending_frees_.size(); i++) {
+      if (cudaEventQuery(pending_frees_[i].first) == cudaErrorNotReady) {
+        pending_frees_[kept++] = pending_frees_[i];
+        continue;
+      }
+      cudaEventDestroy(pending_frees_[i].first);
+      free_lists_[sizes_.at(pending_frees_[i].second)].push_back(pending_frees_[i].second);
+    }
+    pending_frees_.resize(kept);
+  }
+
+  void ReleaseCached() {
+    for (auto& pending : pending_frees_) cudaEventSynchronize(pending.first);
+    ProcessPendingFrees();
+    for (auto& entry : free_lists_) {
+      for (void* ptr : entry.second) {
+        cudaFreeHost(ptr);
+        sizes_.erase(ptr);
+        bytes_reserved_ -= entry.first;
+      }
+      entry.second.clear();
+    }
+  }
+
+  std::mutex mutex_;
+  std::map<size_t, std::vector<void*>> free_lists_;
+  std::unordered_map<void*, size_t> sizes_;
+  std::vector<std::pair<cudaEvent_t, void*>> pending_frees_;
+  size_t bytes_reserved_ = 0;
+};
+
+PinnedHostAllocator& PinnedAllocator() {
+  // never destroyed, like Allocator()
+  static PinnedHostAllocator* allocator = new PinnedHostAllocator();
+  return *allocator;
+}
+
+class Graph {
+  /**
+   * A CUDA graph of the work issued on the current stream between CaptureBegin() and
+   * CaptureEnd(), which Replay() runs again in one launch instead of one launch per kernel.
+   * The captured kernels keep the addresses and the scalar arguments they were given, so the
+   * arrays they use must outlive the graph: the ones allocated during the capture do, coming
+   * from a pool that the graph owns (see CachingAllocator), and the ones from before, e.g.
+   * the inputs and the parameters, have to be kept by the caller.  The work is only recorded
+   * by the capture, not run, and must stay on the device: copies from or to the host and
+   * waiting for the stream are errors while it lasts.  The default stream cannot be captured.
+   */
+ public:
+  Graph() : stream_(0), pool_(NextPool()), graph_(nullptr), exec_(nullptr), capturing_(false) {}
+  ~Graph() {
+    if (replayed_) replayed_->Synchronize();
+    if (exec_) cudaGraphExecDestroy(exec_);
+    if (graph_) cudaGraphDestroy(graph_);
+    if (graph_ || capturing_) Allocator().ReleasePool(pool_, stream_);
+  }
+  Graph(const Graph&) = delete;
+  Graph& operator=(const Graph&) = delete;
+
+  void CaptureBegin() {
+    if (graph_ || capturing_)
+      throw std::runtime_error("graph capture: the graph is captured already");
+    if (profiler::Enabled())
+      throw std::runtime_error("graph capture: the profiler cannot time captured kernels");
+    stream_ = CurrentStream();
+    if (stream_ == 0)
+      throw std::runtime_error("graph capture: the default stream cannot be captured");
+    Allocator().BeginCapture(stream_, pool_);
+    // relaxed, as the allocator may still have to get new segments with cudaMalloc
+    cudaError_t err = cudaStreamBeginCapture(stream_, cudaStreamCaptureModeRelaxed);
+    if (err != cudaSuccess) Allocator().EndCapture(stream_);
+    CheckCuda(err);
+    capturing_ = true;
+  }
+
+  void CaptureEnd() {
+    if (!capturing_) throw std::runtime_error("graph capture: the graph is not being captured");
+    cudaGraph_t graph = nullptr;
+    cudaError_t err = cudaStreamEndCapture(stream_, &graph);
+    Allocator().EndCapture(stream_);
+    capturing_ = false;
+    if (err != cudaSuccess && graph != nullptr) cudaGraphDestroy(graph);
+    CheckCuda(err);
+    graph_ = graph;
+    CheckCuda(cudaGraphInstantiateWithFlags(&exec_, graph_, 0));
+  }
+
+  void Replay() {
+    if (!exec_) throw std::runtime_error("graph replay: the graph has not been captured");
+    CheckCuda(cudaGraphLaunch(exec_, CurrentStream()));
+    if (!replayed_) replayed_.reset(new Event(false));
+    replayed_->Record(CurrentStream());
+  }
+
+  size_t NumNodes() const {
+    // the kernels, copies and memsets replayed by one launch
+    size_t n = 0;
+    if (graph_) CheckCuda(cudaGraphGetNodes(graph_, nullptr, &n));
+    return n;
+  }
+
+ private:
+  static cudaStream_t NextPool() {
+    // tokens from the top of the address space, which no stream handle can be
+    static std::atomic<uintptr_t> count(0);
+    return (cudaStream_t)(UINTPTR_MAX - count++);
+  }
+
+  cudaStream_t stream_;
+  cudaStream_t pool_;
+  cudaGraph_t graph_;
+  cudaGraphExec_t exec_;
+  bool capturing_;
+  std::unique_ptr<Event> replayed_;
+};
+
 struct CudaArray {
-  CudaArray(const size_t size) {
-    cudaError_t err = cudaMalloc(&ptr, size * ELEM_SIZE);
-    if (err != cudaSuccess) throw std::runtime_error(cudaGetErrorString(err));
+  // size counts items, of dtype; ptr is typed for the float32 kernels, the others go through
+  // data<T>()
+  CudaArray(const size_t size, DType dtype = DTYPE_FLOAT32)
+      : dtype(dtype), device(CurrentDevice()) {
+    // device memory comes from the caching allocator instead of cudaMalloc/cudaFree directly,
+    // in the pool of the stream the array is created on, on the current device
+    ptr = (scalar_t*)Allocator().Allocate(size * DTypeSize(dtype), CurrentStream());
     this->size = size;
+    if (profiler::Enabled())
+      profiler::Global().RecordAlloc(size * DTypeSize(dtype), Allocator().GetStats().bytes_in_use);
+  }
+  // wrap device memory owned by someone else (a DLPack tensor), given back by calling release
+  CudaArray(scalar_t* ptr, size_t size, std::function<void()> release)
+      : ptr(ptr), size(size), dtype(DTYPE_FLOAT32), device(CurrentDevice()), release(release) {}
+  ~CudaArray() {
+    DeviceGuard guard(device, true);
+    if (release) {
+      release();
+    } else {
+      Allocator().Free(ptr);
+      if (profiler::Enabled()) profiler::Global().RecordFree(Allocator().GetStats().bytes_in_use);
+    }
   }
-  ~CudaArray() { cudaFree(ptr); }
   size_t ptr_as_int() { return (size_t)ptr; }
-  
+  // tell the allocator that the array is also used on stream (see CachingAllocator)
+  void RecordStream(const Stream& stream) {
+    if (!release) Allocator().RecordStream(ptr, stream.handle());
+  }
+
+  template <typename T>
+  T* data() const { return (T*)ptr; }
+  size_t itemsize() const { return DTypeSize(dtype); }
+
   scalar_t* ptr;
   size_t size;
+  DType dtype;
+  int device;  // the array's memory is on this device, and its kernels run there
+  std::function<void()> release;
+};
+
+inline void CheckDType(const CudaArray& a, const CudaArray& out, const char* kernel) {
+  if (a.dtype != out.dtype)
+    throw std::invalid_argument(std::string(kernel) + ": arrays of different dtypes (" +
+                                DTypeName(a.dtype) + ", " + DTypeName(out.dtype) + ")");
+}
+
+inline void CheckFloat32(const CudaArray& a, const char* kernel) {
+  // for the kernels that only exist in float32; NDArray upcasts their operands first
+  if (a.dtype != DTYPE_FLOAT32)
+    throw std::invalid_argument(std::string(kernel) + ": only float32 arrays are supported, not " +
+                                DTypeName(a.dtype));
+}
+
+inline void CheckInt8(const CudaArray& a, const char* kernel) {
+  if (a.dtype != DTYPE_INT8)
+    throw std::invalid_argument(std::string(kernel) + ": expected an int8 array, not " +
+                                DTypeName(a.dtype));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Profiling (see ndarray_profiler.h)
+////////////////////////////////////////////////////////////////////////////////
+
+// the bytes an array argument of a kernel accounts for in the profiler (see SumArgBytes())
+inline uint64_t ArgBytes(const CudaArray& a) { return a.size * a.itemsize(); }
+inline uint64_t ArgBytes(CudaArray* a) { return a ? ArgBytes(*a) : 0; }
+inline uint64_t ArgBytes(const CudaArray* a) { return a ? ArgBytes(*a) : 0; }
+inline uint64_t ArgBytes(const std::vector<CudaArray*>& arrays) {
+  uint64_t total = 0;
+  for (CudaArray* a : arrays) total += ArgBytes(a);
+  return total;
+}
+
+// the device of an array argument of a kernel, -1 for the others (see FirstArgDevice())
+template <typename T>
+inline int ArgDevice(const T&) { return -1; }
+inline int ArgDevice(const CudaArray& a) { return a.device; }
+inline int ArgDevice(CudaArray* a) { return a ? a->device : -1; }
+inline int ArgDevice(const CudaArray* a) { return a ? a->device : -1; }
+inline int ArgDevice(const std::vector<CudaArray*>& arrays) {
+  return arrays.empty() ? -1 : ArgDevice(arrays[0]);
+}
+
+template <typename... Ts>
+inline int FirstArgDevice(const Ts&... args) {
+  // the device a kernel runs on: that of its first array argument
+  int devices[] = {-1, ArgDevice(args)...};
+  for (int device : devices)
+    if (device >= 0) return device;
+  return -1;
+}
+
+class KernelTimer {
+  /**
+   * Times the profiled kernels on the GPU without waiting for them: Begin() and End() record a
+   * pair of timing events around the launch on the current stream, and the pairs are handed to
+   * the profiler once they have completed, checked on every profiled call and waited for by
+   * Flush() before the results are read.  An event's time is placed on the host clock through
+   * an anchor event per device, recorded and waited for on the first profiled call there.
+   */
+ public:
+  std::unique_ptr<Event> Begin() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Retire(false);
+    int device = CurrentDevice();
+    if (anchors_.find(device) == anchors_.end()) {
+      Anchor& anchor = anchors_[device];
+      anchor.event.reset(new Event(true));
+      anchor.event->Record(CurrentStream());
+      anchor.event->Synchronize();
+      anchor.host_us = profiler::NowUs();
+    }
+    std::unique_ptr<Event> start = TakeEvent();
+    start->Record(CurrentStream());
+    return start;
+  }
+
+  void End(const char* name, uint64_t bytes, std::unique_ptr<Event> start) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<Event> end = TakeEvent();
+    end->Record(CurrentStream());
+    pending_.push_back(Call{name, bytes, CurrentDevice(), std::move(start), std::move(end)});
+  }
+
+  void Flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Retire(true);
+  }
+
+  void Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.clear();
+    anchors_.clear();
+  }
+
+ private:
+  struct Call {
+    const char* name;
+    uint64_t bytes;
+    int device;
+    std::unique_ptr<Event> start, end;
+  };
+  struct Anchor {
+    std::unique_ptr<Event> event;
+    double host_us;
+  };
+
+  std::unique_ptr<Event> TakeEvent() {
+    if (free_events_.empty()) return std::unique_ptr<Event>(new Event(true));
+    std::unique_ptr<Event> event = std::move(free_events_.back());
+    free_events_.pop_back();
+    return event;
+  }
+
+  void Retire(bool wait) {
+    // record the completed calls, oldest first, and wait for the others if asked to
+    while (!pending_.empty()) {
+      Call& call = pending_.front();
+      if (wait)
+        call.end->Synchronize();
+      else if (!call.end->Query())
+        break;
+      auto anchor = anchors_.find(call.device);
+      if (anchor != anchors_.end()) {
+        const Anchor& a = anchor->second;
+        double start_us = a.host_us + 1e3 * a.event->ElapsedTime(*call.start);
+        double dur_us = 1e3 * call.start->ElapsedTime(*call.end);
+        profiler::Global().RecordKernel(call.name, start_us, dur_us, call.bytes);
+      }
+      free_events_.push_back(std::move(call.start));
+      free_events_.push_back(std::move(call.end));
+      pending_.pop_front();
+    }
+  }
+
+  std::mutex mutex_;
+  std::deque<Call> pending_;
+  std::map<int, Anchor> anchors_;
+  std::vector<std::unique_ptr<Event>> free_events_;
+};
+
+KernelTimer& Timer() {
+  // never destroyed, like Allocator()
+  static KernelTimer* timer = new KernelTimer();
+  return *timer;
+}
+
+/**
+ * What the module binds in place of each kernel: the kernel is launched on the device of its
+ * first array (and on that device's current stream), and while the profiler is enabled the
+ * launch is timed (see KernelTimer) and recorded under the name it is bound as.
+ */
+template <typename... Args>
+struct ProfiledKernel {
+  const char* name;
+  void (*fn)(Args...);
+
+  void operator()(Args... args) const {
+    DeviceGuard guard(FirstArgDevice(args...));
+    if (!profiler::Enabled()) return fn(std::forward<Args>(args)...);
+    uint64_t bytes = profiler::SumArgBytes(args...);
+    std::unique_ptr<Event> start = Timer().Begin();
+    fn(std::forward<Args>(args)...);
+    Timer().End(name, bytes, std::move(start));
+  }
 };
 
+template <typename... Args>
+ProfiledKernel<Args...> Profiled(const char* name, void (*fn)(Args...)) {
+  return ProfiledKernel<Args...>{name, fn};
+}
+
 struct CudaDims {
   dim3 block, grid;
 };
@@ -64,14 +1031,17 @@ CudaVec VecToCuda(const std::vector<int32_t>& x) {
 // Fill call
 ////////////////////////////////////////////////////////////////////////////////
 
-__global__ void FillKernel(scalar_t* out, scalar_t val, size_t size) {
+template <typename T>
+__global__ void FillKernel(T* out, scalar_t val, size_t size) {
   size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
-  if (gid < size) out[gid] = val;
+  if (gid < size) out[gid] = FromFloat<T>(val);
 }
 
 void Fill(CudaArray* out, scalar_t val) {
   CudaDims dim = CudaOneDim(out->size);
-  FillKernel<<<dim.grid, dim.block>>>(out->ptr, val, out->size);
+  DISPATCH_DTYPE(out->dtype, T,
+                 FillKernel<T><<<dim.grid, dim.block, 0, CurrentStream()>>>(out->data<T>(), val,
+                                                                            out->size));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -93,8 +1063,71 @@ __device__ size_t getLocation(const CudaVec &shape, const CudaVec &strides, size
     return loc;
 }
 
-__global__ void CompactKernel(const scalar_t* a, scalar_t* out, size_t size, CudaVec shape,
-                              CudaVec strides, size_t offset) {
+struct StridedLayout {
+  /**
+   * A (shape, strides) pair with singleton dimensions dropped and adjacent dimensions merged
+   * whenever the outer one steps exactly over the inner one.  Compact views collapse to a single
+   * unit-stride dimension and most slices/broadcasts to one or two dimensions, which keeps the
+   * per-thread div/mod chain in getLocation() short.
+   */
+  std::vector<int32_t> shape, strides;
+  size_t size;
+};
+
+StridedLayout CollapseLayout(const std::vector<int32_t>& shape,
+                             const std::vector<int32_t>& strides) {
+  StridedLayout layout;
+  layout.size = 1;
+  for (size_t i = 0; i < shape.size(); i++) {
+    layout.size *= shape[i];
+    if (shape[i] == 1) continue;
+    if (!layout.shape.empty() && layout.strides.back() == strides[i] * shape[i]) {
+      layout.shape.back() *= shape[i];
+      layout.strides.back() = strides[i];
+    } else {
+      layout.shape.push_back(shape[i]);
+      layout.strides.push_back(strides[i]);
+    }
+  }
+  if (layout.shape.empty()) {
+    layout.shape.push_back(1);
+    layout.strides.push_back(1);
+  }
+  return layout;
+}
+
+// Rows at least this long use the row kernels below; shorter rows would leave most of a block idle
+#define ROW_KERNEL_MIN_INNER 64
+#define MAX_GRID_Y 65535
+#define TRANSPOSE_TILE 32
+#define TRANSPOSE_ROWS 8
+
+__device__ size_t RowLocation(const CudaVec& shape, const CudaVec& strides, size_t offset,
+                              size_t row) {
+  // location of the first element of a row of the innermost dimension
+  size_t loc = offset;
+  for (int32_t d = (int32_t)shape.size - 2; d >= 0; d--) {
+    loc += strides.data[d] * (row % shape.data[d]);
+    row /= shape.data[d];
+  }
+  return loc;
+}
+
+CudaDims CudaRows(size_t num_rows, size_t inner) {
+  /**
+   * Launch configuration for the row kernels: blockIdx.x covers the innermost dimension and
+   * blockIdx.y (grid-striding when there are more rows than MAX_GRID_Y) the rows.
+   */
+  CudaDims dim;
+  dim.block = dim3(BASE_THREAD_NUM, 1, 1);
+  dim.grid = dim3((inner + BASE_THREAD_NUM - 1) / BASE_THREAD_NUM,
+                  std::min<size_t>(num_rows, MAX_GRID_Y), 1);
+  return dim;
+}
+
+template <typename T>
+__global__ void CompactKernel(const T* a, T* out, size_t size, CudaVec shape, CudaVec strides,
+                              size_t offset) {
   /**
    * The CUDA kernel for the compact opeation.  This should effectively map a single entry in the 
    * non-compact input a, to the corresponding item (at location gid) in the compact array out.
@@ -110,13 +1143,88 @@ __global__ void CompactKernel(const scalar_t* a, scalar_t* out, size_t size, Cud
   size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
 
   /// BEGIN SOLUTION
-    size_t loc = getLocation(shape, strides, offset, gid);
     if (gid < size) {
+        size_t loc = getLocation(shape, strides, offset, gid);
         out[gid] = a[loc];
     }
   /// END SOLUTION
 }
 
+template <typename T>
+__global__ void CompactRowsKernel(const T* a, T* out, size_t num_rows, CudaVec shape,
+                                  CudaVec strides, size_t offset) {
+  /**
+   * Compact with one block row per row of the innermost dimension.  The row's base location is
+   * computed once per block and each thread then only adds col * inner_stride, so threads of a
+   * warp write consecutive items of out (and, for unit inner stride, read consecutive items of a).
+   */
+  __shared__ size_t base;
+  size_t inner = shape.data[shape.size - 1];
+  size_t inner_stride = strides.data[shape.size - 1];
+  size_t col = blockIdx.x * blockDim.x + threadIdx.x;
+  for (size_t row = blockIdx.y; row < num_rows; row += gridDim.y) {
+    if (threadIdx.x == 0) base = RowLocation(shape, strides, offset, row);
+    __syncthreads();
+    if (col < inner) out[row * inner + col] = a[base + col * inner_stride];
+    __syncthreads();
+  }
+}
+
+template <typename T>
+__global__ void CompactTransposeKernel(const T* a, T* out, size_t rows, size_t cols,
+                                       size_t col_stride, size_t offset) {
+  /**
+   * Compact a 2D view with strides (1, col_stride), i.e. a transpose.  Each block stages a
+   * TRANSPOSE_TILE x TRANSPOSE_TILE tile through shared memory so that both the reads from a
+   * (along rows) and the writes to out (along columns) are coalesced.  The tile is padded by one
+   * column to avoid shared memory bank conflicts.
+   */
+  __shared__ T tile[TRANSPOSE_TILE][TRANSPOSE_TILE + 1];
+  size_t i = blockIdx.x * TRANSPOSE_TILE + threadIdx.x;
+  for (size_t k = threadIdx.y; k < TRANSPOSE_TILE; k += TRANSPOSE_ROWS) {
+    size_t j = blockIdx.y * TRANSPOSE_TILE + k;
+    if (i < rows && j < cols) tile[k][threadIdx.x] = a[offset + i + j * col_stride];
+  }
+  __syncthreads();
+  size_t j = blockIdx.y * TRANSPOSE_TILE + threadIdx.x;
+  for (size_t k = threadIdx.y; k < TRANSPOSE_TILE; k += TRANSPOSE_ROWS) {
+    size_t i = blockIdx.x * TRANSPOSE_TILE + k;
+    if (i < rows && j < cols) out[i * cols + j] = tile[threadIdx.x][k];
+  }
+}
+
+template <typename T>
+void CompactItems(const T* a, T* out, size_t size, const std::vector<int32_t>& shape,
+                  const std::vector<int32_t>& strides, size_t offset) {
+  StridedLayout layout = CollapseLayout(shape, strides);
+  if (layout.size == 0) return;
+  size_t ndim = layout.shape.size();
+  size_t inner = layout.shape[ndim - 1];
+  size_t num_rows = layout.size / inner;
+
+  if (ndim == 1 && layout.strides[0] == 1) {
+    cudaError_t err = cudaMemcpyAsync(out, a + offset, layout.size * sizeof(T),
+                                      cudaMemcpyDeviceToDevice, CurrentStream());
+    if (err != cudaSuccess) throw std::runtime_error(cudaGetErrorString(err));
+  } else if (ndim == 2 && layout.strides[0] == 1 && layout.strides[1] > 1 &&
+             (inner + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE <= MAX_GRID_Y) {
+    size_t rows = layout.shape[0];
+    dim3 grid((rows + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE,
+              (inner + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE, 1);
+    dim3 block(TRANSPOSE_TILE, TRANSPOSE_ROWS, 1);
+    CompactTransposeKernel<<<grid, block, 0, CurrentStream()>>>(a, out, rows, inner,
+                                                                layout.strides[1], offset);
+  } else if (inner >= ROW_KERNEL_MIN_INNER) {
+    CudaDims dim = CudaRows(num_rows, inner);
+    CompactRowsKernel<<<dim.grid, dim.block, 0, CurrentStream()>>>(
+        a, out, num_rows, VecToCuda(layout.shape), VecToCuda(layout.strides), offset);
+  } else {
+    CudaDims dim = CudaOneDim(size);
+    CompactKernel<<<dim.grid, dim.block, 0, CurrentStream()>>>(
+        a, out, size, VecToCuda(layout.shape), VecToCuda(layout.strides), offset);
+  }
+}
+
 void Compact(const CudaArray& a, CudaArray* out, std::vector<int32_t> shape,
              std::vector<int32_t> strides, size_t offset) {
   /**
@@ -125,6 +1233,10 @@ void Compact(const CudaArray& a, CudaArray* out, std::vector<int32_t> shape,
    * you the code for this fuction, and also the prototype for the CompactKernel() function).  For
    * the functions after this, however, you'll need to define these kernels as you see fit to 
    * execute the underlying function.
+   *
+   * The layout is first collapsed on the host, and then dispatched to a device-to-device copy
+   * (already contiguous), a shared-memory transpose (2D with unit outer stride), the row kernel
+   * (long innermost rows), or the generic per-item kernel over the collapsed dimensions.
    * 
    * Args:
    *   a: non-compact represntation of the array, given as input
@@ -133,20 +1245,23 @@ void Compact(const CudaArray& a, CudaArray* out, std::vector<int32_t> shape,
    *   strides: strides of the *a* array (not out, which has compact strides)
    *   offset: offset of the *a* array (not out, which has zero offset, being compact)
    */
-
-  // Nothing needs to be added here
-  CudaDims dim = CudaOneDim(out->size);
-  CompactKernel<<<dim.grid, dim.block>>>(a.ptr, out->ptr, out->size, VecToCuda(shape),
-                                         VecToCuda(strides), offset);
+  CheckDType(a, *out, "compact");
+  if (out->dtype == DTYPE_INT8) {
+    CompactItems(a.data<int8_t>(), out->data<int8_t>(), out->size, shape, strides, offset);
+    return;
+  }
+  DISPATCH_DTYPE(out->dtype, T, CompactItems(a.data<T>(), out->data<T>(), out->size, shape,
+                                             strides, offset));
 }
 
 
-__global__ void EwiseSetitemKernel(const scalar_t* a, scalar_t* out, size_t size, CudaVec shape,
+template <typename T>
+__global__ void EwiseSetitemKernel(const T* a, T* out, size_t size, CudaVec shape,
                                    CudaVec strides, size_t offset) {
     size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
 
-    size_t loc = getLocation(shape, strides, offset, gid);
     if (gid < size) {
+        size_t loc = getLocation(shape, strides, offset, gid);
         out[loc] = a[gid];
     }
 }
@@ -166,20 +1281,39 @@ void EwiseSetitem(const CudaArray& a, CudaArray* out, std::vector<int32_t> shape
    *   offset: offset of the *out* array (not a, which has zero offset, being compact)
    */
   /// BEGIN SOLUTION
+  CheckDType(a, *out, "ewise_setitem");
+  StridedLayout layout = CollapseLayout(shape, strides);
+  if (layout.size == 0) return;
+  if (layout.shape.size() == 1 && layout.strides[0] == 1) {
+    cudaError_t err =
+        cudaMemcpyAsync((char*)out->ptr + offset * out->itemsize(), a.ptr,
+                        layout.size * a.itemsize(), cudaMemcpyDeviceToDevice, CurrentStream());
+    if (err != cudaSuccess) throw std::runtime_error(cudaGetErrorString(err));
+    return;
+  }
   CudaDims dim = CudaOneDim(a.size);
-  EwiseSetitemKernel<<<dim.grid, dim.block>>>(a.ptr, out->ptr, a.size, VecToCuda(shape),
-                                         VecToCuda(strides), offset);
+  if (out->dtype == DTYPE_INT8) {
+    EwiseSetitemKernel<<<dim.grid, dim.block, 0, CurrentStream()>>>(
+        a.data<int8_t>(), out->data<int8_t>(), a.size, VecToCuda(layout.shape),
+        VecToCuda(layout.strides), offset);
+    return;
+  }
+  DISPATCH_DTYPE(out->dtype, T,
+                 EwiseSetitemKernel<<<dim.grid, dim.block, 0, CurrentStream()>>>(
+                     a.data<T>(), out->data<T>(), a.size, VecToCuda(layout.shape),
+                     VecToCuda(layout.strides), offset));
   /// END SOLUTION
 }
 
 
-__global__ void ScalarSetitemKernel(const scalar_t val, scalar_t* out, size_t size, CudaVec shape,
+template <typename T>
+__global__ void ScalarSetitemKernel(const scalar_t val, T* out, size_t size, CudaVec shape,
                                    CudaVec strides, size_t offset) {
     size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
 
-    size_t loc = getLocation(shape, strides, offset, gid);
     if (gid < size) {
-        out[loc] = val;
+        size_t loc = getLocation(shape, strides, offset, gid);
+        out[loc] = FromFloat<T>(val);
     }
 }
 
@@ -200,198 +1334,921 @@ void ScalarSetitem(size_t size, scalar_t val, CudaArray* out, std::vector<int32_
    *   offset: offset of the out array
    */
   /// BEGIN SOLUTION
+  StridedLayout layout = CollapseLayout(shape, strides);
+  if (layout.size == 0) return;
   CudaDims dim = CudaOneDim(size);
-  ScalarSetitemKernel<<<dim.grid, dim.block>>>(val, out->ptr, size, VecToCuda(shape),
-                                         VecToCuda(strides), offset);
+  DISPATCH_DTYPE(out->dtype, T,
+                 ScalarSetitemKernel<<<dim.grid, dim.block, 0, CurrentStream()>>>(
+                     val, out->data<T>(), size, VecToCuda(layout.shape),
+                     VecToCuda(layout.strides), offset));
   /// END SOLUTION
 }
 
+template <typename Src, typename Dst>
+__global__ void AsTypeKernel(const Src* a, Dst* out, size_t size) {
+  size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
+  if (gid < size) out[gid] = FromFloat<Dst>(ToFloat(a[gid]));
+}
+
+void AsType(const CudaArray& a, CudaArray* out) {
+  /**
+   * Convert the compact array a into out, which has the same size and any dtype (to int8 by
+   * rounding and saturating).
+   */
+  if (a.size != out->size) throw std::invalid_argument("astype: arrays of different sizes");
+  if (out->size == 0) return;
+  CudaDims dim = CudaOneDim(out->size);
+  if (a.dtype == DTYPE_INT8 && out->dtype == DTYPE_INT8) {
+    CheckCuda(cudaMemcpyAsync(out->ptr, a.ptr, a.size, cudaMemcpyDeviceToDevice,
+                              CurrentStream()));
+  } else if (a.dtype == DTYPE_INT8) {
+    DISPATCH_DTYPE(out->dtype, Dst,
+                   AsTypeKernel<<<dim.grid, dim.block, 0, CurrentStream()>>>(
+                       a.data<int8_t>(), out->data<Dst>(), out->size));
+  } else if (out->dtype == DTYPE_INT8) {
+    DISPATCH_DTYPE(a.dtype, Src,
+                   AsTypeKernel<<<dim.grid, dim.block, 0, CurrentStream()>>>(
+                       a.data<Src>(), out->data<int8_t>(), out->size));
+  } else {
+    DISPATCH_DTYPE(a.dtype, Src,
+                   DISPATCH_DTYPE(out->dtype, Dst,
+                                  AsTypeKernel<<<dim.grid, dim.block, 0, CurrentStream()>>>(
+                                      a.data<Src>(), out->data<Dst>(), out->size)));
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Elementwise and scalar operations
 ////////////////////////////////////////////////////////////////////////////////
 
-__global__ void EwiseAddKernel(const scalar_t* a, const scalar_t* b, scalar_t* out, size_t size) {
-  size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
-  if (gid < size) out[gid] = a[gid] + b[gid];
+/**
+ * The transcendental functions of the element-wise, fused, epilogue and softmax kernels.  By
+ * default these are the CUDA math library's expf, logf, tanhf and powf (within 2 ulp of
+ * correctly rounded).  Building with NEEDLE_CUDA_FAST_MATH defined (cmake
+ * -DNEEDLE_CUDA_FAST_MATH=ON) switches them to the hardware approximations __expf, __logf and
+ * __powf, which are several times faster but lose accuracy: their error grows with |x| for exp
+ * (about 2 + 1.2|x| ulp), is bounded by 2^-21 absolutely rather than relatively for log near
+ * 1, and powf(x, y) becomes exp2(y * log2(x)), which is NaN for x < 0 even at integer y.  tanh
+ * then goes through __expf as well, to about 1e-7 absolute error.
+ *
+ * DevicePow() takes shortcuts for the exponents common in models (x^2, x^0.5, ...), which are
+ * exact or within an ulp on either path.  In ScalarPower the exponent is the same for every
+ * thread, so the branches do not diverge.
+ */
+#ifdef NEEDLE_CUDA_FAST_MATH
+__device__ __forceinline__ scalar_t DeviceExp(scalar_t x) { return __expf(x); }
+__device__ __forceinline__ scalar_t DeviceLog(scalar_t x) { return __logf(x); }
+__device__ __forceinline__ scalar_t DeviceTanh(scalar_t x) {
+  return 1 - 2 / (__expf(2 * x) + 1);  // saturates to +-1 as __expf goes to inf or 0
+}
+__device__ __forceinline__ scalar_t DevicePowGeneral(scalar_t x, scalar_t y) {
+  return __powf(x, y);
+}
+#else
+__device__ __forceinline__ scalar_t DeviceExp(scalar_t x) { return expf(x); }
+__device__ __forceinline__ scalar_t DeviceLog(scalar_t x) { return logf(x); }
+__device__ __forceinline__ scalar_t DeviceTanh(scalar_t x) { return tanhf(x); }
+__device__ __forceinline__ scalar_t DevicePowGeneral(scalar_t x, scalar_t y) { return powf(x, y); }
+#endif
+
+__device__ __forceinline__ scalar_t DevicePow(scalar_t x, scalar_t y) {
+  if (y == 2) return x * x;
+  if (y == 0.5f) return sqrtf(x);  // differs from powf only for x = -0 and -inf
+  if (y == 1) return x;
+  if (y == 0) return 1;  // even for NaN, like powf
+  if (y == -1) return 1 / x;
+  if (y == 3) return x * x * x;
+  if (y == -0.5f) return rsqrtf(x);
+  return DevicePowGeneral(x, y);
 }
 
-void EwiseAdd(const CudaArray& a, const CudaArray& b, CudaArray* out) {
+// four contiguous items, 4 * sizeof(item) aligned, converted to / from float
+__device__ __forceinline__ float4 Load4(const scalar_t* p) {
+  return *reinterpret_cast<const float4*>(p);
+}
+
+__device__ __forceinline__ float4 Load4(const float16_t* p) {
+  float2 lo = __half22float2(reinterpret_cast<const __half2*>(p)[0]);
+  float2 hi = __half22float2(reinterpret_cast<const __half2*>(p)[1]);
+  return make_float4(lo.x, lo.y, hi.x, hi.y);
+}
+
+__device__ __forceinline__ float4 Load4(const bfloat16_t* p) {
+  float2 lo = __bfloat1622float2(reinterpret_cast<const __nv_bfloat162*>(p)[0]);
+  float2 hi = __bfloat1622float2(reinterpret_cast<const __nv_bfloat162*>(p)[1]);
+  return make_float4(lo.x, lo.y, hi.x, hi.y);
+}
+
+__device__ __forceinline__ void Store4(scalar_t* p, float4 v) {
+  *reinterpret_cast<float4*>(p) = v;
+}
+
+__device__ __forceinline__ void Store4(float16_t* p, float4 v) {
+  reinterpret_cast<__half2*>(p)[0] = __floats2half2_rn(v.x, v.y);
+  reinterpret_cast<__half2*>(p)[1] = __floats2half2_rn(v.z, v.w);
+}
+
+__device__ __forceinline__ void Store4(bfloat16_t* p, float4 v) {
+  reinterpret_cast<__nv_bfloat162*>(p)[0] = __floats2bfloat162_rn(v.x, v.y);
+  reinterpret_cast<__nv_bfloat162*>(p)[1] = __floats2bfloat162_rn(v.z, v.w);
+}
+
+/**
+ * The engine behind the element-wise, scalar and unary operators, compact or strided.  The
+ * operators are functors of floats (below), and an operand is a source handing out items as
+ * floats: an ArraySrc for a compact array, a StridedSrc for a view given by (strides, offset),
+ * where a stride of 0 broadcasts the view along that dimension without materializing it (a bias
+ * row, a scalar tensor), or a ScalarSrc for a scalar.
+ *
+ * The kernels are pure bandwidth, so each thread moves four items at a time as one float4 (two
+ * __half2 for 16-bit types) whenever every array is suitably aligned, falling back to one item
+ * at a time otherwise.  Strided views are vectorized along their innermost dimension when it
+ * has a multiple of four items, every operand steps by 0 or 1 along it and the rows of those
+ * stepping by 1 stay aligned.  The grid is sized to fill the SMs (CudaGridStride()) and each
+ * thread loops over the items with a grid stride, rather than launching one thread per item.
+ */
+#define BINARY_FUNCTOR(NAME, EXPR)                                                \
+  struct NAME {                                                                   \
+    __device__ scalar_t operator()(scalar_t x, scalar_t y) const { return EXPR; } \
+  };
+
+#define UNARY_FUNCTOR(NAME, EXPR)                                     \
+  struct NAME {                                                       \
+    __device__ scalar_t operator()(scalar_t x) const { return EXPR; } \
+  };
+
+BINARY_FUNCTOR(AddFn, x + y)
+BINARY_FUNCTOR(MulFn, x * y)
+BINARY_FUNCTOR(DivFn, x / y)
+BINARY_FUNCTOR(PowerFn, DevicePow(x, y))
+BINARY_FUNCTOR(MaximumFn, max(x, y))
+BINARY_FUNCTOR(EqFn, scalar_t(x == y))
+BINARY_FUNCTOR(GeFn, scalar_t(x >= y))
+UNARY_FUNCTOR(LogFn, DeviceLog(x))
+UNARY_FUNCTOR(ExpFn, DeviceExp(x))
+UNARY_FUNCTOR(TanhFn, DeviceTanh(x))
+
+template <typename Op>
+struct UnaryFn {
+  // a unary operator run by the engine as a binary one, whose second operand is ignored
+  __device__ scalar_t operator()(scalar_t x, scalar_t) const { return Op()(x); }
+};
+
+#define ELEMENTWISE_BLOCKS_PER_SM 4
+
+int NumSMs() {
+  // cached per device (and thread, like CurrentStreamSlot(), so no lock)
+  static thread_local std::vector<int> counts;
+  int device = CurrentDevice();
+  if ((size_t)device >= counts.size()) counts.resize(device + 1, 0);
+  if (counts[device] == 0)
+    CheckCuda(cudaDeviceGetAttribute(&counts[device], cudaDevAttrMultiProcessorCount, device));
+  return counts[device];
+}
+
+CudaDims CudaGridStride(size_t work) {
   /**
-   * Add together two CUDA array
+   * Dimensions for a grid-stride loop over work items: one thread per item up to
+   * ELEMENTWISE_BLOCKS_PER_SM blocks per SM, each thread taking several items beyond that.
    */
-  CudaDims dim = CudaOneDim(out->size);
-  EwiseAddKernel<<<dim.grid, dim.block>>>(a.ptr, b.ptr, out->ptr, out->size);
+  CudaDims dim;
+  size_t num_blocks = (work + BASE_THREAD_NUM - 1) / BASE_THREAD_NUM;
+  num_blocks = std::min(num_blocks, (size_t)NumSMs() * ELEMENTWISE_BLOCKS_PER_SM);
+  dim.block = dim3(BASE_THREAD_NUM, 1, 1);
+  dim.grid = dim3(std::max<size_t>(num_blocks, 1), 1, 1);
+  return dim;
 }
 
-__global__ void ScalarAddKernel(const scalar_t* a, scalar_t val, scalar_t* out, size_t size) {
-  size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
-  if (gid < size) out[gid] = a[gid] + val;
+template <typename T>
+inline bool Aligned4(const T* p) {
+  // whether Load4()/Store4() can access p
+  return (uintptr_t)p % (4 * sizeof(T)) == 0;
+}
+
+template <typename T>
+struct ArraySrc {
+  const T* p;
+  bool Vectorizable() const { return Aligned4(p); }
+  __device__ scalar_t Get(size_t i) const { return ToFloat(p[i]); }
+  __device__ float4 Get4(size_t i) const { return Load4(p + i); }
+};
+
+template <typename T>
+struct StridedSrc {
+  const T* p;
+  CudaVec strides;
+  size_t offset;
+  bool Vectorizable() const {
+    // broadcast along the innermost dimension, or reading aligned groups of four along it
+    int32_t inner = strides.data[strides.size - 1];
+    if (inner == 0) return true;
+    if (inner != 1 || offset % 4 != 0 || !Aligned4(p)) return false;
+    for (uint32_t d = 0; d + 1 < strides.size; d++)
+      if (strides.data[d] % 4 != 0) return false;
+    return true;
+  }
+  __device__ size_t Start() const { return offset; }
+  __device__ size_t Step(int32_t dim, size_t index) const { return strides.data[dim] * index; }
+  __device__ scalar_t Get(size_t loc) const { return ToFloat(p[loc]); }
+  __device__ float4 Get4(size_t loc) const {
+    // the same for every thread of the launch, so the branch does not diverge
+    if (strides.data[strides.size - 1] != 0) return Load4(p + loc);
+    scalar_t x = ToFloat(p[loc]);
+    return make_float4(x, x, x, x);
+  }
+};
+
+struct ScalarSrc {
+  scalar_t val;
+  bool Vectorizable() const { return true; }
+  __device__ size_t Start() const { return 0; }
+  __device__ size_t Step(int32_t, size_t) const { return 0; }
+  __device__ scalar_t Get(size_t) const { return val; }
+  __device__ float4 Get4(size_t) const { return make_float4(val, val, val, val); }
+};
+
+template <typename Op>
+__device__ __forceinline__ float4 Apply4(float4 x, float4 y) {
+  Op op;
+  return make_float4(op(x.x, y.x), op(x.y, y.y), op(x.z, y.z), op(x.w, y.w));
+}
+
+template <typename Op, typename T, typename A, typename B>
+__global__ void EwiseKernel(A a, B b, T* out, size_t size, bool vec) {
+  // out[i] = Op(a[i], b[i]) for compact operands, four items per step when vec
+  size_t stride = (size_t)gridDim.x * blockDim.x;
+  size_t tid = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  size_t head = 0;
+  if (vec) {
+    head = size / 4 * 4;
+    for (size_t i = tid * 4; i < head; i += stride * 4)
+      Store4(out + i, Apply4<Op>(a.Get4(i), b.Get4(i)));
+  }
+  for (size_t i = head + tid; i < size; i += stride)
+    out[i] = FromFloat<T>(Op()(a.Get(i), b.Get(i)));
+}
+
+template <typename Op, typename T, typename A, typename B>
+__global__ void EwiseStridedKernel(A a, B b, T* out, size_t size, CudaVec shape, bool vec) {
+  // out[i] = Op(a[...], b[...]) with out compact, a and b located by shape and their strides;
+  // when vec, the innermost dimension is a multiple of 4 and each step does 4 items of it
+  size_t width = vec ? 4 : 1;
+  size_t stride = (size_t)gridDim.x * blockDim.x * width;
+  for (size_t i = ((size_t)blockIdx.x * blockDim.x + threadIdx.x) * width; i < size; i += stride) {
+    size_t a_loc = a.Start(), b_loc = b.Start(), rest = i;
+    for (int32_t d = (int32_t)shape.size - 1; d >= 0; d--) {
+      size_t index = rest % shape.data[d];
+      rest /= shape.data[d];
+      a_loc += a.Step(d, index);
+      b_loc += b.Step(d, index);
+    }
+    if (vec) {
+      Store4(out + i, Apply4<Op>(a.Get4(a_loc), b.Get4(b_loc)));
+    } else {
+      out[i] = FromFloat<T>(Op()(a.Get(a_loc), b.Get(b_loc)));
+    }
+  }
+}
+
+template <typename Op, typename T, typename A, typename B>
+void LaunchEwise(A a, B b, T* out, size_t size) {
+  if (size == 0) return;
+  bool vec = a.Vectorizable() && b.Vectorizable() && Aligned4(out);
+  CudaDims dim = CudaGridStride(vec ? std::max<size_t>(size / 4, 1) : size);
+  EwiseKernel<Op, T><<<dim.grid, dim.block, 0, CurrentStream()>>>(a, b, out, size, vec);
+}
+
+template <typename Op, typename T, typename A, typename B>
+void LaunchEwiseStrided(A a, B b, T* out, const StridedLayout& layout) {
+  if (layout.size == 0) return;
+  bool vec = layout.shape.back() % 4 == 0 && a.Vectorizable() && b.Vectorizable() &&
+             Aligned4(out);
+  CudaDims dim = CudaGridStride(vec ? layout.size / 4 : layout.size);
+  EwiseStridedKernel<Op, T><<<dim.grid, dim.block, 0, CurrentStream()>>>(
+      a, b, out, layout.size, VecToCuda(layout.shape), vec);
+}
+
+template <typename Op>
+void EwiseBinary(const CudaArray& a, const CudaArray& b, CudaArray* out, const char* kernel) {
+  CheckDType(a, *out, kernel);
+  CheckDType(b, *out, kernel);
+  DISPATCH_DTYPE(out->dtype, T,
+                 LaunchEwise<Op>(ArraySrc<T>{a.data<T>()}, ArraySrc<T>{b.data<T>()},
+                                 out->data<T>(), out->size));
+}
+
+template <typename Op>
+void ScalarBinary(const CudaArray& a, scalar_t val, CudaArray* out, const char* kernel) {
+  CheckDType(a, *out, kernel);
+  DISPATCH_DTYPE(out->dtype, T,
+                 LaunchEwise<Op>(ArraySrc<T>{a.data<T>()}, ScalarSrc{val}, out->data<T>(),
+                                 out->size));
+}
+
+template <typename Op>
+void EwiseUnary(const CudaArray& a, CudaArray* out, const char* kernel) {
+  CheckDType(a, *out, kernel);
+  DISPATCH_DTYPE(out->dtype, T,
+                 LaunchEwise<UnaryFn<Op>>(ArraySrc<T>{a.data<T>()}, ScalarSrc{0},
+                                          out->data<T>(), out->size));
+}
+
+void EwiseAdd(const CudaArray& a, const CudaArray& b, CudaArray* out) {
+  /**
+   * Add together two CUDA array
+   */
+  EwiseBinary<AddFn>(a, b, out, "ewise_add");
 }
 
 void ScalarAdd(const CudaArray& a, scalar_t val, CudaArray* out) {
   /**
    * Add together a CUDA array and a scalar value.
    */
-  CudaDims dim = CudaOneDim(out->size);
-  ScalarAddKernel<<<dim.grid, dim.block>>>(a.ptr, val, out->ptr, out->size);
+  ScalarBinary<AddFn>(a, val, out, "scalar_add");
 }
 
-/**
- * In the code the follows, use the above template to create analogous elementise
- * and and scalar operators for the following functions.  See the numpy backend for
- * examples of how they should work.
- *   - EwiseMul, ScalarMul
- *   - EwiseDiv, ScalarDiv
- *   - ScalarPower
- *   - EwiseMaximum, ScalarMaximum
- *   - EwiseEq, ScalarEq
- *   - EwiseGe, ScalarGe
- *   - EwiseLog
- *   - EwiseExp
- *   - EwiseTanh
- *
- * If you implement all these naively, there will be a lot of repeated code, so
- * you are welcome (but not required), to use macros or templates to define these
- * functions (however you want to do so, as long as the functions match the proper)
- * signatures above.
- */
-
-#define ELEMENTWISE_OP_KERNEL(NAME, OP) \
-__global__ void NAME##Kernel(const scalar_t* a, const scalar_t* b, scalar_t* out, size_t size) { \
-    size_t gid = blockIdx.x * blockDim.x + threadIdx.x; \
-    if (gid < size) out[gid] = scalar_t(a[gid] OP b[gid]); \
-}                                       \
-
-#define ELEMENTWISE_1_param_FUNC_KERNEL(NAME, FUNC) \
-__global__ void NAME##Kernel(const scalar_t* a, scalar_t* out, size_t size) { \
-    size_t gid = blockIdx.x * blockDim.x + threadIdx.x; \
-    if (gid < size) out[gid] = FUNC(a[gid]); \
-}                                                    \
-
-#define ELEMENTWISE_2_params_FUNC_KERNEL(NAME, FUNC) \
-__global__ void NAME##Kernel(const scalar_t* a, const scalar_t* b, scalar_t* out, size_t size) { \
-    size_t gid = blockIdx.x * blockDim.x + threadIdx.x; \
-    if (gid < size) out[gid] = FUNC(a[gid], b[gid]); \
-} \
-
-#define SCALAR_OP_KERNEL(NAME, OP) \
-__global__ void NAME##Kernel(const scalar_t* a, scalar_t val, scalar_t* out, size_t size) { \
-    size_t gid = blockIdx.x * blockDim.x + threadIdx.x; \
-    if (gid < size) out[gid] = scalar_t(a[gid] OP val); \
-}                                  \
-
-#define SCALAR_FUNC_KERNEL(NAME, FUNC) \
-__global__ void NAME##Kernel(const scalar_t* a, scalar_t val, scalar_t* out, size_t size) { \
-    size_t gid = blockIdx.x * blockDim.x + threadIdx.x; \
-    if (gid < size) out[gid] = FUNC(a[gid], val); \
-} \
-
-ELEMENTWISE_OP_KERNEL(EwiseMul, *)
-ELEMENTWISE_OP_KERNEL(EwiseDiv, /)
-ELEMENTWISE_2_params_FUNC_KERNEL(EwiseMaximum, max)
-ELEMENTWISE_OP_KERNEL(EwiseEq, ==)
-ELEMENTWISE_OP_KERNEL(EwiseGe, >=)
-ELEMENTWISE_1_param_FUNC_KERNEL(EwiseLog, logf)
-ELEMENTWISE_1_param_FUNC_KERNEL(EwiseExp, expf)
-ELEMENTWISE_1_param_FUNC_KERNEL(EwiseTanh, tanhf)
-
-SCALAR_OP_KERNEL(ScalarMul, *)
-SCALAR_OP_KERNEL(ScalarDiv, /)
-SCALAR_FUNC_KERNEL(ScalarMaximum, max)
-SCALAR_OP_KERNEL(ScalarEq, ==)
-SCALAR_OP_KERNEL(ScalarGe, >=)
-SCALAR_FUNC_KERNEL(ScalarPower, powf)
-
 void EwiseMul(const CudaArray& a, const CudaArray& b, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    EwiseMulKernel<<<dim.grid, dim.block>>>(a.ptr, b.ptr, out->ptr, out->size);
+  EwiseBinary<MulFn>(a, b, out, "ewise_mul");
 }
 
 void EwiseDiv(const CudaArray& a, const CudaArray& b, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    EwiseDivKernel<<<dim.grid, dim.block>>>(a.ptr, b.ptr, out->ptr, out->size);
+  EwiseBinary<DivFn>(a, b, out, "ewise_div");
 }
 
 void EwiseMaximum(const CudaArray& a, const CudaArray& b, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    EwiseMaximumKernel<<<dim.grid, dim.block>>>(a.ptr, b.ptr, out->ptr, out->size);
+  EwiseBinary<MaximumFn>(a, b, out, "ewise_maximum");
 }
 
 void EwiseEq(const CudaArray& a, const CudaArray& b, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    EwiseEqKernel<<<dim.grid, dim.block>>>(a.ptr, b.ptr, out->ptr, out->size);
+  EwiseBinary<EqFn>(a, b, out, "ewise_eq");
 }
 
 void EwiseGe(const CudaArray& a, const CudaArray& b, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    EwiseGeKernel<<<dim.grid, dim.block>>>(a.ptr, b.ptr, out->ptr, out->size);
+  EwiseBinary<GeFn>(a, b, out, "ewise_ge");
 }
 
-void EwiseLog(const CudaArray& a, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    EwiseLogKernel<<<dim.grid, dim.block>>>(a.ptr, out->ptr, out->size);
-}
+void EwiseLog(const CudaArray& a, CudaArray* out) { EwiseUnary<LogFn>(a, out, "ewise_log"); }
 
-void EwiseExp(const CudaArray& a, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    EwiseExpKernel<<<dim.grid, dim.block>>>(a.ptr, out->ptr, out->size);
-}
+void EwiseExp(const CudaArray& a, CudaArray* out) { EwiseUnary<ExpFn>(a, out, "ewise_exp"); }
 
-void EwiseTanh(const CudaArray& a, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    EwiseTanhKernel<<<dim.grid, dim.block>>>(a.ptr, out->ptr, out->size);
-}
+void EwiseTanh(const CudaArray& a, CudaArray* out) { EwiseUnary<TanhFn>(a, out, "ewise_tanh"); }
 
 void ScalarMul(const CudaArray& a, scalar_t val, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    ScalarMulKernel<<<dim.grid, dim.block>>>(a.ptr, val, out->ptr, out->size);
+  ScalarBinary<MulFn>(a, val, out, "scalar_mul");
 }
 
 void ScalarDiv(const CudaArray& a, scalar_t val, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    ScalarDivKernel<<<dim.grid, dim.block>>>(a.ptr, val, out->ptr, out->size);
+  ScalarBinary<DivFn>(a, val, out, "scalar_div");
 }
 
 void ScalarMaximum(const CudaArray& a, scalar_t val, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    ScalarMaximumKernel<<<dim.grid, dim.block>>>(a.ptr, val, out->ptr, out->size);
+  ScalarBinary<MaximumFn>(a, val, out, "scalar_maximum");
 }
 
 void ScalarEq(const CudaArray& a, scalar_t val, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    ScalarEqKernel<<<dim.grid, dim.block>>>(a.ptr, val, out->ptr, out->size);
+  ScalarBinary<EqFn>(a, val, out, "scalar_eq");
 }
 
 void ScalarGe(const CudaArray& a, scalar_t val, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    ScalarGeKernel<<<dim.grid, dim.block>>>(a.ptr, val, out->ptr, out->size);
+  ScalarBinary<GeFn>(a, val, out, "scalar_ge");
 }
 
 void ScalarPower(const CudaArray& a, scalar_t val, CudaArray* out) {
-    CudaDims dim = CudaOneDim(out->size);
-    ScalarPowerKernel<<<dim.grid, dim.block>>>(a.ptr, val, out->ptr, out->size);
+  ScalarBinary<PowerFn>(a, val, out, "scalar_power");
+}
+
+/**
+ * Strided variants of the element-wise, scalar and unary operators, which read broadcast,
+ * permuted or sliced inputs in place given the (shape, strides, offset) of each input view,
+ * instead of requiring a compact() copy first.  out is always compact.  The layouts are
+ * collapsed on the host (jointly for two inputs), so the per-thread div/mod chain only runs
+ * over the dimensions that are left.
+ */
+void CollapseLayoutPair(const std::vector<int32_t>& shape, const std::vector<int32_t>& a_strides,
+                        const std::vector<int32_t>& b_strides, StridedLayout* a,
+                        StridedLayout* b) {
+  // CollapseLayout() for two views of one shape, merging dimensions only where both allow it
+  a->size = 1;
+  for (size_t i = 0; i < shape.size(); i++) {
+    a->size *= shape[i];
+    if (shape[i] == 1) continue;
+    if (!a->shape.empty() && a->strides.back() == a_strides[i] * shape[i] &&
+        b->strides.back() == b_strides[i] * shape[i]) {
+      a->shape.back() *= shape[i];
+      a->strides.back() = a_strides[i];
+      b->strides.back() = b_strides[i];
+    } else {
+      a->shape.push_back(shape[i]);
+      a->strides.push_back(a_strides[i]);
+      b->strides.push_back(b_strides[i]);
+    }
+  }
+  if (a->shape.empty()) {
+    a->shape.push_back(1);
+    a->strides.push_back(1);
+    b->strides.push_back(1);
+  }
+  b->shape = a->shape;
+  b->size = a->size;
+}
+
+template <typename Op>
+void EwiseStrided(const CudaArray& a, const CudaArray& b, CudaArray* out,
+                  std::vector<int32_t> shape, std::vector<int32_t> a_strides, size_t a_offset,
+                  std::vector<int32_t> b_strides, size_t b_offset) {
+  CheckDType(a, *out, "ewise_strided");
+  CheckDType(b, *out, "ewise_strided");
+  StridedLayout a_layout, b_layout;
+  CollapseLayoutPair(shape, a_strides, b_strides, &a_layout, &b_layout);
+  DISPATCH_DTYPE(out->dtype, T,
+                 LaunchEwiseStrided<Op>(
+                     StridedSrc<T>{a.data<T>(), VecToCuda(a_layout.strides), a_offset},
+                     StridedSrc<T>{b.data<T>(), VecToCuda(b_layout.strides), b_offset},
+                     out->data<T>(), a_layout));
+}
+
+template <typename Op>
+void ScalarStrided(const CudaArray& a, scalar_t val, CudaArray* out, std::vector<int32_t> shape,
+                   std::vector<int32_t> strides, size_t offset) {
+  CheckDType(a, *out, "scalar_strided");
+  StridedLayout layout = CollapseLayout(shape, strides);
+  DISPATCH_DTYPE(out->dtype, T,
+                 LaunchEwiseStrided<Op>(
+                     StridedSrc<T>{a.data<T>(), VecToCuda(layout.strides), offset},
+                     ScalarSrc{val}, out->data<T>(), layout));
+}
+
+template <typename Op>
+void UnaryStrided(const CudaArray& a, CudaArray* out, std::vector<int32_t> shape,
+                  std::vector<int32_t> strides, size_t offset) {
+  CheckDType(a, *out, "unary_strided");
+  StridedLayout layout = CollapseLayout(shape, strides);
+  DISPATCH_DTYPE(out->dtype, T,
+                 LaunchEwiseStrided<UnaryFn<Op>>(
+                     StridedSrc<T>{a.data<T>(), VecToCuda(layout.strides), offset},
+                     ScalarSrc{0}, out->data<T>(), layout));
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
-// Elementwise and scalar operations
+// Fused element-wise programs
 ////////////////////////////////////////////////////////////////////////////////
 
-__global__ void MatmulKernel(const scalar_t* a, const scalar_t* b, scalar_t* out, uint32_t M, uint32_t N,
-                             uint32_t P, size_t size) {
-    size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
-//    size_t x = gid / P % M;
-    size_t x = gid / P;
-    size_t y = gid % P;
-    scalar_t sum = 0;
-    if (gid < size) {
-        for (size_t i = 0; i < N; i++) {
-            sum += a[x * N + i] * b[i * P + y];
+/**
+ * A chain of element-wise and scalar operators recorded by fuse() in ndarray.py, as a register
+ * bytecode of four int32s per instruction (opcode, dst, a, b): for FUSED_LOAD `a` indexes the
+ * inputs, for FUSED_SCALAR the scalars, otherwise `a` and `b` are source registers, and the result
+ * is the last instruction's dst.  Each thread interprets the whole program for one output
+ * element, reading every input in place through its own strides over the common (collapsed)
+ * shape, so the chain is one launch and one pass over memory no matter how long it is.  The
+ * program travels in the kernel parameters, like CudaVec, so launches never share state.
+ */
+#define FUSED_MAX_REGISTERS 16
+#define FUSED_MAX_INSTRS 64
+#define FUSED_MAX_INPUTS 8
+#define FUSED_MAX_SCALARS 16
+
+enum FusedOpcode {
+  // must match FUSED_OPCODES in ndarray.py
+  FUSED_LOAD,
+  FUSED_SCALAR,
+  FUSED_ADD,
+  FUSED_SUB,
+  FUSED_MUL,
+  FUSED_DIV,
+  FUSED_POWER,
+  FUSED_MAXIMUM,
+  FUSED_EQ,
+  FUSED_GE,
+  FUSED_NEG,
+  FUSED_LOG,
+  FUSED_EXP,
+  FUSED_TANH,
+  FUSED_NUM_OPCODES
+};
+
+struct FusedProgram {
+  int32_t num_instrs;
+  int32_t code[FUSED_MAX_INSTRS][4];
+  scalar_t scalars[FUSED_MAX_SCALARS];
+  uint32_t num_inputs;
+  const scalar_t* inputs[FUSED_MAX_INPUTS];
+  size_t offsets[FUSED_MAX_INPUTS];
+  int32_t strides[FUSED_MAX_INPUTS][MAX_VEC_SIZE];
+  CudaVec shape;
+};
+
+__device__ scalar_t EvalFused(const FusedProgram& prog, size_t gid) {
+  // run the program for item gid of the (collapsed) shape
+  size_t locs[FUSED_MAX_INPUTS];
+  for (uint32_t k = 0; k < prog.num_inputs; k++) locs[k] = prog.offsets[k];
+  size_t rest = gid;
+  for (int32_t d = (int32_t)prog.shape.size - 1; d >= 0; d--) {
+    size_t index = rest % prog.shape.data[d];
+    rest /= prog.shape.data[d];
+    for (uint32_t k = 0; k < prog.num_inputs; k++) locs[k] += prog.strides[k][d] * index;
+  }
+
+  scalar_t regs[FUSED_MAX_REGISTERS];
+  for (int32_t i = 0; i < prog.num_instrs; i++) {
+    const int32_t* instr = prog.code[i];
+    int32_t a = instr[2], b = instr[3];
+    scalar_t val = 0;
+    switch (instr[0]) {
+      case FUSED_LOAD: val = prog.inputs[a][locs[a]]; break;
+      case FUSED_SCALAR: val = prog.scalars[a]; break;
+      case FUSED_ADD: val = regs[a] + regs[b]; break;
+      case FUSED_SUB: val = regs[a] - regs[b]; break;
+      case FUSED_MUL: val = regs[a] * regs[b]; break;
+      case FUSED_DIV: val = regs[a] / regs[b]; break;
+      case FUSED_POWER: val = DevicePow(regs[a], regs[b]); break;
+      case FUSED_MAXIMUM: val = max(regs[a], regs[b]); break;
+      case FUSED_EQ: val = scalar_t(regs[a] == regs[b]); break;
+      case FUSED_GE: val = scalar_t(regs[a] >= regs[b]); break;
+      case FUSED_NEG: val = -regs[a]; break;
+      case FUSED_LOG: val = DeviceLog(regs[a]); break;
+      case FUSED_EXP: val = DeviceExp(regs[a]); break;
+      case FUSED_TANH: val = DeviceTanh(regs[a]); break;
+    }
+    regs[instr[1]] = val;
+  }
+  return regs[prog.code[prog.num_instrs - 1][1]];
+}
+
+__global__ void EwiseFusedKernel(FusedProgram prog, scalar_t* out, size_t size) {
+  size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
+  if (gid < size) out[gid] = EvalFused(prog, gid);
+}
+
+size_t MakeFusedProgram(const std::vector<CudaArray*>& inputs,
+                        const std::vector<std::vector<int32_t>>& input_strides,
+                        const std::vector<size_t>& input_offsets,
+                        const std::vector<scalar_t>& scalars, const std::vector<int32_t>& program,
+                        const CudaArray& out, const std::vector<int32_t>& shape,
+                        const char* kernel, FusedProgram* prog) {
+  // check the arguments of a fused kernel and pack them into prog; returns the size of shape
+  CheckFloat32(out, kernel);
+  for (const CudaArray* input : inputs) CheckFloat32(*input, kernel);
+  size_t num_inputs = inputs.size();
+  if (input_strides.size() != num_inputs || input_offsets.size() != num_inputs)
+    throw std::invalid_argument(std::string(kernel) +
+                                ": one strides/offset entry is needed per input");
+  if (program.empty() || program.size() % 4 != 0 || program.size() > 4 * FUSED_MAX_INSTRS ||
+      num_inputs > FUSED_MAX_INPUTS || scalars.size() > FUSED_MAX_SCALARS)
+    throw std::invalid_argument(std::string(kernel) + ": program exceeds the CUDA limits");
+  if (shape.size() > MAX_VEC_SIZE)
+    throw std::runtime_error("Exceeded CUDA supported max dimensions");
+
+  prog->num_instrs = program.size() / 4;
+  for (int32_t i = 0; i < prog->num_instrs; i++) {
+    int32_t op = program[4 * i], dst = program[4 * i + 1];
+    int32_t a = program[4 * i + 2], b = program[4 * i + 3];
+    bool ok = op >= 0 && op < FUSED_NUM_OPCODES && dst >= 0 && dst < FUSED_MAX_REGISTERS;
+    if (op == FUSED_LOAD) {
+      ok = ok && a >= 0 && (size_t)a < num_inputs;
+    } else if (op == FUSED_SCALAR) {
+      ok = ok && a >= 0 && (size_t)a < scalars.size();
+    } else {
+      ok = ok && a >= 0 && a < FUSED_MAX_REGISTERS;
+      if (op < FUSED_NEG) ok = ok && b >= 0 && b < FUSED_MAX_REGISTERS;
+    }
+    if (!ok) throw std::invalid_argument(std::string(kernel) + ": invalid instruction");
+    prog->code[i][0] = op;
+    prog->code[i][1] = dst;
+    prog->code[i][2] = a;
+    prog->code[i][3] = op < FUSED_NEG ? b : 0;
+  }
+  for (size_t i = 0; i < scalars.size(); i++) prog->scalars[i] = scalars[i];
+
+  // collapse all the views together, merging dimensions only where every input allows it (which
+  // keeps the order of the items, so a reduction over trailing items can use it too)
+  size_t size = 1;
+  std::vector<int32_t> dims;
+  std::vector<std::vector<int32_t>> strides(num_inputs);
+  for (size_t i = 0; i < shape.size(); i++) {
+    size *= shape[i];
+    if (shape[i] == 1) continue;
+    bool merge = !dims.empty();
+    for (size_t k = 0; k < num_inputs && merge; k++)
+      merge = strides[k].back() == input_strides[k][i] * shape[i];
+    if (merge) {
+      dims.back() *= shape[i];
+      for (size_t k = 0; k < num_inputs; k++) strides[k].back() = input_strides[k][i];
+    } else {
+      dims.push_back(shape[i]);
+      for (size_t k = 0; k < num_inputs; k++) strides[k].push_back(input_strides[k][i]);
+    }
+  }
+  prog->shape = VecToCuda(dims);
+  prog->num_inputs = num_inputs;
+  for (size_t k = 0; k < num_inputs; k++) {
+    prog->inputs[k] = inputs[k]->ptr;
+    prog->offsets[k] = input_offsets[k];
+    for (size_t d = 0; d < dims.size(); d++) prog->strides[k][d] = strides[k][d];
+  }
+  return size;
+}
+
+void EwiseFused(const std::vector<CudaArray*>& inputs,
+                const std::vector<std::vector<int32_t>>& input_strides,
+                const std::vector<size_t>& input_offsets, const std::vector<scalar_t>& scalars,
+                const std::vector<int32_t>& program, CudaArray* out,
+                const std::vector<int32_t>& shape) {
+  /**
+   * Args:
+   *   inputs: arrays read by FUSED_LOAD
+   *   input_strides, input_offsets: the view of each input over shape (0 strides broadcast)
+   *   scalars: constants read by FUSED_SCALAR
+   *   program: the bytecode, four int32s per instruction
+   *   out: compact output array with the given shape
+   */
+  FusedProgram prog;
+  size_t size = MakeFusedProgram(inputs, input_strides, input_offsets, scalars, program, *out,
+                                 shape, "ewise_fused", &prog);
+  if (size == 0) return;
+  CudaDims dim = CudaOneDim(size);
+  EwiseFusedKernel<<<dim.grid, dim.block, 0, CurrentStream()>>>(prog, out->ptr, size);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Matrix multiplication
+////////////////////////////////////////////////////////////////////////////////
+
+// Each block computes a MATMUL_BM x MATMUL_BN tile of out, stepping over N in MATMUL_BK chunks,
+// and each thread a MATMUL_TM x MATMUL_TN sub-tile of that held in registers.
+#define MATMUL_BM 128
+#define MATMUL_BN 128
+#define MATMUL_BK 8
+#define MATMUL_TM 8
+#define MATMUL_TN 8
+#define MATMUL_THREADS ((MATMUL_BM / MATMUL_TM) * (MATMUL_BN / MATMUL_TN))
+
+template <typename T>
+__device__ __forceinline__ float4 LoadFloat4(const T* src, size_t row, size_t col, size_t rows,
+                                             size_t cols, size_t row_stride, size_t col_stride,
+                                             bool aligned) {
+  /**
+   * Load src[row, col:col+4] of a rows x cols matrix with the given strides as one vector when
+   * the whole run is in bounds, contiguous and aligned to its size, otherwise item by item with
+   * out-of-bounds items set to zero.
+   */
+  const T* p = src + row * row_stride + col * col_stride;
+  if (aligned && row < rows && col + 3 < cols) return Load4(p);
+  float4 v;
+  v.x = (row < rows && col < cols) ? ToFloat(p[0]) : 0;
+  v.y = (row < rows && col + 1 < cols) ? ToFloat(p[col_stride]) : 0;
+  v.z = (row < rows && col + 2 < cols) ? ToFloat(p[2 * col_stride]) : 0;
+  v.w = (row < rows && col + 3 < cols) ? ToFloat(p[3 * col_stride]) : 0;
+  return v;
+}
+
+enum EpilogueActivation {
+  // must match EPILOGUE_ACTIVATIONS in ndarray.py
+  ACTIVATION_NONE,
+  ACTIVATION_RELU,
+  ACTIVATION_TANH
+};
+
+struct BiasActivation {
+  // activation(scale * x + bias[col]), applied to every output value as it is stored
+  __device__ scalar_t operator()(size_t col, scalar_t x) const {
+    x = x * scale + (bias != nullptr ? bias[col] : 0);
+    if (activation == ACTIVATION_RELU) return max(x, 0.0f);
+    if (activation == ACTIVATION_TANH) return DeviceTanh(x);
+    return x;
+  }
+  const scalar_t* bias;
+  scalar_t scale;
+  int32_t activation;
+};
+
+template <typename T>
+__global__ void __launch_bounds__(MATMUL_THREADS)
+MatmulKernel(const T* __restrict__ a_base, const T* __restrict__ b_base,
+             T* __restrict__ out_base, uint32_t M, uint32_t N, uint32_t P,
+             size_t a_row_stride, size_t a_col_stride, size_t b_row_stride, size_t b_col_stride,
+             size_t batch, CudaVec batch_shape, CudaVec a_batch_strides,
+             CudaVec b_batch_strides, BiasActivation epilogue) {
+  /**
+   * Shared-memory tiled matmul with register blocking.
+   *
+   * For every MATMUL_BK step, the 256 threads cooperatively fetch a MATMUL_BM x MATMUL_BK tile
+   * of a and a MATMUL_BK x MATMUL_BN tile of b into shared memory, one float4 per thread per
+   * operand.  The a tile is stored transposed so that, for each k, a thread can read its
+   * MATMUL_TM values of a and MATMUL_TN values of b as float4s and accumulate their outer product
+   * into registers.  Rows/columns past M, N or P are loaded as zero and never stored, which is
+   * all the boundary handling needed for arbitrary sizes.  a and b may be strided views (e.g.
+   * transposed); only out has to be compact.
+   *
+   * blockIdx.z (striding by gridDim.z) walks a batch of independent products over batch_shape,
+   * each operand having its own batch strides (0 to broadcast it); out holds them back to back.
+   * The epilogue (scale, bias, activation) is applied to the accumulators on the way out.
+   * 16-bit operands are converted to float as the tiles are fetched, so the tiles, the
+   * accumulation and the epilogue are in float either way.
+   */
+  __shared__ __align__(16) scalar_t a_tile[MATMUL_BK][MATMUL_BM];
+  __shared__ __align__(16) scalar_t b_tile[MATMUL_BK][MATMUL_BN];
+
+  const uint32_t tid = threadIdx.x;
+  const uint32_t tx = tid % (MATMUL_BN / MATMUL_TN);
+  const uint32_t ty = tid / (MATMUL_BN / MATMUL_TN);
+  const size_t row0 = (size_t)blockIdx.y * MATMUL_BM;
+  const size_t col0 = (size_t)blockIdx.x * MATMUL_BN;
+
+  // which float4 of each tile this thread fetches
+  const uint32_t a_row = tid / (MATMUL_BK / 4), a_col = (tid % (MATMUL_BK / 4)) * 4;
+  const uint32_t b_row = tid / (MATMUL_BN / 4), b_col = (tid % (MATMUL_BN / 4)) * 4;
+
+  for (size_t z = blockIdx.z; z < batch; z += gridDim.z) {
+    size_t a_loc = 0, b_loc = 0, rest = z;
+    for (int32_t d = (int32_t)batch_shape.size - 1; d >= 0; d--) {
+      size_t index = rest % batch_shape.data[d];
+      rest /= batch_shape.data[d];
+      a_loc += a_batch_strides.data[d] * index;
+      b_loc += b_batch_strides.data[d] * index;
+    }
+    const T* a = a_base + a_loc;
+    const T* b = b_base + b_loc;
+    T* out = out_base + z * M * P;
+    // vector access needs contiguous rows that all start on a 4-item boundary
+    const bool a_aligned =
+        a_col_stride == 1 && a_row_stride % 4 == 0 && (size_t)a % (4 * sizeof(T)) == 0;
+    const bool b_aligned =
+        b_col_stride == 1 && b_row_stride % 4 == 0 && (size_t)b % (4 * sizeof(T)) == 0;
+    const bool out_aligned = P % 4 == 0 && (size_t)out % (4 * sizeof(T)) == 0;
+
+    float acc[MATMUL_TM][MATMUL_TN];
+#pragma unroll
+    for (int i = 0; i < MATMUL_TM; i++)
+#pragma unroll
+      for (int j = 0; j < MATMUL_TN; j++) acc[i][j] = 0;
+
+    for (size_t k0 = 0; k0 < N; k0 += MATMUL_BK) {
+      float4 av = LoadFloat4(a, row0 + a_row, k0 + a_col, M, N, a_row_stride, a_col_stride,
+                             a_aligned);
+      a_tile[a_col + 0][a_row] = av.x;
+      a_tile[a_col + 1][a_row] = av.y;
+      a_tile[a_col + 2][a_row] = av.z;
+      a_tile[a_col + 3][a_row] = av.w;
+      *reinterpret_cast<float4*>(&b_tile[b_row][b_col]) =
+          LoadFloat4(b, k0 + b_row, col0 + b_col, N, P, b_row_stride, b_col_stride, b_aligned);
+      __syncthreads();
+
+#pragma unroll
+      for (int k = 0; k < MATMUL_BK; k++) {
+        float a_reg[MATMUL_TM], b_reg[MATMUL_TN];
+#pragma unroll
+        for (int i = 0; i < MATMUL_TM; i += 4)
+          *reinterpret_cast<float4*>(&a_reg[i]) =
+              *reinterpret_cast<const float4*>(&a_tile[k][ty * MATMUL_TM + i]);
+#pragma unroll
+        for (int j = 0; j < MATMUL_TN; j += 4)
+          *reinterpret_cast<float4*>(&b_reg[j]) =
+              *reinterpret_cast<const float4*>(&b_tile[k][tx * MATMUL_TN + j]);
+#pragma unroll
+        for (int i = 0; i < MATMUL_TM; i++)
+#pragma unroll
+          for (int j = 0; j < MATMUL_TN; j++) acc[i][j] += a_reg[i] * b_reg[j];
+      }
+      __syncthreads();
+    }
+
+#pragma unroll
+    for (int i = 0; i < MATMUL_TM; i++) {
+      size_t row = row0 + ty * MATMUL_TM + i;
+      if (row >= M) break;
+#pragma unroll
+      for (int j = 0; j < MATMUL_TN; j += 4) {
+        size_t col = col0 + tx * MATMUL_TN + j;
+        T* dst = out + row * P + col;
+        if (out_aligned && col + 3 < P) {
+          Store4(dst, make_float4(epilogue(col, acc[i][j]), epilogue(col + 1, acc[i][j + 1]),
+                                  epilogue(col + 2, acc[i][j + 2]),
+                                  epilogue(col + 3, acc[i][j + 3])));
+        } else {
+          for (int jj = 0; jj < 4 && col + jj < P; jj++)
+            dst[jj] = FromFloat<T>(epilogue(col + jj, acc[i][j + jj]));
         }
-        out[x * P + y] = sum;
+      }
+    }
+  }
+}
+
+/**
+ * Tensor core matmul for compact 16-bit operands whose dimensions are all multiples of
+ * WMMA_DIM.  Each warp multiplies WMMA_DIM x WMMA_DIM fragments with wmma::mma_sync, which
+ * accumulates in float, and owns a WMMA_WARP_TILES x WMMA_WARP_TILES block of them so that each
+ * a and b fragment it loads is used twice; a block is WMMA_BLOCK_WARPS x WMMA_BLOCK_WARPS warps.
+ * The fragments are loaded straight from global memory (the rows a warp reads are shared with
+ * its neighbours through L1), and the float accumulators go through a per-warp shared buffer
+ * to be rounded to T.  float16 needs sm_70 and bfloat16 sm_80; the kernel is empty when
+ * compiled for older architectures, and Matmul() then uses MatmulKernel instead.
+ */
+#define WMMA_DIM 16
+#define WMMA_WARP_TILES 2
+#define WMMA_BLOCK_WARPS 2
+#define WMMA_BLOCK_TILE (WMMA_DIM * WMMA_WARP_TILES * WMMA_BLOCK_WARPS)
+#define WMMA_THREADS (32 * WMMA_BLOCK_WARPS * WMMA_BLOCK_WARPS)
+
+template <typename T>
+__device__ void MatmulWmmaTiles(const T* a, const T* b, T* out, uint32_t M, uint32_t N,
+                                uint32_t P, size_t row0, size_t col0, float* staging) {
+  using namespace nvcuda;
+  wmma::fragment<wmma::accumulator, WMMA_DIM, WMMA_DIM, WMMA_DIM, float>
+      acc[WMMA_WARP_TILES][WMMA_WARP_TILES];
+#pragma unroll
+  for (int i = 0; i < WMMA_WARP_TILES; i++)
+#pragma unroll
+    for (int j = 0; j < WMMA_WARP_TILES; j++) wmma::fill_fragment(acc[i][j], 0.0f);
+
+  // the bounds checks below only depend on the warp's position, so they never diverge
+  for (size_t k = 0; k < N; k += WMMA_DIM) {
+    wmma::fragment<wmma::matrix_a, WMMA_DIM, WMMA_DIM, WMMA_DIM, T, wmma::row_major>
+        a_frag[WMMA_WARP_TILES];
+    wmma::fragment<wmma::matrix_b, WMMA_DIM, WMMA_DIM, WMMA_DIM, T, wmma::row_major>
+        b_frag[WMMA_WARP_TILES];
+#pragma unroll
+    for (int i = 0; i < WMMA_WARP_TILES; i++)
+      if (row0 + i * WMMA_DIM < M)
+        wmma::load_matrix_sync(a_frag[i], a + (row0 + i * WMMA_DIM) * N + k, N);
+#pragma unroll
+    for (int j = 0; j < WMMA_WARP_TILES; j++)
+      if (col0 + j * WMMA_DIM < P)
+        wmma::load_matrix_sync(b_frag[j], b + k * P + col0 + j * WMMA_DIM, P);
+#pragma unroll
+    for (int i = 0; i < WMMA_WARP_TILES; i++)
+#pragma unroll
+      for (int j = 0; j < WMMA_WARP_TILES; j++)
+        if (row0 + i * WMMA_DIM < M && col0 + j * WMMA_DIM < P)
+          wmma::mma_sync(acc[i][j], a_frag[i], b_frag[j], acc[i][j]);
+  }
+
+  uint32_t lane = threadIdx.x % 32;
+  for (int i = 0; i < WMMA_WARP_TILES; i++) {
+    for (int j = 0; j < WMMA_WARP_TILES; j++) {
+      size_t row = row0 + i * WMMA_DIM, col = col0 + j * WMMA_DIM;
+      if (row >= M || col >= P) continue;
+      wmma::store_matrix_sync(staging, acc[i][j], WMMA_DIM, wmma::mem_row_major);
+      __syncwarp();
+      for (uint32_t e = lane; e < WMMA_DIM * WMMA_DIM; e += 32)
+        out[(row + e / WMMA_DIM) * P + col + e % WMMA_DIM] = FromFloat<T>(staging[e]);
+      __syncwarp();
     }
+  }
+}
+
+__device__ void MatmulWmmaWarp(const float16_t* a, const float16_t* b, float16_t* out,
+                               uint32_t M, uint32_t N, uint32_t P, size_t row0, size_t col0,
+                               float* staging) {
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 700
+  MatmulWmmaTiles(a, b, out, M, N, P, row0, col0, staging);
+#endif
 }
 
+__device__ void MatmulWmmaWarp(const bfloat16_t* a, const bfloat16_t* b, bfloat16_t* out,
+                               uint32_t M, uint32_t N, uint32_t P, size_t row0, size_t col0,
+                               float* staging) {
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 800
+  MatmulWmmaTiles(a, b, out, M, N, P, row0, col0, staging);
+#endif
+}
+
+template <typename T>
+__global__ void __launch_bounds__(WMMA_THREADS)
+MatmulWmmaKernel(const T* a, const T* b, T* out, uint32_t M, uint32_t N, uint32_t P) {
+  __shared__ float staging[WMMA_BLOCK_WARPS * WMMA_BLOCK_WARPS][WMMA_DIM * WMMA_DIM];
+  uint32_t warp = threadIdx.x / 32;
+  size_t row0 = (size_t)blockIdx.y * WMMA_BLOCK_TILE +
+                (warp / WMMA_BLOCK_WARPS) * WMMA_DIM * WMMA_WARP_TILES;
+  size_t col0 = (size_t)blockIdx.x * WMMA_BLOCK_TILE +
+                (warp % WMMA_BLOCK_WARPS) * WMMA_DIM * WMMA_WARP_TILES;
+  MatmulWmmaWarp(a, b, out, M, N, P, row0, col0, staging[warp]);
+}
+
+template <typename T>
+bool MatmulWmma(const T* a, const T* b, T* out, uint32_t M, uint32_t N, uint32_t P,
+                int min_arch) {
+  /**
+   * Launch MatmulWmmaKernel if it applies: the dimensions are multiples of WMMA_DIM, the
+   * operands are aligned for load_matrix_sync, and the kernel was compiled for (at least)
+   * min_arch, which binaryVersion reports for the code that actually runs on this device.
+   */
+  static int arch = -1;
+  if (arch < 0) {
+    cudaFuncAttributes attr;
+    arch = cudaFuncGetAttributes(&attr, MatmulWmmaKernel<T>) == cudaSuccess
+               ? attr.binaryVersion * 10
+               : 0;
+  }
+  if (arch < min_arch || M % WMMA_DIM != 0 || N % WMMA_DIM != 0 || P % WMMA_DIM != 0 ||
+      (size_t)a % 32 != 0 || (size_t)b % 32 != 0)
+    return false;
+  dim3 grid((P + WMMA_BLOCK_TILE - 1) / WMMA_BLOCK_TILE,
+            (M + WMMA_BLOCK_TILE - 1) / WMMA_BLOCK_TILE, 1);
+  MatmulWmmaKernel<<<grid, WMMA_THREADS, 0, CurrentStream()>>>(a, b, out, M, N, P);
+  return true;
+}
 
 void Matmul(const CudaArray& a, const CudaArray& b, CudaArray* out, uint32_t M, uint32_t N,
             uint32_t P) {
@@ -418,34 +2275,388 @@ void Matmul(const CudaArray& a, const CudaArray& b, CudaArray* out, uint32_t M,
    */
 
   /// BEGIN SOLUTION
-  // 测试用例有些矩阵太小了，不好写tiled matrix mul
-  // 这里仅仅实现最naive的方式，矩阵乘的各种优化作为一个独立专题具体另加学习
-  CudaDims dim = CudaOneDim(out->size);
-  MatmulKernel<<<dim.grid, dim.block>>>(a.ptr, b.ptr, out->ptr, M, N, P, out->size);
+  CheckDType(a, *out, "matmul");
+  CheckDType(b, *out, "matmul");
+  if (M == 0 || P == 0) return;
+  // 16-bit operands go to the tensor cores when the shape and the GPU allow it
+  if (out->dtype == DTYPE_FLOAT16 &&
+      MatmulWmma(a.data<float16_t>(), b.data<float16_t>(), out->data<float16_t>(), M, N, P, 700))
+    return;
+  if (out->dtype == DTYPE_BFLOAT16 &&
+      MatmulWmma(a.data<bfloat16_t>(), b.data<bfloat16_t>(), out->data<bfloat16_t>(), M, N, P,
+                 800))
+    return;
+  dim3 grid((P + MATMUL_BN - 1) / MATMUL_BN, (M + MATMUL_BM - 1) / MATMUL_BM, 1);
+  CudaVec no_batch = VecToCuda({});
+  BiasActivation epilogue = {nullptr, 1, ACTIVATION_NONE};
+  DISPATCH_DTYPE(out->dtype, T,
+                 MatmulKernel<<<grid, MATMUL_THREADS, 0, CurrentStream()>>>(
+                     a.data<T>(), b.data<T>(), out->data<T>(), M, N, P, N, 1, P, 1, 1, no_batch,
+                     no_batch, no_batch, epilogue));
   /// END SOLUTION
 }
 
+void MatmulStrided(const CudaArray& a, const CudaArray& b, CudaArray* out, uint32_t M, uint32_t N,
+                   uint32_t P, std::vector<int32_t> a_strides, size_t a_offset,
+                   std::vector<int32_t> b_strides, size_t b_offset) {
+  /**
+   * Matmul() on possibly non-compact a (M x N, strides a_strides, offset a_offset) and b (N x P),
+   * read in place by the tile loads; out is compact.
+   */
+  CheckDType(a, *out, "matmul_strided");
+  CheckDType(b, *out, "matmul_strided");
+  if (M == 0 || P == 0) return;
+  dim3 grid((P + MATMUL_BN - 1) / MATMUL_BN, (M + MATMUL_BM - 1) / MATMUL_BM, 1);
+  CudaVec no_batch = VecToCuda({});
+  BiasActivation epilogue = {nullptr, 1, ACTIVATION_NONE};
+  DISPATCH_DTYPE(out->dtype, T,
+                 MatmulKernel<<<grid, MATMUL_THREADS, 0, CurrentStream()>>>(
+                     a.data<T>() + a_offset, b.data<T>() + b_offset, out->data<T>(), M, N, P,
+                     a_strides[0], a_strides[1], b_strides[0], b_strides[1], 1, no_batch,
+                     no_batch, no_batch, epilogue));
+}
+
+void MatmulEpilogue(const CudaArray& a, const CudaArray& b, const CudaArray* bias, CudaArray* out,
+                    uint32_t M, uint32_t N, uint32_t P, std::vector<int32_t> a_strides,
+                    size_t a_offset, std::vector<int32_t> b_strides, size_t b_offset,
+                    int32_t activation, scalar_t scale) {
+  /**
+   * out = activation(scale * (a @ b) + bias) in one launch: MatmulStrided() with the scale, the
+   * bias (a compact vector of P values added to every row, or None) and the activation applied
+   * to the accumulators as they are stored, instead of as separate passes over out.  A 16-bit
+   * bias is converted to float first.
+   */
+  if (activation < ACTIVATION_NONE || activation > ACTIVATION_TANH)
+    throw std::invalid_argument("matmul_epilogue: unknown activation");
+  CheckDType(a, *out, "matmul_epilogue");
+  CheckDType(b, *out, "matmul_epilogue");
+  if (M == 0 || P == 0) return;
+  std::unique_ptr<CudaArray> bias_float;
+  if (bias != nullptr && bias->dtype != DTYPE_FLOAT32) {
+    bias_float.reset(new CudaArray(bias->size));
+    AsType(*bias, bias_float.get());
+    bias = bias_float.get();
+  }
+  dim3 grid((P + MATMUL_BN - 1) / MATMUL_BN, (M + MATMUL_BM - 1) / MATMUL_BM, 1);
+  CudaVec no_batch = VecToCuda({});
+  BiasActivation epilogue = {bias != nullptr ? bias->ptr : nullptr, scale, activation};
+  DISPATCH_DTYPE(out->dtype, T,
+                 MatmulKernel<<<grid, MATMUL_THREADS, 0, CurrentStream()>>>(
+                     a.data<T>() + a_offset, b.data<T>() + b_offset, out->data<T>(), M, N, P,
+                     a_strides[0], a_strides[1], b_strides[0], b_strides[1], 1, no_batch,
+                     no_batch, no_batch, epilogue));
+}
+
+#define MAX_GRID_Z 65535
+
+void MatmulBatched(const CudaArray& a, const CudaArray& b, CudaArray* out,
+                   std::vector<int32_t> batch_shape, uint32_t M, uint32_t N, uint32_t P,
+                   std::vector<int32_t> a_strides, size_t a_offset, std::vector<int32_t> b_strides,
+                   size_t b_offset) {
+  /**
+   * A batch of products out[z] = a[z] * b[z] over the batch dimensions batch_shape, in a single
+   * launch.  a is a (batch_shape..., M, N) view and b a (batch_shape..., N, P) view, with one
+   * stride per dimension (a batch stride of 0 broadcasts that operand); out is compact.  The
+   * batch dimensions are collapsed where both operands allow it, and go on blockIdx.z.
+   */
+  CheckDType(a, *out, "matmul_batched");
+  CheckDType(b, *out, "matmul_batched");
+  size_t batch_ndim = batch_shape.size();
+  std::vector<int32_t> dims, a_batch, b_batch;
+  size_t batch = 1;
+  for (size_t d = 0; d < batch_ndim; d++) {
+    batch *= batch_shape[d];
+    if (batch_shape[d] == 1) continue;
+    if (!dims.empty() && a_batch.back() == a_strides[d] * batch_shape[d] &&
+        b_batch.back() == b_strides[d] * batch_shape[d]) {
+      dims.back() *= batch_shape[d];
+      a_batch.back() = a_strides[d];
+      b_batch.back() = b_strides[d];
+    } else {
+      dims.push_back(batch_shape[d]);
+      a_batch.push_back(a_strides[d]);
+      b_batch.push_back(b_strides[d]);
+    }
+  }
+  if (batch == 0 || M == 0 || P == 0) return;
+  dim3 grid((P + MATMUL_BN - 1) / MATMUL_BN, (M + MATMUL_BM - 1) / MATMUL_BM,
+            std::min<size_t>(batch, MAX_GRID_Z));
+  BiasActivation epilogue = {nullptr, 1, ACTIVATION_NONE};
+  DISPATCH_DTYPE(out->dtype, T,
+                 MatmulKernel<<<grid, MATMUL_THREADS, 0, CurrentStream()>>>(
+                     a.data<T>() + a_offset, b.data<T>() + b_offset, out->data<T>(), M, N, P,
+                     a_strides[batch_ndim], a_strides[batch_ndim + 1], b_strides[batch_ndim],
+                     b_strides[batch_ndim + 1], batch, VecToCuda(dims), VecToCuda(a_batch),
+                     VecToCuda(b_batch), epilogue));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Max and sum reductions
 ////////////////////////////////////////////////////////////////////////////////
 
-__global__ void ReduceMaxKernel(const scalar_t* a, scalar_t* out, size_t size, size_t reduce_size) {
-    size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
+#define WARP_SIZE 32
+#define FULL_WARP_MASK 0xffffffff
+// Rows of at most this many items are reduced by a single warp (when there are enough of them)
+#define WARP_REDUCE_MAX_SIZE 4096
+// Each block of the first pass of a two-pass reduction handles at least this many items
+#define REDUCE_MIN_ITEMS_PER_BLOCK (BASE_THREAD_NUM * 16)
 
-    if (gid < size) {
-        scalar_t max_num = a[gid * reduce_size];
-        for (size_t i = 1; i < reduce_size; i++) {
-            max_num = max(a[gid * reduce_size + i], max_num);
-        }
-        out[gid] = max_num;
+struct SumOp {
+  __device__ static scalar_t Identity() { return 0; }
+  __device__ static scalar_t Combine(scalar_t x, scalar_t y) { return x + y; }
+};
+
+struct MaxOp {
+  __device__ static scalar_t Identity() { return -INFINITY; }
+  __device__ static scalar_t Combine(scalar_t x, scalar_t y) { return max(x, y); }
+};
+
+template <typename Op>
+__device__ scalar_t WarpReduce(scalar_t val) {
+  for (int delta = WARP_SIZE / 2; delta > 0; delta /= 2)
+    val = Op::Combine(val, __shfl_down_sync(FULL_WARP_MASK, val, delta));
+  return val;
+}
+
+template <typename Op>
+__device__ scalar_t BlockReduce(scalar_t val) {
+  /**
+   * Reduce val across the whole block; the result is valid in thread 0.  Each warp reduces with
+   * shuffles, the per-warp results go through shared memory, and warp 0 reduces those.
+   */
+  __shared__ scalar_t warp_results[WARP_SIZE];
+  int lane = threadIdx.x % WARP_SIZE, warp = threadIdx.x / WARP_SIZE;
+  val = WarpReduce<Op>(val);
+  if (lane == 0) warp_results[warp] = val;
+  __syncthreads();
+  if (warp == 0) {
+    val = lane < (blockDim.x + WARP_SIZE - 1) / WARP_SIZE ? warp_results[lane] : Op::Identity();
+    val = WarpReduce<Op>(val);
+  }
+  // warp_results may be reused by the caller's next row
+  __syncthreads();
+  return val;
+}
+
+struct ContiguousRows {
+  // rows of row_size items stored back to back, as in a compact array
+  __device__ size_t operator()(size_t row) const { return row * row_size; }
+  size_t row_size;
+};
+
+struct StridedRows {
+  // first item of each row of a strided view, over its (collapsed) outer dimensions
+  __device__ size_t operator()(size_t row) const {
+    return getLocation(shape, strides, offset, row);
+  }
+  CudaVec shape, strides;
+  size_t offset;
+};
+
+struct AxisRows {
+  // output (o, j) of a compact (outer, reduce_size, inner) array reduced over its middle axis
+  __device__ size_t operator()(size_t row) const {
+    return (row / inner) * reduce_size * inner + row % inner;
+  }
+  size_t reduce_size, inner;
+};
+
+/**
+ * The kernels below reduce num_rows rows of reduce_size items each, the items of a row being
+ * reduce_stride apart and row r starting at a + rows(r).  Items are read as T and written as
+ * O; the accumulation is in float whatever the two are.
+ */
+template <typename Op, typename Rows, typename T, typename O>
+__global__ void ReduceThreadKernel(const T* a, O* out, size_t num_rows, size_t reduce_size,
+                                   size_t reduce_stride, Rows rows) {
+  // one thread per output, for short rows (and strided rows, where neighbouring threads then
+  // read neighbouring items)
+  size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
+  if (gid < num_rows) {
+    const T* row = a + rows(gid);
+    scalar_t val = ToFloat(row[0]);
+    for (size_t i = 1; i < reduce_size; i++)
+      val = Op::Combine(val, ToFloat(row[i * reduce_stride]));
+    out[gid] = FromFloat<O>(val);
+  }
+}
+
+template <typename Op, typename Rows, typename T, typename O>
+__global__ void ReduceWarpKernel(const T* a, O* out, size_t num_rows, size_t reduce_size,
+                                 size_t reduce_stride, Rows rows) {
+  // one warp per output: the lanes read the row with coalesced strided loads, then shuffle
+  size_t warp_id = (blockIdx.x * blockDim.x + threadIdx.x) / WARP_SIZE;
+  size_t num_warps = gridDim.x * blockDim.x / WARP_SIZE;
+  int lane = threadIdx.x % WARP_SIZE;
+  for (size_t r = warp_id; r < num_rows; r += num_warps) {
+    const T* row = a + rows(r);
+    scalar_t val = Op::Identity();
+    for (size_t i = lane; i < reduce_size; i += WARP_SIZE)
+      val = Op::Combine(val, ToFloat(row[i * reduce_stride]));
+    val = WarpReduce<Op>(val);
+    if (lane == 0) out[r] = FromFloat<O>(val);
+  }
+}
+
+template <typename Op, typename Rows, typename T, typename O>
+__global__ void ReduceBlockKernel(const T* a, O* out, size_t num_rows, size_t reduce_size,
+                                  size_t reduce_stride, Rows rows, size_t num_parts) {
+  /**
+   * One block per (row, part): the block reduces items [part * part_size, (part + 1) * part_size)
+   * of the row and writes out[row * num_parts + part].  With num_parts == 1 this is a plain
+   * block-per-row reduction; with more parts it is the first pass of a two-pass reduction.
+   * Rows are grid-strided over blockIdx.y.
+   */
+  size_t part = blockIdx.x;
+  size_t part_size = (reduce_size + num_parts - 1) / num_parts;
+  size_t begin = part * part_size, end = min(reduce_size, begin + part_size);
+  for (size_t r = blockIdx.y; r < num_rows; r += gridDim.y) {
+    const T* row = a + rows(r);
+    scalar_t val = Op::Identity();
+    for (size_t i = begin + threadIdx.x; i < end; i += blockDim.x)
+      val = Op::Combine(val, ToFloat(row[i * reduce_stride]));
+    val = BlockReduce<Op>(val);
+    if (threadIdx.x == 0) out[r * num_parts + part] = FromFloat<O>(val);
+  }
+}
+
+template <typename Op, typename T, typename Rows>
+void ReduceRows(const T* a, CudaArray* out, size_t reduce_size, size_t reduce_stride,
+                Rows rows) {
+  /**
+   * Reduce the out->size rows described by (reduce_size, reduce_stride, rows) of a.  The strategy
+   * is picked from the shape of the problem so that the GPU is always filled:
+   *   - short rows: one thread per row;
+   *   - many rows of moderate length: one warp per row;
+   *   - enough rows to give every SM a couple of blocks: one block per row;
+   *   - otherwise (few, long rows, e.g. summing a whole tensor): a two-pass reduction that
+   *     splits every row over several blocks, then reduces the per-block partials.
+   * Rows whose items are not contiguous (reducing a non-last axis in place) also go one thread
+   * per row as long as there are enough of them, since then it is the threads of a warp that
+   * read adjacent items.  The partials of the two-pass reduction stay in float.  Rows of no
+   * items sum to 0, as in numpy, and have no max.
+   */
+  T* res = out->data<T>();
+  size_t num_rows = out->size;
+  if (num_rows == 0) return;
+  if (reduce_size == 0) {
+    if (!std::is_same<Op, SumOp>::value)
+      throw std::invalid_argument("reduce_max: zero-size reduction has no identity");
+    Fill(out, 0);
+    return;
+  }
+  size_t num_sms = NumSMs();
+  size_t warps_per_block = BASE_THREAD_NUM / WARP_SIZE;
+
+  bool strided_rows = reduce_stride != 1 && num_rows >= num_sms * BASE_THREAD_NUM;
+  if (reduce_size <= WARP_SIZE || strided_rows) {
+    CudaDims dim = CudaOneDim(num_rows);
+    ReduceThreadKernel<Op><<<dim.grid, dim.block, 0, CurrentStream()>>>(
+        a, res, num_rows, reduce_size, reduce_stride, rows);
+  } else if (reduce_size <= WARP_REDUCE_MAX_SIZE &&
+             num_rows >= 2 * num_sms * warps_per_block) {
+    size_t num_blocks = (num_rows + warps_per_block - 1) / warps_per_block;
+    ReduceWarpKernel<Op><<<num_blocks, BASE_THREAD_NUM, 0, CurrentStream()>>>(
+        a, res, num_rows, reduce_size, reduce_stride, rows);
+  } else {
+    size_t num_parts = 1;
+    if (num_rows < 2 * num_sms) {
+      size_t max_parts =
+          (reduce_size + REDUCE_MIN_ITEMS_PER_BLOCK - 1) / REDUCE_MIN_ITEMS_PER_BLOCK;
+      num_parts = max<size_t>(1, min(max_parts, (4 * num_sms + num_rows - 1) / num_rows));
     }
+    dim3 grid(num_parts, min<size_t>(num_rows, MAX_GRID_Y), 1);
+    if (num_parts == 1) {
+      ReduceBlockKernel<Op><<<grid, BASE_THREAD_NUM, 0, CurrentStream()>>>(
+          a, res, num_rows, reduce_size, reduce_stride, rows, 1);
+    } else {
+      CudaArray partials(num_rows * num_parts);
+      ReduceBlockKernel<Op><<<grid, BASE_THREAD_NUM, 0, CurrentStream()>>>(
+          a, partials.ptr, num_rows, reduce_size, reduce_stride, rows, num_parts);
+      dim3 final_grid(1, grid.y, 1);
+      ReduceBlockKernel<Op><<<final_grid, BASE_THREAD_NUM, 0, CurrentStream()>>>(
+          partials.ptr, res, num_rows, num_parts, 1, ContiguousRows{num_parts}, 1);
+    }
+  }
+}
+
+__global__ void EwiseFusedSumKernel(FusedProgram prog, scalar_t* out, size_t num_rows,
+                                    size_t reduce_size, size_t num_parts) {
+  // ReduceBlockKernel<SumOp> over the results of a fused program, one block per (row, part)
+  size_t part = blockIdx.x;
+  size_t part_size = (reduce_size + num_parts - 1) / num_parts;
+  size_t begin = part * part_size, end = min(reduce_size, begin + part_size);
+  for (size_t r = blockIdx.y; r < num_rows; r += gridDim.y) {
+    scalar_t val = 0;
+    for (size_t i = begin + threadIdx.x; i < end; i += blockDim.x)
+      val += EvalFused(prog, r * reduce_size + i);
+    val = BlockReduce<SumOp>(val);
+    if (threadIdx.x == 0) out[r * num_parts + part] = val;
+  }
+}
+
+void EwiseFusedSum(const std::vector<CudaArray*>& inputs,
+                   const std::vector<std::vector<int32_t>>& input_strides,
+                   const std::vector<size_t>& input_offsets, const std::vector<scalar_t>& scalars,
+                   const std::vector<int32_t>& program, CudaArray* out,
+                   const std::vector<int32_t>& shape, size_t reduce_size) {
+  /**
+   * EwiseFused() summed over the trailing axes of shape in the same pass, so the element-wise
+   * result is never stored: out[i] is the sum of results [i * reduce_size, (i + 1) * reduce_size)
+   * of the program over shape.  One block per output, and for few outputs the two-pass scheme of
+   * ReduceRows(), so that a full reduction still fills the GPU.
+   *
+   * Args:
+   *   as for EwiseFused(), but out is compact with prod(shape) / reduce_size items
+   *   reduce_size: the number of items summed into each output, the product of the sizes of
+   *     the trailing axes of shape that are reduced
+   */
+  FusedProgram prog;
+  size_t size = MakeFusedProgram(inputs, input_strides, input_offsets, scalars, program, *out,
+                                 shape, "ewise_fused_sum", &prog);
+  size_t split = shape.size(), trailing = 1;
+  while (split > 0 && trailing < reduce_size) trailing *= shape[--split];
+  if (reduce_size == 0 || trailing != reduce_size || out->size * reduce_size != size)
+    throw std::invalid_argument("ewise_fused_sum: reduce_size must be the size of trailing axes "
+                                "of shape, and out have the remaining items");
+  size_t num_rows = out->size;
+  if (num_rows == 0) return;
+
+  size_t num_sms = NumSMs();
+  size_t num_parts = 1;
+  if (num_rows < 2 * num_sms) {
+    size_t max_parts = (reduce_size + REDUCE_MIN_ITEMS_PER_BLOCK - 1) / REDUCE_MIN_ITEMS_PER_BLOCK;
+    num_parts = max<size_t>(1, min(max_parts, (4 * num_sms + num_rows - 1) / num_rows));
+  }
+  dim3 grid(num_parts, min<size_t>(num_rows, MAX_GRID_Y), 1);
+  if (num_parts == 1) {
+    EwiseFusedSumKernel<<<grid, BASE_THREAD_NUM, 0, CurrentStream()>>>(prog, out->ptr, num_rows,
+                                                                        reduce_size, 1);
+  } else {
+    CudaArray partials(num_rows * num_parts);
+    EwiseFusedSumKernel<<<grid, BASE_THREAD_NUM, 0, CurrentStream()>>>(
+        prog, partials.ptr, num_rows, reduce_size, num_parts);
+    dim3 final_grid(1, grid.y, 1);
+    ReduceBlockKernel<SumOp><<<final_grid, BASE_THREAD_NUM, 0, CurrentStream()>>>(
+        partials.ptr, out->ptr, num_rows, num_parts, 1, ContiguousRows{num_parts}, 1);
+  }
+}
+
+template <typename Op>
+void ReduceStrided(const CudaArray& a, CudaArray* out, const std::vector<int32_t>& shape,
+                   const std::vector<int32_t>& strides, size_t offset) {
+  // reduce a strided view over its last dimension, reading it in place
+  CheckFloat32(a, "reduce_strided");
+  StridedLayout layout = CollapseLayout(std::vector<int32_t>(shape.begin(), shape.end() - 1),
+                                        std::vector<int32_t>(strides.begin(), strides.end() - 1));
+  StridedRows rows = {VecToCuda(layout.shape), VecToCuda(layout.strides), offset};
+  ReduceRows<Op>(a.ptr, out, shape.back(), strides.back(), rows);
 }
 
 
 void ReduceMax(const CudaArray& a, CudaArray* out, size_t reduce_size) {
   /**
-   * Reduce by taking maximum over `reduce_size` contiguous blocks.  Even though it is inefficient,
-   * for simplicity you can perform each reduction in a single CUDA thread.
+   * Reduce by taking maximum over `reduce_size` contiguous blocks.
    * 
    * Args:
    *   a: compact array of size a.size = out.size * reduce_size to reduce over
@@ -453,29 +2664,16 @@ void ReduceMax(const CudaArray& a, CudaArray* out, size_t reduce_size) {
    *   redice_size: size of the dimension to reduce over
    */
   /// BEGIN SOLUTION
-  CudaDims dim = CudaOneDim(out->size);
-  ReduceMaxKernel<<<dim.grid, dim.block>>>(a.ptr, out->ptr, out->size, reduce_size);
+  CheckDType(a, *out, "reduce_max");
+  DISPATCH_DTYPE(a.dtype, T, ReduceRows<MaxOp>(a.data<T>(), out, reduce_size, 1,
+                                               ContiguousRows{reduce_size}));
   /// END SOLUTION
 }
 
 
-__global__ void ReduceSumKernel(const scalar_t* a, scalar_t* out, size_t size, size_t reduce_size) {
-    size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
-
-    if (gid < size) {
-        scalar_t sum_res = 0;
-        for (size_t i = 0; i < reduce_size; i++) {
-            sum_res += a[gid * reduce_size + i];
-        }
-        out[gid] = sum_res;
-    }
-}
-
-
 void ReduceSum(const CudaArray& a, CudaArray* out, size_t reduce_size) {
   /**
-   * Reduce by taking summation over `reduce_size` contiguous blocks.  Again, for simplicity you 
-   * can perform each reduction in a single CUDA thread.
+   * Reduce by taking summation over `reduce_size` contiguous blocks.
    * 
    * Args:
    *   a: compact array of size a.size = out.size * reduce_size to reduce over
@@ -483,11 +2681,1061 @@ void ReduceSum(const CudaArray& a, CudaArray* out, size_t reduce_size) {
    *   redice_size: size of the dimension to reduce over
    */
   /// BEGIN SOLUTION
-  CudaDims dim = CudaOneDim(out->size);
-  ReduceSumKernel<<<dim.grid, dim.block>>>(a.ptr, out->ptr, out->size, reduce_size);
+  CheckDType(a, *out, "reduce_sum");
+  DISPATCH_DTYPE(a.dtype, T, ReduceRows<SumOp>(a.data<T>(), out, reduce_size, 1,
+                                               ContiguousRows{reduce_size}));
   /// END SOLUTION
 }
 
+void ReduceMaxAxis(const CudaArray& a, CudaArray* out, size_t outer, size_t reduce_size,
+                   size_t inner) {
+  /**
+   * ReduceMax() over the middle axis of a compact a viewed as (outer, reduce_size, inner), in
+   * place: each output reads its items inner apart, so with many outputs neighbouring threads
+   * read neighbouring items and no transposed copy of a is needed.
+   */
+  CheckDType(a, *out, "reduce_max_axis");
+  DISPATCH_DTYPE(a.dtype, T, ReduceRows<MaxOp>(a.data<T>(), out, reduce_size, inner,
+                                               AxisRows{reduce_size, inner}));
+}
+
+void ReduceSumAxis(const CudaArray& a, CudaArray* out, size_t outer, size_t reduce_size,
+                   size_t inner) {
+  // the ReduceSum() counterpart of ReduceMaxAxis()
+  CheckDType(a, *out, "reduce_sum_axis");
+  DISPATCH_DTYPE(a.dtype, T, ReduceRows<SumOp>(a.data<T>(), out, reduce_size, inner,
+                                               AxisRows{reduce_size, inner}));
+}
+
+void ReduceMaxStrided(const CudaArray& a, CudaArray* out, std::vector<int32_t> shape,
+                      std::vector<int32_t> strides, size_t offset) {
+  // ReduceMax() over the last dimension of a non-compact view of a
+  ReduceStrided<MaxOp>(a, out, shape, strides, offset);
+}
+
+void ReduceSumStrided(const CudaArray& a, CudaArray* out, std::vector<int32_t> shape,
+                      std::vector<int32_t> strides, size_t offset) {
+  // ReduceSum() over the last dimension of a non-compact view of a
+  ReduceStrided<SumOp>(a, out, shape, strides, offset);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Softmax family
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * logsumexp, log-softmax and softmax over the middle axis of a compact (outer, reduce_size,
+ * inner) array, and softmax cross-entropy against integer labels.  The row statistics come from
+ * one online pass: a running max m and sum s of exp(x - m), rescaled whenever the max grows, so
+ * every exponent is <= 0.  For inner == 1 each warp owns a row: the lanes stride over it, their
+ * (m, s) pairs are merged with a butterfly shuffle so that every lane ends up with the row's
+ * logsumexp, and the lanes then write the normalized row.  For inner > 1 each thread owns one
+ * (outer, inner) column, and neighbouring threads read neighbouring columns.
+ */
+enum SoftmaxMode { SOFTMAX_LOGSUMEXP, SOFTMAX_LOG, SOFTMAX_PROB };
+
+struct OnlineLogSumExp {
+  __device__ OnlineLogSumExp() : max(-INFINITY), sum(0) {}
+  __device__ void Add(scalar_t x) {
+    if (x == -INFINITY) return;  // adds nothing, and exp(-inf - -inf) would be NaN
+    if (x > max) {
+      sum = sum * DeviceExp(max - x) + 1;
+      max = x;
+    } else {
+      sum += DeviceExp(x - max);
+    }
+  }
+  __device__ void Merge(scalar_t other_max, scalar_t other_sum) {
+    scalar_t new_max = fmaxf(max, other_max);
+    if (new_max == -INFINITY) return;  // both still empty
+    sum = sum * DeviceExp(max - new_max) + other_sum * DeviceExp(other_max - new_max);
+    max = new_max;
+  }
+  __device__ scalar_t Value() const { return max + DeviceLog(sum); }
+  scalar_t max, sum;
+};
+
+__device__ scalar_t WarpLogSumExp(const scalar_t* row, size_t len, size_t stride) {
+  // logsumexp of row[0:len:stride], computed by the whole warp and returned to every lane
+  OnlineLogSumExp stats;
+  for (size_t j = threadIdx.x % WARP_SIZE; j < len; j += WARP_SIZE) stats.Add(row[j * stride]);
+  for (int mask = WARP_SIZE / 2; mask > 0; mask /= 2)
+    stats.Merge(__shfl_xor_sync(FULL_WARP_MASK, stats.max, mask),
+                __shfl_xor_sync(FULL_WARP_MASK, stats.sum, mask));
+  return stats.Value();
+}
+
+__device__ __forceinline__ scalar_t SoftmaxOutput(scalar_t x, scalar_t lse, int mode) {
+  // a row of only -inf (fully masked) has probabilities 0, where x - lse would be NaN
+  if (lse == -INFINITY) return mode == SOFTMAX_LOG ? -INFINITY : 0;
+  return mode == SOFTMAX_LOG ? x - lse : DeviceExp(x - lse);
+}
+
+__global__ void SoftmaxRowsKernel(const scalar_t* a, scalar_t* out, size_t num_rows,
+                                  size_t reduce_size, int mode) {
+  size_t row = ((size_t)blockIdx.x * blockDim.x + threadIdx.x) / WARP_SIZE;
+  if (row >= num_rows) return;  // uniform per warp, so the shuffles below stay full-warp
+  const scalar_t* src = a + row * reduce_size;
+  scalar_t lse = WarpLogSumExp(src, reduce_size, 1);
+  if (mode == SOFTMAX_LOGSUMEXP) {
+    if (threadIdx.x % WARP_SIZE == 0) out[row] = lse;
+    return;
+  }
+  scalar_t* dst = out + row * reduce_size;
+  for (size_t j = threadIdx.x % WARP_SIZE; j < reduce_size; j += WARP_SIZE)
+    dst[j] = SoftmaxOutput(src[j], lse, mode);
+}
+
+__global__ void SoftmaxColumnsKernel(const scalar_t* a, scalar_t* out, size_t outer,
+                                     size_t reduce_size, size_t inner, int mode) {
+  size_t gid = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  if (gid >= outer * inner) return;
+  size_t o = gid / inner, j = gid % inner;
+  const scalar_t* src = a + o * reduce_size * inner + j;
+  OnlineLogSumExp stats;
+  for (size_t r = 0; r < reduce_size; r++) stats.Add(src[r * inner]);
+  scalar_t lse = stats.Value();
+  if (mode == SOFTMAX_LOGSUMEXP) {
+    out[gid] = lse;
+    return;
+  }
+  scalar_t* dst = out + o * reduce_size * inner + j;
+  for (size_t r = 0; r < reduce_size; r++)
+    dst[r * inner] = SoftmaxOutput(src[r * inner], lse, mode);
+}
+
+void SoftmaxAxis(const CudaArray& a, CudaArray* out, size_t outer, size_t reduce_size,
+                 size_t inner, int mode) {
+  CheckFloat32(a, "softmax");
+  if (outer * inner == 0 || reduce_size == 0) return;
+  if (inner == 1) {
+    size_t rows_per_block = BASE_THREAD_NUM / WARP_SIZE;
+    size_t num_blocks = (outer + rows_per_block - 1) / rows_per_block;
+    SoftmaxRowsKernel<<<num_blocks, BASE_THREAD_NUM, 0, CurrentStream()>>>(a.ptr, out->ptr, outer,
+                                                                           reduce_size, mode);
+  } else {
+    CudaDims dim = CudaOneDim(outer * inner);
+    SoftmaxColumnsKernel<<<dim.grid, dim.block, 0, CurrentStream()>>>(a.ptr, out->ptr, outer,
+                                                                      reduce_size, inner, mode);
+  }
+}
+
+void LogSumExpAxis(const CudaArray& a, CudaArray* out, size_t outer, size_t reduce_size,
+                   size_t inner) {
+  SoftmaxAxis(a, out, outer, reduce_size, inner, SOFTMAX_LOGSUMEXP);
+}
+
+void LogSoftmaxAxis(const CudaArray& a, CudaArray* out, size_t outer, size_t reduce_size,
+                    size_t inner) {
+  SoftmaxAxis(a, out, outer, reduce_size, inner, SOFTMAX_LOG);
+}
+
+void SoftmaxProbAxis(const CudaArray& a, CudaArray* out, size_t outer, size_t reduce_size,
+                     size_t inner) {
+  SoftmaxAxis(a, out, outer, reduce_size, inner, SOFTMAX_PROB);
+}
+
+__global__ void SoftmaxCrossEntropyKernel(const scalar_t* logits, const scalar_t* labels,
+                                          scalar_t* loss, scalar_t* grad, size_t rows,
+                                          size_t classes) {
+  size_t row = ((size_t)blockIdx.x * blockDim.x + threadIdx.x) / WARP_SIZE;
+  if (row >= rows) return;
+  const scalar_t* src = logits + row * classes;
+  scalar_t lse = WarpLogSumExp(src, classes, 1);
+  scalar_t label = labels[row];
+  bool valid = label >= 0 && label < classes && label == floorf(label);
+  size_t y = valid ? (size_t)label : 0;
+  if (threadIdx.x % WARP_SIZE == 0) loss[row] = valid ? lse - src[y] : NAN;
+  if (grad == nullptr) return;
+  scalar_t* dst = grad + row * classes;
+  for (size_t j = threadIdx.x % WARP_SIZE; j < classes; j += WARP_SIZE)
+    dst[j] = DeviceExp(src[j] - lse) - scalar_t(valid && j == y);
+}
+
+void SoftmaxCrossEntropy(const CudaArray& logits, const CudaArray& labels, CudaArray* loss,
+                         CudaArray* grad, size_t rows, size_t classes) {
+  /**
+   * Per-row loss[i] = logsumexp(logits[i]) - logits[i, labels[i]] of a compact rows x classes
+   * array, and (unless grad is None) grad[i] = softmax(logits[i]) - one_hot(labels[i]), one warp
+   * per row.  labels holds class indices as floats; an out-of-range label gives a NaN loss, as
+   * the kernel cannot raise.
+   */
+  CheckFloat32(logits, "softmax_cross_entropy");
+  if (rows == 0 || classes == 0) return;
+  size_t rows_per_block = BASE_THREAD_NUM / WARP_SIZE;
+  size_t num_blocks = (rows + rows_per_block - 1) / rows_per_block;
+  SoftmaxCrossEntropyKernel<<<num_blocks, BASE_THREAD_NUM, 0, CurrentStream()>>>(
+      logits.ptr, labels.ptr, loss->ptr, grad != nullptr ? grad->ptr : nullptr, rows, classes);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Normalization layers
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * LayerNorm and BatchNorm over a compact rows x dim array,
+ *   out = (x - mean) * inv_std * weight + bias,  inv_std = 1 / sqrt(var + eps),
+ * with the statistics over each row (LayerNorm) or each column (BatchNorm), from a Welford pass
+ * (running count, mean and sum of squared deviations m2, merged pairwise across threads), and
+ * the backward pass with xhat = (x - mean) * inv_std and dy = grad_out * weight
+ *   grad_x = inv_std * (dy - mean(dy) - xhat * mean(dy * xhat))
+ * along the normalized axis, grad_weight = sum(grad_out * xhat), grad_bias = sum(grad_out).
+ *
+ * A row is owned by one warp, whose lanes stride over it and merge their partial statistics
+ * with a butterfly shuffle.  Column statistics use WARP_SIZE x NORM_COLUMN_ROWS blocks: each
+ * block owns WARP_SIZE neighbouring columns, so the reads of a warp are coalesced, its
+ * NORM_COLUMN_ROWS warps stride over the rows, and the warps' partial statistics are merged
+ * through shared memory.  weight and bias may be null (no affine transform).
+ */
+#define NORM_COLUMN_ROWS (BASE_THREAD_NUM / WARP_SIZE)
+
+struct Welford {
+  __device__ Welford() : count(0), mean(0), m2(0) {}
+  __device__ void Add(scalar_t x) {
+    count += 1;
+    scalar_t delta = x - mean;
+    mean += delta / count;
+    m2 += delta * (x - mean);
+  }
+  __device__ void Merge(scalar_t other_count, scalar_t other_mean, scalar_t other_m2) {
+    if (other_count == 0) return;
+    scalar_t total = count + other_count;
+    scalar_t delta = other_mean - mean;
+    mean += delta * (other_count / total);
+    m2 += other_m2 + delta * delta * (count * other_count / total);
+    count = total;
+  }
+  __device__ scalar_t InvStd(scalar_t eps) const { return rsqrtf(m2 / count + eps); }
+  scalar_t count, mean, m2;
+};
+
+__device__ scalar_t WarpAllSum(scalar_t val) {
+  // like WarpReduce<SumOp>, but every lane gets the sum
+  for (int mask = WARP_SIZE / 2; mask > 0; mask /= 2)
+    val += __shfl_xor_sync(FULL_WARP_MASK, val, mask);
+  return val;
+}
+
+__device__ __forceinline__ scalar_t Affine(scalar_t xhat, const scalar_t* weight,
+                                           const scalar_t* bias, size_t j) {
+  return (weight != nullptr ? xhat * weight[j] : xhat) + (bias != nullptr ? bias[j] : 0);
+}
+
+__global__ void LayerNormForwardKernel(const scalar_t* x, const scalar_t* weight,
+                                       const scalar_t* bias, scalar_t* out, scalar_t* mean,
+                                       scalar_t* inv_std, size_t rows, size_t dim,
+                                       scalar_t eps) {
+  size_t row = ((size_t)blockIdx.x * blockDim.x + threadIdx.x) / WARP_SIZE;
+  if (row >= rows) return;  // uniform per warp
+  size_t lane = threadIdx.x % WARP_SIZE;
+  const scalar_t* src = x + row * dim;
+  Welford stats;
+  for (size_t j = lane; j < dim; j += WARP_SIZE) stats.Add(src[j]);
+  for (int mask = WARP_SIZE / 2; mask > 0; mask /= 2)
+    stats.Merge(__shfl_xor_sync(FULL_WARP_MASK, stats.count, mask),
+                __shfl_xor_sync(FULL_WARP_MASK, stats.mean, mask),
+                __shfl_xor_sync(FULL_WARP_MASK, stats.m2, mask));
+  scalar_t m = stats.mean, s = stats.InvStd(eps);
+  if (lane == 0) {
+    mean[row] = m;
+    inv_std[row] = s;
+  }
+  scalar_t* dst = out + row * dim;
+  for (size_t j = lane; j < dim; j += WARP_SIZE) dst[j] = Affine((src[j] - m) * s, weight, bias, j);
+}
+
+__global__ void LayerNormBackwardKernel(const scalar_t* grad_out, const scalar_t* x,
+                                        const scalar_t* weight, const scalar_t* mean,
+                                        const scalar_t* inv_std, scalar_t* grad_x, size_t rows,
+                                        size_t dim) {
+  size_t row = ((size_t)blockIdx.x * blockDim.x + threadIdx.x) / WARP_SIZE;
+  if (row >= rows) return;
+  size_t lane = threadIdx.x % WARP_SIZE;
+  const scalar_t* g = grad_out + row * dim;
+  const scalar_t* src = x + row * dim;
+  scalar_t m = mean[row], s = inv_std[row];
+  scalar_t sum_dy = 0, sum_dy_xhat = 0;
+  for (size_t j = lane; j < dim; j += WARP_SIZE) {
+    scalar_t dy = weight != nullptr ? g[j] * weight[j] : g[j];
+    sum_dy += dy;
+    sum_dy_xhat += dy * (src[j] - m) * s;
+  }
+  scalar_t mean_dy = WarpAllSum(sum_dy) / dim, mean_dy_xhat = WarpAllSum(sum_dy_xhat) / dim;
+  scalar_t* dst = grad_x + row * dim;
+  for (size_t j = lane; j < dim; j += WARP_SIZE) {
+    scalar_t dy = weight != nullptr ? g[j] * weight[j] : g[j];
+    dst[j] = s * (dy - mean_dy - (src[j] - m) * s * mean_dy_xhat);
+  }
+}
+
+__global__ void NormParamGradKernel(const scalar_t* grad_out, const scalar_t* x,
+                                    const scalar_t* mean, const scalar_t* inv_std,
+                                    scalar_t* grad_weight, scalar_t* grad_bias, size_t rows,
+                                    size_t dim, bool row_stats) {
+  // grad_weight[j] = sum_i grad_out[i, j] * xhat[i, j], grad_bias[j] = sum_i grad_out[i, j],
+  // with mean and inv_std per row (LayerNorm) or per column (BatchNorm)
+  __shared__ scalar_t partial_grad[NORM_COLUMN_ROWS][WARP_SIZE];
+  __shared__ scalar_t partial_grad_xhat[NORM_COLUMN_ROWS][WARP_SIZE];
+  size_t j = (size_t)blockIdx.x * WARP_SIZE + threadIdx.x;
+  scalar_t sum_g = 0, sum_g_xhat = 0;
+  if (j < dim) {
+    for (size_t i = threadIdx.y; i < rows; i += NORM_COLUMN_ROWS) {
+      size_t k = row_stats ? i : j;
+      scalar_t g = grad_out[i * dim + j];
+      sum_g += g;
+      sum_g_xhat += g * (x[i * dim + j] - mean[k]) * inv_std[k];
+    }
+  }
+  partial_grad[threadIdx.y][threadIdx.x] = sum_g;
+  partial_grad_xhat[threadIdx.y][threadIdx.x] = sum_g_xhat;
+  __syncthreads();
+  if (threadIdx.y != 0 || j >= dim) return;
+  for (int w = 1; w < NORM_COLUMN_ROWS; w++) {
+    sum_g += partial_grad[w][threadIdx.x];
+    sum_g_xhat += partial_grad_xhat[w][threadIdx.x];
+  }
+  grad_weight[j] = sum_g_xhat;
+  grad_bias[j] = sum_g;
+}
+
+void LayerNormForward(const CudaArray& x, const CudaArray* weight, const CudaArray* bias,
+                      CudaArray* out, CudaArray* mean, CudaArray* inv_std, size_t rows,
+                      size_t dim, scalar_t eps) {
+  /**
+   * Normalize each row of x over its dim items; mean and inv_std (rows items) are saved for
+   * LayerNormBackward().
+   */
+  CheckFloat32(x, "layer_norm_forward");
+  if (rows == 0 || dim == 0) return;
+  size_t rows_per_block = BASE_THREAD_NUM / WARP_SIZE;
+  size_t num_blocks = (rows + rows_per_block - 1) / rows_per_block;
+  LayerNormForwardKernel<<<num_blocks, BASE_THREAD_NUM, 0, CurrentStream()>>>(
+      x.ptr, weight != nullptr ? weight->ptr : nullptr, bias != nullptr ? bias->ptr : nullptr,
+      out->ptr, mean->ptr, inv_std->ptr, rows, dim, eps);
+}
+
+void LayerNormBackward(const CudaArray& grad_out, const CudaArray& x, const CudaArray* weight,
+                       const CudaArray& mean, const CudaArray& inv_std, CudaArray* grad_x,
+                       CudaArray* grad_weight, CudaArray* grad_bias, size_t rows, size_t dim) {
+  CheckFloat32(x, "layer_norm_backward");
+  if (rows == 0 || dim == 0) return;
+  size_t rows_per_block = BASE_THREAD_NUM / WARP_SIZE;
+  size_t num_blocks = (rows + rows_per_block - 1) / rows_per_block;
+  LayerNormBackwardKernel<<<num_blocks, BASE_THREAD_NUM, 0, CurrentStream()>>>(
+      grad_out.ptr, x.ptr, weight != nullptr ? weight->ptr : nullptr, mean.ptr, inv_std.ptr,
+      grad_x->ptr, rows, dim);
+  NormParamGradKernel<<<(dim + WARP_SIZE - 1) / WARP_SIZE, dim3(WARP_SIZE, NORM_COLUMN_ROWS), 0,
+                        CurrentStream()>>>(
+      grad_out.ptr, x.ptr, mean.ptr, inv_std.ptr, grad_weight->ptr, grad_bias->ptr, rows, dim,
+      true);
+}
+
+__global__ void BatchNormStatsKernel(const scalar_t* x, scalar_t* mean, scalar_t* inv_std,
+                                     scalar_t* running_mean, scalar_t* running_var, size_t rows,
+                                     size_t dim, scalar_t eps, scalar_t momentum,
+                                     bool training) {
+  __shared__ scalar_t partial[3][NORM_COLUMN_ROWS][WARP_SIZE];
+  size_t j = (size_t)blockIdx.x * WARP_SIZE + threadIdx.x;
+  Welford stats;
+  if (training && j < dim)
+    for (size_t i = threadIdx.y; i < rows; i += NORM_COLUMN_ROWS) stats.Add(x[i * dim + j]);
+  partial[0][threadIdx.y][threadIdx.x] = stats.count;
+  partial[1][threadIdx.y][threadIdx.x] = stats.mean;
+  partial[2][threadIdx.y][threadIdx.x] = stats.m2;
+  __syncthreads();
+  if (threadIdx.y != 0 || j >= dim) return;
+  if (!training) {
+    mean[j] = running_mean[j];
+    inv_std[j] = rsqrtf(running_var[j] + eps);
+    return;
+  }
+  for (int w = 1; w < NORM_COLUMN_ROWS; w++)
+    stats.Merge(partial[0][w][threadIdx.x], partial[1][w][threadIdx.x], partial[2][w][threadIdx.x]);
+  mean[j] = stats.mean;
+  inv_std[j] = stats.InvStd(eps);
+  if (running_mean != nullptr)
+    running_mean[j] = (1 - momentum) * running_mean[j] + momentum * stats.mean;
+  if (running_var != nullptr)
+    running_var[j] = (1 - momentum) * running_var[j] + momentum * (stats.m2 / stats.count);
+}
+
+__global__ void BatchNormApplyKernel(const scalar_t* x, const scalar_t* weight,
+                                     const scalar_t* bias, const scalar_t* mean,
+                                     const scalar_t* inv_std, scalar_t* out, size_t size,
+                                     size_t dim) {
+  size_t gid = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  if (gid >= size) return;
+  size_t j = gid % dim;
+  out[gid] = Affine((x[gid] - mean[j]) * inv_std[j], weight, bias, j);
+}
+
+__global__ void BatchNormBackwardKernel(const scalar_t* grad_out, const scalar_t* x,
+                                        const scalar_t* weight, const scalar_t* mean,
+                                        const scalar_t* inv_std, const scalar_t* grad_weight,
+                                        const scalar_t* grad_bias, scalar_t* grad_x, size_t rows,
+                                        size_t dim, bool training) {
+  size_t gid = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  if (gid >= rows * dim) return;
+  size_t j = gid % dim;
+  scalar_t s = inv_std[j], w = weight != nullptr ? weight[j] : 1;
+  scalar_t g = grad_out[gid];
+  if (training) g -= (grad_bias[j] + (x[gid] - mean[j]) * s * grad_weight[j]) / rows;
+  grad_x[gid] = s * w * g;
+}
+
+void BatchNormForward(const CudaArray& x, const CudaArray* weight, const CudaArray* bias,
+                      CudaArray* out, CudaArray* mean, CudaArray* inv_std,
+                      CudaArray* running_mean, CudaArray* running_var, size_t rows, size_t dim,
+                      scalar_t eps, scalar_t momentum, bool training) {
+  /**
+   * Normalize each column of x over its rows items, with the batch statistics in training mode
+   * (updating running_mean and running_var, if given, in the same kernel that computes them)
+   * and with the running statistics otherwise; see the CPU backend.  mean and inv_std (dim
+   * items) are saved for BatchNormBackward().
+   */
+  CheckFloat32(x, "batch_norm_forward");
+  if (dim == 0 || (training && rows == 0)) return;
+  if (!training && (running_mean == nullptr || running_var == nullptr))
+    throw std::invalid_argument("batch_norm_forward: evaluation needs the running statistics");
+  BatchNormStatsKernel<<<(dim + WARP_SIZE - 1) / WARP_SIZE, dim3(WARP_SIZE, NORM_COLUMN_ROWS), 0,
+                         CurrentStream()>>>(
+      x.ptr, mean->ptr, inv_std->ptr, running_mean != nullptr ? running_mean->ptr : nullptr,
+      running_var != nullptr ? running_var->ptr : nullptr, rows, dim, eps, momentum, training);
+  if (rows == 0) return;
+  CudaDims grid = CudaOneDim(rows * dim);
+  BatchNormApplyKernel<<<grid.grid, grid.block, 0, CurrentStream()>>>(
+      x.ptr, weight != nullptr ? weight->ptr : nullptr, bias != nullptr ? bias->ptr : nullptr,
+      mean->ptr, inv_std->ptr, out->ptr, rows * dim, dim);
+}
+
+void BatchNormBackward(const CudaArray& grad_out, const CudaArray& x, const CudaArray* weight,
+                       const CudaArray& mean, const CudaArray& inv_std, CudaArray* grad_x,
+                       CudaArray* grad_weight, CudaArray* grad_bias, size_t rows, size_t dim,
+                       bool training) {
+  CheckFloat32(x, "batch_norm_backward");
+  if (rows == 0 || dim == 0) return;
+  NormParamGradKernel<<<(dim + WARP_SIZE - 1) / WARP_SIZE, dim3(WARP_SIZE, NORM_COLUMN_ROWS), 0,
+                        CurrentStream()>>>(
+      grad_out.ptr, x.ptr, mean.ptr, inv_std.ptr, grad_weight->ptr, grad_bias->ptr, rows, dim,
+      false);
+  CudaDims grid = CudaOneDim(rows * dim);
+  BatchNormBackwardKernel<<<grid.grid, grid.block, 0, CurrentStream()>>>(
+      grad_out.ptr, x.ptr, weight != nullptr ? weight->ptr : nullptr, mean.ptr, inv_std.ptr,
+      grad_weight->ptr, grad_bias->ptr, grad_x->ptr, rows, dim, training);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Optimizer steps
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The SGD and Adam updates of the CPU backend, for a whole list of parameters per launch.  The
+ * tensors are cut into chunks of OPT_CHUNK items and each block updates one chunk; the pointers
+ * of the tensors and which tensor and chunk each block takes are passed by value, in the kernel
+ * arguments (at most 4 KB), so one launch covers up to OPT_MAX_TENSORS tensors and
+ * OPT_MAX_BLOCKS chunks, and only longer lists take more.
+ */
+#define OPT_MAX_TENSORS 24
+#define OPT_MAX_BLOCKS 320
+#define OPT_CHUNK (BASE_THREAD_NUM * 16)
+
+struct TensorChunks {
+  scalar_t* ptrs[4][OPT_MAX_TENSORS];  // param, grad, and one or two state tensors
+  size_t sizes[OPT_MAX_TENSORS];
+  uint8_t block_tensor[OPT_MAX_BLOCKS];
+  uint32_t block_chunk[OPT_MAX_BLOCKS];
+};
+
+__global__ void SgdStepKernel(TensorChunks chunks, scalar_t lr, scalar_t momentum,
+                              scalar_t weight_decay) {
+  size_t t = chunks.block_tensor[blockIdx.x];
+  size_t begin = (size_t)chunks.block_chunk[blockIdx.x] * OPT_CHUNK;
+  size_t end = begin + OPT_CHUNK < chunks.sizes[t] ? begin + OPT_CHUNK : chunks.sizes[t];
+  scalar_t* p = chunks.ptrs[0][t];
+  const scalar_t* g = chunks.ptrs[1][t];
+  scalar_t* u = chunks.ptrs[2][t];
+  for (size_t i = begin + threadIdx.x; i < end; i += blockDim.x) {
+    scalar_t ui = momentum * u[i] + (1 - momentum) * (g[i] + weight_decay * p[i]);
+    u[i] = ui;
+    p[i] -= lr * ui;
+  }
+}
+
+__global__ void AdamCountKernel(scalar_t* step_count) { *step_count += 1; }
+
+__global__ void AdamStepKernel(TensorChunks chunks, scalar_t lr, scalar_t beta1, scalar_t beta2,
+                               scalar_t eps, scalar_t weight_decay, scalar_t m_scale,
+                               scalar_t v_scale, const scalar_t* step_count) {
+  if (step_count != nullptr) {
+    // the bias corrections of the step counted on the device (see MultiAdamStep())
+    m_scale = 1 / (1 - powf(beta1, *step_count));
+    v_scale = 1 / (1 - powf(beta2, *step_count));
+  }
+  size_t t = chunks.block_tensor[blockIdx.x];
+  size_t begin = (size_t)chunks.block_chunk[blockIdx.x] * OPT_CHUNK;
+  size_t end = begin + OPT_CHUNK < chunks.sizes[t] ? begin + OPT_CHUNK : chunks.sizes[t];
+  scalar_t* p = chunks.ptrs[0][t];
+  const scalar_t* g = chunks.ptrs[1][t];
+  scalar_t* m = chunks.ptrs[2][t];
+  scalar_t* v = chunks.ptrs[3][t];
+  for (size_t i = begin + threadIdx.x; i < end; i += blockDim.x) {
+    scalar_t pi = p[i];
+    scalar_t gi = g[i] + weight_decay * pi;
+    scalar_t mi = beta1 * m[i] + (1 - beta1) * gi;
+    scalar_t vi = beta2 * v[i] + (1 - beta2) * gi * gi;
+    m[i] = mi;
+    v[i] = vi;
+    p[i] = pi - lr * (mi * m_scale) / (sqrtf(vi * v_scale) + eps);
+  }
+}
+
+template <typename Launch>
+void LaunchTensorChunks(const std::vector<const std::vector<CudaArray*>*>& lists,
+                        const char* kernel, Launch launch) {
+  /**
+   * Check that the lists (param, grad, state...) match, and call launch(chunks, num_blocks)
+   * for as few launches as cover all their chunks.
+   */
+  const std::vector<CudaArray*>& first = *lists[0];
+  for (const std::vector<CudaArray*>* list : lists) {
+    if (list->size() != first.size())
+      throw std::invalid_argument(std::string(kernel) + ": the lists differ in length");
+    for (size_t t = 0; t < first.size(); t++) {
+      CheckFloat32(*(*list)[t], kernel);
+      if ((*list)[t]->size != first[t]->size)
+        throw std::invalid_argument(std::string(kernel) + ": tensor " + std::to_string(t) +
+                                    " differs in size from its parameter");
+    }
+  }
+  TensorChunks chunks;
+  size_t num_tensors = 0, num_blocks = 0;
+  for (size_t t = 0; t < first.size(); t++) {
+    size_t size = first[t]->size;
+    if (size == 0) continue;
+    for (size_t l = 0; l < lists.size(); l++) chunks.ptrs[l][num_tensors] = (*lists[l])[t]->ptr;
+    chunks.sizes[num_tensors] = size;
+    for (size_t c = 0; c * OPT_CHUNK < size; c++) {
+      if (num_blocks == OPT_MAX_BLOCKS) {
+        // the rest of this tensor goes to the next launch, as its first tensor
+        launch(chunks, num_blocks);
+        for (size_t l = 0; l < lists.size(); l++) chunks.ptrs[l][0] = chunks.ptrs[l][num_tensors];
+        chunks.sizes[0] = size;
+        num_tensors = num_blocks = 0;
+      }
+      chunks.block_tensor[num_blocks] = num_tensors;
+      chunks.block_chunk[num_blocks++] = c;
+    }
+    if (++num_tensors == OPT_MAX_TENSORS) {
+      launch(chunks, num_blocks);
+      num_tensors = num_blocks = 0;
+    }
+  }
+  if (num_blocks > 0) launch(chunks, num_blocks);
+}
+
+void MultiSgdStep(const std::vector<CudaArray*>& params, const std::vector<CudaArray*>& grads,
+                  const std::vector<CudaArray*>& moments, scalar_t lr, scalar_t momentum,
+                  scalar_t weight_decay) {
+  LaunchTensorChunks({&params, &grads, &moments}, "sgd_step",
+                     [&](const TensorChunks& chunks, size_t num_blocks) {
+                       SgdStepKernel<<<num_blocks, BASE_THREAD_NUM, 0, CurrentStream()>>>(
+                           chunks, lr, momentum, weight_decay);
+                     });
+}
+
+void SgdStep(CudaArray* param, const CudaArray& grad, CudaArray* moment, scalar_t lr,
+             scalar_t momentum, scalar_t weight_decay) {
+  MultiSgdStep({param}, {const_cast<CudaArray*>(&grad)}, {moment}, lr, momentum, weight_decay);
+}
+
+void LaunchAdamStep(const std::vector<CudaArray*>& params, const std::vector<CudaArray*>& grads,
+                    const std::vector<CudaArray*>& m, const std::vector<CudaArray*>& v,
+                    scalar_t lr, scalar_t beta1, scalar_t beta2, scalar_t eps,
+                    scalar_t weight_decay, scalar_t m_scale, scalar_t v_scale,
+                    const scalar_t* step_count) {
+  LaunchTensorChunks({&params, &grads, &m, &v}, "adam_step",
+                     [&](const TensorChunks& chunks, size_t num_blocks) {
+                       AdamStepKernel<<<num_blocks, BASE_THREAD_NUM, 0, CurrentStream()>>>(
+                           chunks, lr, beta1, beta2, eps, weight_decay, m_scale, v_scale,
+                           step_count);
+                     });
+}
+
+void MultiAdamStepAt(const std::vector<CudaArray*>& params, const std::vector<CudaArray*>& grads,
+                     const std::vector<CudaArray*>& m, const std::vector<CudaArray*>& v,
+                     scalar_t lr, scalar_t beta1, scalar_t beta2, scalar_t eps,
+                     scalar_t weight_decay, uint32_t step) {
+  // step is the number of the step being taken, counting from 1, for the bias corrections
+  if (step == 0) throw std::invalid_argument("adam_step: steps count from 1");
+  scalar_t m_scale = 1 / (1 - std::pow(beta1, (scalar_t)step));
+  scalar_t v_scale = 1 / (1 - std::pow(beta2, (scalar_t)step));
+  LaunchAdamStep(params, grads, m, v, lr, beta1, beta2, eps, weight_decay, m_scale, v_scale,
+                 nullptr);
+}
+
+void MultiAdamStep(const std::vector<CudaArray*>& params, const std::vector<CudaArray*>& grads,
+                   const std::vector<CudaArray*>& m, const std::vector<CudaArray*>& v,
+                   scalar_t lr, scalar_t beta1, scalar_t beta2, scalar_t eps,
+                   scalar_t weight_decay, CudaArray* step_count) {
+  /**
+   * MultiAdamStepAt() for the step after the step_count[0] taken so far.  The count is
+   * incremented and read by kernels, never by the host, so a step captured into a Graph takes
+   * the bias corrections of the next step on every replay instead of those of the capture.
+   */
+  if (step_count->size != 1 || step_count->dtype != DTYPE_FLOAT32)
+    throw std::invalid_argument("adam_step: step_count must be one float32 item");
+  AdamCountKernel<<<1, 1, 0, CurrentStream()>>>(step_count->ptr);
+  LaunchAdamStep(params, grads, m, v, lr, beta1, beta2, eps, weight_decay, 1, 1,
+                 step_count->ptr);
+}
+
+void AdamStep(CudaArray* param, const CudaArray& grad, CudaArray* m, CudaArray* v, scalar_t lr,
+              scalar_t beta1, scalar_t beta2, scalar_t eps, scalar_t weight_decay,
+              uint32_t step) {
+  MultiAdamStepAt({param}, {const_cast<CudaArray*>(&grad)}, {m}, {v}, lr, beta1, beta2, eps,
+                  weight_decay, step);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Quantized (int8) inference
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The same scheme as the CPU backend: a Linear layer's weight is stored transposed, as a p x n
+ * int8 matrix with one float32 scale per output channel (row), the activations are quantized per
+ * row on the fly, and
+ *   out[i][j] = activation(acc[i][j] * a_scale[i] * w_scale[j] + bias[j])
+ * where acc is the exact int32 dot product of row i of a and row j of w, optionally requantized
+ * to int8 with one out_scale.  Rows of both operands are contiguous along k, so the GEMM reads
+ * them four values to a word and multiplies the words with dp4a (sm_61 and up).
+ */
+#define INT8_BM 64
+#define INT8_BN 64  // the tile loads below assume INT8_BN == INT8_BM
+#define INT8_BK 64  // values of k per shared memory tile, a multiple of 4
+#define INT8_TM 4
+#define INT8_TN 4
+#define INT8_THREADS ((INT8_BM / INT8_TM) * (INT8_BN / INT8_TN))
+
+__global__ void QuantizeRowsKernel(const scalar_t* a, int8_t* out, scalar_t* scales,
+                                   size_t rows, size_t cols) {
+  // one warp per row: scales[row] = max |a[row]| / 127, out[row] = round(a[row] / scales[row])
+  size_t row = ((size_t)blockIdx.x * blockDim.x + threadIdx.x) / WARP_SIZE;
+  size_t lane = threadIdx.x % WARP_SIZE;
+  if (row >= rows) return;
+  const scalar_t* x = a + row * cols;
+  scalar_t amax = 0;
+  for (size_t k = lane; k < cols; k += WARP_SIZE) amax = max(amax, fabsf(x[k]));
+  amax = __shfl_sync(FULL_WARP_MASK, WarpReduce<MaxOp>(amax), 0);
+  scalar_t scale = amax > 0 ? amax / 127 : 1, inv_scale = 1 / scale;
+  for (size_t k = lane; k < cols; k += WARP_SIZE)
+    out[row * cols + k] = FromFloat<int8_t>(x[k] * inv_scale);
+  if (lane == 0) scales[row] = scale;
+}
+
+template <typename T>
+__global__ void DequantizeRowsKernel(const int8_t* a, const scalar_t* scales, T* out, size_t size,
+                                     size_t cols) {
+  size_t gid = blockIdx.x * blockDim.x + threadIdx.x;
+  if (gid < size) out[gid] = FromFloat<T>(a[gid] * scales[gid / cols]);
+}
+
+__device__ __forceinline__ int32_t Dot4(int32_t a, int32_t b, int32_t c) {
+  // c + the dot product of the four signed bytes of a and b
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 610
+  return __dp4a(a, b, c);
+#else
+  for (int shift = 24; shift >= 0; shift -= 8) c += ((a << shift) >> 24) * ((b << shift) >> 24);
+  return c;
+#endif
+}
+
+template <bool Aligned>
+__device__ __forceinline__ int32_t LoadInt8x4(const int8_t* row, uint32_t k, uint32_t n) {
+  // row[k:k+4] packed into a word, zeros past n (Aligned: rows start at multiples of 4 bytes)
+  if (Aligned) return k < n ? *(const int32_t*)(row + k) : 0;
+  int32_t word = 0;
+  for (uint32_t b = 0; b < 4; b++)
+    if (k + b < n) word |= (int32_t)(uint8_t)row[k + b] << (8 * b);
+  return word;
+}
+
+template <bool Aligned, typename O>
+__global__ void __launch_bounds__(INT8_THREADS)
+MatmulInt8Kernel(const int8_t* a, const scalar_t* a_scales, const int8_t* w,
+                 const scalar_t* w_scales, O* out, uint32_t M, uint32_t N, uint32_t P,
+                 BiasActivation epilogue, scalar_t out_mult) {
+  /**
+   * One INT8_BM x INT8_BN block of out per thread block, through INT8_BK-wide shared memory tiles
+   * of a and w.  Each thread accumulates INT8_TM x INT8_TN outputs, taking every
+   * (INT8_BM / INT8_TM)-th row and (INT8_BN / INT8_TN)-th channel of the block so that a warp
+   * reads the padded tiles without bank conflicts.  out_mult is 1 / out_scale for an int8 out.
+   */
+  __shared__ int32_t a_tile[INT8_BM][INT8_BK / 4 + 1];
+  __shared__ int32_t w_tile[INT8_BN][INT8_BK / 4 + 1];
+  const uint32_t row_step = INT8_BM / INT8_TM, col_step = INT8_BN / INT8_TN;
+  uint32_t tx = threadIdx.x % col_step, ty = threadIdx.x / col_step;
+  uint32_t i0 = blockIdx.y * INT8_BM, j0 = blockIdx.x * INT8_BN;
+  int32_t acc[INT8_TM][INT8_TN] = {};
+
+  for (uint32_t k0 = 0; k0 < N; k0 += INT8_BK) {
+    for (uint32_t e = threadIdx.x; e < INT8_BM * INT8_BK / 4; e += INT8_THREADS) {
+      uint32_t r = e / (INT8_BK / 4), kw = e % (INT8_BK / 4);
+      a_tile[r][kw] = i0 + r < M ? LoadInt8x4<Aligned>(a + (size_t)(i0 + r) * N, k0 + 4 * kw, N)
+                                 : 0;
+      w_tile[r][kw] = j0 + r < P ? LoadInt8x4<Aligned>(w + (size_t)(j0 + r) * N, k0 + 4 * kw, N)
+                                 : 0;
+    }
+    __syncthreads();
+#pragma unroll
+    for (uint32_t kw = 0; kw < INT8_BK / 4; kw++) {
+      int32_t a_frag[INT8_TM], w_frag[INT8_TN];
+#pragma unroll
+      for (uint32_t i = 0; i < INT8_TM; i++) a_frag[i] = a_tile[ty + i * row_step][kw];
+#pragma unroll
+      for (uint32_t j = 0; j < INT8_TN; j++) w_frag[j] = w_tile[tx + j * col_step][kw];
+#pragma unroll
+      for (uint32_t i = 0; i < INT8_TM; i++)
+#pragma unroll
+        for (uint32_t j = 0; j < INT8_TN; j++) acc[i][j] = Dot4(a_frag[i], w_frag[j], acc[i][j]);
+    }
+    __syncthreads();
+  }
+
+#pragma unroll
+  for (uint32_t i = 0; i < INT8_TM; i++) {
+    uint32_t row = i0 + ty + i * row_step;
+#pragma unroll
+    for (uint32_t j = 0; j < INT8_TN; j++) {
+      uint32_t col = j0 + tx + j * col_step;
+      if (row < M && col < P) {
+        scalar_t x = epilogue(col, acc[i][j] * (a_scales[row] * w_scales[col]));
+        out[(size_t)row * P + col] = FromFloat<O>(x * out_mult);
+      }
+    }
+  }
+}
+
+void QuantizeRows(const CudaArray& a, CudaArray* out, CudaArray* scales, uint32_t rows,
+                  uint32_t cols) {
+  /**
+   * Quantize each row of the compact rows x cols float32 matrix a to int8, symmetrically:
+   * scales[i] = max_k |a[i][k]| / 127 and out[i][k] = round(a[i][k] / scales[i]).  An all-zero
+   * row gets scale 1.  For a weight, a is its transpose, so that the rows are output channels.
+   */
+  CheckFloat32(a, "quantize_rows");
+  CheckInt8(*out, "quantize_rows");
+  CheckFloat32(*scales, "quantize_rows");
+  if (rows == 0) return;
+  CudaDims dim = CudaOneDim((size_t)rows * WARP_SIZE);
+  QuantizeRowsKernel<<<dim.grid, dim.block, 0, CurrentStream()>>>(a.ptr, out->data<int8_t>(),
+                                                                   scales->ptr, rows, cols);
+}
+
+void DequantizeRows(const CudaArray& a, const CudaArray& scales, CudaArray* out, uint32_t rows,
+                    uint32_t cols) {
+  // out[i][k] = a[i][k] * scales[i], the inverse of QuantizeRows() up to rounding
+  CheckInt8(a, "dequantize_rows");
+  CheckFloat32(scales, "dequantize_rows");
+  size_t size = (size_t)rows * cols;
+  if (size == 0) return;
+  CudaDims dim = CudaOneDim(size);
+  DISPATCH_DTYPE(out->dtype, T,
+                 DequantizeRowsKernel<<<dim.grid, dim.block, 0, CurrentStream()>>>(
+                     a.data<int8_t>(), scales.ptr, out->data<T>(), size, cols));
+}
+
+template <typename O>
+void MatmulInt8Launch(const CudaArray& a, const CudaArray& a_scales, const CudaArray& w,
+                      const CudaArray& w_scales, O* out, uint32_t M, uint32_t N, uint32_t P,
+                      BiasActivation epilogue, scalar_t out_mult) {
+  dim3 grid((P + INT8_BN - 1) / INT8_BN, (M + INT8_BM - 1) / INT8_BM, 1);
+  if (N % 4 == 0) {
+    MatmulInt8Kernel<true><<<grid, INT8_THREADS, 0, CurrentStream()>>>(
+        a.data<int8_t>(), a_scales.ptr, w.data<int8_t>(), w_scales.ptr, out, M, N, P, epilogue,
+        out_mult);
+  } else {
+    MatmulInt8Kernel<false><<<grid, INT8_THREADS, 0, CurrentStream()>>>(
+        a.data<int8_t>(), a_scales.ptr, w.data<int8_t>(), w_scales.ptr, out, M, N, P, epilogue,
+        out_mult);
+  }
+}
+
+void MatmulInt8(const CudaArray& a, const CudaArray& a_scales, const CudaArray& w,
+                const CudaArray& w_scales, const CudaArray* bias, CudaArray* out, uint32_t M,
+                uint32_t N, uint32_t P, int32_t activation, scalar_t out_scale) {
+  /**
+   * The int8 Linear layer above: a (M x N) and w (P x N) are compact int8 matrices quantized per
+   * row with scales a_scales (M) and w_scales (P); bias is a compact vector of P values or None.
+   * A float out (of any float dtype) gets the rescaled result with the bias and activation
+   * applied; an int8 out gets it requantized, round(result / out_scale).
+   */
+  if (activation < ACTIVATION_NONE || activation > ACTIVATION_TANH)
+    throw std::invalid_argument("matmul_int8: unknown activation");
+  CheckInt8(a, "matmul_int8");
+  CheckInt8(w, "matmul_int8");
+  CheckFloat32(a_scales, "matmul_int8");
+  CheckFloat32(w_scales, "matmul_int8");
+  if (out->dtype == DTYPE_INT8 && !(out_scale > 0))
+    throw std::invalid_argument("matmul_int8: out_scale must be positive");
+  if (M == 0 || P == 0) return;
+  std::unique_ptr<CudaArray> bias_float;
+  if (bias != nullptr && bias->dtype != DTYPE_FLOAT32) {
+    bias_float.reset(new CudaArray(bias->size));
+    AsType(*bias, bias_float.get());
+    bias = bias_float.get();
+  }
+  BiasActivation epilogue = {bias != nullptr ? bias->ptr : nullptr, 1, activation};
+  if (out->dtype == DTYPE_INT8) {
+    MatmulInt8Launch(a, a_scales, w, w_scales, out->data<int8_t>(), M, N, P, epilogue,
+                     1 / out_scale);
+    return;
+  }
+  DISPATCH_DTYPE(out->dtype, T,
+                 MatmulInt8Launch(a, a_scales, w, w_scales, out->data<T>(), M, N, P, epilogue,
+                                  1.0f));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// DLPack interop
+////////////////////////////////////////////////////////////////////////////////
+
+void SyncForConsumer(pybind11::object stream) {
+  /**
+   * Make the stream a DLPack consumer passed to __dlpack__ wait for the work queued on the
+   * current stream, by the protocol's stream numbering: None or -1 to not synchronize, 1 for the
+   * legacy default stream, 2 for the per-thread default stream, anything else a cudaStream_t.
+   */
+  if (stream.is_none()) return;
+  intptr_t value = stream.cast<intptr_t>();
+  if (value == -1) return;
+  cudaStream_t consumer = value == 1   ? (cudaStream_t)0
+                          : value == 2 ? cudaStreamPerThread
+                                       : (cudaStream_t)value;
+  cudaStream_t producer = CurrentStream();
+  if (consumer == producer) return;
+  Event event(false);
+  event.Record(producer);
+  CheckCuda(cudaStreamWaitEvent(consumer, event.handle(), 0));
+}
+
+pybind11::tuple ArrayFromDLPack(pybind11::capsule capsule) {
+  /**
+   * Take over a tensor in device memory, returned as (Array, shape, strides), without a copy.
+   * The producer has already ordered its work before the current stream, which from_dlpack() in
+   * ndarray.py passed to its __dlpack__.
+   */
+  namespace py = pybind11;
+  dlpack::Imported imported = dlpack::Import(capsule, {kDLCUDA, kDLCUDAManaged});
+  CudaArray* array = new CudaArray(imported.data, imported.size, imported.release);
+  return py::make_tuple(py::cast(array, py::return_value_policy::take_ownership),
+                        imported.shape, imported.strides);
+}
+
+void UploadStaged(void* staging, CudaArray* out) {
+  /**
+   * Copy out->size float32 items from a pinned staging buffer (which this takes over) to out on
+   * the current stream, rounded to the dtype of out on the device.  Returns as soon as the copy
+   * is queued; the buffer is reused once it completed.
+   */
+  DeviceGuard guard(out->device);
+  std::unique_ptr<CudaArray> float_copy;
+  CudaArray* dst = out;
+  if (out->dtype != DTYPE_FLOAT32) {
+    float_copy.reset(new CudaArray(out->size));
+    dst = float_copy.get();
+  }
+  size_t bytes = out->size * ELEM_SIZE;
+  cudaEvent_t copied = nullptr;
+  try {
+    CheckCuda(cudaMemcpyAsync(dst->ptr, staging, bytes, cudaMemcpyHostToDevice,
+                              CurrentStream()));
+    CheckCuda(cudaEventCreateWithFlags(&copied, cudaEventDisableTiming));
+    CheckCuda(cudaEventRecord(copied, CurrentStream()));
+  } catch (...) {
+    // the copy may not have been queued, or not be waited on: wait for everything instead
+    cudaDeviceSynchronize();
+    if (copied != nullptr) cudaEventDestroy(copied);
+    PinnedAllocator().Free(staging);
+    throw;
+  }
+  PinnedAllocator().Free(staging, copied);
+  if (dst != out) AsType(*dst, out);
+}
+
+template <typename S>
+void GatherRowsFrom(const S* src, const int64_t* indices, size_t num_indices, size_t row_size,
+                    float scale, float* out) {
+  for (size_t i = 0; i < num_indices; i++) {
+    const S* row = src + (size_t)indices[i] * row_size;
+    float* dst = out + i * row_size;
+    for (size_t j = 0; j < row_size; j++) dst[j] = scale * (float)row[j];
+  }
+}
+
+void GatherRows(pybind11::array src, pybind11::array_t<int64_t> indices, CudaArray* out,
+                float scale) {
+  /**
+   * out[i, ...] = scale * src[indices[i], ...] for the data loader, as in the cpu backend: the
+   * rows of a C-contiguous uint8 or float32 src are gathered (with the GIL released) straight
+   * into a pinned buffer, which is uploaded on the current stream.  So a loader thread with a
+   * stream of its own uploads the next batch while the training thread computes.
+   */
+  namespace py = pybind11;
+  bool is_uint8 = py::isinstance<py::array_t<uint8_t>>(src);
+  if (!is_uint8 && !py::isinstance<py::array_t<scalar_t>>(src))
+    throw std::invalid_argument("gather_rows: src must be a uint8 or float32 array");
+  if (src.ndim() < 1 || !(src.flags() & py::array::c_style))
+    throw std::invalid_argument("gather_rows: src must be a C-contiguous array");
+  if (indices.ndim() != 1 || !(indices.flags() & py::array::c_style))
+    throw std::invalid_argument("gather_rows: indices must be a contiguous 1-d array");
+  size_t num_rows = src.shape(0);
+  size_t row_size = num_rows == 0 ? 0 : src.size() / num_rows;
+  size_t num_indices = indices.size();
+  if (out->size != num_indices * row_size)
+    throw std::invalid_argument("gather_rows: out must hold len(indices) rows of src");
+  const int64_t* index = indices.data();
+  for (size_t i = 0; i < num_indices; i++) {
+    if (index[i] < 0 || (size_t)index[i] >= num_rows)
+      throw std::invalid_argument("gather_rows: index out of range");
+  }
+  const void* data = src.data();
+  py::gil_scoped_release release;
+  float* staging = (float*)PinnedAllocator().Allocate(out->size * ELEM_SIZE);
+  if (is_uint8) {
+    GatherRowsFrom((const uint8_t*)data, index, num_indices, row_size, scale, staging);
+  } else {
+    GatherRowsFrom((const scalar_t*)data, index, num_indices, row_size, scale, staging);
+  }
+  UploadStaged(staging, out);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Multiple devices
+////////////////////////////////////////////////////////////////////////////////
+
+void EnablePeerAccess(int device, int peer) {
+  // let kernels and copies on device reach peer's memory directly, where the hardware can
+  static std::mutex mutex;
+  static std::set<std::pair<int, int>> enabled;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!enabled.insert(std::make_pair(device, peer)).second) return;
+  int can_access = 0;
+  CheckCuda(cudaDeviceCanAccessPeer(&can_access, device, peer));
+  // otherwise cudaMemcpyPeerAsync still works, staged through the host
+  if (!can_access) return;
+  DeviceGuard guard(device);
+  cudaError_t err = cudaDeviceEnablePeerAccess(peer, 0);
+  if (err == cudaErrorPeerAccessAlreadyEnabled) {
+    cudaGetLastError();
+    return;
+  }
+  CheckCuda(err);
+}
+
+void CopyPeer(const CudaArray& a, CudaArray* out) {
+  /**
+   * Copy a into out, which may be on another device, without going through the host where the
+   * devices can reach each other.  The copy is queued on the current stream of out's device
+   * after the work queued so far on that of a's, and later work on a's stream waits for it, so
+   * a can be overwritten or freed there right away.
+   */
+  if (a.size != out->size) throw std::invalid_argument("copy_peer: arrays of different sizes");
+  CheckDType(a, *out, "copy_peer");
+  size_t bytes = a.size * a.itemsize();
+  if (a.device == out->device) {
+    DeviceGuard guard(a.device);
+    CheckCuda(cudaMemcpyAsync(out->ptr, a.ptr, bytes, cudaMemcpyDeviceToDevice,
+                              CurrentStream()));
+    return;
+  }
+  EnablePeerAccess(out->device, a.device);
+  // events are recorded on streams of the device they were created on
+  std::unique_ptr<Event> ready, done;
+  cudaStream_t src_stream;
+  {
+    DeviceGuard guard(a.device);
+    src_stream = CurrentStream();
+    ready.reset(new Event(false));
+    ready->Record(src_stream);
+  }
+  {
+    DeviceGuard guard(out->device);
+    cudaStream_t stream = CurrentStream();
+    CheckCuda(cudaStreamWaitEvent(stream, ready->handle(), 0));
+    CheckCuda(cudaMemcpyPeerAsync(out->ptr, out->device, a.ptr, a.device, bytes, stream));
+    done.reset(new Event(false));
+    done->Record(stream);
+  }
+  DeviceGuard guard(a.device);
+  CheckCuda(cudaStreamWaitEvent(src_stream, done->handle(), 0));
+}
+
+#ifdef NEEDLE_NCCL
+inline void CheckNccl(ncclResult_t err) {
+  if (err != ncclSuccess) throw std::runtime_error(ncclGetErrorString(err));
+}
+
+std::vector<ncclComm_t>& Communicators(const std::vector<int>& devices) {
+  // one clique per list of devices, set up on first use and kept for the process
+  static std::map<std::vector<int>, std::vector<ncclComm_t>> comms;
+  std::vector<ncclComm_t>& clique = comms[devices];
+  if (clique.empty()) {
+    std::vector<ncclComm_t> created(devices.size());
+    CheckNccl(ncclCommInitAll(created.data(), (int)devices.size(), devices.data()));
+    clique = created;
+  }
+  return clique;
+}
+#endif
+
+void AllReduceSum(const std::vector<CudaArray*>& arrays) {
+  /**
+   * Replace each of the arrays, all of the same size and dtype and each on a device of its own,
+   * by their sum, on the current stream of each device.  With NCCL (built with NEEDLE_NCCL) the
+   * sum is a ring all-reduce over the links between the devices; otherwise the arrays are copied
+   * to the first one's device, summed there and copied back.
+   */
+  if (arrays.empty()) return;
+  std::vector<int> devices;
+  for (CudaArray* a : arrays) {
+    if (a->size != arrays[0]->size)
+      throw std::invalid_argument("all_reduce_sum: arrays of different sizes");
+    CheckDType(*a, *arrays[0], "all_reduce_sum");
+    if (std::find(devices.begin(), devices.end(), a->device) != devices.end())
+      throw std::invalid_argument("all_reduce_sum: two arrays on the same device");
+    devices.push_back(a->device);
+  }
+  if (arrays[0]->dtype == DTYPE_INT8)
+    throw std::invalid_argument("all_reduce_sum: int8 arrays cannot be summed");
+  if (arrays.size() == 1) return;
+#ifdef NEEDLE_NCCL
+  std::vector<ncclComm_t>& comms = Communicators(devices);
+  ncclDataType_t type = arrays[0]->dtype == DTYPE_FLOAT16    ? ncclHalf
+                        : arrays[0]->dtype == DTYPE_BFLOAT16 ? ncclBfloat16
+                                                             : ncclFloat;
+  CheckNccl(ncclGroupStart());
+  for (size_t i = 0; i < arrays.size(); i++) {
+    DeviceGuard guard(devices[i]);
+    CheckNccl(ncclAllReduce(arrays[i]->ptr, arrays[i]->ptr, arrays[i]->size, type, ncclSum,
+                            comms[i], CurrentStream()));
+  }
+  CheckNccl(ncclGroupEnd());
+#else
+  CudaArray* root = arrays[0];
+  {
+    DeviceGuard guard(root->device);
+    for (size_t i = 1; i < arrays.size(); i++) {
+      CudaArray other(root->size, root->dtype);
+      CopyPeer(*arrays[i], &other);
+      // freeing other right away is fine, the add being queued on the stream it belongs to
+      EwiseAdd(*root, other, root);
+    }
+  }
+  for (size_t i = 1; i < arrays.size(); i++) CopyPeer(*root, arrays[i]);
+#endif
+}
+
 }  // namespace cuda
 }  // namespace needle
 
@@ -498,63 +3746,259 @@ PYBIND11_MODULE(ndarray_backend_cuda, m) {
 
   m.attr("__device_name__") = "cuda";
   m.attr("__tile_size__") = TILE;
+#ifdef NEEDLE_CUDA_FAST_MATH
+  m.attr("__fast_math__") = true;
+#else
+  m.attr("__fast_math__") = false;
+#endif
+
+  m.def("memory_stats", []() {
+    CachingAllocator::Stats stats = Allocator().GetStats();
+    py::dict res;
+    res["bytes_in_use"] = stats.bytes_in_use;
+    res["bytes_reserved"] = stats.bytes_reserved;
+    res["bytes_cached"] = stats.bytes_reserved - stats.bytes_in_use;
+    res["num_segments"] = stats.num_segments;
+    res["num_allocs"] = stats.num_allocs;
+    res["num_cache_hits"] = stats.num_cache_hits;
+    res["hit_rate"] = stats.num_allocs ? (double)stats.num_cache_hits / stats.num_allocs : 0.0;
+    res["pinned_bytes_reserved"] = PinnedAllocator().BytesReserved();
+    return res;
+  });
+  m.def("empty_cache", []() {
+    Allocator().EmptyCache();
+    PinnedAllocator().EmptyCache();
+  });
+
+  // the opt-in profiler (see ndarray_profiler.h), whose kernel times are read from events
+  m.def("profiler_enable", [](bool enabled) { profiler::SetEnabled(enabled); },
+        py::arg("enabled") = true);
+  m.def("profiler_enabled", []() { return profiler::Enabled(); });
+  m.def("profiler_reset", []() {
+    Timer().Reset();
+    profiler::Global().Reset();
+  });
+  m.def("profiler_stats", []() {
+    Timer().Flush();
+    return profiler::Global().Stats();
+  });
+  m.def("profiler_export_trace", [](const std::string& path) {
+    Timer().Flush();
+    profiler::Global().ExportTrace(path, "needle cuda");
+  });
+
+
+  py::class_<Event, std::shared_ptr<Event>>(m, "Event")
+      .def(py::init<bool>(), py::arg("enable_timing") = false)
+      .def("record", [](Event& event, const Stream* stream) {
+        event.Record(stream != nullptr ? stream->handle() : CurrentStream());
+      }, py::arg("stream") = nullptr)
+      .def("synchronize", &Event::Synchronize, py::call_guard<py::gil_scoped_release>())
+      .def("query", &Event::Query)
+      .def("elapsed_time", &Event::ElapsedTime);
+
+  py::class_<Stream, std::shared_ptr<Stream>>(m, "Stream")
+      .def(py::init<bool, int>(), py::arg("non_blocking") = true, py::arg("priority") = 0)
+      .def_property_readonly("device", &Stream::device)
+      .def("ptr", &Stream::ptr_as_int)
+      .def("synchronize", &Stream::Synchronize, py::call_guard<py::gil_scoped_release>())
+      .def("query", &Stream::Query)
+      .def("record_event", RecordEvent, py::arg("enable_timing") = false)
+      .def("wait_event", WaitEvent)
+      .def("wait_stream", WaitStream);
+
+  py::class_<Graph, std::shared_ptr<Graph>>(m, "Graph")
+      .def(py::init<>())
+      .def("capture_begin", &Graph::CaptureBegin)
+      .def("capture_end", &Graph::CaptureEnd)
+      .def("replay", &Graph::Replay)
+      .def_property_readonly("num_nodes", &Graph::NumNodes);
+
+  m.def("current_stream", GetCurrentStream);
+  m.def("default_stream",
+        []() { return std::make_shared<Stream>((cudaStream_t)0, CurrentDevice()); });
+  m.def("set_stream", SetCurrentStream);
+  m.def("synchronize", []() { CheckCuda(cudaDeviceSynchronize()); },
+        py::call_guard<py::gil_scoped_release>());
+
+  // several devices: arrays are made on the current device (on_device() picks another one for
+  // a call), and the kernels of the module run on the device of their arrays
+  m.def("device_count", []() {
+    int count;
+    CheckCuda(cudaGetDeviceCount(&count));
+    return count;
+  });
+  m.def("current_device", CurrentDevice);
+  m.def("on_device", [](int device, py::function fn, py::args args, py::kwargs kwargs) {
+    DeviceGuard guard(device);
+    return fn(*args, **kwargs);
+  });
+  m.def("copy_peer", Profiled("copy_peer", CopyPeer));
+  m.def("all_reduce_sum", Profiled("all_reduce_sum", AllReduceSum));
 
   py::class_<CudaArray>(m, "Array")
-      .def(py::init<size_t>(), py::return_value_policy::take_ownership)
+      .def(py::init([](size_t size, const std::string& dtype) {
+             return new CudaArray(size, ParseDType(dtype));
+           }),
+           py::arg("size"), py::arg("dtype") = "float32")
       .def_readonly("size", &CudaArray::size)
-      .def("ptr", &CudaArray::ptr_as_int);
-
-  // return numpy array, copying from CPU
-  m.def("to_numpy", [](const CudaArray& a, std::vector<size_t> shape, std::vector<size_t> strides,
-                       size_t offset) {
+      .def_property_readonly("dtype", [](const CudaArray& a) { return DTypeName(a.dtype); })
+      .def_property_readonly("itemsize", &CudaArray::itemsize)
+      .def_readonly("device", &CudaArray::device)
+      .def("ptr", &CudaArray::ptr_as_int)
+      .def("record_stream", &CudaArray::RecordStream);
+
+  // an array of size items of dtype in the memory of arena, offset bytes in, which keeps arena
+  // alive; the arrays of a planned training step share arenas this way (see needle/memory.py)
+  m.def("arena_view", [](py::object arena, size_t offset, size_t size, const std::string& dtype) {
+    const CudaArray& a = arena.cast<const CudaArray&>();
+    DType type = ParseDType(dtype);
+    if (offset % DTypeSize(type) != 0 || offset + size * DTypeSize(type) > a.size * a.itemsize())
+      throw std::invalid_argument("arena_view: the view must lie within the arena, aligned");
+    CudaArray* view = new CudaArray((scalar_t*)((char*)a.ptr + offset), size, [arena]() {});
+    view->dtype = type;
+    view->device = a.device;
+    return view;
+  }, py::return_value_policy::take_ownership);
+
+  // Copies go through pinned host buffers on the current stream.  to_numpy_async returns at
+  // once, with an event to wait on before reading the array; to_numpy waits for the copy itself.
+  // The numpy array keeps the pinned buffer until it is collected.  float16 arrays come back as
+  // float16; bfloat16 ones, which numpy has no type for, have to be converted to float32 first.
+  auto to_numpy_async = [](const CudaArray& a, std::vector<size_t> shape,
+                           std::vector<size_t> strides, size_t offset) {
+    if (a.dtype == DTYPE_BFLOAT16)
+      throw std::invalid_argument("to_numpy: convert bfloat16 arrays to float32 first");
+    DeviceGuard guard(a.device);
+    size_t itemsize = a.itemsize();
     std::vector<size_t> numpy_strides = strides;
     std::transform(numpy_strides.begin(), numpy_strides.end(), numpy_strides.begin(),
-                   [](size_t& c) { return c * ELEM_SIZE; });
-
-    // copy memory to host
-    scalar_t* host_ptr = (scalar_t*)std::malloc(a.size * ELEM_SIZE);
-    if (host_ptr == 0) throw std::bad_alloc();
-    cudaError_t err = cudaMemcpy(host_ptr, a.ptr, a.size * ELEM_SIZE, cudaMemcpyDeviceToHost);
-    if (err != cudaSuccess) throw std::runtime_error(cudaGetErrorString(err));
-
-    // return numpy array
-    py::capsule deallocate_buffer(host_ptr, [](void* p) { free(p); });
-    return py::array_t<scalar_t>(shape, numpy_strides, host_ptr + offset, deallocate_buffer);
+                   [itemsize](size_t& c) { return c * itemsize; });
+
+    char* host_ptr = (char*)PinnedAllocator().Allocate(a.size * itemsize);
+    std::shared_ptr<Event> done = std::make_shared<Event>(false);
+    try {
+      CheckCuda(cudaMemcpyAsync(host_ptr, a.ptr, a.size * itemsize, cudaMemcpyDeviceToHost,
+                                CurrentStream()));
+      done->Record(CurrentStream());
+    } catch (...) {
+      PinnedAllocator().Free(host_ptr);
+      throw;
+    }
+    py::capsule deallocate_buffer(host_ptr, [](void* p) { PinnedAllocator().Free(p); });
+    py::array array(py::dtype(DTypeName(a.dtype)), shape, numpy_strides,
+                    host_ptr + offset * itemsize, deallocate_buffer);
+    return std::make_pair(array, done);
+  };
+  m.def("to_numpy_async", to_numpy_async);
+  m.def("to_numpy", [to_numpy_async](const CudaArray& a, std::vector<size_t> shape,
+                                     std::vector<size_t> strides, size_t offset) {
+    auto result = to_numpy_async(a, shape, strides, offset);
+    {
+      py::gil_scoped_release release;
+      result.second->Synchronize();
+    }
+    return result.first;
   });
 
-  // copy numpy array to GPU
+  // copy numpy array to GPU: the data is staged in a pinned buffer, so this returns as soon as
+  // the copy is queued on the current stream and the numpy array may be changed right away.  The
+  // float32 data is rounded to the dtype of out on the device.
   m.def("from_numpy", [](py::array_t<scalar_t> a, CudaArray* out) {
-    cudaError_t err =
-        cudaMemcpy(out->ptr, a.request().ptr, out->size * ELEM_SIZE, cudaMemcpyHostToDevice);
-    if (err != cudaSuccess) throw std::runtime_error(cudaGetErrorString(err));
+    void* staging = PinnedAllocator().Allocate(out->size * ELEM_SIZE);
+    std::memcpy(staging, a.request().ptr, out->size * ELEM_SIZE);
+    UploadStaged(staging, out);
   });
-
-  m.def("fill", Fill);
-  m.def("compact", Compact);
-  m.def("ewise_setitem", EwiseSetitem);
-  m.def("scalar_setitem", ScalarSetitem);
-  m.def("ewise_add", EwiseAdd);
-  m.def("scalar_add", ScalarAdd);
-
-   m.def("ewise_mul", EwiseMul);
-   m.def("scalar_mul", ScalarMul);
-   m.def("ewise_div", EwiseDiv);
-   m.def("scalar_div", ScalarDiv);
-   m.def("scalar_power", ScalarPower);
-
-   m.def("ewise_maximum", EwiseMaximum);
-   m.def("scalar_maximum", ScalarMaximum);
-   m.def("ewise_eq", EwiseEq);
-   m.def("scalar_eq", ScalarEq);
-   m.def("ewise_ge", EwiseGe);
-   m.def("scalar_ge", ScalarGe);
-
-   m.def("ewise_log", EwiseLog);
-   m.def("ewise_exp", EwiseExp);
-   m.def("ewise_tanh", EwiseTanh);
-
-   m.def("matmul", Matmul);
-
-   m.def("reduce_max", ReduceMax);
-   m.def("reduce_sum", ReduceSum);
+  m.def("gather_rows", GatherRows, py::arg("src"), py::arg("indices"), py::arg("out"),
+        py::arg("scale") = 1.0f);
+
+  // DLPack capsules sharing device memory with an array, with no trip through the host
+  m.def("to_dlpack", [](py::object array, std::vector<int32_t> shape,
+                        std::vector<int32_t> strides, size_t offset, py::object stream) {
+    const CudaArray& a = array.cast<const CudaArray&>();
+    CheckFloat32(a, "to_dlpack");
+    DeviceGuard guard(a.device);
+    SyncForConsumer(stream);
+    return dlpack::Export(array, a.ptr + offset, DLDevice{kDLCUDA, a.device}, shape,
+                          strides);
+  }, py::arg("array"), py::arg("shape"), py::arg("strides"), py::arg("offset"),
+        py::arg("stream") = py::none());
+  m.def("from_dlpack", ArrayFromDLPack);
+  m.def("dlpack_device", []() { return py::make_tuple((int)kDLCUDA, CurrentDevice()); });
+
+  m.def("fill", Profiled("fill", Fill));
+  m.def("compact", Profiled("compact", Compact));
+  m.def("ewise_setitem", Profiled("ewise_setitem", EwiseSetitem));
+  m.def("scalar_setitem", Profiled("scalar_setitem", ScalarSetitem));
+  m.def("astype", Profiled("astype", AsType));
+  m.def("ewise_add", Profiled("ewise_add", EwiseAdd));
+  m.def("scalar_add", Profiled("scalar_add", ScalarAdd));
+
+  m.def("ewise_mul", Profiled("ewise_mul", EwiseMul));
+  m.def("scalar_mul", Profiled("scalar_mul", ScalarMul));
+  m.def("ewise_div", Profiled("ewise_div", EwiseDiv));
+  m.def("scalar_div", Profiled("scalar_div", ScalarDiv));
+  m.def("scalar_power", Profiled("scalar_power", ScalarPower));
+
+  m.def("ewise_maximum", Profiled("ewise_maximum", EwiseMaximum));
+  m.def("scalar_maximum", Profiled("scalar_maximum", ScalarMaximum));
+  m.def("ewise_eq", Profiled("ewise_eq", EwiseEq));
+  m.def("scalar_eq", Profiled("scalar_eq", ScalarEq));
+  m.def("ewise_ge", Profiled("ewise_ge", EwiseGe));
+  m.def("scalar_ge", Profiled("scalar_ge", ScalarGe));
+
+  m.def("ewise_log", Profiled("ewise_log", EwiseLog));
+  m.def("ewise_exp", Profiled("ewise_exp", EwiseExp));
+  m.def("ewise_tanh", Profiled("ewise_tanh", EwiseTanh));
+
+  m.def("matmul", Profiled("matmul", Matmul));
+
+  m.def("reduce_max", Profiled("reduce_max", ReduceMax));
+  m.def("reduce_sum", Profiled("reduce_sum", ReduceSum));
+  m.def("reduce_max_axis", Profiled("reduce_max_axis", ReduceMaxAxis));
+  m.def("reduce_sum_axis", Profiled("reduce_sum_axis", ReduceSumAxis));
+  m.def("logsumexp_axis", Profiled("logsumexp_axis", LogSumExpAxis));
+  m.def("log_softmax_axis", Profiled("log_softmax_axis", LogSoftmaxAxis));
+  m.def("softmax_axis", Profiled("softmax_axis", SoftmaxProbAxis));
+  m.def("softmax_cross_entropy", Profiled("softmax_cross_entropy", SoftmaxCrossEntropy));
+  m.def("layer_norm_forward", Profiled("layer_norm_forward", LayerNormForward));
+  m.def("layer_norm_backward", Profiled("layer_norm_backward", LayerNormBackward));
+  m.def("batch_norm_forward", Profiled("batch_norm_forward", BatchNormForward));
+  m.def("batch_norm_backward", Profiled("batch_norm_backward", BatchNormBackward));
+  m.def("sgd_step", Profiled("sgd_step", SgdStep));
+  m.def("adam_step", Profiled("adam_step", AdamStep));
+  m.def("multi_sgd_step", Profiled("multi_sgd_step", MultiSgdStep));
+  m.def("multi_adam_step", Profiled("multi_adam_step", MultiAdamStep));
+
+  // strided variants, reading non-compact inputs in place (see EwiseStrided()); the element-wise
+  // ones take every float dtype
+  m.attr("ewise_strided_dtypes") = py::make_tuple("float32", "float16", "bfloat16");
+  m.def("ewise_add_strided", Profiled("ewise_add_strided", EwiseStrided<AddFn>));
+  m.def("scalar_add_strided", Profiled("scalar_add_strided", ScalarStrided<AddFn>));
+  m.def("ewise_mul_strided", Profiled("ewise_mul_strided", EwiseStrided<MulFn>));
+  m.def("scalar_mul_strided", Profiled("scalar_mul_strided", ScalarStrided<MulFn>));
+  m.def("ewise_div_strided", Profiled("ewise_div_strided", EwiseStrided<DivFn>));
+  m.def("scalar_div_strided", Profiled("scalar_div_strided", ScalarStrided<DivFn>));
+  m.def("scalar_power_strided", Profiled("scalar_power_strided", ScalarStrided<PowerFn>));
+  m.def("ewise_maximum_strided", Profiled("ewise_maximum_strided", EwiseStrided<MaximumFn>));
+  m.def("scalar_maximum_strided", Profiled("scalar_maximum_strided", ScalarStrided<MaximumFn>));
+  m.def("ewise_eq_strided", Profiled("ewise_eq_strided", EwiseStrided<EqFn>));
+  m.def("scalar_eq_strided", Profiled("scalar_eq_strided", ScalarStrided<EqFn>));
+  m.def("ewise_ge_strided", Profiled("ewise_ge_strided", EwiseStrided<GeFn>));
+  m.def("scalar_ge_strided", Profiled("scalar_ge_strided", ScalarStrided<GeFn>));
+  m.def("ewise_log_strided", Profiled("ewise_log_strided", UnaryStrided<LogFn>));
+  m.def("ewise_exp_strided", Profiled("ewise_exp_strided", UnaryStrided<ExpFn>));
+  m.def("ewise_tanh_strided", Profiled("ewise_tanh_strided", UnaryStrided<TanhFn>));
+  m.def("matmul_strided", Profiled("matmul_strided", MatmulStrided));
+  m.def("matmul_batched", Profiled("matmul_batched", MatmulBatched));
+  m.def("matmul_epilogue", Profiled("matmul_epilogue", MatmulEpilogue));
+  m.def("quantize_rows", Profiled("quantize_rows", QuantizeRows));
+  m.def("dequantize_rows", Profiled("dequantize_rows", DequantizeRows));
+  m.def("matmul_int8", Profiled("matmul_int8", MatmulInt8));
+  m.def("reduce_max_strided", Profiled("reduce_max_strided", ReduceMaxStrided));
+  m.def("reduce_sum_strided", Profiled("reduce_sum_strided", ReduceSumStrided));
+
+  // a chain of element-wise operators in one launch (see EwiseFused() and fuse() in ndarray.py)
+  m.def("ewise_fused", Profiled("ewise_fused", EwiseFused));
+  m.def("ewise_fused_sum", Profiled("ewise_fused_sum", EwiseFusedSum));
 }
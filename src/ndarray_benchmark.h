@@ -0,0 +1,256 @@
+/**
+ * The harness shared by the native benchmarks of the backends (ndarray_benchmark_cpu.cc and
+ * ndarray_benchmark_cuda.cu), which call the kernels directly, without Python in between.
+ *
+ * Every case is one kernel on one shape (or layout), timed call by call after a warm-up until
+ * both --min-time seconds and --min-repeats calls have passed.  A case reports the median and 99th
+ * percentile latency, and, from the work its caller declares, GFLOP/s and GB/s and the fraction
+ * of the machine's peak that is (whichever of the two is higher, i.e. what bounds the kernel).
+ * The results are written as CSV, one line per case:
+ *
+ *   backend,isa,threads,kernel,case,calls,p50_us,p99_us,gflops,gbs,peak_pct,baseline_p50_us,change
+ *
+ * with (backend, isa, threads, kernel, case) as the key, so the output of an earlier run can be
+ * passed back as --baseline: change is then p50 / baseline p50 - 1, and the run fails (exit code 1)
+ * if any case got slower than --max-regression.
+ */
+#ifndef NEEDLE_NDARRAY_BENCHMARK_H_
+#define NEEDLE_NDARRAY_BENCHMARK_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace needle {
+namespace bench {
+
+struct Options {
+  std::string filter;    // only the kernels whose name contains this
+  std::string baseline;  // CSV of an earlier run to compare against
+  std::string out;       // where to write the CSV, stdout if empty
+  double min_time = 0.2;
+  size_t min_repeats = 10;
+  double max_regression = 0.1;
+  double peak_gflops = 0;  // 0: unknown
+  double peak_gbs = 0;     // 0: measured
+  bool quick = false;      // smaller shapes only, e.g. for a smoke test
+  std::vector<size_t> threads;
+  std::vector<std::string> isas;
+};
+
+inline std::vector<std::string> SplitList(const std::string& s, char sep) {
+  std::vector<std::string> items;
+  std::stringstream stream(s);
+  std::string item;
+  while (std::getline(stream, item, sep)) items.push_back(item);
+  return items;
+}
+
+inline void PrintUsage(const char* prog) {
+  std::cerr
+      << "usage: " << prog << " [options]\n"
+      << "  --filter=NAME          only run the kernels whose name contains NAME\n"
+      << "  --baseline=FILE        compare against the CSV of an earlier run\n"
+      << "  --max-regression=F     fail if a case is slower than the baseline by more than F"
+         " (default 0.1)\n"
+      << "  --out=FILE             write the CSV to FILE instead of stdout\n"
+      << "  --min-time=SECONDS     time each case for at least this long (default 0.2)\n"
+      << "  --min-repeats=N        and for at least N calls (default 10)\n"
+      << "  --threads=N,M,...      thread counts to sweep (cpu, default 1 and all cores)\n"
+      << "  --isa=NAME,...         kernel sets to sweep (cpu, default all supported ones)\n"
+      << "  --peak-gflops=F        compute peak of the machine, for peak_pct\n"
+      << "  --peak-gbs=F           memory bandwidth peak (default: measured with a copy)\n"
+      << "  --quick                small shapes only\n";
+}
+
+inline Options ParseArgs(int argc, char** argv) {
+  /**
+   * The options above; exits with usage on --help or anything it does not understand.
+   */
+  Options opt;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i], value;
+    size_t eq = arg.find('=');
+    if (eq != std::string::npos) {
+      value = arg.substr(eq + 1);
+      arg = arg.substr(0, eq);
+    }
+    try {
+      if (arg == "--filter") {
+        opt.filter = value;
+      } else if (arg == "--baseline") {
+        opt.baseline = value;
+      } else if (arg == "--max-regression") {
+        opt.max_regression = std::stod(value);
+      } else if (arg == "--out") {
+        opt.out = value;
+      } else if (arg == "--min-time") {
+        opt.min_time = std::stod(value);
+      } else if (arg == "--min-repeats") {
+        opt.min_repeats = std::stoul(value);
+      } else if (arg == "--threads") {
+        for (const std::string& n : SplitList(value, ',')) opt.threads.push_back(std::stoul(n));
+      } else if (arg == "--isa") {
+        opt.isas = SplitList(value, ',');
+      } else if (arg == "--peak-gflops") {
+        opt.peak_gflops = std::stod(value);
+      } else if (arg == "--peak-gbs") {
+        opt.peak_gbs = std::stod(value);
+      } else if (arg == "--quick" && eq == std::string::npos) {
+        opt.quick = true;
+      } else {
+        PrintUsage(argv[0]);
+        std::exit(arg == "--help" || arg == "-h" ? 0 : 2);
+      }
+    } catch (const std::logic_error&) {  // stod/stoul on a malformed number
+      std::cerr << argv[0] << ": bad value for " << arg << ": " << value << "\n";
+      std::exit(2);
+    }
+  }
+  return opt;
+}
+
+struct Result {
+  std::string key;  // backend,isa,threads,kernel,case
+  size_t calls;
+  double p50_us, p99_us, gflops, gbs, peak_pct;
+};
+
+class Runner {
+ public:
+  /**
+   * Runs and records the cases of one backend.  The caller sets isa, threads and peak_gbs before
+   * each sweep, and, for a device that runs asynchronously, time_call, which must return the
+   * seconds fn took to complete.
+   */
+  Runner(const Options& opt, const std::string& backend) : opt_(opt), backend_(backend) {
+    time_call = [](const std::function<void()>& fn) {
+      auto start = std::chrono::steady_clock::now();
+      fn();
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    if (!opt.baseline.empty()) LoadBaseline(opt.baseline);
+  }
+
+  bool Enabled(const std::string& kernel) const {
+    return opt_.filter.empty() || kernel.find(opt_.filter) != std::string::npos;
+  }
+
+  void Run(const std::string& kernel, const std::string& name, double flops, double bytes,
+           const std::function<void()>& fn) {
+    /**
+     * Time fn, one call of kernel on the case called name (no commas), which does flops
+     * floating point operations (0 for pure data movement) and moves bytes to and from memory.
+     */
+    if (!Enabled(kernel)) return;
+    for (int i = 0; i < 3; i++) time_call(fn);  // warm up caches, the pool and the allocator
+    std::vector<double> times;
+    double total = 0;
+    while ((total < opt_.min_time || times.size() < opt_.min_repeats) && times.size() < 100000) {
+      times.push_back(time_call(fn));
+      total += times.back();
+    }
+    std::sort(times.begin(), times.end());
+    size_t n = times.size();
+    Result res;
+    res.key = backend_ + "," + isa + "," + std::to_string(threads) + "," + kernel + "," + name;
+    res.calls = n;
+    res.p50_us = times[n / 2] * 1e6;
+    res.p99_us = times[std::min(n - 1, (size_t)std::ceil(0.99 * n) - 1)] * 1e6;
+    res.gflops = flops / (res.p50_us * 1e3);
+    res.gbs = bytes / (res.p50_us * 1e3);
+    res.peak_pct = 0;
+    if (opt_.peak_gflops > 0) res.peak_pct = 100 * res.gflops / opt_.peak_gflops;
+    if (peak_gbs > 0) res.peak_pct = std::max(res.peak_pct, 100 * res.gbs / peak_gbs);
+    results_.push_back(res);
+    std::cerr << res.key << ": " << res.p50_us << " us\n";
+  }
+
+  int Finish() {
+    /**
+     * Write the CSV and compare against the baseline; returns the exit code of the benchmark.
+     */
+    std::ofstream file;
+    if (!opt_.out.empty()) {
+      file.open(opt_.out);
+      if (!file) throw std::runtime_error("cannot write " + opt_.out);
+    }
+    std::ostream& out = opt_.out.empty() ? std::cout : file;
+    out << "backend,isa,threads,kernel,case,calls,p50_us,p99_us,gflops,gbs,peak_pct,"
+           "baseline_p50_us,change\n";
+    size_t compared = 0;
+    std::vector<std::string> regressions;
+    char line[256];
+    for (const Result& res : results_) {
+      std::snprintf(line, sizeof(line), ",%zu,%.3f,%.3f,%.3f,%.3f,%.1f", res.calls, res.p50_us,
+                    res.p99_us, res.gflops, res.gbs, res.peak_pct);
+      out << res.key << line;
+      std::map<std::string, double>::const_iterator base = baseline_.find(res.key);
+      if (base != baseline_.end()) {
+        double change = res.p50_us / base->second - 1;
+        std::snprintf(line, sizeof(line), ",%.3f,%+.3f", base->second, change);
+        out << line;
+        compared++;
+        if (change > opt_.max_regression)
+          regressions.push_back(res.key + ": " + std::to_string((int)std::round(100 * change)) +
+                                "% slower");
+      } else {
+        out << ",,";
+      }
+      out << "\n";
+    }
+    if (opt_.baseline.empty()) return 0;
+    std::cerr << compared << " of " << results_.size() << " cases found in " << opt_.baseline
+              << ", " << regressions.size() << " slower by more than "
+              << std::round(100 * opt_.max_regression) << "%\n";
+    for (const std::string& r : regressions) std::cerr << "  " << r << "\n";
+    return regressions.empty() ? 0 : 1;
+  }
+
+  std::function<double(const std::function<void()>&)> time_call;
+  std::string isa;
+  size_t threads = 1;
+  double peak_gbs = 0;
+
+ private:
+  void LoadBaseline(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("cannot read baseline " + path);
+    std::string line;
+    std::getline(file, line);  // header
+    while (std::getline(file, line)) {
+      std::vector<std::string> fields = SplitList(line, ',');
+      if (fields.size() < 7) continue;
+      std::string key = fields[0];
+      for (size_t i = 1; i < 5; i++) key += "," + fields[i];
+      baseline_[key] = std::stod(fields[6]);
+    }
+  }
+
+  Options opt_;
+  std::string backend_;
+  std::vector<Result> results_;
+  std::map<std::string, double> baseline_;  // key -> p50_us
+};
+
+inline std::string Shape(const std::vector<size_t>& dims) {
+  // "64x128", for the case names
+  std::string s;
+  for (size_t d : dims) s += (s.empty() ? "" : "x") + std::to_string(d);
+  return s;
+}
+
+}  // namespace bench
+}  // namespace needle
+
+#endif  // NEEDLE_NDARRAY_BENCHMARK_H_
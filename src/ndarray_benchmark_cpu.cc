@@ -0,0 +1,119 @@
+/**
+ * Native benchmark of the CPU backend: every kernel of ndarray_benchmark_cpu_suite.h, for each
+ * copy of the kernels this processor supports (--isa) and each thread count (--threads), with
+ * the output and baseline comparison described in ndarray_benchmark.h.  E.g.
+ *
+ *   ndarray_benchmark_cpu --out=before.csv
+ *   ...change a kernel, rebuild...
+ *   ndarray_benchmark_cpu --baseline=before.csv --filter=matmul
+ *
+ * The backend is compiled into this binary, so the kernels are timed without the pybind11 call
+ * in front of them (python -m needle.backend_ndarray.benchmark measures that part).
+ */
+#include "ndarray_backend_cpu.cc"
+#include "ndarray_benchmark.h"
+
+#include <random>
+
+namespace needle {
+namespace cpu {
+
+typedef std::unique_ptr<AlignedArray> Array;
+
+Array Empty(size_t size, DType dtype = DTYPE_FLOAT32) {
+  Array a(new AlignedArray(size, dtype));
+  std::memset(a->ptr, 0, size * a->itemsize());  // fault the pages in before timing
+  return a;
+}
+
+Array Random(size_t size, scalar_t lo = -1, scalar_t hi = 1) {
+  Array a(new AlignedArray(size));
+  std::mt19937 gen(size);
+  std::uniform_real_distribution<scalar_t> dist(lo, hi);
+  for (size_t i = 0; i < size; i++) a->ptr[i] = dist(gen);
+  return a;
+}
+
+double MeasureBandwidth() {
+  // GB/s of the best of a few parallel copies of 128 MiB, about what the memory system sustains
+  size_t size = 32 << 20;
+  Array src = Random(size), dst = Empty(size);
+  double best = 0;
+  for (int i = 0; i < 5; i++) {
+    auto start = std::chrono::steady_clock::now();
+    ParallelFor(size, 1 << 16, [&](size_t begin, size_t end) {
+      std::memcpy(dst->ptr + begin, src->ptr + begin, (end - begin) * ELEM_SIZE);
+    });
+    double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    best = std::max(best, 2 * size * ELEM_SIZE / seconds / 1e9);
+  }
+  return best;
+}
+
+// the suite, once per copy of the kernels, next to it
+namespace baseline {
+#include "ndarray_benchmark_cpu_suite.h"
+}  // namespace baseline
+#ifdef NEEDLE_X86_DISPATCH
+namespace sse42 {
+#include "ndarray_benchmark_cpu_suite.h"
+}  // namespace sse42
+namespace avx2 {
+#include "ndarray_benchmark_cpu_suite.h"
+}  // namespace avx2
+namespace avx512 {
+#include "ndarray_benchmark_cpu_suite.h"
+}  // namespace avx512
+#endif
+
+void (*SuiteOf(const KernelSet& set))(bench::Runner&, bool) {
+  // RunSuite() of the namespace behind a KERNEL_SETS entry
+#ifdef NEEDLE_X86_DISPATCH
+  if (set.define == avx512::DefineKernels) return avx512::RunSuite;
+  if (set.define == avx2::DefineKernels) return avx2::RunSuite;
+  if (set.define == sse42::DefineKernels) return sse42::RunSuite;
+#endif
+  return baseline::RunSuite;
+}
+
+}  // namespace cpu
+}  // namespace needle
+
+int main(int argc, char** argv) {
+  using namespace needle;
+  using namespace cpu;
+  bench::Options opt = bench::ParseArgs(argc, argv);
+  if (opt.threads.empty()) {
+    opt.threads.push_back(1);
+    if (DefaultNumThreads() > 1) opt.threads.push_back(DefaultNumThreads());
+  }
+
+  std::vector<const KernelSet*> sets;
+  for (const KernelSet* set : SupportedKernelSets()) {
+    bool requested = std::find(opt.isas.begin(), opt.isas.end(), set->name) != opt.isas.end();
+    if (opt.isas.empty() || requested) sets.push_back(set);
+  }
+  if (sets.empty()) {
+    std::cerr << "none of the requested kernel sets is supported on this cpu\n";
+    return 2;
+  }
+
+  try {
+    bench::Runner runner(opt, "cpu");
+    for (size_t threads : opt.threads) {
+      Pool().SetNumThreads(threads);
+      runner.threads = threads;
+      runner.peak_gbs = opt.peak_gbs > 0 ? opt.peak_gbs : MeasureBandwidth();
+      std::cerr << "threads=" << threads << ": peak " << runner.peak_gbs << " GB/s\n";
+      for (const KernelSet* set : sets) {
+        runner.isa = set->name;
+        SuiteOf(*set)(runner, opt.quick);
+      }
+    }
+    return runner.Finish();
+  } catch (const std::exception& e) {
+    std::cerr << "error: " << e.what() << "\n";
+    return 2;
+  }
+}
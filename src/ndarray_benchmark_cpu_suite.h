@@ -0,0 +1,237 @@
+/**
+ * The cases of the CPU benchmark, one or more per kernel bound by DefineKernels().
+ *
+ * Like ndarray_backend_cpu_kernels.h, this is included once per copy of the kernels, inside its
+ * namespace (see ndarray_benchmark_cpu.cc), so the calls below bind to that copy.  It is compiled
+ * for the default target, since it only calls into the kernels.
+ *
+ * Each case declares the work it does: flops counts one per output item for the element-wise
+ * kernels (whatever the op costs) and 2 per multiply-add for the products, bytes the compulsory
+ * traffic, each input item read and each output item written once.
+ */
+
+void RunSuite(bench::Runner& r, bool quick) {
+  using bench::Shape;
+  const double F = sizeof(scalar_t);
+
+  // element-wise, from sizes where only the call overhead shows up to memory bound ones
+  std::vector<size_t> sizes = {1 << 10, 1 << 16, 1 << 20};
+  if (!quick) sizes.push_back(1 << 24);
+  for (size_t n : sizes) {
+    Array a = Random(n, -2, 2), b = Random(n, 0.5, 2), out = Empty(n);
+    Array half = Empty(n, DTYPE_FLOAT16), int8 = Empty(n, DTYPE_INT8);
+    std::string c = std::to_string(n);
+    double unary = 2 * n * F, binary = 3 * n * F;
+    r.Run("fill", c, 0, n * F, [&] { Fill(out.get(), 1); });
+    r.Run("ewise_add", c, n, binary, [&] { EwiseAdd(*a, *b, out.get()); });
+    r.Run("ewise_mul", c, n, binary, [&] { EwiseMul(*a, *b, out.get()); });
+    r.Run("ewise_div", c, n, binary, [&] { EwiseDiv(*a, *b, out.get()); });
+    r.Run("ewise_maximum", c, n, binary, [&] { EwiseMaximum(*a, *b, out.get()); });
+    r.Run("ewise_eq", c, n, binary, [&] { EwiseEq(*a, *b, out.get()); });
+    r.Run("ewise_ge", c, n, binary, [&] { EwiseGe(*a, *b, out.get()); });
+    r.Run("scalar_add", c, n, unary, [&] { ScalarAdd(*a, 1.5, out.get()); });
+    r.Run("scalar_mul", c, n, unary, [&] { ScalarMul(*a, 1.5, out.get()); });
+    r.Run("scalar_div", c, n, unary, [&] { ScalarDiv(*a, 1.5, out.get()); });
+    r.Run("scalar_maximum", c, n, unary, [&] { ScalarMaximum(*a, 0, out.get()); });
+    r.Run("scalar_eq", c, n, unary, [&] { ScalarEq(*a, 0, out.get()); });
+    r.Run("scalar_ge", c, n, unary, [&] { ScalarGe(*a, 0, out.get()); });
+    // a shortcut exponent and the general path
+    r.Run("scalar_power", c + ":2", n, unary, [&] { ScalarPower(*b, 2, out.get()); });
+    r.Run("scalar_power", c + ":1.7", n, unary, [&] { ScalarPower(*b, 1.7, out.get()); });
+    r.Run("ewise_log", c, n, unary, [&] { EwiseLog(*b, out.get()); });
+    r.Run("ewise_exp", c, n, unary, [&] { EwiseExp(*a, out.get()); });
+    r.Run("ewise_tanh", c, n, unary, [&] { EwiseTanh(*a, out.get()); });
+    r.Run("astype", c + ":float32>float16", 0, 6 * n, [&] { AsType(*a, half.get()); });
+    r.Run("astype", c + ":float16>float32", 0, 6 * n, [&] { AsType(*half, out.get()); });
+    r.Run("astype", c + ":float32>int8", 0, 5 * n, [&] { AsType(*a, int8.get()); });
+    // a * b + a, which unfused is two passes and an intermediate
+    std::vector<AlignedArray*> inputs = {a.get(), b.get()};
+    std::vector<int32_t> program = {FUSED_LOAD, 0, 0, 0, FUSED_LOAD, 1, 1, 0,
+                                    FUSED_MUL,  2, 0, 1, FUSED_ADD,  3, 2, 0};
+    r.Run("ewise_fused", c + ":a*b+a", 2 * n, binary, [&] {
+      EwiseFused(inputs, {{1}, {1}}, {0, 0}, {}, program, out.get(), {(int32_t)n});
+    });
+    Array total = Empty(1);
+    r.Run("ewise_fused_sum", c + ":sum(a*b+a)", 3 * n, 2 * n * F, [&] {
+      EwiseFusedSum(inputs, {{1}, {1}}, {0, 0}, {}, program, total.get(), {(int32_t)n}, n);
+    });
+  }
+
+  // layouts: the strided views that compact() and the *_strided kernels read in place
+  int32_t s = quick ? 256 : 2048;
+  size_t s2 = (size_t)s * s;
+  {
+    // reductions take the number of rows from the size of out
+    Array a = Random(s2), b = Random(s2), out = Empty(s2), row = Empty(s), one = Empty(1);
+    std::string c = Shape({(size_t)s, (size_t)s});
+    std::string half = Shape({(size_t)s / 2, (size_t)s / 2});
+    r.Run("compact", c + ":transpose", 0, 2 * s2 * F,
+          [&] { Compact(*a, out.get(), {s, s}, {1, s}, 0); });
+    r.Run("compact", c + ":broadcast", 0, (s2 + s) * F,
+          [&] { Compact(*a, out.get(), {s, s}, {0, 1}, 0); });
+    r.Run("compact", half + ":slice", 0, s2 / 2 * F,
+          [&] { Compact(*a, out.get(), {s / 2, s / 2}, {2 * s, 2}, s + 1); });
+    r.Run("ewise_setitem", half + ":slice", 0, s2 / 2 * F,
+          [&] { EwiseSetitem(*b, out.get(), {s / 2, s / 2}, {2 * s, 2}, s + 1); });
+    r.Run("scalar_setitem", half + ":slice", 0, s2 / 4 * F,
+          [&] { ScalarSetitem(s2 / 4, 0, out.get(), {s / 2, s / 2}, {2 * s, 2}, s + 1); });
+    r.Run("ewise_add_strided", c + ":transpose", s2, 3 * s2 * F,
+          [&] { EwiseStrided<AddOp>(*a, *b, out.get(), {s, s}, {1, s}, 0, {s, 1}, 0); });
+    r.Run("scalar_mul_strided", c + ":transpose", s2, 2 * s2 * F,
+          [&] { ScalarStrided<MulOp>(*a, 1.5, out.get(), {s, s}, {1, s}, 0); });
+    r.Run("ewise_exp_strided", c + ":transpose", s2, 2 * s2 * F,
+          [&] { UnaryStrided<ExpOp>(*a, out.get(), {s, s}, {1, s}, 0); });
+    r.Run("reduce_sum_strided", c + ":transpose", s2, (s2 + s) * F,
+          [&] { ReduceSumStrided(*a, row.get(), {s, s}, {1, s}, 0); });
+    r.Run("reduce_max_strided", c + ":transpose", s2, (s2 + s) * F,
+          [&] { ReduceMaxStrided(*a, row.get(), {s, s}, {1, s}, 0); });
+
+    // NCHW -> NHWC
+    int32_t n = quick ? 8 : 32, ch = 64, h = quick ? 16 : 32, w = h;
+    size_t size = (size_t)n * ch * h * w;
+    Array image = Random(size), permuted = Empty(size);
+    r.Run("compact", Shape({(size_t)n, (size_t)h, (size_t)w, (size_t)ch}) + ":nchw>nhwc", 0,
+          2 * size * F, [&] {
+            Compact(*image, permuted.get(), {n, h, w, ch}, {ch * h * w, w, 1, h * w}, 0);
+          });
+
+    // reductions over the last, middle and all dimensions, and over short rows
+    r.Run("reduce_sum", c, s2, (s2 + s) * F, [&] { ReduceSum(*a, row.get(), s); });
+    r.Run("reduce_max", c, s2, (s2 + s) * F, [&] { ReduceMax(*a, row.get(), s); });
+    r.Run("reduce_sum", Shape({1, s2}), s2, s2 * F, [&] { ReduceSum(*a, one.get(), s2); });
+    Array quarter = Empty(s2 / 4);
+    r.Run("reduce_sum", Shape({s2 / 4, 4}), s2, 1.25 * s2 * F,
+          [&] { ReduceSum(*a, quarter.get(), 4); });
+    r.Run("reduce_sum_axis", Shape({1, (size_t)s, (size_t)s}), s2, (s2 + s) * F,
+          [&] { ReduceSumAxis(*a, row.get(), 1, s, s); });
+    r.Run("reduce_max_axis", Shape({1, (size_t)s, (size_t)s}), s2, (s2 + s) * F,
+          [&] { ReduceMaxAxis(*a, row.get(), 1, s, s); });
+  }
+
+  // row-wise normalizations, on wide rows and on classifier-sized ones
+  std::vector<std::vector<size_t>> rows_cols = {{(size_t)s, (size_t)s}, {16 * (size_t)s, 10}};
+  for (const std::vector<size_t>& shape : rows_cols) {
+    size_t rows = shape[0], cols = shape[1], size = rows * cols;
+    Array a = Random(size, -4, 4), out = Empty(size), grad = Empty(size), loss = Empty(rows);
+    Array lse = Empty(rows), labels = Empty(rows);
+    for (size_t i = 0; i < rows; i++) labels->ptr[i] = (i * 7) % cols;
+    std::string c = Shape(shape);
+    r.Run("softmax_axis", c, size, 2 * size * F,
+          [&] { SoftmaxProbAxis(*a, out.get(), rows, cols, 1); });
+    r.Run("log_softmax_axis", c, size, 2 * size * F,
+          [&] { LogSoftmaxAxis(*a, out.get(), rows, cols, 1); });
+    r.Run("logsumexp_axis", c, size, (size + rows) * F,
+          [&] { LogSumExpAxis(*a, lse.get(), rows, cols, 1); });
+    r.Run("softmax_cross_entropy", c, size, (2 * size + 2 * rows) * F,
+          [&] { SoftmaxCrossEntropy(*a, *labels, loss.get(), grad.get(), rows, cols); });
+  }
+  {
+    size_t rows = quick ? 512 : 8192, dim = quick ? 256 : 1024, size = rows * dim;
+    Array x = Random(size), grad_out = Random(size), out = Empty(size), grad_x = Empty(size);
+    Array weight = Random(dim, 0.5, 1.5), bias = Random(dim), grad_weight = Empty(dim);
+    Array grad_bias = Empty(dim), running_mean = Random(dim), running_var = Random(dim, 0.5, 2);
+    Array mean = Empty(std::max(rows, dim)), inv_std = Empty(std::max(rows, dim));
+    std::string c = Shape({rows, dim});
+    r.Run("layer_norm_forward", c, size, 2 * size * F, [&] {
+      LayerNormForward(*x, weight.get(), bias.get(), out.get(), mean.get(), inv_std.get(), rows,
+                       dim, 1e-5);
+    });
+    LayerNormForward(*x, weight.get(), bias.get(), out.get(), mean.get(), inv_std.get(), rows,
+                     dim, 1e-5);
+    r.Run("layer_norm_backward", c, size, 3 * size * F, [&] {
+      LayerNormBackward(*grad_out, *x, weight.get(), *mean, *inv_std, grad_x.get(),
+                        grad_weight.get(), grad_bias.get(), rows, dim);
+    });
+    r.Run("batch_norm_forward", c + ":train", size, 2 * size * F, [&] {
+      BatchNormForward(*x, weight.get(), bias.get(), out.get(), mean.get(), inv_std.get(),
+                       running_mean.get(), running_var.get(), rows, dim, 1e-5, 0.1, true);
+    });
+    r.Run("batch_norm_forward", c + ":eval", size, 2 * size * F, [&] {
+      BatchNormForward(*x, weight.get(), bias.get(), out.get(), mean.get(), inv_std.get(),
+                       running_mean.get(), running_var.get(), rows, dim, 1e-5, 0.1, false);
+    });
+    BatchNormForward(*x, weight.get(), bias.get(), out.get(), mean.get(), inv_std.get(),
+                     running_mean.get(), running_var.get(), rows, dim, 1e-5, 0.1, true);
+    r.Run("batch_norm_backward", c, size, 3 * size * F, [&] {
+      BatchNormBackward(*grad_out, *x, weight.get(), *mean, *inv_std, grad_x.get(),
+                        grad_weight.get(), grad_bias.get(), rows, dim, true);
+    });
+  }
+  {
+    // an optimizer step over a model of many small layers, all of it in one call
+    size_t count = 64, items = 4096, size = count * items;
+    std::vector<Array> state;
+    std::vector<AlignedArray*> params, grads, m, v;
+    for (size_t t = 0; t < count; t++) {
+      for (std::vector<AlignedArray*>* list : {&params, &grads, &m, &v}) {
+        state.push_back(list == &v ? Random(items, 0, 1) : Random(items));
+        list->push_back(state.back().get());
+      }
+    }
+    std::string c = std::to_string(count) + "x" + std::to_string(items);
+    r.Run("multi_sgd_step", c, size, 5 * size * F,
+          [&] { MultiSgdStep(params, grads, m, 1e-3, 0.9, 1e-4); });
+    r.Run("multi_adam_step", c, size, 7 * size * F,
+          [&] { MultiAdamStepAt(params, grads, m, v, 1e-3, 0.9, 0.999, 1e-8, 1e-4, 10); });
+  }
+
+  // products: square, matrix-vector and tall-skinny
+  std::vector<std::vector<uint32_t>> mnps = {{64, 64, 64}, {256, 256, 256}, {1, 1024, 1024},
+                                             {4096, 256, 16}};
+  if (!quick) {
+    mnps.push_back({1024, 1024, 1024});
+    mnps.push_back({2048, 2048, 2048});
+  }
+  for (const std::vector<uint32_t>& mnp : mnps) {
+    uint32_t m = mnp[0], n = mnp[1], p = mnp[2];
+    int32_t ni = n, pi = p;
+    Array a = Random((size_t)m * n), b = Random((size_t)n * p), out = Empty((size_t)m * p);
+    Array bias = Random(p);
+    std::string c = Shape({m, n, p});
+    double flops = 2.0 * m * n * p, bytes = ((double)m * n + (double)n * p + (double)m * p) * F;
+    r.Run("matmul", c, flops, bytes, [&] { Matmul(*a, *b, out.get(), m, n, p); });
+    if (m % TILE == 0 && n % TILE == 0 && p % TILE == 0)
+      r.Run("matmul_tiled", c, flops, bytes, [&] { MatmulTiled(*a, *b, out.get(), m, n, p); });
+    // b viewed transposed, as in x @ w.T
+    r.Run("matmul_strided", c + ":bT", flops, bytes,
+          [&] { MatmulStrided(*a, *b, out.get(), m, n, p, {ni, 1}, 0, {1, ni}, 0); });
+    r.Run("matmul_epilogue", c + ":bias+relu", flops, bytes + p * F, [&] {
+      MatmulEpilogue(*a, *b, bias.get(), out.get(), m, n, p, {ni, 1}, 0, {pi, 1}, 0,
+                     ACTIVATION_RELU, 1);
+    });
+
+    Array qa = Empty((size_t)m * n, DTYPE_INT8), a_scales = Empty(m);
+    Array qw = Empty((size_t)p * n, DTYPE_INT8), w_scales = Empty(p);
+    Array q_out = Empty((size_t)m * p, DTYPE_INT8), dq = Empty((size_t)m * n);
+    QuantizeRows(*b, qw.get(), w_scales.get(), p, n);  // any p x n values will do
+    r.Run("quantize_rows", Shape({m, n}), (double)m * n, ((double)m * n * 5 + m * 4),
+          [&] { QuantizeRows(*a, qa.get(), a_scales.get(), m, n); });
+    r.Run("dequantize_rows", Shape({m, n}), (double)m * n, ((double)m * n * 5 + m * 4),
+          [&] { DequantizeRows(*qa, *a_scales, dq.get(), m, n); });
+    double int8_bytes = (double)m * n + (double)n * p + ((double)m + p) * F;
+    r.Run("matmul_int8", c + ":float", flops, int8_bytes + (double)m * p * F, [&] {
+      MatmulInt8(*qa, *a_scales, *qw, *w_scales, bias.get(), out.get(), m, n, p,
+                 ACTIVATION_RELU, 1);
+    });
+    r.Run("matmul_int8", c + ":int8", flops, int8_bytes + (double)m * p, [&] {
+      MatmulInt8(*qa, *a_scales, *qw, *w_scales, bias.get(), q_out.get(), m, n, p,
+                 ACTIVATION_RELU, 0.05);
+    });
+  }
+  {
+    // many small products (attention heads), and one weight against a batch
+    uint32_t batch = quick ? 8 : 64, d = quick ? 32 : 64, l = quick ? 64 : 256;
+    int32_t bi = batch, di = d, li = l;
+    Array q = Random((size_t)batch * l * d), k = Random((size_t)batch * d * l);
+    Array out = Empty((size_t)batch * l * l);
+    r.Run("matmul_batched", Shape({batch, l, d, l}), 2.0 * batch * l * d * l,
+          (2.0 * batch * l * d + (double)batch * l * l) * F, [&] {
+            MatmulBatched(*q, *k, out.get(), {bi}, l, d, l, {li * di, di, 1}, 0,
+                          {di * li, li, 1}, 0);
+          });
+    r.Run("matmul_batched", Shape({batch, l, d, l}) + ":broadcast_b", 2.0 * batch * l * d * l,
+          ((double)batch * l * d + (double)d * l + (double)batch * l * l) * F, [&] {
+            MatmulBatched(*q, *k, out.get(), {bi}, l, d, l, {li * di, di, 1}, 0, {0, li, 1}, 0);
+          });
+  }
+}
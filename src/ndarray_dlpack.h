@@ -0,0 +1,157 @@
+/**
+ * DLPack export and import for the backend modules.
+ *
+ * DLPack (https://github.com/dmlc/dlpack) describes a strided tensor in some device's memory
+ * together with a deleter, and is passed between libraries in a PyCapsule named "dltensor" that
+ * the consumer renames to "used_dltensor" once it has taken ownership.  Only the part of the ABI
+ * that needle needs (float32 tensors, CPU and CUDA devices) is declared here, matching the layout
+ * of dlpack.h.
+ */
+#ifndef NEEDLE_NDARRAY_DLPACK_H_
+#define NEEDLE_NDARRAY_DLPACK_H_
+
+#include <pybind11/pybind11.h>
+
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+extern "C" {
+
+enum DLDeviceType {
+  kDLCPU = 1,
+  kDLCUDA = 2,
+  kDLCUDAHost = 3,
+  kDLCUDAManaged = 13,
+};
+
+enum DLDataTypeCode {
+  kDLInt = 0,
+  kDLUInt = 1,
+  kDLFloat = 2,
+};
+
+typedef struct {
+  int32_t device_type;
+  int32_t device_id;
+} DLDevice;
+
+typedef struct {
+  uint8_t code;
+  uint8_t bits;
+  uint16_t lanes;
+} DLDataType;
+
+typedef struct {
+  void* data;
+  DLDevice device;
+  int32_t ndim;
+  DLDataType dtype;
+  int64_t* shape;
+  int64_t* strides;  // in elements, or null for a compact (row major) tensor
+  uint64_t byte_offset;
+} DLTensor;
+
+typedef struct DLManagedTensor {
+  DLTensor dl_tensor;
+  void* manager_ctx;
+  void (*deleter)(struct DLManagedTensor* self);
+} DLManagedTensor;
+
+}  // extern "C"
+
+namespace needle {
+namespace dlpack {
+
+struct ExportContext {
+  pybind11::object owner;  // the backend Array whose memory is exported
+  std::vector<int64_t> shape, strides;
+};
+
+inline pybind11::capsule Export(pybind11::object owner, float* data, DLDevice device,
+                                const std::vector<int32_t>& shape,
+                                const std::vector<int32_t>& strides) {
+  /**
+   * Wrap the float32 view (data, shape, strides) of owner, which stays alive until the consumer
+   * calls the deleter (or the capsule is dropped without being consumed).
+   */
+  ExportContext* ctx = new ExportContext;
+  ctx->owner = owner;
+  ctx->shape.assign(shape.begin(), shape.end());
+  ctx->strides.assign(strides.begin(), strides.end());
+  DLManagedTensor* tensor = new DLManagedTensor;
+  tensor->dl_tensor.data = data;
+  tensor->dl_tensor.device = device;
+  tensor->dl_tensor.ndim = shape.size();
+  tensor->dl_tensor.dtype = DLDataType{kDLFloat, 32, 1};
+  tensor->dl_tensor.shape = ctx->shape.data();
+  tensor->dl_tensor.strides = ctx->strides.data();
+  tensor->dl_tensor.byte_offset = 0;
+  tensor->manager_ctx = ctx;
+  tensor->deleter = [](DLManagedTensor* self) {
+    // consumers may free the tensor from a thread that does not hold the GIL
+    pybind11::gil_scoped_acquire gil;
+    delete (ExportContext*)self->manager_ctx;
+    delete self;
+  };
+  return pybind11::capsule(tensor, "dltensor", [](PyObject* capsule) {
+    if (!PyCapsule_IsValid(capsule, "dltensor")) return;  // consumed
+    DLManagedTensor* tensor = (DLManagedTensor*)PyCapsule_GetPointer(capsule, "dltensor");
+    tensor->deleter(tensor);
+  });
+}
+
+struct Imported {
+  float* data;  // at the first item, byte_offset already applied
+  size_t size;  // items from data to the last one the view can reach
+  std::vector<int32_t> shape, strides;
+  std::function<void()> release;  // hands the tensor back to its producer
+};
+
+inline Imported Import(pybind11::capsule capsule, const std::vector<int32_t>& device_types) {
+  /**
+   * Take ownership of the tensor in a "dltensor" capsule, which must hold float32 data on one of
+   * device_types, with non-negative strides.
+   */
+  if (!PyCapsule_IsValid(capsule.ptr(), "dltensor"))
+    throw std::invalid_argument("from_dlpack: expected an unconsumed \"dltensor\" capsule");
+  DLManagedTensor* tensor = (DLManagedTensor*)PyCapsule_GetPointer(capsule.ptr(), "dltensor");
+  const DLTensor& t = tensor->dl_tensor;
+  bool device_ok = false;
+  for (int32_t type : device_types) device_ok = device_ok || t.device.device_type == type;
+  if (!device_ok) throw std::invalid_argument("from_dlpack: tensor is on another device");
+  if (t.dtype.code != kDLFloat || t.dtype.bits != 32 || t.dtype.lanes != 1)
+    throw std::invalid_argument("from_dlpack: only float32 tensors are supported");
+  if (t.byte_offset % sizeof(float) != 0)
+    throw std::invalid_argument("from_dlpack: byte_offset is not a multiple of the item size");
+
+  Imported res;
+  res.data = (float*)((char*)t.data + t.byte_offset);
+  res.shape.resize(t.ndim);
+  res.strides.resize(t.ndim);
+  int64_t stride = 1;
+  bool empty = false;
+  res.size = 1;
+  for (int32_t i = t.ndim - 1; i >= 0; i--) {
+    res.shape[i] = t.shape[i];
+    res.strides[i] = t.strides != nullptr ? t.strides[i] : stride;
+    if (res.strides[i] < 0)
+      throw std::invalid_argument("from_dlpack: negative strides are not supported");
+    stride *= t.shape[i];
+    empty = empty || t.shape[i] == 0;
+    res.size += (size_t)(t.shape[i] - 1) * res.strides[i];
+  }
+  if (empty) res.size = 0;
+
+  PyCapsule_SetName(capsule.ptr(), "used_dltensor");
+  res.release = [tensor]() {
+    if (tensor->deleter != nullptr) tensor->deleter(tensor);
+  };
+  return res;
+}
+
+}  // namespace dlpack
+}  // namespace needle
+
+#endif  // NEEDLE_NDARRAY_DLPACK_H_
@@ -0,0 +1,210 @@
+/**
+ * Opt-in kernel profiler for the backend modules.
+ *
+ * Every kernel is bound through a wrapper (Profiled() in each backend) that, while the profiler
+ * is enabled, times the call and counts the bytes of the arrays passed to it, and every array
+ * allocation and release is counted as well.  Disabled, which is the default, all of it costs one
+ * relaxed load and a branch per call.  From Python (see BackendDevice.profile() in ndarray.py):
+ *
+ *   profiler_enable(bool)       start or stop recording
+ *   profiler_reset()            drop everything recorded so far
+ *   profiler_stats()            {"kernels": {name: {calls, total_us, max_us, bytes}},
+ *                                "allocs": {count, bytes, max_bytes, frees}, "dropped_events"}
+ *   profiler_export_trace(path) write the calls as a Chrome trace (chrome://tracing, Perfetto)
+ *
+ * bytes is the size of the array arguments, so for a strided view it is the whole buffer rather
+ * than the items actually touched.  Times are in microseconds on the host's steady clock.  On the
+ * CPU a call is timed on the host; on the GPU it is the time between two events around the
+ * kernel, placed on the host clock, so the traces of the two modules line up.
+ */
+#ifndef NEEDLE_NDARRAY_PROFILER_H_
+#define NEEDLE_NDARRAY_PROFILER_H_
+
+#include <pybind11/pybind11.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace needle {
+namespace profiler {
+
+// trace events kept, beyond which they are only counted (the per-kernel totals stay exact)
+const size_t MAX_TRACE_EVENTS = 1 << 20;
+
+// read by every profiled call, hence a plain flag rather than a member of Global(), whose
+// function-local static would add a guard check
+static std::atomic<bool> enabled(false);
+
+inline bool Enabled() { return enabled.load(std::memory_order_relaxed); }
+
+inline void SetEnabled(bool value) { enabled.store(value, std::memory_order_relaxed); }
+
+inline double NowUs() {
+  return std::chrono::duration<double, std::micro>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+class Profiler {
+ public:
+  void Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    kernels_.clear();
+    events_.clear();
+    allocs_ = AllocStats();
+    dropped_ = 0;
+  }
+
+  void RecordKernel(const char* name, double start_us, double dur_us, uint64_t bytes) {
+    // name must outlive the profiler (the kernels are bound with string literals)
+    std::lock_guard<std::mutex> lock(mutex_);
+    KernelStats& stats = kernels_[name];
+    stats.calls++;
+    stats.total_us += dur_us;
+    stats.max_us = std::max(stats.max_us, dur_us);
+    stats.bytes += bytes;
+    AddEvent(Event{name, 'X', start_us, dur_us, bytes});
+  }
+
+  void RecordAlloc(uint64_t bytes, uint64_t bytes_in_use) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    allocs_.count++;
+    allocs_.bytes += bytes;
+    allocs_.max_bytes = std::max(allocs_.max_bytes, bytes);
+    AddEvent(Event{"bytes_in_use", 'C', NowUs(), 0, bytes_in_use});
+  }
+
+  void RecordFree(uint64_t bytes_in_use) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    allocs_.frees++;
+    AddEvent(Event{"bytes_in_use", 'C', NowUs(), 0, bytes_in_use});
+  }
+
+  pybind11::dict Stats() {
+    namespace py = pybind11;
+    std::lock_guard<std::mutex> lock(mutex_);
+    // the same name may have been recorded through several pointers (one per binding)
+    std::unordered_map<std::string, KernelStats> merged;
+    for (const auto& entry : kernels_) {
+      KernelStats& stats = merged[entry.first];
+      stats.calls += entry.second.calls;
+      stats.total_us += entry.second.total_us;
+      stats.max_us = std::max(stats.max_us, entry.second.max_us);
+      stats.bytes += entry.second.bytes;
+    }
+    py::dict kernels;
+    for (const auto& entry : merged) {
+      py::dict stats;
+      stats["calls"] = entry.second.calls;
+      stats["total_us"] = entry.second.total_us;
+      stats["max_us"] = entry.second.max_us;
+      stats["bytes"] = entry.second.bytes;
+      kernels[entry.first.c_str()] = stats;
+    }
+    py::dict allocs;
+    allocs["count"] = allocs_.count;
+    allocs["bytes"] = allocs_.bytes;
+    allocs["max_bytes"] = allocs_.max_bytes;
+    allocs["frees"] = allocs_.frees;
+    py::dict res;
+    res["kernels"] = kernels;
+    res["allocs"] = allocs;
+    res["dropped_events"] = dropped_;
+    return res;
+  }
+
+  void ExportTrace(const std::string& path, const char* process_name) {
+    /**
+     * Write the recorded events in the Chrome trace event format: one complete ("X") event per
+     * kernel call, with its bytes as an argument, and a counter ("C") track of the bytes in use
+     * by the allocator.
+     */
+    std::lock_guard<std::mutex> lock(mutex_);
+    FILE* file = std::fopen(path.c_str(), "w");
+    if (file == nullptr) throw std::runtime_error("profiler_export_trace: cannot write " + path);
+    std::fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    std::fprintf(file,
+                 "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0, "
+                 "\"args\": {\"name\": \"%s\"}}",
+                 process_name);
+    for (const Event& e : events_) {
+      if (e.phase == 'X') {
+        std::fprintf(file,
+                     ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": %.3f, "
+                     "\"dur\": %.3f, \"args\": {\"bytes\": %llu}}",
+                     e.name, e.ts_us, e.dur_us, (unsigned long long)e.value);
+      } else {
+        std::fprintf(file,
+                     ",\n{\"name\": \"%s\", \"ph\": \"C\", \"pid\": 0, \"tid\": 0, \"ts\": %.3f, "
+                     "\"args\": {\"bytes\": %llu}}",
+                     e.name, e.ts_us, (unsigned long long)e.value);
+      }
+    }
+    std::fprintf(file, "\n]}\n");
+    bool failed = std::ferror(file) != 0;
+    if (std::fclose(file) != 0 || failed)
+      throw std::runtime_error("profiler_export_trace: error writing " + path);
+  }
+
+ private:
+  struct KernelStats {
+    uint64_t calls = 0;
+    double total_us = 0, max_us = 0;
+    uint64_t bytes = 0;
+  };
+  struct AllocStats {
+    uint64_t count = 0, bytes = 0, max_bytes = 0, frees = 0;
+  };
+  struct Event {
+    const char* name;
+    char phase;  // 'X' (a call) or 'C' (a counter)
+    double ts_us, dur_us;
+    uint64_t value;  // bytes moved or bytes in use
+  };
+
+  void AddEvent(const Event& event) {
+    if (events_.size() < MAX_TRACE_EVENTS)
+      events_.push_back(event);
+    else
+      dropped_++;
+  }
+
+  std::mutex mutex_;
+  std::unordered_map<const char*, KernelStats> kernels_;
+  std::vector<Event> events_;
+  AllocStats allocs_;
+  uint64_t dropped_ = 0;
+};
+
+inline Profiler& Global() {
+  // one per module, never destroyed (arrays may be freed during interpreter shutdown)
+  static Profiler* profiler = new Profiler();
+  return *profiler;
+}
+
+template <typename T>
+inline uint64_t ArgBytes(const T&) {
+  return 0;  // scalars, shapes, strides
+}
+
+template <typename... Ts>
+inline uint64_t SumArgBytes(const Ts&... args) {
+  // the bytes of the array arguments, each backend providing ArgBytes() for its array type
+  uint64_t sizes[] = {0, ArgBytes(args)...};
+  uint64_t total = 0;
+  for (uint64_t size : sizes) total += size;
+  return total;
+}
+
+}  // namespace profiler
+}  // namespace needle
+
+#endif  // NEEDLE_NDARRAY_PROFILER_H_
@@ -1,3 +1,6 @@
+import json
+import os
+import subprocess
 import sys
 
 sys.path.append("/home/tang22/CMU_DLSys/cmu_dlsys_hw3/python")
@@ -73,6 +76,26 @@ def check_same_memory(original, view):
             "np_fn": lambda X: X.transpose()[3:7, 2:5],
             "nd_fn": lambda X: X.permute((1, 0))[3:7, 2:5],
         },
+        {
+            "shape": (70, 45),
+            "np_fn": lambda X: X.transpose(),
+            "nd_fn": lambda X: X.permute((1, 0)),
+        },
+        {
+            "shape": (5, 1, 300),
+            "np_fn": lambda X: np.broadcast_to(X, shape=(5, 7, 300))[1:4, :, 20:],
+            "nd_fn": lambda X: X.broadcast_to((5, 7, 300))[1:4, :, 20:],
+        },
+        {
+            "shape": (6, 80, 1),
+            "np_fn": lambda X: np.broadcast_to(X, shape=(6, 80, 90)),
+            "nd_fn": lambda X: X.broadcast_to((6, 80, 90)),
+        },
+        {
+            "shape": (4, 6, 70),
+            "np_fn": lambda X: X.transpose(1, 0, 2)[:, 1:3, ::2],
+            "nd_fn": lambda X: X.permute((1, 0, 2))[:, 1:3, ::2],
+        },
     ],
     ids=[
         "transpose",
@@ -83,6 +106,10 @@ def check_same_memory(original, view):
         "getitem1",
         "getitem2",
         "transposegetitem",
+        "transpose_large",
+        "broadcast_rows",
+        "broadcast_inner",
+        "permute_slice",
     ],
 )
 @pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
@@ -103,6 +130,13 @@ reduce_params = [
     {"dims": (4, 5, 6), "axis": 0},
     {"dims": (4, 5, 6), "axis": 1},
     {"dims": (4, 5, 6), "axis": 2},
+    {"dims": (3000, 100), "axis": 1},
+    {"dims": (8, 20000), "axis": 1},
+    {"dims": (300, 256), "axis": 0},
+    {"dims": (4, 5, 6), "axis": (0, 1)},
+    {"dims": (4, 5, 6), "axis": (0, 2)},
+    {"dims": (4, 5, 6), "axis": -1},
+    {"dims": (4, 5, 6), "axis": None},
 ]
 
 
@@ -128,6 +162,36 @@ def test_reduce_max(params, device):
     )
 
 
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+@pytest.mark.parametrize("axis", [0, 1, (0, 2), None])
+def test_reduce_noncompact(axis, device):
+    _A = np.random.randn(6, 5, 4)
+    A = nd.array(_A, device=device).permute((2, 1, 0))
+    _A = _A.transpose((2, 1, 0))
+    np.testing.assert_allclose(
+        _A.sum(axis=axis), A.sum(axis=axis, keepdims=False).numpy(), atol=1e-5, rtol=1e-5
+    )
+    np.testing.assert_allclose(
+        _A.max(axis=axis), A.max(axis=axis, keepdims=False).numpy(), atol=1e-5, rtol=1e-5
+    )
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+@pytest.mark.parametrize("axis", [1, (0, 1), (1, 2)])
+def test_reduce_empty(axis, device):
+    _A = np.zeros((3, 0, 2), dtype=np.float32)
+    A = nd.array(_A, device=device)
+    # compact, and non-compact (read by the strided kernels), with the empty axis reduced
+    for _view, view in [(_A, A), (_A.transpose((2, 1, 0)), A.permute((2, 1, 0)))]:
+        # leave freed buffers of the output's size behind for it to be handed
+        nd.array(np.full(_view.sum(axis=axis).shape, 7.0), device=device).numpy()
+        np.testing.assert_array_equal(
+            _view.sum(axis=axis), view.sum(axis=axis, keepdims=False).numpy()
+        )
+        with pytest.raises(ValueError):
+            view.max(axis=axis)
+
+
 """ For converting slice notation to slice objects to make some proceeding tests easier to read """
 
 
@@ -263,6 +327,66 @@ def test_ewise_max(shape, device):
     )
 
 
+@pytest.mark.parametrize("fn", OP_FNS, ids=OP_NAMES)
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_ewise_fn_strided(fn, device):
+    # non-compact operands: a permuted view and a broadcast view
+    _A = np.random.randn(6, 5, 4)
+    _B = np.random.randn(4, 1, 6)
+    A = nd.array(_A, device=device).permute((2, 1, 0))
+    B = nd.array(_B, device=device).broadcast_to((4, 5, 6))
+    _A, _B = _A.transpose((2, 1, 0)), np.broadcast_to(_B, (4, 5, 6))
+    np.testing.assert_allclose(fn(_A, _B), fn(A, B).numpy(), atol=1e-5, rtol=1e-5)
+    np.testing.assert_allclose(fn(_A, 0.5), fn(A, 0.5).numpy(), atol=1e-5, rtol=1e-5)
+    np.testing.assert_allclose(np.exp(_A), A.exp().numpy(), atol=1e-5, rtol=1e-5)
+
+
+@pytest.mark.parametrize("dtype", ["float32", "float16"])
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_ewise_broadcast(dtype, device):
+    # a bias row and a scalar tensor read in place, aligned and unaligned
+    # views, and sizes that are not a multiple of the vector width
+    tol = 1e-5 if dtype == "float32" else 1e-2
+    _X = np.random.randn(33, 68).astype(np.float32)
+    _b = np.random.randn(1, 68).astype(np.float32)
+    _s = np.random.randn(1, 1).astype(np.float32)
+    X = nd.array(_X, device=device, dtype=dtype)
+    b = nd.array(_b, device=device, dtype=dtype)
+    s = nd.array(_s, device=device, dtype=dtype)
+    # the inputs as rounded to dtype
+    _X, _b, _s = [a.numpy().astype(np.float32) for a in (X, b, s)]
+    Y = X + b.broadcast_to(X.shape)
+    np.testing.assert_allclose(Y.numpy(), _X + _b, atol=tol, rtol=tol)
+    Y = X * s.broadcast_to(X.shape)
+    np.testing.assert_allclose(Y.numpy(), _X * _s, atol=tol, rtol=tol)
+    for cols in (slice(4, 12), slice(1, 9), slice(0, 67)):
+        V, _V = X[:, cols], _X[:, cols]
+        np.testing.assert_allclose((V / (V * V + 1.0)).numpy(), _V / (_V * _V + 1.0),
+                                   atol=tol, rtol=tol)
+        np.testing.assert_allclose((V >= 0.0).numpy(), (_V >= 0.0).astype(np.float32))
+        np.testing.assert_allclose((V == V + 0.0).numpy(), np.ones_like(_V))
+    np.testing.assert_allclose((X[:, :67] + 1.0).exp().numpy(), np.exp(_X[:, :67] + 1.0),
+                               atol=tol, rtol=tol)
+
+
+@pytest.mark.parametrize("device", _DEVICES + [nd.cpu_numpy()], ids=["cpu", "cuda", "numpy"])
+def test_ewise_fused(device):
+    _X = np.random.randn(8, 300)
+    _M, _V = np.random.randn(8, 1), np.random.rand(8, 1) + 0.5
+    _W, _B = np.random.randn(300), np.random.randn(300)
+    X, M, V, W, B = [nd.array(a, device=device) for a in (_X, _M, _V, _W, _B)]
+    norm = nd.fuse(lambda x, m, v, w, b: (x - m) / (v + 1e-5) ** 0.5 * w + b)
+    np.testing.assert_allclose(norm(X, M, V, W, B).numpy(),
+                               (_X - _M) / (_V + 1e-5) ** 0.5 * _W + _B, atol=1e-5, rtol=1e-5)
+    # scalar on the left, unary functions, comparisons and a transposed input
+    fn = nd.fuse(lambda x, y: 2 / (1 + nd.exp(-x)) - nd.tanh(y) * (x >= y) + nd.maximum(x, 0.1))
+    _Y = _X.T.copy()
+    Y = nd.array(_Y, device=device).permute((1, 0))
+    np.testing.assert_allclose(fn(X, Y).numpy(),
+                               2 / (1 + np.exp(-_X)) - np.tanh(_X) * (_X >= _X) +
+                               np.maximum(_X, 0.1), atol=1e-5, rtol=1e-5)
+
+
 permute_params = [
     {"dims": (4, 5, 6), "axes": (0, 1, 2)},
     {"dims": (4, 5, 6), "axes": (1, 0, 2)},
@@ -361,6 +485,8 @@ matmul_dims = [
     (72, 73, 74),
     (74, 73, 72),
     (128, 128, 128),
+    (16, 24, 8),
+    (100, 264, 40),
 ]
 
 
@@ -374,6 +500,770 @@ def test_matmul(m, n, p, device):
     np.testing.assert_allclose((A @ B).numpy(), _A @ _B, rtol=1e-5, atol=1e-5)
 
 
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+@pytest.mark.parametrize("m,n,p", [(8, 8, 8), (72, 73, 74), (5, 4, 3)])
+def test_matmul_transposed(m, n, p, device):
+    _A = np.random.randn(n, m)
+    _B = np.random.randn(p, n)
+    A = nd.array(_A, device=device).permute((1, 0))
+    B = nd.array(_B, device=device).permute((1, 0))
+    np.testing.assert_allclose((A @ B).numpy(), _A.T @ _B.T, rtol=1e-5, atol=1e-5)
+
+
+@pytest.mark.parametrize("device", _DEVICES + [nd.cpu_numpy()], ids=["cpu", "cuda", "numpy"])
+@pytest.mark.parametrize("activation", [None, "relu", "tanh"])
+@pytest.mark.parametrize("m,n,p", [(8, 16, 32), (33, 65, 17)])
+def test_matmul_epilogue(m, n, p, activation, device):
+    _X = np.random.randn(m, n)
+    _W = np.random.randn(n, p)
+    _b = np.random.randn(p)
+    X, W, b = [nd.array(a, device=device) for a in (_X, _W, _b)]
+    acts = {None: lambda x: x, "relu": lambda x: np.maximum(x, 0), "tanh": np.tanh}
+    out = X.matmul_epilogue(W, b, activation, scale=0.5)
+    np.testing.assert_allclose(out.numpy(), acts[activation](0.5 * (_X @ _W) + _b),
+                               rtol=1e-4, atol=1e-4)
+    # no bias, transposed weight
+    Wt = nd.array(_W.T.copy(), device=device).permute((1, 0))
+    np.testing.assert_allclose(X.matmul_epilogue(Wt, None, activation).numpy(),
+                               acts[activation](_X @ _W), rtol=1e-4, atol=1e-4)
+
+
+batched_matmul_shapes = [
+    ((4, 8, 5), (4, 5, 7)),
+    ((2, 3, 33, 17), (2, 3, 17, 9)),
+    ((6, 10, 12), (12, 4)),  # one matrix broadcast over the batch
+    ((3, 1, 5, 6), (1, 4, 6, 2)),
+]
+
+
+@pytest.mark.parametrize("device", _DEVICES + [nd.cpu_numpy()], ids=["cpu", "cuda", "numpy"])
+@pytest.mark.parametrize("a_shape,b_shape", batched_matmul_shapes)
+def test_batched_matmul(a_shape, b_shape, device):
+    _A = np.random.randn(*a_shape)
+    _B = np.random.randn(*b_shape)
+    A = nd.array(_A, device=device)
+    B = nd.array(_B, device=device)
+    np.testing.assert_allclose((A @ B).numpy(), _A @ _B, rtol=1e-4, atol=1e-4)
+    # transposed (non-compact) right operand
+    _Bt = np.swapaxes(_B, -1, -2).copy()
+    Bt = nd.array(_Bt, device=device)
+    axes = tuple(range(len(b_shape) - 2)) + (len(b_shape) - 1, len(b_shape) - 2)
+    np.testing.assert_allclose((A @ Bt.permute(axes)).numpy(), _A @ _B, rtol=1e-4, atol=1e-4)
+    # a slice of a larger batch, which starts past the beginning of its buffer
+    _X = np.random.randn(a_shape[0] + 3, *a_shape[1:])
+    X = nd.array(_X, device=device)
+    idxs = (slice(2, 2 + a_shape[0]),) + (slice(None),) * (len(a_shape) - 1)
+    np.testing.assert_allclose((X[idxs] @ B).numpy(), _X[idxs] @ _B, rtol=1e-4, atol=1e-4)
+
+
+@pytest.mark.parametrize("device", _DEVICES + [nd.cpu_numpy()], ids=["cpu", "cuda", "numpy"])
+@pytest.mark.parametrize("shape,axis", [((7, 300), -1), ((4, 5, 6), 1), ((4, 5, 6), (0, 2)),
+                                        ((3, 1100), 0), ((2, 3, 4), None)])
+def test_softmax_family(shape, axis, device):
+    _A = 10 * np.random.randn(*shape).astype(np.float32)
+    np_axis = axis if axis is not None else tuple(range(len(shape)))
+    np_axis = tuple(a % len(shape) for a in np.atleast_1d(np_axis))
+    kept = [d for d in range(len(shape)) if d not in np_axis]
+    if kept:
+        # fully masked rows: logsumexp -inf, log-softmax -inf and softmax 0
+        _A[(slice(None),) * kept[0] + (0,)] = -np.inf
+    A = nd.array(_A, device=device)
+    m = _A.max(axis=np_axis, keepdims=True)
+    m = np.where(np.isneginf(m), 0, m)
+    with np.errstate(divide="ignore", invalid="ignore"):
+        lse = np.log(np.exp(_A - m).sum(axis=np_axis, keepdims=True)) + m
+        log_softmax = np.where(np.isneginf(lse), -np.inf, _A - lse)
+    np.testing.assert_allclose(A.logsumexp(axis).numpy(), lse, rtol=1e-5, atol=1e-5)
+    np.testing.assert_allclose(A.logsumexp(axis, keepdims=False).numpy(),
+                               np.squeeze(lse, axis=np_axis), rtol=1e-5, atol=1e-5)
+    np.testing.assert_allclose(A.log_softmax(axis).numpy(), log_softmax, rtol=1e-5, atol=1e-5)
+    np.testing.assert_allclose(A.softmax(axis).numpy(), np.exp(log_softmax), rtol=1e-5,
+                               atol=1e-5)
+
+
+@pytest.mark.parametrize("device", _DEVICES + [nd.cpu_numpy()], ids=["cpu", "cuda", "numpy"])
+def test_softmax_cross_entropy(device):
+    _Z = np.random.randn(50, 10).astype(np.float32)
+    _y = np.random.randint(0, 10, 50)
+    loss, grad = nd.softmax_cross_entropy(nd.array(_Z, device=device),
+                                          nd.array(_y, device=device), with_grad=True)
+    lse = np.log(np.exp(_Z).sum(axis=1))
+    np.testing.assert_allclose(loss.numpy(), lse - _Z[np.arange(50), _y], rtol=1e-5, atol=1e-5)
+    expected = np.exp(_Z - lse[:, None])
+    expected[np.arange(50), _y] -= 1
+    np.testing.assert_allclose(grad.numpy(), expected, rtol=1e-5, atol=1e-5)
+
+
+def _norm_reference(x, w, b, g, axis):
+    m = x.mean(axis=axis, keepdims=True)
+    s = 1 / np.sqrt(x.var(axis=axis, keepdims=True) + 1e-5)
+    xhat = (x - m) * s
+    dy = g * w
+    dx = s * (dy - dy.mean(axis=axis, keepdims=True)
+              - xhat * (dy * xhat).mean(axis=axis, keepdims=True))
+    return xhat * w + b, dx, (g * xhat).sum(axis=0), g.sum(axis=0)
+
+
+@pytest.mark.parametrize("device", _DEVICES + [nd.cpu_numpy()], ids=["cpu", "cuda", "numpy"])
+@pytest.mark.parametrize("rows,dim", [(8, 16), (300, 7), (5, 1500)])
+def test_layer_norm(rows, dim, device):
+    _X = 3 + 2 * np.random.randn(rows, dim).astype(np.float32)
+    _w, _b = np.random.randn(dim).astype(np.float32), np.random.randn(dim).astype(np.float32)
+    _G = np.random.randn(rows, dim).astype(np.float32)
+    X, w, b, G = [nd.array(a, device=device) for a in (_X, _w, _b, _G)]
+    out, mean, inv_std = nd.layer_norm(X, w, b)
+    grads = nd.layer_norm_backward(G, X, w, mean, inv_std)
+    expected = _norm_reference(_X, _w, _b, _G, axis=1)
+    for result, reference in zip((out,) + grads, expected):
+        np.testing.assert_allclose(result.numpy(), reference, rtol=1e-4, atol=1e-4)
+
+
+@pytest.mark.parametrize("device", _DEVICES + [nd.cpu_numpy()], ids=["cpu", "cuda", "numpy"])
+@pytest.mark.parametrize("rows,dim", [(8, 16), (3000, 7), (5, 100)])
+def test_batch_norm(rows, dim, device):
+    _X = 3 + 2 * np.random.randn(rows, dim).astype(np.float32)
+    _w, _b = np.random.randn(dim).astype(np.float32), np.random.randn(dim).astype(np.float32)
+    _G = np.random.randn(rows, dim).astype(np.float32)
+    X, w, b, G = [nd.array(a, device=device) for a in (_X, _w, _b, _G)]
+    running_mean = nd.array(np.zeros(dim), device=device)
+    running_var = nd.array(np.ones(dim), device=device)
+    out, mean, inv_std = nd.batch_norm(X, w, b, running_mean, running_var, momentum=0.1)
+    grads = nd.batch_norm_backward(G, X, w, mean, inv_std)
+    expected = _norm_reference(_X, _w, _b, _G, axis=0)
+    for result, reference in zip((out,) + grads, expected):
+        np.testing.assert_allclose(result.numpy(), reference, rtol=1e-4, atol=1e-4)
+    np.testing.assert_allclose(running_mean.numpy(), 0.1 * _X.mean(axis=0), rtol=1e-4, atol=1e-4)
+    np.testing.assert_allclose(running_var.numpy(), 0.9 + 0.1 * _X.var(axis=0),
+                               rtol=1e-4, atol=1e-4)
+    # evaluation mode uses (and leaves alone) the running statistics
+    out, _, _ = nd.batch_norm(X, w, b, running_mean, running_var, training=False)
+    _rm, _rv = running_mean.numpy(), running_var.numpy()
+    np.testing.assert_allclose(out.numpy(), (_X - _rm) / np.sqrt(_rv + 1e-5) * _w + _b,
+                               rtol=1e-4, atol=1e-4)
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+@pytest.mark.parametrize("exponent", [0, 1, 2, 3, -1, 0.5, -0.5, 1.5])
+def test_scalar_power_exponents(exponent, device):
+    _A = np.abs(np.random.randn(37, 5)).astype(np.float32) + 0.1
+    A = nd.array(_A, device=device)
+    np.testing.assert_allclose((A**exponent).numpy(), _A**exponent, rtol=1e-5, atol=1e-5)
+    # strided (transposed) input
+    np.testing.assert_allclose((A.permute((1, 0))**exponent).numpy(), _A.T**exponent,
+                               rtol=1e-5, atol=1e-5)
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_transcendental_range(device):
+    # odd length, so the vectorized kernels also run their scalar tails
+    _A = np.concatenate([np.linspace(-110, 110, 1001), [0.0, -0.0, np.inf, -np.inf, np.nan,
+                                                        1e-40, 1e-30, 3e38]]).astype(np.float32)
+    A = nd.array(_A, device=device)
+    with np.errstate(all="ignore"):
+        np.testing.assert_allclose(A.exp().numpy(), np.exp(_A), rtol=1e-6)
+        np.testing.assert_allclose(A.tanh().numpy(), np.tanh(_A), rtol=1e-6, atol=1e-7)
+        np.testing.assert_allclose(A.log().numpy(), np.log(_A), rtol=1e-6)
+
+
+@pytest.mark.parametrize("num_threads", [1, 4])
+def test_cpu_num_threads(num_threads):
+    device = nd.cpu()
+    old_num_threads = device.get_num_threads()
+    device.set_num_threads(num_threads)
+    try:
+        assert device.get_num_threads() == num_threads
+        _A = np.random.randn(300, 200)
+        _B = np.random.randn(200, 500)
+        A = nd.array(_A, device=device)
+        B = nd.array(_B, device=device)
+        np.testing.assert_allclose((A @ B).numpy(), _A @ _B, rtol=1e-4, atol=1e-4)
+        np.testing.assert_allclose((A + A).numpy(), _A + _A, rtol=1e-5, atol=1e-5)
+        np.testing.assert_allclose(
+            A.sum(axis=1).numpy(), _A.sum(axis=1, keepdims=True), rtol=1e-4, atol=1e-4
+        )
+        np.testing.assert_allclose(
+            A.permute((1, 0)).compact().numpy(), _A.T, rtol=1e-5, atol=1e-5
+        )
+    finally:
+        device.set_num_threads(old_num_threads)
+
+
+def test_cpu_isa():
+    mod = nd.cpu().mod
+    assert mod.__cpu_isa__ in mod.__cpu_isas__
+
+
+# run in a fresh interpreter, since the kernel set is picked when the backend is imported
+_CPU_ISA_SCRIPT = """
+import numpy as np
+from needle import backend_ndarray as nd
+device = nd.cpu()
+assert device.mod.__cpu_isa__ == "%s", device.mod.__cpu_isa__
+_A, _B = np.random.randn(70, 90), np.random.randn(90, 130)
+A, B = nd.array(_A, device=device), nd.array(_B, device=device)
+np.testing.assert_allclose((A @ B).numpy(), _A @ _B, rtol=1e-4, atol=1e-4)
+np.testing.assert_allclose((A * 2 + A).exp().numpy(), np.exp(3 * _A), rtol=1e-5, atol=1e-5)
+np.testing.assert_allclose(A.sum(axis=0).numpy(), _A.sum(axis=0, keepdims=True), rtol=1e-4,
+                           atol=1e-4)
+np.testing.assert_allclose(B.max(axis=1).numpy(), _B.max(axis=1, keepdims=True), rtol=1e-5)
+"""
+
+
+def _run_with_cpu_isa(isa, script):
+    env = dict(os.environ, NEEDLE_CPU_ISA=isa)
+    python_dir = os.path.dirname(os.path.dirname(ndl.__file__))
+    env["PYTHONPATH"] = os.pathsep.join([python_dir] + [env.get("PYTHONPATH", "")])
+    return subprocess.run([sys.executable, "-c", script], env=env, capture_output=True,
+                          text=True)
+
+
+@pytest.mark.parametrize("isa", nd.cpu().mod.__cpu_isas__)
+def test_cpu_isa_kernels(isa):
+    result = _run_with_cpu_isa(isa, _CPU_ISA_SCRIPT % isa)
+    assert result.returncode == 0, result.stderr
+
+
+def test_cpu_isa_unsupported():
+    result = _run_with_cpu_isa("no-such-isa", "import needle.backend_ndarray")
+    assert result.returncode != 0
+    assert "NEEDLE_CPU_ISA=no-such-isa is not supported" in result.stderr
+
+
+@pytest.mark.skipif(not nd.cuda().enabled(), reason="No GPU")
+def test_cuda_caching_allocator():
+    device = nd.cuda()
+    _A = np.random.randn(128, 128)
+    A = nd.array(_A, device=device)
+    for _ in range(10):
+        np.testing.assert_allclose(((A + 1) * 2).numpy(), (_A + 1) * 2, rtol=1e-5, atol=1e-5)
+    stats = device.memory_stats()
+    assert stats["bytes_in_use"] <= stats["bytes_reserved"]
+    assert stats["num_cache_hits"] > 0
+    device.empty_cache()
+    assert device.memory_stats()["bytes_reserved"] >= device.memory_stats()["bytes_in_use"]
+    np.testing.assert_allclose(A.numpy(), _A, rtol=1e-5, atol=1e-5)
+
+
+@pytest.mark.skipif(not nd.cuda().enabled(), reason="No GPU")
+def test_cuda_streams():
+    device = nd.cuda()
+    _A = np.random.randn(256, 256)
+    A = nd.array(_A, device=device)
+    copy_stream = device.Stream()
+    with device.stream(copy_stream):
+        assert device.current_stream().ptr() == copy_stream.ptr()
+        B = nd.array(_A * 2, device=device)
+        uploaded = copy_stream.record_event()
+    assert device.current_stream().ptr() == device.default_stream().ptr()
+    device.current_stream().wait_event(uploaded)
+    B._handle.record_stream(device.current_stream())
+    C = A @ B + A
+    out, done = device.to_numpy_async(C._handle, C.shape, C.strides, C._offset)
+    done.synchronize()
+    assert done.query()
+    np.testing.assert_allclose(out, _A @ (_A * 2) + _A, rtol=1e-4, atol=1e-4)
+    del B
+    device.synchronize()
+    assert device.memory_stats()["pinned_bytes_reserved"] > 0
+
+
+def test_cpu_memory_pool():
+    device = nd.cpu()
+    _A = np.random.randn(64, 64)
+    A = nd.array(_A, device=device)
+    for _ in range(10):
+        np.testing.assert_allclose(((A + 1) * 2).numpy(), (_A + 1) * 2, rtol=1e-5, atol=1e-5)
+    stats = device.memory_stats()
+    assert stats["num_pool_hits"] > 0
+    device.empty_cache()
+    assert device.memory_stats()["bytes_cached"] == 0
+    device.set_memory_pool(False)
+    try:
+        np.testing.assert_allclose((A * 2).numpy(), _A * 2, rtol=1e-5, atol=1e-5)
+        assert device.memory_stats()["bytes_cached"] == 0
+    finally:
+        device.set_memory_pool(True)
+    np.testing.assert_allclose(A.numpy(), _A, rtol=1e-5, atol=1e-5)
+
+
+def test_cpu_numpy_zero_copy():
+    device = nd.cpu()
+    _A = np.random.randn(8, 16).astype(np.float32)
+    A = nd.asarray(_A, device=device)
+    _A[0, 0] = 5.0
+    assert A.numpy()[0, 0] == 5.0
+    view = A.numpy(copy=False)
+    view[1, 1] = 7.0
+    assert _A[1, 1] == 7.0
+    B = nd.asarray(_A[:, ::2], device=device)
+    check_same_memory(A, B)
+    np.testing.assert_allclose((B + 1).numpy(), _A[:, ::2] + 1, rtol=1e-6)
+    # anything that can't be shared is copied
+    C = nd.asarray(np.ones((3, 3)), device=device)
+    np.testing.assert_allclose(C.numpy(), np.ones((3, 3)))
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_dlpack_round_trip(device):
+    _A = np.random.randn(4, 6)
+    A = nd.array(_A, device=device)
+    B = nd.from_dlpack(A.permute((1, 0)))
+    assert B.device == device
+    check_same_memory(A, B)
+    np.testing.assert_allclose(B.numpy(), _A.T, rtol=1e-6)
+    np.testing.assert_allclose((B @ A).numpy(), _A.T @ _A, rtol=1e-4, atol=1e-4)
+    if device == nd.cpu() and hasattr(np, "from_dlpack"):
+        C = np.from_dlpack(A)
+        C[0, 0] = 3.0
+        assert A.numpy()[0, 0] == 3.0
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+@pytest.mark.parametrize("dtype,tol", [("float16", 1e-2), ("bfloat16", 5e-2)])
+def test_half_precision(dtype, tol, device):
+    _A = np.random.randn(48, 32).astype(np.float32)
+    _B = np.random.randn(32, 64).astype(np.float32)
+    A = nd.array(_A, dtype=dtype, device=device)
+    B = nd.array(_B, dtype=dtype, device=device)
+    assert A.dtype == dtype and (A @ B).dtype == dtype
+    np.testing.assert_allclose(A.astype("float32").numpy(), _A, rtol=tol, atol=tol)
+    # accumulation is in float32, so the error does not grow with the reduced size
+    np.testing.assert_allclose((A @ B).numpy(), _A @ _B, rtol=tol, atol=tol * 8)
+    np.testing.assert_allclose((A[:, 1:31] @ B[1:31, 3:]).numpy(), _A[:, 1:31] @ _B[1:31, 3:],
+                               rtol=tol, atol=tol * 8)
+    np.testing.assert_allclose((A + A * 2).numpy(), _A * 3, rtol=tol, atol=tol)
+    np.testing.assert_allclose(A.exp().numpy(), np.exp(_A), rtol=tol, atol=tol)
+    np.testing.assert_allclose(A.permute((1, 0)).compact().numpy(), _A.T, rtol=tol, atol=tol)
+    np.testing.assert_allclose(A.sum(axis=0).numpy(), _A.sum(axis=0, keepdims=True),
+                               rtol=tol, atol=tol * 8)
+    np.testing.assert_allclose(A.sum().numpy(), _A.sum(keepdims=True), rtol=tol, atol=tol * 32)
+    np.testing.assert_allclose(A.softmax().numpy(), np.exp(_A) / np.exp(_A).sum(1, keepdims=True),
+                               rtol=tol, atol=tol)
+    # mixed dtypes compute in float32
+    assert (A + nd.array(_A, device=device)).dtype == "float32"
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+@pytest.mark.parametrize("m,n,p", [(16, 64, 32), (37, 129, 70)])
+def test_matmul_int8(m, n, p, device):
+    _X = np.random.randn(m, n).astype(np.float32)
+    _W = np.random.randn(n, p).astype(np.float32)
+    _b = np.random.randn(p).astype(np.float32)
+    W = nd.QuantizedWeight(nd.array(_W, device=device))
+    assert W.data.dtype == "int8" and W.data.shape == (p, n)
+    # int8 arrays copy, compact or not, without any arithmetic
+    for data in (W.data, W.data[1:, 2:]):
+        copy = nd.NDArray(data)
+        assert copy.dtype == "int8" and copy._handle is not data._handle
+        np.testing.assert_array_equal(copy.astype("float32").numpy(),
+                                      data.astype("float32").numpy())
+    # one rounding step of at most half a scale per item
+    np.testing.assert_allclose(W.dequantize().numpy(), _W,
+                               atol=np.abs(_W).max(axis=0).max() / 254 + 1e-6)
+    X = nd.array(_X, device=device)
+    ref = np.maximum(_X @ _W + _b, 0)
+    tol = 0.02 * np.abs(_X @ _W).max()
+    out = X.matmul_int8(W, nd.array(_b, device=device), "relu")
+    assert out.dtype == "float32"
+    np.testing.assert_allclose(out.numpy(), ref, atol=tol)
+    q = X.matmul_int8(W, nd.array(_b, device=device), "relu", out_scale=ref.max() / 127)
+    assert q.dtype == "int8"
+    np.testing.assert_allclose(q.astype("float32").numpy() * (ref.max() / 127), ref,
+                               atol=tol + ref.max() / 127)
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_profiler(device, tmp_path):
+    # 50 is no multiple of the tile size, so A @ B is one call of matmul
+    A = nd.array(np.random.randn(50, 50), device=device)
+    B = nd.array(np.random.randn(50, 50), device=device)
+    trace = str(tmp_path / "trace.json")
+    with device.profile(trace_path=trace):
+        for _ in range(3):
+            A + B
+        A @ B
+    stats = device.profiler_stats()
+    add = stats["kernels"]["ewise_add"]
+    assert add["calls"] == 3 and add["bytes"] == 3 * 3 * 50 * 50 * 4
+    assert add["max_us"] > 0 and add["total_us"] >= add["max_us"]
+    assert stats["kernels"]["matmul"]["calls"] == 1
+    assert stats["allocs"]["count"] >= 4
+    with open(trace) as f:
+        events = json.load(f)["traceEvents"]
+    assert sum(e["name"] == "ewise_add" and e["ph"] == "X" for e in events) == 3
+    # nothing is recorded outside the with block
+    A + B
+    assert device.profiler_stats()["kernels"]["ewise_add"]["calls"] == 3
+    assert not device.profiler_enabled()
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_lazy_fusion(device):
+    _X, _Y, _B = np.random.randn(8, 300), np.random.randn(8, 300), np.random.randn(1, 300)
+    X, Y, B = [ndl.Tensor(nd.array(a, device=device), device=device, requires_grad=False)
+               for a in (_X, _Y, _B)]
+    _Z = (_X * _Y + _B) * 0.5 + _X
+    ndl.lazy.clear_plan_cache()
+    for _ in range(2):
+        with device.profile(), ndl.lazy.lazy_mode():
+            Z = (X * Y + B.broadcast_to((8, 300))) * 0.5 + X
+            S = ((Z + 1.0) * Z).sum(axes=(1,))
+            assert Z.cached_data is None
+            ndl.lazy.realize(Z, S)
+        kernels = device.profiler_stats()["kernels"]
+        # one pass for Z and one for S, with neither the broadcast nor (Z + 1) * Z stored
+        assert kernels["ewise_fused"]["calls"] == 1
+        assert kernels["ewise_fused_sum"]["calls"] == 1
+        assert "ewise_add" not in kernels and "ewise_mul" not in kernels
+        np.testing.assert_allclose(Z.numpy(), _Z, atol=1e-5, rtol=1e-5)
+        np.testing.assert_allclose(S.numpy(), ((_Z + 1) * _Z).sum(axis=1), atol=1e-3, rtol=1e-5)
+    assert ndl.lazy.plan_cache_info() == {"size": 1, "hits": 1, "misses": 1}
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_lazy_fusion_sliced(device):
+    # leaves that are slices, starting past the beginning of their buffers
+    _X, _B = np.random.randn(8, 301), np.random.randn(3, 300)
+    X = ndl.Tensor.make_const(nd.array(_X, device=device)[:, 1:])
+    B = ndl.Tensor.make_const(nd.array(_B, device=device)[2:3, :])
+    _X, _B = _X[:, 1:], _B[2:3, :]
+    with device.profile(), ndl.lazy.lazy_mode():
+        Z = X * 2 + B.broadcast_to((8, 300))
+        S = (X * 2).sum(axes=(1,))
+        T = (X * B.broadcast_to((8, 300))).sum(axes=(0,))
+        ndl.lazy.realize(Z, S, T)
+    kernels = device.profiler_stats()["kernels"]
+    assert kernels["ewise_fused"]["calls"] == 1
+    assert kernels["ewise_fused_sum"]["calls"] == 2
+    np.testing.assert_allclose(Z.numpy(), _X * 2 + _B, atol=1e-5, rtol=1e-5)
+    np.testing.assert_allclose(S.numpy(), (_X * 2).sum(axis=1), atol=1e-4, rtol=1e-5)
+    np.testing.assert_allclose(T.numpy(), (_X * _B).sum(axis=0), atol=1e-4, rtol=1e-5)
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_optimizer_step(device):
+    # small tensors and one of several chunks, all of them in one kernel call per step
+    shapes = [(3,), (5, 7), (1,), (300, 300)]
+    _params = [np.random.randn(*s).astype("float32") for s in shapes]
+    _grads = [np.random.randn(*s).astype("float32") for s in shapes]
+    params = {}
+    for name in ("sgd", "adam"):
+        params[name] = [ndl.Tensor(nd.array(p, device=device), device=device) for p in _params]
+        for p, g in zip(params[name], _grads):
+            p.grad = ndl.Tensor(nd.array(g, device=device), device=device, requires_grad=False)
+    sgd = ndl.optim.SGD(params["sgd"], lr=0.1, momentum=0.9, weight_decay=0.01)
+    adam = ndl.optim.Adam(params["adam"], lr=0.01, weight_decay=0.01)
+    ref_sgd, ref_adam = [p.copy() for p in _params], [p.copy() for p in _params]
+    u, m, v = [[np.zeros_like(p) for p in _params] for _ in range(3)]
+    for t in range(1, 4):
+        with device.profile():
+            sgd.step()
+            adam.step()
+        kernels = device.profiler_stats()["kernels"]
+        assert kernels["multi_sgd_step"]["calls"] == 1 and kernels["multi_adam_step"]["calls"] == 1
+        for i, g in enumerate(_grads):
+            u[i] = 0.9 * u[i] + 0.1 * (g + 0.01 * ref_sgd[i])
+            ref_sgd[i] = ref_sgd[i] - 0.1 * u[i]
+            g = g + 0.01 * ref_adam[i]
+            m[i] = 0.9 * m[i] + 0.1 * g
+            v[i] = 0.999 * v[i] + 0.001 * g * g
+            m_hat, v_hat = m[i] / (1 - 0.9 ** t), v[i] / (1 - 0.999 ** t)
+            ref_adam[i] = ref_adam[i] - 0.01 * m_hat / (np.sqrt(v_hat) + 1e-8)
+    for p, ref in zip(params["sgd"] + params["adam"], ref_sgd + ref_adam):
+        np.testing.assert_allclose(p.numpy(), ref, atol=1e-5, rtol=1e-5)
+
+
+@pytest.mark.skipif(not nd.cuda().enabled(), reason="No GPU")
+def test_graphed_adam_step():
+    # adam_step() captured once and replayed: each replay counts its step on the device, so the
+    # bias corrections are those of steps 1..N, not those of the capture
+    device = nd.cuda()
+    shapes = [(5, 7), (300,)]
+    _params = [np.random.randn(*s).astype("float32") for s in shapes]
+    _grads = [np.random.randn(*s).astype("float32") for s in shapes]
+    params = [nd.array(p, device=device) for p in _params]
+    grads = [nd.array(g, device=device) for g in _grads]
+    m = [nd.full(s, 0.0, device=device) for s in shapes]
+    v = [nd.full(s, 0.0, device=device) for s in shapes]
+    step_counts = {device.name: nd.full((1,), 0.0, device=device)}
+    graph = device.Graph()
+    with device.capture(graph):
+        nd.adam_step(params, grads, m, v, step_counts, 0.01, weight_decay=0.01)
+    num_steps = 4
+    for _ in range(num_steps):
+        graph.replay()
+    ref = [p.copy() for p in _params]
+    ref_m, ref_v = [np.zeros_like(p) for p in _params], [np.zeros_like(p) for p in _params]
+    for t in range(1, num_steps + 1):
+        for i, g in enumerate(_grads):
+            g = g + 0.01 * ref[i]
+            ref_m[i] = 0.9 * ref_m[i] + 0.1 * g
+            ref_v[i] = 0.999 * ref_v[i] + 0.001 * g * g
+            m_hat, v_hat = ref_m[i] / (1 - 0.9 ** t), ref_v[i] / (1 - 0.999 ** t)
+            ref[i] = ref[i] - 0.01 * m_hat / (np.sqrt(v_hat) + 1e-8)
+    assert step_counts[device.name].numpy()[0] == num_steps
+    for p, r in zip(params, ref):
+        np.testing.assert_allclose(p.numpy(), r, atol=1e-5, rtol=1e-5)
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_data_loader(device, tmp_path):
+    import gzip
+    import struct
+
+    _X = np.random.randint(0, 256, size=(10, 4, 4)).astype(np.uint8)
+    _y = np.random.randint(0, 10, size=10).astype(np.uint8)
+    with gzip.open(str(tmp_path / "images-idx3-ubyte.gz"), "wb") as f:
+        f.write(struct.pack(">HBBIII", 0, 8, 3, 10, 4, 4) + _X.tobytes())
+    with gzip.open(str(tmp_path / "labels-idx1-ubyte.gz"), "wb") as f:
+        f.write(struct.pack(">HBBI", 0, 8, 1, 10) + _y.tobytes())
+    dataset = ndl.data.MNISTDataset(str(tmp_path / "images-idx3-ubyte.gz"),
+                                    str(tmp_path / "labels-idx1-ubyte.gz"))
+    # read from the uncompressed copy, memory-mapped
+    assert (tmp_path / "images-idx3-ubyte").exists() and isinstance(dataset.images, np.memmap)
+    X, y = dataset[3]
+    np.testing.assert_allclose(X, _X[3].reshape(-1) / 255.0, atol=1e-6)
+    assert y == _y[3]
+    _X = _X.reshape(10, 16).astype(np.float32) / 255.0
+    for num_workers in (0, 2):
+        loader = ndl.data.DataLoader(dataset, batch_size=4, shuffle=True,
+                                     num_workers=num_workers, device=device)
+        for _ in range(2):
+            batches = list(loader)
+            assert [X.shape for X, _ in batches] == [(4, 16), (4, 16), (2, 16)]
+            X = np.concatenate([X.numpy() for X, _ in batches])
+            y = np.concatenate([y.numpy() for _, y in batches]).astype(np.uint8)
+            order = np.concatenate(loader.ordering)
+            np.testing.assert_allclose(X, _X[order], atol=1e-6)
+            np.testing.assert_equal(y, _y[order])
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_memory_planner(device):
+    _A = np.random.randn(64, 64).astype(np.float32)
+    A = nd.array(_A, device=device)
+
+    def step():
+        B = A + 1.0
+        C = B * B
+        return ((C - B).tanh() * 2.0).numpy()
+
+    _B = _A + 1.0
+    ref = np.tanh(_B * _B - _B) * 2.0
+    planner = ndl.memory.MemoryPlanner()
+    for i in range(3):
+        with planner.step():
+            out = step()
+        np.testing.assert_allclose(out, ref, atol=1e-5, rtol=1e-5)
+    report = planner.report()
+    # the temporaries freed early share memory with the later ones
+    assert report["planned_peak"] < report["naive_peak"]
+    assert report["live_peak"] <= report["planned_peak"]
+    assert report["hits"] == report["num_planned"] > 0 and report["fallbacks"] == 0
+
+
+def _has_backward():
+    # backward() needs the autograd core (compute_gradient_of_variables), which may be a stub
+    x = ndl.Tensor([1.0], requires_grad=True)
+    try:
+        (x * x).backward()
+    except NotImplementedError:
+        return False
+    return True
+
+
+_NEEDS_BACKWARD = pytest.mark.skipif(not _has_backward(), reason="backward() not implemented")
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_graphed_step(device):
+    _W = np.random.randn(8, 32).astype(np.float32)
+    W = ndl.Tensor(nd.array(_W, device=device), device=device, requires_grad=False)
+    step = ndl.cuda_graphs.GraphedStep(lambda X: ((X * W + 1.0) * X).sum(axes=(1,)))
+    for i in range(4):
+        _X = np.random.randn(8, 32).astype(np.float32)
+        X = ndl.Tensor(nd.array(_X, device=device), device=device, requires_grad=False)
+        if i < 2:
+            Y = step(X)
+        else:
+            # replays launch no kernels of the step, only the copy of the input
+            with device.profile():
+                Y = step(X)
+            if device.name == "cuda":
+                kernels = device.profiler_stats()["kernels"]
+                assert "ewise_mul" not in kernels and "reduce_sum" not in kernels
+        np.testing.assert_allclose(Y.numpy(), ((_X * _W + 1.0) * _X).sum(axis=1),
+                                   atol=1e-4, rtol=1e-4)
+    assert step.num_graphs == (1 if device.name == "cuda" else 0)
+
+
+@_NEEDS_BACKWARD
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+@pytest.mark.parametrize("optimizer", ["sgd", "adam"])
+def test_graphed_train_step(optimizer, device):
+    # forward, backward and the optimizer update, graphed, against the same steps run eagerly
+    _W1, _W2 = np.random.randn(8, 16).astype(np.float32), np.random.randn(8, 16).astype(np.float32)
+
+    def make_step():
+        params = [ndl.nn.Parameter(nd.array(_W, device=device), device=device)
+                  for _W in (_W1, _W2)]
+        if optimizer == "sgd":
+            opt = ndl.optim.SGD(params, lr=0.01, momentum=0.9)
+        else:
+            opt = ndl.optim.Adam(params, lr=0.01)
+
+        def step(X):
+            opt.reset_grad()
+            out = (X * params[0] + 1.0) * params[1]
+            loss = out * out
+            loss.backward()
+            opt.step()
+            return loss
+
+        return params, step
+
+    params, step = make_step()
+    ref_params, ref_step = make_step()
+    graphed = ndl.cuda_graphs.GraphedStep(step)
+    for _ in range(5):
+        _X = np.random.randn(8, 16).astype(np.float32)
+        X = ndl.Tensor(nd.array(_X, device=device), device=device, requires_grad=False)
+        loss, ref_loss = graphed(X), ref_step(X)
+        np.testing.assert_allclose(loss.numpy(), ref_loss.numpy(), atol=1e-4, rtol=1e-4)
+        # replays go on updating the parameters, and Adam on counting its steps
+        for p, ref in zip(params, ref_params):
+            np.testing.assert_allclose(p.numpy(), ref.numpy(), atol=1e-5, rtol=1e-5)
+    assert graphed.num_graphs == (1 if device.name == "cuda" else 0)
+
+
+@_NEEDS_BACKWARD
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_data_parallel(device):
+    class Model(ndl.nn.Module):
+        def __init__(self, _w1, _w2):
+            super().__init__()
+            self.w1 = ndl.nn.Parameter(nd.array(_w1, device=device), device=device)
+            self.w2 = ndl.nn.Parameter(nd.array(_w2, device=device), device=device)
+
+        def forward(self, X):
+            return (X * self.w1 + 1.0) * self.w2
+
+    model = Model(np.random.randn(3, 8), np.random.randn(3, 8))
+    # two replicas on one device, whose gradients are reduced one parameter (bucket) at a time
+    dp = ndl.nn.DataParallel(model, [device, device], bucket_size=3 * 8 * 4)
+    assert dp.parameters() == model.parameters()
+    opt = ndl.optim.SGD(model.parameters(), lr=0.1)
+    for step in range(2):
+        _X = np.random.randn(6, 8).astype(np.float32)
+        _w1, _w2 = model.w1.numpy(), model.w2.numpy()
+        # the replicas run on halves of the batch with the parameters model has now
+        outputs = dp(ndl.Tensor(nd.array(_X, device=device), device=device))
+        for out, _x in zip(outputs, (_X[:3], _X[3:])):
+            np.testing.assert_allclose(out.numpy(), (_x * _w1 + 1.0) * _w2, atol=1e-5, rtol=1e-5)
+        losses = [out * out for out in outputs]
+        if step == 0:
+            # each bucket is reduced by the grad hooks as soon as both backward passes reach it,
+            # so the gradients are averaged before synchronize()
+            for loss in losses:
+                loss.backward()
+        else:
+            dp.backward(losses)
+        # model gets the mean of the gradients of a single model run on each half
+        ref_grads = []
+        for _x in (_X[:3], _X[3:]):
+            ref = Model(_w1, _w2)
+            out = ref(ndl.Tensor(nd.array(_x, device=device), device=device))
+            (out * out).backward()
+            ref_grads.append([ref.w1.grad.numpy(), ref.w2.grad.numpy()])
+        for p, grads in zip((model.w1, model.w2), zip(*ref_grads)):
+            np.testing.assert_allclose(p.grad.numpy(), np.mean(grads, axis=0), atol=1e-4,
+                                       rtol=1e-4)
+        dp.synchronize()
+        opt.step()
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_data_parallel_buckets(device):
+    # the grad hooks driven through the grad setter, as backward() sets grads: last params first
+    class Model(ndl.nn.Module):
+        def __init__(self):
+            super().__init__()
+            self.w1 = ndl.nn.Parameter(nd.array(np.random.randn(3, 8), device=device),
+                                       device=device)
+            self.w2 = ndl.nn.Parameter(nd.array(np.random.randn(3, 8), device=device),
+                                       device=device)
+
+        def forward(self, X):
+            return X
+
+    model = Model()
+    # one parameter per bucket, w2's first
+    dp = ndl.nn.DataParallel(model, [device, device], bucket_size=3 * 8 * 4)
+    X = ndl.Tensor(nd.array(np.random.randn(4, 8), device=device), device=device)
+    _grads = np.random.randn(2, 2, 3, 8).astype(np.float32)  # replica, parameter
+
+    def set_grad(replica, index):
+        p = dp.replicas[replica].parameters()[index]
+        p.grad = ndl.Tensor(nd.array(_grads[replica, index], device=device), device=device)
+
+    dp(X)
+    for index in (1, 0):
+        set_grad(0, index)
+        # the bucket waits for the other replica
+        np.testing.assert_allclose(model.parameters()[index].grad.numpy(), _grads[0, index])
+        set_grad(1, index)
+        # and is averaged as soon as it has it, before synchronize()
+        np.testing.assert_allclose(model.parameters()[index].grad.numpy(),
+                                   _grads[:, index].mean(axis=0), atol=1e-6)
+    dp.synchronize()
+
+    # a replica without a gradient for w1: synchronize() reduces its bucket, taking it as zero
+    dp(X)
+    assert dp.replicas[1].w1.grad is None
+    set_grad(0, 1)
+    set_grad(1, 1)
+    set_grad(0, 0)
+    np.testing.assert_allclose(model.w2.grad.numpy(), _grads[:, 1].mean(axis=0), atol=1e-6)
+    np.testing.assert_allclose(model.w1.grad.numpy(), _grads[0, 0])
+    dp.synchronize()
+    np.testing.assert_allclose(model.w1.grad.numpy(), _grads[0, 0] / 2, atol=1e-6)
+    assert dp.replicas[1].w1.grad is None
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_inplace_and_out(device):
+    _A = np.random.randn(16, 16).astype(np.float32)
+    _B = np.random.randn(16, 16).astype(np.float32)
+    A = nd.array(_A, device=device)
+    B = nd.array(_B, device=device)
+    ptr = A._handle.ptr()
+    A.add_(B).mul_(2.0).maximum_(0.5)
+    assert A._handle.ptr() == ptr
+    _A = np.maximum((_A + _B) * 2.0, 0.5)
+    np.testing.assert_allclose(A.numpy(), _A, atol=1e-5, rtol=1e-5)
+    # an operand that is a transposed view of the output is read before it is written
+    A.add_(A.permute((1, 0)))
+    _A = _A + _A.T
+    np.testing.assert_allclose(A.numpy(), _A, atol=1e-5, rtol=1e-5)
+    # non-compact and other-dtype outputs
+    A[2:10, 3:7].exp_()
+    _A[2:10, 3:7] = np.exp(_A[2:10, 3:7])
+    np.testing.assert_allclose(A.numpy(), _A, atol=1e-5, rtol=1e-5)
+    C = nd.array(np.zeros((16, 16)), dtype="float16", device=device)
+    nd.multiply(A, B, out=C)
+    assert C.dtype == "float16"
+    np.testing.assert_allclose(C.numpy(), _A * _B, atol=1e-2, rtol=1e-2)
+    nd.add(B, 1.0, out=B)
+    np.testing.assert_allclose(B.numpy(), _B + 1.0, atol=1e-5, rtol=1e-5)
+
+    x = ndl.Tensor(nd.array(_A, device=device), device=device)
+    with ndl.no_grad():
+        y = x * x + 1.0
+    assert not y.requires_grad and y.inputs == [] and x.requires_grad
+    np.testing.assert_allclose(y.numpy(), _A * _A + 1.0, atol=1e-5, rtol=1e-5)
+    assert (x * x).requires_grad
+
+
 @pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
 def test_scalar_mul(device):
     A = np.random.randn(5, 5)